@@ -0,0 +1,226 @@
+;; This file is part of Elfuse.
+
+;; Elfuse is free software: you can redistribute it and/or modify
+;; it under the terms of the GNU General Public License as published by
+;; the Free Software Foundation, either version 3 of the License, or
+;; (at your option) any later version.
+
+;; Elfuse is distributed in the hope that it will be useful,
+;; but WITHOUT ANY WARRANTY; without even the implied warranty of
+;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;; GNU General Public License for more details.
+
+;; You should have received a copy of the GNU General Public License
+;; along with Elfuse.  If not, see <http://www.gnu.org/licenses/>.
+
+;; Standard workloads against a synthetic in-memory tree, for catching
+;; performance regressions. The tree has BENCH_FILES files f0, f1, ...
+;; of BENCH_FILE_SIZE bytes in its root and a writable scratch/
+;; directory. Each workload in BENCH_WORKLOADS runs bench/loadgen with
+;; BENCH_THREADS threads doing BENCH_OPS operations each:
+;;
+;;   make bench BENCH_THREADS=8 BENCH_WORKLOADS="stat randread"
+;;
+;; Results are printed and written to bench-results.json as a JSON
+;; object of the settings and a list of per-workload results with ops/s
+;; and p50/p99/p999 latencies, so runs can be compared over time.
+
+(require 'elfuse)
+(require 'json)
+
+(defun bench-fs--setting (name default)
+  "Return the environment variable NAME as a number, or DEFAULT."
+  (let ((value (getenv name)))
+    (if (and value (not (equal value "")))
+        (string-to-number value)
+      default)))
+
+(defvar bench-fs-files (bench-fs--setting "BENCH_FILES" 1000)
+  "Number of files in the tree root.")
+
+(defvar bench-fs-file-size (bench-fs--setting "BENCH_FILE_SIZE" (* 64 1024))
+  "Size of every file in the tree root.")
+
+(defvar bench-fs-threads (bench-fs--setting "BENCH_THREADS" 4)
+  "Number of load generator threads.")
+
+(defvar bench-fs-ops (bench-fs--setting "BENCH_OPS" 10000)
+  "Number of operations per load generator thread.")
+
+(defvar bench-fs-workloads
+  (let ((value (getenv "BENCH_WORKLOADS")))
+    (if (and value (not (equal value "")))
+        (split-string value)
+      '("stat" "readdir" "seqread" "randread" "append" "churn")))
+  "Workloads to run, see bench/loadgen.c.")
+
+(defvar bench-fs-loadgen (expand-file-name "bench/loadgen")
+  "The load generator binary.")
+
+(defvar bench-fs--content nil
+  "Content shared by all files in the root.")
+
+(defvar bench-fs--root-entries nil
+  "The root listing with attributes.")
+
+(defvar bench-fs--scratch (make-hash-table :test 'equal)
+  "Names of scratch/ files and their content.")
+
+(defun bench-fs--root-index (path)
+  "Index of the root file at PATH or nil."
+  (when (string-match "\\`/f\\([0-9]+\\)\\'" path)
+    (let ((index (string-to-number (match-string 1 path))))
+      (and (< index bench-fs-files) index))))
+
+(defun bench-fs--scratch-name (path)
+  "Name of the scratch file at PATH or nil."
+  (when (string-match "\\`/scratch/\\([^/]+\\)\\'" path)
+    (match-string 1 path)))
+
+(defun bench-fs--content (path)
+  "Content of the file at PATH, signals ENOENT if there's none."
+  (cond ((bench-fs--root-index path) bench-fs--content)
+        ((gethash (bench-fs--scratch-name path) bench-fs--scratch))
+        (t (signal 'elfuse-op-error elfuse-ENOENT))))
+
+(defun bench-fs--getattr (path)
+  (cond ((member path '("/" "/scratch")) [dir 0])
+        ((bench-fs--root-index path) (vector 'file bench-fs-file-size))
+        (t (let ((content (gethash (bench-fs--scratch-name path) bench-fs--scratch)))
+             (if content
+                 (vector 'file (length content))
+               (signal 'elfuse-op-error elfuse-ENOENT))))))
+
+(defun bench-fs--readdir (path)
+  (cond ((equal path "/") bench-fs--root-entries)
+        ((equal path "/scratch")
+         (let ((entries (list "." "..")))
+           (maphash (lambda (name content)
+                      (push (vector name 'file (length content)) entries))
+                    bench-fs--scratch)
+           (vconcat entries)))
+        (t (signal 'elfuse-op-error elfuse-ENOENT))))
+
+(defun bench-fs--open (path)
+  (bench-fs--content path)
+  t)
+
+(defun bench-fs--release (path)
+  (and (bench-fs--content path) t))
+
+(defun bench-fs--read (path offset size)
+  (let ((content (bench-fs--content path)))
+    (substring content (min offset (length content))
+               (min (+ offset size) (length content)))))
+
+(defun bench-fs--write (path data offset)
+  (let* ((name (or (bench-fs--scratch-name path)
+                   (signal 'elfuse-op-error elfuse-EACCESS)))
+         (content (or (gethash name bench-fs--scratch)
+                      (signal 'elfuse-op-error elfuse-ENOENT)))
+         (end (+ offset (length data))))
+    (puthash name
+             (concat (substring content 0 (min offset (length content)))
+                     (make-string (max 0 (- offset (length content))) 0)
+                     data
+                     (substring content (min end (length content))))
+             bench-fs--scratch)
+    (length data)))
+
+(defun bench-fs--truncate (path size)
+  (let* ((name (or (bench-fs--scratch-name path)
+                   (signal 'elfuse-op-error elfuse-EACCESS)))
+         (content (or (gethash name bench-fs--scratch)
+                      (signal 'elfuse-op-error elfuse-ENOENT))))
+    (puthash name
+             (if (< size (length content))
+                 (substring content 0 size)
+               (concat content (make-string (- size (length content)) 0)))
+             bench-fs--scratch)
+    0))
+
+(defun bench-fs--create (path)
+  (let ((name (or (bench-fs--scratch-name path)
+                  (signal 'elfuse-op-error elfuse-EACCESS))))
+    (puthash name "" bench-fs--scratch)
+    0))
+
+(defun bench-fs--unlink (path)
+  (let ((name (bench-fs--scratch-name path)))
+    (unless (and name (gethash name bench-fs--scratch))
+      (signal 'elfuse-op-error elfuse-ENOENT))
+    (remhash name bench-fs--scratch)
+    0))
+
+(defconst bench-fs--handlers
+  '((:getattr . bench-fs--getattr)
+    (:readdir . bench-fs--readdir)
+    (:open . bench-fs--open)
+    (:release . bench-fs--release)
+    (:read . bench-fs--read)
+    (:write . bench-fs--write)
+    (:truncate . bench-fs--truncate)
+    (:create . bench-fs--create)
+    (:unlink . bench-fs--unlink))
+  "Handlers of the bench tree.")
+
+(defun bench-fs--setup ()
+  "Build the tree."
+  (setq bench-fs--content (make-string bench-fs-file-size ?x))
+  (let ((entries (list (vector "scratch" 'dir 0) "." "..")))
+    (dotimes (i bench-fs-files)
+      (push (vector (format "f%d" i) 'file bench-fs-file-size) entries))
+    (setq bench-fs--root-entries (vconcat (nreverse entries))))
+  (clrhash bench-fs--scratch))
+
+(defun bench-fs--run-workload (dir workload)
+  "Run WORKLOAD against DIR, serving requests meanwhile.
+Return the parsed loadgen result."
+  (with-temp-buffer
+    (let ((proc (make-process
+                 :name "loadgen"
+                 :buffer (current-buffer)
+                 :command (list bench-fs-loadgen
+                                "-d" dir
+                                "-w" workload
+                                "-t" (number-to-string bench-fs-threads)
+                                "-n" (number-to-string bench-fs-ops)
+                                "-f" (number-to-string bench-fs-files)
+                                "-s" (number-to-string bench-fs-file-size))
+                 :connection-type 'pipe
+                 :noquery t)))
+      ;; Handlers only run while Emacs waits for input
+      (while (process-live-p proc)
+        (accept-process-output nil 0.01))
+      (accept-process-output proc 0)
+      (unless (zerop (process-exit-status proc))
+        (error "loadgen %s failed: %s" workload (buffer-string)))
+      (goto-char (point-min))
+      (json-parse-buffer :object-type 'alist))))
+
+(defun bench-fs-run ()
+  "Run all `bench-fs-workloads' and report."
+  (bench-fs--setup)
+  (let* ((dir (make-temp-file "elfuse-bench" t))
+         (mount (elfuse-mount dir bench-fs--handlers))
+         results)
+    (unless mount
+      (error "Failed to mount %s" dir))
+    (unwind-protect
+        (dolist (workload bench-fs-workloads)
+          (let ((result (bench-fs--run-workload dir workload)))
+            (message "%s" (json-serialize result))
+            (push result results)))
+      (elfuse-unmount mount)
+      (delete-directory dir))
+    (with-temp-file "bench-results.json"
+      (insert (json-serialize
+               `((date . ,(format-time-string "%FT%T%z"))
+                 (files . ,bench-fs-files)
+                 (file_size . ,bench-fs-file-size)
+                 (fuse_threads . ,elfuse-fuse-threads)
+                 (results . ,(vconcat (nreverse results)))))
+              "\n"))))
+
+(bench-fs-run)
+(kill-emacs)
@@ -0,0 +1,47 @@
+;; This file is part of Elfuse.
+
+;; Elfuse is free software: you can redistribute it and/or modify
+;; it under the terms of the GNU General Public License as published by
+;; the Free Software Foundation, either version 3 of the License, or
+;; (at your option) any later version.
+
+;; Elfuse is distributed in the hope that it will be useful,
+;; but WITHOUT ANY WARRANTY; without even the implied warranty of
+;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;; GNU General Public License for more details.
+
+;; You should have received a copy of the GNU General Public License
+;; along with Elfuse.  If not, see <http://www.gnu.org/licenses/>.
+
+;; Compare the per-request cost of calling a handler the old way
+;; (interning the handler and result symbols and calling `fboundp' on
+;; every request) with the resolved handler table. Nothing is mounted,
+;; the module calls a trivial getattr handler in a loop:
+;;
+;;   emacs -Q --batch -L . -l bench/handler-dispatch.el
+;;
+;; Results are printed and written to handler-dispatch.txt.
+
+(require 'elfuse)
+
+(defvar handler-dispatch-requests 1000000
+  "Number of handler calls per variant.")
+
+(elfuse-define-op getattr (_path)
+  [dir 0])
+
+(defun handler-dispatch-run ()
+  "Time both variants and report."
+  ;; Warm up
+  (elfuse--bench-handlers 1000)
+  (seq-let (interned resolved) (elfuse--bench-handlers handler-dispatch-requests)
+    (let ((report
+           (format "interned ns/request=%.1f resolved ns/request=%.1f saved ns/request=%.1f"
+                   (/ interned (float handler-dispatch-requests))
+                   (/ resolved (float handler-dispatch-requests))
+                   (/ (- interned resolved) (float handler-dispatch-requests)))))
+      (message "%s" report)
+      (with-temp-file "handler-dispatch.txt"
+        (insert report "\n")))))
+
+(handler-dispatch-run)
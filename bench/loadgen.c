@@ -0,0 +1,301 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Load generator for make bench. Runs a workload against a mounted
+ * bench-fs.el tree from a number of threads and prints throughput and
+ * latency percentiles as a single JSON object:
+ *
+ *   loadgen -d DIR -w WORKLOAD [-t THREADS] [-n OPS] [-f FILES] [-s FILE_SIZE]
+ *
+ * DIR holds files f0 .. f<FILES-1> of FILE_SIZE bytes each and a
+ * writable scratch/ directory. OPS is the number of operations per
+ * thread. Workloads:
+ *
+ *   stat      stat a random file
+ *   readdir   list DIR
+ *   seqread   read a file 64 KiB at a time, from the start again at EOF
+ *   randread  read 4 KiB at a random offset of a random file
+ *   append    append 128 bytes to a file per thread
+ *   churn     create and unlink a file
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SEQREAD_SIZE (64 * 1024)
+#define RANDREAD_SIZE 4096
+#define APPEND_SIZE 128
+/* Files a randread thread keeps open */
+#define RANDREAD_FILES 64
+
+enum workload {
+    WORKLOAD_STAT,
+    WORKLOAD_READDIR,
+    WORKLOAD_SEQREAD,
+    WORKLOAD_RANDREAD,
+    WORKLOAD_APPEND,
+    WORKLOAD_CHURN,
+};
+
+static const char *const workload_names[] = {
+    [WORKLOAD_STAT] = "stat",
+    [WORKLOAD_READDIR] = "readdir",
+    [WORKLOAD_SEQREAD] = "seqread",
+    [WORKLOAD_RANDREAD] = "randread",
+    [WORKLOAD_APPEND] = "append",
+    [WORKLOAD_CHURN] = "churn",
+};
+
+static const char *dir;
+static enum workload workload;
+static long files = 1000;
+static long file_size = 64 * 1024;
+static long ops = 10000;
+static int threads_size = 4;
+
+struct worker {
+    pthread_t thread;
+    int index;
+    unsigned seed;
+    /* Latency of every operation in ns */
+    uint64_t *latencies;
+    long errors;
+};
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+file_path(char *path, size_t size, long index)
+{
+    snprintf(path, size, "%s/f%ld", dir, index);
+}
+
+/* Open a file for reading, counting failures as errors */
+static int
+open_file(struct worker *worker, long index)
+{
+    char path[4096];
+    file_path(path, sizeof(path), index);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        worker->errors++;
+    return fd;
+}
+
+static void *
+run_worker(void *data)
+{
+    struct worker *worker = data;
+    char path[4096];
+    char *buf = malloc(SEQREAD_SIZE);
+    int fds[RANDREAD_FILES];
+    int fds_size = 0;
+    int fd = -1;
+
+    /* Setup isn't timed */
+    switch (workload) {
+    case WORKLOAD_SEQREAD:
+        fd = open_file(worker, worker->index % files);
+        break;
+    case WORKLOAD_RANDREAD:
+        fds_size = files < RANDREAD_FILES ? files : RANDREAD_FILES;
+        for (int i = 0; i < fds_size; i++)
+            fds[i] = open_file(worker, rand_r(&worker->seed) % files);
+        break;
+    case WORKLOAD_APPEND:
+        snprintf(path, sizeof(path), "%s/scratch/append-%d", dir, worker->index);
+        fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0)
+            worker->errors++;
+        memset(buf, 'a', APPEND_SIZE);
+        break;
+    default:
+        break;
+    }
+
+    for (long op = 0; op < ops; op++) {
+        uint64_t start = now_ns();
+        int failed = 0;
+
+        switch (workload) {
+        case WORKLOAD_STAT: {
+            struct stat st;
+            file_path(path, sizeof(path), rand_r(&worker->seed) % files);
+            failed = stat(path, &st) != 0;
+            break;
+        }
+        case WORKLOAD_READDIR: {
+            DIR *d = opendir(dir);
+            if (d == NULL) {
+                failed = 1;
+                break;
+            }
+            while (readdir(d) != NULL);
+            closedir(d);
+            break;
+        }
+        case WORKLOAD_SEQREAD: {
+            ssize_t size = fd < 0 ? -1 : read(fd, buf, SEQREAD_SIZE);
+            if (size == 0)
+                lseek(fd, 0, SEEK_SET);
+            failed = size < 0;
+            break;
+        }
+        case WORKLOAD_RANDREAD: {
+            int file_fd = fds[rand_r(&worker->seed) % fds_size];
+            off_t offset = file_size > RANDREAD_SIZE ? rand_r(&worker->seed) % (file_size - RANDREAD_SIZE) : 0;
+            failed = file_fd < 0 || pread(file_fd, buf, RANDREAD_SIZE, offset) < 0;
+            break;
+        }
+        case WORKLOAD_APPEND:
+            failed = fd < 0 || write(fd, buf, APPEND_SIZE) != APPEND_SIZE;
+            break;
+        case WORKLOAD_CHURN: {
+            snprintf(path, sizeof(path), "%s/scratch/churn-%d-%ld", dir, worker->index, op);
+            int churn_fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+            failed = churn_fd < 0;
+            if (churn_fd >= 0) {
+                close(churn_fd);
+                failed = unlink(path) != 0;
+            }
+            break;
+        }
+        }
+
+        worker->latencies[op] = now_ns() - start;
+        worker->errors += failed;
+    }
+
+    if (fd >= 0)
+        close(fd);
+    for (int i = 0; i < fds_size; i++)
+        if (fds[i] >= 0)
+            close(fds[i]);
+    free(buf);
+
+    return NULL;
+}
+
+static int
+compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double
+percentile_us(const uint64_t *sorted, size_t size, double fraction)
+{
+    if (size == 0)
+        return 0.0;
+    size_t index = (size_t)(fraction * size);
+    if (index >= size)
+        index = size - 1;
+    return sorted[index] / 1000.0;
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr, "usage: %s -d DIR -w stat|readdir|seqread|randread|append|churn "
+            "[-t THREADS] [-n OPS] [-f FILES] [-s FILE_SIZE]\n", name);
+    exit(2);
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *workload_name = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:w:t:n:f:s:")) != -1) {
+        switch (opt) {
+        case 'd': dir = optarg; break;
+        case 'w': workload_name = optarg; break;
+        case 't': threads_size = atoi(optarg); break;
+        case 'n': ops = atol(optarg); break;
+        case 'f': files = atol(optarg); break;
+        case 's': file_size = atol(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (dir == NULL || workload_name == NULL || threads_size < 1 || ops < 1 || files < 1)
+        usage(argv[0]);
+
+    size_t workloads_size = sizeof(workload_names) / sizeof(workload_names[0]);
+    size_t i;
+    for (i = 0; i < workloads_size; i++)
+        if (strcmp(workload_name, workload_names[i]) == 0)
+            break;
+    if (i == workloads_size)
+        usage(argv[0]);
+    workload = i;
+
+    struct worker *workers = calloc(threads_size, sizeof(*workers));
+    uint64_t *latencies = malloc(sizeof(uint64_t) * ops * threads_size);
+    if (workers == NULL || latencies == NULL) {
+        perror("loadgen");
+        return 1;
+    }
+
+    uint64_t start = now_ns();
+    for (int t = 0; t < threads_size; t++) {
+        workers[t].index = t;
+        workers[t].seed = t * 7919 + 1;
+        workers[t].latencies = latencies + (size_t)t * ops;
+        if (pthread_create(&workers[t].thread, NULL, run_worker, &workers[t]) != 0) {
+            perror("loadgen");
+            return 1;
+        }
+    }
+    long errors = 0;
+    for (int t = 0; t < threads_size; t++) {
+        pthread_join(workers[t].thread, NULL);
+        errors += workers[t].errors;
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    size_t total = (size_t)ops * threads_size;
+    qsort(latencies, total, sizeof(uint64_t), compare_u64);
+
+    printf("{\"workload\":\"%s\",\"threads\":%d,\"ops\":%zu,\"errors\":%ld,"
+           "\"seconds\":%.3f,\"ops_per_sec\":%.1f,"
+           "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}\n",
+           workload_names[workload], threads_size, total, errors,
+           seconds, total / seconds,
+           percentile_us(latencies, total, 0.5), percentile_us(latencies, total, 0.99),
+           percentile_us(latencies, total, 0.999), latencies[total - 1] / 1000.0);
+
+    free(latencies);
+    free(workers);
+    return 0;
+}
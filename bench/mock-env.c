@@ -0,0 +1,776 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Request marshaling without Emacs. The module is built together with a
+ * mock emacs_env whose values live in an arena, handlers are C functions
+ * returning prebuilt values. Synthetic requests are queued on a mount
+ * without a FUSE loop and handled by calling elfuse--check-ops directly,
+ * so what's measured is the queue, the dispatch and the conversion of
+ * arguments and results:
+ *
+ *   make mock-env
+ *   bench/mock-env [-n BATCHES] [-b BATCH] [-e ENTRIES] [-l LIMIT_NS]
+ *
+ * Every workload prints the time and, on x86, cycles per request along
+ * with the number of mock Lisp values made per request. With -l the
+ * exit status is 1 if any workload takes more than LIMIT_NS per
+ * request. The binary runs as is under perf or valgrind. */
+
+#include "elfuse-module.c"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+enum mock_type {
+    MOCK_SYMBOL,
+    MOCK_INTEGER,
+    MOCK_FLOAT,
+    MOCK_STRING,
+    MOCK_VECTOR,
+    MOCK_CONS,
+    MOCK_FUNCTION,
+    MOCK_USER_PTR,
+};
+
+struct emacs_value_tag {
+    enum mock_type type;
+    union {
+        struct {
+            const char *name;
+            emacs_value function;
+            struct emacs_value_tag *next;
+        } symbol;
+        intmax_t integer;
+        double number;
+        struct {
+            char *data;
+            ptrdiff_t size;
+        } string;
+        struct {
+            emacs_value *items;
+            ptrdiff_t size;
+        } vector;
+        struct {
+            emacs_value car;
+            emacs_value cdr;
+        } cons;
+        struct {
+            ptrdiff_t min_arity;
+            ptrdiff_t max_arity;
+            emacs_subr function;
+            void *data;
+        } function;
+        struct {
+            void (*fin)(void *);
+            void *ptr;
+        } user_ptr;
+    };
+};
+
+/* Values and their data are bump allocated and dropped after every batch,
+ * everything allocated before arena_mark stays */
+#define ARENA_SIZE (256 * 1024 * 1024)
+
+static char *arena;
+static size_t arena_used;
+static size_t arena_mark;
+static size_t values_made;
+
+static void *
+arena_alloc(size_t size)
+{
+    size = (size + 15) & ~(size_t)15;
+    if (arena_used + size > ARENA_SIZE) {
+        fprintf(stderr, "mock-env: arena exhausted, use a smaller batch\n");
+        exit(1);
+    }
+    void *ptr = arena + arena_used;
+    arena_used += size;
+    return ptr;
+}
+
+static emacs_value
+mock_value(enum mock_type type)
+{
+    emacs_value value = arena_alloc(sizeof(*value));
+    value->type = type;
+    values_made++;
+    return value;
+}
+
+/* Symbols are never freed */
+static struct emacs_value_tag *symbols;
+
+static struct {
+    enum emacs_funcall_exit status;
+    emacs_value symbol;
+    emacs_value data;
+} mock_exit;
+
+static emacs_value
+mock_intern(emacs_env *env, const char *name)
+{
+    (void)env;
+    for (struct emacs_value_tag *symbol = symbols; symbol != NULL; symbol = symbol->symbol.next)
+        if (strcmp(symbol->symbol.name, name) == 0)
+            return symbol;
+
+    struct emacs_value_tag *symbol = calloc(1, sizeof(*symbol));
+    symbol->type = MOCK_SYMBOL;
+    symbol->symbol.name = strdup(name);
+    symbol->symbol.next = symbols;
+    symbols = symbol;
+    return symbol;
+}
+
+static void
+mock_signal(emacs_env *env, emacs_value symbol, emacs_value data)
+{
+    (void)env;
+    if (mock_exit.status != emacs_funcall_exit_return)
+        return;
+    mock_exit.status = emacs_funcall_exit_signal;
+    mock_exit.symbol = symbol;
+    mock_exit.data = data;
+}
+
+static void
+mock_throw(emacs_env *env, emacs_value tag, emacs_value value)
+{
+    (void)env;
+    if (mock_exit.status != emacs_funcall_exit_return)
+        return;
+    mock_exit.status = emacs_funcall_exit_throw;
+    mock_exit.symbol = tag;
+    mock_exit.data = value;
+}
+
+static enum emacs_funcall_exit
+mock_non_local_exit_check(emacs_env *env)
+{
+    (void)env;
+    return mock_exit.status;
+}
+
+static void
+mock_non_local_exit_clear(emacs_env *env)
+{
+    (void)env;
+    mock_exit.status = emacs_funcall_exit_return;
+}
+
+static enum emacs_funcall_exit
+mock_non_local_exit_get(emacs_env *env, emacs_value *symbol, emacs_value *data)
+{
+    (void)env;
+    if (mock_exit.status != emacs_funcall_exit_return) {
+        *symbol = mock_exit.symbol;
+        *data = mock_exit.data;
+    }
+    return mock_exit.status;
+}
+
+/* Only values made before arena_mark, e.g. handlers, can be global */
+static emacs_value
+mock_make_global_ref(emacs_env *env, emacs_value value)
+{
+    (void)env;
+    return value;
+}
+
+static void
+mock_free_global_ref(emacs_env *env, emacs_value value)
+{
+    (void)env; (void)value;
+}
+
+static bool
+mock_is_not_nil(emacs_env *env, emacs_value value)
+{
+    return value != mock_intern(env, "nil");
+}
+
+static bool
+mock_eq(emacs_env *env, emacs_value a, emacs_value b)
+{
+    (void)env;
+    if (a->type == MOCK_INTEGER && b->type == MOCK_INTEGER)
+        return a->integer == b->integer;
+    return a == b;
+}
+
+static emacs_value
+mock_type_of(emacs_env *env, emacs_value value)
+{
+    static const char *const names[] = {
+        [MOCK_SYMBOL] = "symbol",
+        [MOCK_INTEGER] = "integer",
+        [MOCK_FLOAT] = "float",
+        [MOCK_STRING] = "string",
+        [MOCK_VECTOR] = "vector",
+        [MOCK_CONS] = "cons",
+        [MOCK_FUNCTION] = "module-function",
+        [MOCK_USER_PTR] = "user-ptr",
+    };
+    return mock_intern(env, names[value->type]);
+}
+
+static emacs_value
+mock_make_integer(emacs_env *env, intmax_t integer)
+{
+    (void)env;
+    emacs_value value = mock_value(MOCK_INTEGER);
+    value->integer = integer;
+    return value;
+}
+
+static intmax_t
+mock_extract_integer(emacs_env *env, emacs_value value)
+{
+    if (value->type != MOCK_INTEGER) {
+        mock_signal(env, mock_intern(env, "wrong-type-argument"), value);
+        return 0;
+    }
+    return value->integer;
+}
+
+static emacs_value
+mock_make_float(emacs_env *env, double number)
+{
+    (void)env;
+    emacs_value value = mock_value(MOCK_FLOAT);
+    value->number = number;
+    return value;
+}
+
+static double
+mock_extract_float(emacs_env *env, emacs_value value)
+{
+    if (value->type == MOCK_INTEGER)
+        return value->integer;
+    if (value->type != MOCK_FLOAT) {
+        mock_signal(env, mock_intern(env, "wrong-type-argument"), value);
+        return 0;
+    }
+    return value->number;
+}
+
+static emacs_value
+mock_make_string(emacs_env *env, const char *contents, ptrdiff_t size)
+{
+    (void)env;
+    emacs_value value = mock_value(MOCK_STRING);
+    value->string.data = arena_alloc(size + 1);
+    memcpy(value->string.data, contents, size);
+    value->string.data[size] = '\0';
+    value->string.size = size;
+    return value;
+}
+
+static bool
+mock_copy_string_contents(emacs_env *env, emacs_value value, char *buffer, ptrdiff_t *size)
+{
+    if (value->type != MOCK_STRING) {
+        mock_signal(env, mock_intern(env, "wrong-type-argument"), value);
+        return false;
+    }
+    ptrdiff_t needed = value->string.size + 1;
+    if (buffer == NULL) {
+        *size = needed;
+        return true;
+    }
+    if (*size < needed) {
+        *size = needed;
+        mock_signal(env, mock_intern(env, "args-out-of-range"), value);
+        return false;
+    }
+    memcpy(buffer, value->string.data, needed);
+    *size = needed;
+    return true;
+}
+
+static emacs_value
+mock_make_vector(ptrdiff_t size, emacs_value *items)
+{
+    emacs_value value = mock_value(MOCK_VECTOR);
+    value->vector.items = arena_alloc(sizeof(emacs_value) * (size > 0 ? size : 1));
+    if (size > 0)
+        memcpy(value->vector.items, items, sizeof(emacs_value) * size);
+    value->vector.size = size;
+    return value;
+}
+
+static emacs_value
+mock_vec_get(emacs_env *env, emacs_value vector, ptrdiff_t i)
+{
+    if (vector->type != MOCK_VECTOR || i < 0 || i >= vector->vector.size) {
+        mock_signal(env, mock_intern(env, "args-out-of-range"), vector);
+        return mock_intern(env, "nil");
+    }
+    return vector->vector.items[i];
+}
+
+static void
+mock_vec_set(emacs_env *env, emacs_value vector, ptrdiff_t i, emacs_value item)
+{
+    if (vector->type != MOCK_VECTOR || i < 0 || i >= vector->vector.size) {
+        mock_signal(env, mock_intern(env, "args-out-of-range"), vector);
+        return;
+    }
+    vector->vector.items[i] = item;
+}
+
+static ptrdiff_t
+mock_vec_size(emacs_env *env, emacs_value vector)
+{
+    if (vector->type != MOCK_VECTOR) {
+        mock_signal(env, mock_intern(env, "wrong-type-argument"), vector);
+        return 0;
+    }
+    return vector->vector.size;
+}
+
+static emacs_value
+mock_make_function(emacs_env *env, ptrdiff_t min_arity, ptrdiff_t max_arity,
+                   emacs_subr function, const char *documentation, void *data)
+{
+    (void)env; (void)documentation;
+    emacs_value value = mock_value(MOCK_FUNCTION);
+    value->function.min_arity = min_arity;
+    value->function.max_arity = max_arity;
+    value->function.function = function;
+    value->function.data = data;
+    return value;
+}
+
+static emacs_value
+mock_make_user_ptr(emacs_env *env, void (*fin)(void *), void *ptr)
+{
+    (void)env;
+    emacs_value value = mock_value(MOCK_USER_PTR);
+    value->user_ptr.fin = fin;
+    value->user_ptr.ptr = ptr;
+    return value;
+}
+
+static void *
+mock_get_user_ptr(emacs_env *env, emacs_value value)
+{
+    if (value->type != MOCK_USER_PTR) {
+        mock_signal(env, mock_intern(env, "wrong-type-argument"), value);
+        return NULL;
+    }
+    return value->user_ptr.ptr;
+}
+
+static void
+mock_set_user_ptr(emacs_env *env, emacs_value value, void *ptr)
+{
+    (void)env;
+    value->user_ptr.ptr = ptr;
+}
+
+static void
+(*mock_get_user_finalizer(emacs_env *env, emacs_value value))(void *)
+{
+    if (value->type != MOCK_USER_PTR) {
+        mock_signal(env, mock_intern(env, "wrong-type-argument"), value);
+        return NULL;
+    }
+    return value->user_ptr.fin;
+}
+
+static void
+mock_set_user_finalizer(emacs_env *env, emacs_value value, void (*fin)(void *))
+{
+    (void)env;
+    value->user_ptr.fin = fin;
+}
+
+static int
+mock_open_channel(emacs_env *env, emacs_value process)
+{
+    (void)env; (void)process;
+    return -1;
+}
+
+static emacs_value
+mock_cons(emacs_value car, emacs_value cdr)
+{
+    emacs_value value = mock_value(MOCK_CONS);
+    value->cons.car = car;
+    value->cons.cdr = cdr;
+    return value;
+}
+
+/* The few Lisp primitives the module calls */
+static emacs_value
+mock_builtin(emacs_env *env, const char *name, ptrdiff_t nargs, emacs_value args[])
+{
+    emacs_value nil_value = mock_intern(env, "nil");
+    emacs_value t_value = mock_intern(env, "t");
+
+    if (strcmp(name, "vector") == 0)
+        return mock_make_vector(nargs, args);
+    if (strcmp(name, "cons") == 0 && nargs == 2)
+        return mock_cons(args[0], args[1]);
+    if ((strcmp(name, "car") == 0 || strcmp(name, "cdr") == 0) && nargs == 1) {
+        if (args[0] == nil_value)
+            return nil_value;
+        if (args[0]->type != MOCK_CONS) {
+            mock_signal(env, mock_intern(env, "wrong-type-argument"), args[0]);
+            return nil_value;
+        }
+        return name[1] == 'a' ? args[0]->cons.car : args[0]->cons.cdr;
+    }
+    if (strcmp(name, "fset") == 0 && nargs == 2) {
+        args[0]->symbol.function = args[1];
+        return args[1];
+    }
+    if (strcmp(name, "fboundp") == 0 && nargs == 1)
+        return args[0]->type == MOCK_SYMBOL && args[0]->symbol.function != NULL ? t_value : nil_value;
+    if (strcmp(name, "symbolp") == 0 && nargs == 1)
+        return args[0]->type == MOCK_SYMBOL ? t_value : nil_value;
+    if (strcmp(name, "symbol-name") == 0 && nargs == 1)
+        return mock_make_string(env, args[0]->symbol.name, strlen(args[0]->symbol.name));
+    if (strcmp(name, "func-arity") == 0 && nargs == 1) {
+        emacs_value function = args[0];
+        if (function->type == MOCK_SYMBOL)
+            function = function->symbol.function;
+        if (function == NULL || function->type != MOCK_FUNCTION) {
+            mock_signal(env, mock_intern(env, "invalid-function"), args[0]);
+            return nil_value;
+        }
+        ptrdiff_t max = function->function.max_arity;
+        return mock_cons(mock_make_integer(env, function->function.min_arity),
+                         max < 0 ? mock_intern(env, "many") : mock_make_integer(env, max));
+    }
+    if (strcmp(name, "signal") == 0 && nargs == 2) {
+        mock_signal(env, args[0], args[1]);
+        return nil_value;
+    }
+    if (strcmp(name, "provide") == 0 || strcmp(name, "set") == 0 || strcmp(name, "message") == 0)
+        return nargs > 0 ? args[nargs - 1] : nil_value;
+
+    mock_signal(env, mock_intern(env, "void-function"), mock_intern(env, name));
+    return nil_value;
+}
+
+static emacs_value
+mock_funcall(emacs_env *env, emacs_value function, ptrdiff_t nargs, emacs_value args[])
+{
+    if (mock_exit.status != emacs_funcall_exit_return)
+        return mock_intern(env, "nil");
+
+    if (function->type == MOCK_SYMBOL) {
+        if (function->symbol.function == NULL)
+            return mock_builtin(env, function->symbol.name, nargs, args);
+        function = function->symbol.function;
+    }
+    if (function->type != MOCK_FUNCTION
+        || nargs < function->function.min_arity
+        || (function->function.max_arity >= 0 && nargs > function->function.max_arity)) {
+        mock_signal(env, mock_intern(env, "invalid-function"), function);
+        return mock_intern(env, "nil");
+    }
+    return function->function.function(env, nargs, args, function->function.data);
+}
+
+static emacs_env mock_env = {
+    .size = sizeof(emacs_env),
+    .make_global_ref = mock_make_global_ref,
+    .free_global_ref = mock_free_global_ref,
+    .non_local_exit_check = mock_non_local_exit_check,
+    .non_local_exit_clear = mock_non_local_exit_clear,
+    .non_local_exit_get = mock_non_local_exit_get,
+    .non_local_exit_signal = mock_signal,
+    .non_local_exit_throw = mock_throw,
+    .make_function = mock_make_function,
+    .funcall = mock_funcall,
+    .intern = mock_intern,
+    .type_of = mock_type_of,
+    .is_not_nil = mock_is_not_nil,
+    .eq = mock_eq,
+    .extract_integer = mock_extract_integer,
+    .make_integer = mock_make_integer,
+    .extract_float = mock_extract_float,
+    .make_float = mock_make_float,
+    .copy_string_contents = mock_copy_string_contents,
+    .make_string = mock_make_string,
+    .make_user_ptr = mock_make_user_ptr,
+    .get_user_ptr = mock_get_user_ptr,
+    .set_user_ptr = mock_set_user_ptr,
+    .get_user_finalizer = mock_get_user_finalizer,
+    .set_user_finalizer = mock_set_user_finalizer,
+    .vec_get = mock_vec_get,
+    .vec_set = mock_vec_set,
+    .vec_size = mock_vec_size,
+    .open_channel = mock_open_channel,
+};
+
+static emacs_env *
+mock_get_environment(struct emacs_runtime *runtime)
+{
+    (void)runtime;
+    return &mock_env;
+}
+
+/* Handlers return the value they were made with */
+static emacs_value
+handler_constant(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)env; (void)nargs; (void)args;
+    return data;
+}
+
+/* A synthetic request type */
+struct workload {
+    const char *name;
+    enum elfuse_op op;
+    enum elfuse_request_state state;
+    /* Bytes read or written */
+    size_t size;
+};
+
+static const struct workload workloads[] = {
+    { "getattr", OP_GETATTR, WAITING_GETATTR, 0 },
+    { "open", OP_OPEN, WAITING_OPEN, 0 },
+    { "readdir", OP_READDIR, WAITING_READDIR, 0 },
+    { "read-4k", OP_READ, WAITING_READ, 4096 },
+    { "read-64k", OP_READ, WAITING_READ, 64 * 1024 },
+    { "write-4k", OP_WRITE, WAITING_WRITE, 4096 },
+};
+
+/* The handler result of WORKLOAD, made before the arena mark */
+static emacs_value
+workload_result(emacs_env *env, const struct workload *workload, long entries)
+{
+    switch (workload->state) {
+    case WAITING_GETATTR: {
+        emacs_value attr[] = { mock_intern(env, "file"), mock_make_integer(env, 4096) };
+        return mock_make_vector(2, attr);
+    }
+    case WAITING_READDIR: {
+        emacs_value *names = malloc(sizeof(emacs_value) * entries);
+        for (long i = 0; i < entries; i++) {
+            char name[32];
+            snprintf(name, sizeof(name), "file-%06ld", i);
+            names[i] = mock_make_string(env, name, strlen(name));
+        }
+        emacs_value result = mock_make_vector(entries, names);
+        free(names);
+        return result;
+    }
+    case WAITING_READ: {
+        char *data = malloc(workload->size);
+        memset(data, 'x', workload->size);
+        emacs_value result = mock_make_string(env, data, workload->size);
+        free(data);
+        return result;
+    }
+    case WAITING_WRITE:
+        return mock_make_integer(env, workload->size);
+    default:
+        return mock_intern(env, "t");
+    }
+}
+
+static void
+call_prepare(struct elfuse_call_state *call, const struct workload *workload, char *buf)
+{
+    memset(call, 0, sizeof(*call));
+    call->request_state = workload->state;
+    call->response_state = RESPONSE_NOTREADY;
+    sem_init(&call->response_sem, 0, 0);
+
+    const char *path = "/file";
+    switch (workload->state) {
+    case WAITING_GETATTR:
+        call->args.getattr.path = path;
+        break;
+    case WAITING_OPEN:
+        call->args.open.path = path;
+        break;
+    case WAITING_READDIR:
+        call->args.readdir.path = "/";
+        call->args.readdir.limit = ELFUSE_READDIR_PAGE_SIZE;
+        break;
+    case WAITING_READ:
+        call->args.read.path = path;
+        call->args.read.size = workload->size;
+        call->args.read.buf = buf;
+        break;
+    case WAITING_WRITE:
+        call->args.write.path = path;
+        call->args.write.buf = buf;
+        call->args.write.size = workload->size;
+        break;
+    default:
+        break;
+    }
+}
+
+/* Wait for CALL and make sure it got what the handler returned */
+static void
+call_finish(struct elfuse_call_state *call, const struct workload *workload, long entries)
+{
+    while (sem_wait(&call->response_sem));
+    sem_destroy(&call->response_sem);
+
+    bool ok = call->response_state == RESPONSE_SUCCESS;
+    if (ok && workload->state == WAITING_READ) {
+        ok = call->results.read.bytes_read == (int)workload->size;
+    } else if (ok && workload->state == WAITING_WRITE) {
+        ok = call->results.write.size == (int)workload->size;
+    } else if (ok && workload->state == WAITING_READDIR) {
+        ok = call->results.readdir.files_size == (size_t)entries;
+    }
+    if (!ok) {
+        fprintf(stderr, "mock-env: %s request failed (state=%d)\n",
+                workload->name, call->response_state);
+        exit(1);
+    }
+    if (call->request_state == WAITING_READDIR) {
+        free(call->results.readdir.files);
+        free(call->results.readdir.attrs);
+    }
+}
+
+static uint64_t
+ticks(void)
+{
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-n BATCHES] [-b BATCH] [-e ENTRIES] [-l LIMIT_NS]\n", name);
+    exit(2);
+}
+
+int
+main(int argc, char *argv[])
+{
+    long batches = 2000;
+    long batch_size = 32;
+    long entries = 100;
+    double limit_ns = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:b:e:l:")) != -1) {
+        switch (opt) {
+        case 'n': batches = atol(optarg); break;
+        case 'b': batch_size = atol(optarg); break;
+        case 'e': entries = atol(optarg); break;
+        case 'l': limit_ns = atof(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (batches < 1 || batch_size < 1 || entries < 0)
+        usage(argv[0]);
+
+    /* Request messages would dominate */
+    atomic_store(&elfuse_log_level, ELFUSE_LOG_WARN);
+
+    arena = malloc(ARENA_SIZE);
+    struct emacs_runtime runtime = {
+        .size = sizeof(runtime),
+        .get_environment = mock_get_environment,
+    };
+    emacs_env *env = &mock_env;
+    if (arena == NULL || emacs_module_init(&runtime) != 0) {
+        fprintf(stderr, "mock-env: failed to initialize\n");
+        return 1;
+    }
+
+    /* Every handler is there, so every workload goes through the same
+     * mount */
+    size_t workloads_size = sizeof(workloads) / sizeof(workloads[0]);
+    emacs_value handlers[OP_COUNT];
+    for (int op = 0; op < OP_COUNT; op++)
+        handlers[op] = mock_make_function(env, 1, 3, handler_constant, NULL, mock_intern(env, "t"));
+
+    emacs_value workload_handlers[sizeof(workloads) / sizeof(workloads[0])];
+    for (size_t i = 0; i < workloads_size; i++) {
+        emacs_value result = workload_result(env, &workloads[i], entries);
+        ptrdiff_t arity = workloads[i].state == WAITING_READ || workloads[i].state == WAITING_WRITE ? 3 : 1;
+        workload_handlers[i] = mock_make_function(env, arity, arity, handler_constant, NULL, result);
+    }
+
+    struct elfuse_mount *mount = elfuse_mount_new(strdup("/mock"), NULL, 1, false);
+    if (mount == NULL) {
+        fprintf(stderr, "mock-env: failed to create a mount\n");
+        return 1;
+    }
+    mount->handlers = handlers_new(env, mock_make_vector(OP_COUNT, handlers));
+    mount->next = mounts;
+    mounts = mount;
+
+    size_t buf_size = 64 * 1024 + 1;
+    struct elfuse_call_state *calls = calloc(batch_size, sizeof(*calls));
+    char *bufs = malloc(buf_size * batch_size);
+    memset(bufs, 'y', buf_size * batch_size);
+    arena_mark = arena_used;
+
+    int status = 0;
+    for (size_t i = 0; i < workloads_size; i++) {
+        const struct workload *workload = &workloads[i];
+        mount->handlers->ops[workload->op] = workload_handlers[i];
+        handlers_generation++;
+
+        uint64_t ns = 0;
+        uint64_t cycles = 0;
+        size_t values = 0;
+        for (long batch = 0; batch < batches; batch++) {
+            for (long c = 0; c < batch_size; c++) {
+                call_prepare(&calls[c], workload, bufs + c * buf_size);
+                elfuse_queue_push(mount, &calls[c]);
+            }
+
+            values_made = 0;
+            uint64_t start_ns = elfuse_now_ns();
+            uint64_t start_ticks = ticks();
+            Felfuse_check_ops(env, 0, NULL, NULL);
+            cycles += ticks() - start_ticks;
+            ns += elfuse_now_ns() - start_ns;
+            values += values_made;
+
+            for (long c = 0; c < batch_size; c++)
+                call_finish(&calls[c], workload, entries);
+            arena_used = arena_mark;
+        }
+
+        double requests = (double)batches * batch_size;
+        double ns_per_request = ns / requests;
+        printf("%-9s ns/request=%.1f cycles/request=%.0f values/request=%.1f\n",
+               workload->name, ns_per_request, cycles / requests, values / requests);
+        if (limit_ns > 0 && ns_per_request > limit_ns) {
+            status = 1;
+        }
+
+        mount->handlers->ops[workload->op] = handlers[workload->op];
+    }
+
+    free(bufs);
+    free(calls);
+    return status;
+}
@@ -0,0 +1,534 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Replays a request trace recorded with elfuse-record-start against a
+ * mount and prints throughput and per-op latencies as a single JSON
+ * object:
+ *
+ *   replay -d DIR -f TRACE [-t THREADS] [-r]
+ *
+ * Paths in the trace are relative to DIR. Requests of a client process
+ * are issued in order by the same thread, processes are spread over
+ * THREADS threads and releases go to the thread that opened the file. With -r requests are issued at their original times,
+ * otherwise as fast as possible. Requests are turned back into syscalls:
+ *
+ *   getattr   lstat
+ *   readdir   list the directory, only for listings from the start
+ *   open      open with the original access mode
+ *   create    open with O_CREAT
+ *   release   close a file opened by open or create
+ *   read      pread from an open file, or open the file just for that
+ *   write     pwrite, likewise
+ *   truncate  truncate
+ *   unlink    unlink
+ *   rename    rename
+ *
+ * Kernel caches make the replayed requests reaching the file system
+ * differ from the recorded ones, recording a trace with the same mount
+ * options keeps them close. Requests whose outcome differs from the
+ * recorded one count as mismatches. */
+
+#define _XOPEN_SOURCE 700
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "elfuse-record.h"
+
+#define OPS (WAITING_UNLINK + 1)
+
+static const char *const op_names[OPS] = {
+    [WAITING_NONE] = "none",
+    [WAITING_CREATE] = "create",
+    [WAITING_RENAME] = "rename",
+    [WAITING_GETATTR] = "getattr",
+    [WAITING_READDIR] = "readdir",
+    [WAITING_OPEN] = "open",
+    [WAITING_RELEASE] = "release",
+    [WAITING_READ] = "read",
+    [WAITING_WRITE] = "write",
+    [WAITING_TRUNCATE] = "truncate",
+    [WAITING_UNLINK] = "unlink",
+};
+
+/* A recorded request with paths under the replay directory */
+struct request {
+    struct elfuse_record record;
+    char *path;
+    char *newpath;
+    /* The thread issuing the request */
+    int worker;
+    /* Replay latency in ns, UINT64_MAX if it wasn't replayed */
+    uint64_t latency;
+    bool failed;
+};
+
+static const char *dir;
+static bool original_timing;
+static int threads_size = 8;
+
+static struct request *requests;
+static size_t requests_size;
+static uint64_t replay_start;
+
+/* Files opened by open and create requests, looked up by path. Entries
+ * are closed once released and no longer used by reads or writes. */
+struct open_file {
+    char *path;
+    int fd;
+    int refs;
+    struct open_file *next;
+};
+
+static pthread_mutex_t files_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct open_file *files;
+
+struct worker {
+    pthread_t thread;
+    int index;
+    char *buf;
+    size_t buf_size;
+};
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+file_add(const char *path, int fd)
+{
+    struct open_file *file = malloc(sizeof(*file));
+    if (file == NULL) {
+        close(fd);
+        return;
+    }
+    file->path = strdup(path);
+    file->fd = fd;
+    file->refs = 1;
+
+    pthread_mutex_lock(&files_lock);
+    file->next = files;
+    files = file;
+    pthread_mutex_unlock(&files_lock);
+}
+
+/* An open file of PATH for a read or a write, NULL if there's none */
+static struct open_file *
+file_get(const char *path)
+{
+    pthread_mutex_lock(&files_lock);
+    struct open_file *file = files;
+    while (file != NULL && strcmp(file->path, path) != 0)
+        file = file->next;
+    if (file != NULL)
+        file->refs++;
+    pthread_mutex_unlock(&files_lock);
+    return file;
+}
+
+static void
+file_put(struct open_file *file)
+{
+    pthread_mutex_lock(&files_lock);
+    bool last = --file->refs == 0;
+    pthread_mutex_unlock(&files_lock);
+
+    if (last) {
+        close(file->fd);
+        free(file->path);
+        free(file);
+    }
+}
+
+/* Forget the most recently opened file of PATH, false if there's none */
+static bool
+file_release(const char *path)
+{
+    pthread_mutex_lock(&files_lock);
+    struct open_file **link = &files;
+    while (*link != NULL && strcmp((*link)->path, path) != 0)
+        link = &(*link)->next;
+    struct open_file *file = *link;
+    if (file != NULL)
+        *link = file->next;
+    pthread_mutex_unlock(&files_lock);
+
+    if (file == NULL)
+        return false;
+    file_put(file);
+    return true;
+}
+
+/* Open flags of a recorded request that are safe to repeat. O_TRUNC
+ * shows up as a separate truncate request. */
+static int
+open_flags(const struct elfuse_record *record)
+{
+    return record->flags & (O_ACCMODE | O_APPEND);
+}
+
+/* Read or write with an open file of PATH or a file opened for it */
+static bool
+transfer(struct worker *worker, struct request *request)
+{
+    const struct elfuse_record *record = &request->record;
+    bool writing = record->op == WAITING_WRITE;
+
+    if (worker->buf_size < record->size) {
+        free(worker->buf);
+        worker->buf = malloc(record->size);
+        worker->buf_size = worker->buf != NULL ? record->size : 0;
+        if (worker->buf == NULL)
+            return false;
+        memset(worker->buf, 'r', record->size);
+    }
+
+    struct open_file *file = file_get(request->path);
+    int fd = file != NULL ? file->fd : open(request->path, writing ? O_WRONLY : O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    ssize_t res = writing
+        ? pwrite(fd, worker->buf, record->size, record->offset)
+        : pread(fd, worker->buf, record->size, record->offset);
+
+    if (file != NULL) {
+        file_put(file);
+    } else {
+        close(fd);
+    }
+    return res >= 0;
+}
+
+/* Issue REQUEST, false if it failed */
+static bool
+replay(struct worker *worker, struct request *request)
+{
+    const struct elfuse_record *record = &request->record;
+
+    switch (record->op) {
+    case WAITING_GETATTR: {
+        struct stat st;
+        return lstat(request->path, &st) == 0;
+    }
+    case WAITING_READDIR: {
+        DIR *d = opendir(request->path);
+        if (d == NULL)
+            return false;
+        while (readdir(d) != NULL);
+        closedir(d);
+        return true;
+    }
+    case WAITING_OPEN:
+    case WAITING_CREATE: {
+        int flags = open_flags(record);
+        if (record->op == WAITING_CREATE)
+            flags |= O_CREAT;
+        int fd = open(request->path, flags, 0644);
+        if (fd < 0)
+            return false;
+        file_add(request->path, fd);
+        return true;
+    }
+    case WAITING_RELEASE:
+        return file_release(request->path);
+    case WAITING_READ:
+    case WAITING_WRITE:
+        return transfer(worker, request);
+    case WAITING_TRUNCATE:
+        return truncate(request->path, record->size) == 0;
+    case WAITING_UNLINK:
+        return unlink(request->path) == 0;
+    case WAITING_RENAME:
+        return rename(request->path, request->newpath) == 0;
+    default:
+        return false;
+    }
+}
+
+/* Listings are replayed once, from their first request */
+static bool
+replayed(const struct request *request)
+{
+    return request->record.op > WAITING_NONE && request->record.op < OPS
+        && (request->record.op != WAITING_READDIR || request->record.offset == 0);
+}
+
+static void *
+run_worker(void *data)
+{
+    struct worker *worker = data;
+
+    for (size_t i = 0; i < requests_size; i++) {
+        struct request *request = &requests[i];
+        if (request->worker != worker->index || !replayed(request))
+            continue;
+
+        if (original_timing) {
+            uint64_t at = replay_start + request->record.time_ns;
+            struct timespec ts = {
+                .tv_sec = at / 1000000000ULL,
+                .tv_nsec = at % 1000000000ULL,
+            };
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+        }
+
+        uint64_t start = now_ns();
+        request->failed = !replay(worker, request);
+        request->latency = now_ns() - start;
+    }
+
+    free(worker->buf);
+    return NULL;
+}
+
+/* A copy of SIZE bytes at DATA prefixed with the replay directory */
+static char *
+replay_path(const char *data, size_t size)
+{
+    size_t dir_size = strlen(dir);
+    char *path = malloc(dir_size + size + 2);
+    if (path == NULL)
+        return NULL;
+    memcpy(path, dir, dir_size);
+    if (size == 0 || data[0] != '/')
+        path[dir_size++] = '/';
+    memcpy(path + dir_size, data, size);
+    path[dir_size + size] = '\0';
+    return path;
+}
+
+/* Releases of files often come without a pid, they go to the thread that
+ * opened the file so that they are never replayed before the open */
+#define RELEASE_LOOKBEHIND 65536
+
+static int
+worker_of(size_t index)
+{
+    const struct request *request = &requests[index];
+    if (request->record.op == WAITING_RELEASE) {
+        size_t stop = index > RELEASE_LOOKBEHIND ? index - RELEASE_LOOKBEHIND : 0;
+        for (size_t i = index; i-- > stop;) {
+            const struct request *open = &requests[i];
+            if ((open->record.op == WAITING_OPEN || open->record.op == WAITING_CREATE)
+                && strcmp(open->path, request->path) == 0)
+                return open->worker;
+        }
+    }
+    return request->record.pid % threads_size;
+}
+
+static bool
+load(const char *trace)
+{
+    FILE *file = fopen(trace, "rb");
+    if (file == NULL) {
+        perror(trace);
+        return false;
+    }
+
+    struct elfuse_record_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1
+        || memcmp(header.magic, ELFUSE_RECORD_MAGIC, sizeof(header.magic)) != 0
+        || header.version != ELFUSE_RECORD_VERSION
+        || header.record_size != sizeof(struct elfuse_record)) {
+        fprintf(stderr, "%s: not an Elfuse trace of version %d\n", trace, ELFUSE_RECORD_VERSION);
+        fclose(file);
+        return false;
+    }
+
+    size_t capacity = 0;
+    char paths[2 * UINT16_MAX];
+    struct elfuse_record record;
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        size_t paths_size = (size_t)record.path_size + record.newpath_size;
+        if (fread(paths, 1, paths_size, file) != paths_size) {
+            fprintf(stderr, "%s: truncated trace, replaying %zu requests\n", trace, requests_size);
+            break;
+        }
+
+        if (requests_size == capacity) {
+            capacity = capacity > 0 ? capacity * 2 : 4096;
+            struct request *more = realloc(requests, capacity * sizeof(*requests));
+            if (more == NULL) {
+                perror("replay");
+                fclose(file);
+                return false;
+            }
+            requests = more;
+        }
+
+        struct request *request = &requests[requests_size++];
+        request->record = record;
+        request->path = replay_path(paths, record.path_size);
+        request->newpath = record.newpath_size > 0
+            ? replay_path(paths + record.path_size, record.newpath_size) : NULL;
+        request->latency = UINT64_MAX;
+        request->failed = false;
+        if (request->path == NULL || (record.newpath_size > 0 && request->newpath == NULL)) {
+            perror("replay");
+            fclose(file);
+            return false;
+        }
+        request->worker = worker_of(requests_size - 1);
+    }
+
+    fclose(file);
+    return true;
+}
+
+static int
+compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double
+percentile_us(const uint64_t *sorted, size_t size, double fraction)
+{
+    if (size == 0)
+        return 0.0;
+    size_t index = (size_t)(fraction * size);
+    if (index >= size)
+        index = size - 1;
+    return sorted[index] / 1000.0;
+}
+
+static void
+print_latencies(const char *prefix, uint64_t *latencies, size_t size)
+{
+    qsort(latencies, size, sizeof(uint64_t), compare_u64);
+    printf("\"%sp50_us\":%.1f,\"%sp99_us\":%.1f,\"%sp999_us\":%.1f,\"%smax_us\":%.1f",
+           prefix, percentile_us(latencies, size, 0.5),
+           prefix, percentile_us(latencies, size, 0.99),
+           prefix, percentile_us(latencies, size, 0.999),
+           prefix, size > 0 ? latencies[size - 1] / 1000.0 : 0.0);
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr, "usage: %s -d DIR -f TRACE [-t THREADS] [-r]\n", name);
+    exit(2);
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *trace = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:f:t:r")) != -1) {
+        switch (opt) {
+        case 'd': dir = optarg; break;
+        case 'f': trace = optarg; break;
+        case 't': threads_size = atoi(optarg); break;
+        case 'r': original_timing = true; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (dir == NULL || trace == NULL || threads_size < 1)
+        usage(argv[0]);
+
+    if (!load(trace))
+        return 1;
+
+    struct worker *workers = calloc(threads_size, sizeof(*workers));
+    uint64_t *latencies = malloc(sizeof(uint64_t) * (requests_size + 1));
+    uint64_t *recorded = malloc(sizeof(uint64_t) * (requests_size + 1));
+    if (workers == NULL || latencies == NULL || recorded == NULL) {
+        perror("replay");
+        return 1;
+    }
+
+    replay_start = now_ns();
+    for (int t = 0; t < threads_size; t++) {
+        workers[t].index = t;
+        if (pthread_create(&workers[t].thread, NULL, run_worker, &workers[t]) != 0) {
+            perror("replay");
+            return 1;
+        }
+    }
+    for (int t = 0; t < threads_size; t++)
+        pthread_join(workers[t].thread, NULL);
+    double seconds = (now_ns() - replay_start) / 1e9;
+
+    size_t total = 0;
+    long errors = 0, mismatches = 0;
+    for (size_t i = 0; i < requests_size; i++) {
+        const struct request *request = &requests[i];
+        if (request->latency == UINT64_MAX)
+            continue;
+        total++;
+        errors += request->failed;
+        mismatches += request->failed != (request->record.result < 0);
+    }
+
+    printf("{\"trace\":\"%s\",\"threads\":%d,\"timing\":\"%s\",\"requests\":%zu,"
+           "\"errors\":%ld,\"mismatches\":%ld,\"seconds\":%.3f,\"ops_per_sec\":%.1f,\"ops\":{",
+           trace, threads_size, original_timing ? "original" : "fast", total,
+           errors, mismatches, seconds, seconds > 0 ? total / seconds : 0.0);
+
+    /* Replayed and recorded latencies side by side */
+    bool first = true;
+    for (int op = WAITING_NONE + 1; op < OPS; op++) {
+        size_t size = 0;
+        long op_errors = 0;
+        for (size_t i = 0; i < requests_size; i++) {
+            const struct request *request = &requests[i];
+            if (request->record.op != op || request->latency == UINT64_MAX)
+                continue;
+            latencies[size] = request->latency;
+            recorded[size] = request->record.duration_ns;
+            op_errors += request->failed;
+            size++;
+        }
+        if (size == 0)
+            continue;
+
+        printf("%s\"%s\":{\"count\":%zu,\"errors\":%ld,", first ? "" : ",", op_names[op], size, op_errors);
+        print_latencies("", latencies, size);
+        printf(",");
+        print_latencies("recorded_", recorded, size);
+        printf("}");
+        first = false;
+    }
+    printf("}}\n");
+
+    for (size_t i = 0; i < requests_size; i++) {
+        free(requests[i].path);
+        free(requests[i].newpath);
+    }
+    free(requests);
+    free(recorded);
+    free(latencies);
+    free(workers);
+    return 0;
+}
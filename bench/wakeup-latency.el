@@ -0,0 +1,76 @@
+;; This file is part of Elfuse.
+
+;; Elfuse is free software: you can redistribute it and/or modify
+;; it under the terms of the GNU General Public License as published by
+;; the Free Software Foundation, either version 3 of the License, or
+;; (at your option) any later version.
+
+;; Elfuse is distributed in the hope that it will be useful,
+;; but WITHOUT ANY WARRANTY; without even the implied warranty of
+;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;; GNU General Public License for more details.
+
+;; You should have received a copy of the GNU General Public License
+;; along with Elfuse.  If not, see <http://www.gnu.org/licenses/>.
+
+;; Compare request round trips of the `pipe', `signal' and `timer'
+;; wakeup methods. Every method mounts a fresh directory and stats a
+;; series of distinct names from a shell loop, so each stat reaches
+;; Emacs. Signal events are only read by an interactive Emacs, so run
+;; this without --batch:
+;;
+;;   emacs -Q -L . -l bench/wakeup-latency.el
+;;
+;; Results are printed to *Messages* and to wakeup-latency.txt.
+
+(require 'elfuse)
+
+(defvar wakeup-latency-requests 2000
+  "Number of stat calls per wakeup method.")
+
+(defvar wakeup-latency-methods '(pipe signal timer)
+  "Wakeup methods to compare.")
+
+(elfuse-define-op getattr (path)
+  (if (equal path "/")
+      [dir 0]
+    [file 0]))
+
+(defun wakeup-latency--run (method)
+  "Mount a temporary directory using METHOD and return the wakeup stats."
+  (let ((dir (make-temp-file "elfuse-wakeup" t))
+        (elfuse-wakeup-method method))
+    (unwind-protect
+        (progn
+          (elfuse-start dir)
+          (elfuse-batch-stats-reset)
+          (let ((proc (start-process
+                       "wakeup-latency" nil "sh" "-c"
+                       (format "i=0; while [ $i -lt %d ]; do stat %s/f$i >/dev/null; i=$((i+1)); done"
+                               wakeup-latency-requests dir))))
+            (while (process-live-p proc)
+              (sit-for 0.01)))
+          (elfuse-batch-stats))
+      (elfuse-stop)
+      (delete-directory dir))))
+
+(defun wakeup-latency-run ()
+  "Compare all methods in `wakeup-latency-methods' and report."
+  (let ((report
+         (mapconcat
+          (lambda (method)
+            (let ((stats (wakeup-latency--run method)))
+              (format "%-6s requests=%d wakeups=%d avg-us=%.1f max-us=%.1f"
+                      method
+                      (alist-get 'requests stats)
+                      (alist-get 'wakeups stats)
+                      (alist-get 'round-trip-avg-us stats)
+                      (alist-get 'round-trip-max-us stats))))
+          wakeup-latency-methods
+          "\n")))
+    (message "%s" report)
+    (with-temp-file "wakeup-latency.txt"
+      (insert report "\n"))))
+
+(wakeup-latency-run)
+(kill-emacs)
@@ -0,0 +1,695 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+#define _XOPEN_SOURCE 700
+
+#include <fnmatch.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "elfuse-cache.h"
+
+#define ATTR_CACHE_INITIAL_BUCKETS 256
+
+uint64_t
+elfuse_hash_path(const char *path)
+{
+    /* FNV-1a */
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char *c = (const unsigned char *) path; *c; c++) {
+        hash ^= *c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+uint64_t
+elfuse_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+bool
+elfuse_path_below(const char *path, const char *prefix)
+{
+    size_t len = strlen(prefix);
+    if (strncmp(path, prefix, len) != 0)
+        return false;
+    return path[len] == '\0' || path[len] == '/' || (len > 0 && prefix[len - 1] == '/');
+}
+
+void
+elfuse_attr_cache_init(struct elfuse_attr_cache *cache)
+{
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->buckets_size = ATTR_CACHE_INITIAL_BUCKETS;
+    cache->buckets = calloc(cache->buckets_size, sizeof(cache->buckets[0]));
+    cache->entries_size = 0;
+    cache->ttl = 1.0;
+    cache->negative_ttl = 1.0;
+    cache->negative_globs = NULL;
+    cache->negative_globs_size = 0;
+    cache->version = 0;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->negative_hits = 0;
+}
+
+void
+elfuse_attr_cache_set_default_ttl(struct elfuse_attr_cache *cache, double ttl)
+{
+    pthread_mutex_lock(&cache->lock);
+    cache->ttl = ttl > 0 ? ttl : 0;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void
+elfuse_attr_cache_set_negative_ttl(struct elfuse_attr_cache *cache, double ttl)
+{
+    pthread_mutex_lock(&cache->lock);
+    cache->negative_ttl = ttl > 0 ? ttl : 0;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+static struct elfuse_attr_cache_entry **
+find_entry(struct elfuse_attr_cache *cache, const char *path, uint64_t hash)
+{
+    struct elfuse_attr_cache_entry **entry = &cache->buckets[hash % cache->buckets_size];
+    while (*entry != NULL) {
+        if ((*entry)->hash == hash && strcmp((*entry)->path, path) == 0)
+            break;
+        entry = &(*entry)->next;
+    }
+    return entry;
+}
+
+static void
+free_entry(struct elfuse_attr_cache *cache, struct elfuse_attr_cache_entry **entry)
+{
+    struct elfuse_attr_cache_entry *dead = *entry;
+    *entry = dead->next;
+    free(dead->path);
+    free(dead);
+    cache->entries_size--;
+}
+
+/* Drop expired entries, then grow the table if it is still crowded */
+static void
+maybe_grow(struct elfuse_attr_cache *cache)
+{
+    if (cache->entries_size < cache->buckets_size * 2)
+        return;
+
+    uint64_t now = elfuse_now_ns();
+    for (size_t i = 0; i < cache->buckets_size; i++) {
+        struct elfuse_attr_cache_entry **entry = &cache->buckets[i];
+        while (*entry != NULL) {
+            if ((*entry)->expires_ns <= now && (*entry)->ttl < 0) {
+                free_entry(cache, entry);
+            } else {
+                entry = &(*entry)->next;
+            }
+        }
+    }
+
+    if (cache->entries_size < cache->buckets_size)
+        return;
+
+    size_t buckets_size = cache->buckets_size * 2;
+    struct elfuse_attr_cache_entry **buckets = calloc(buckets_size, sizeof(buckets[0]));
+    if (buckets == NULL)
+        return;
+
+    for (size_t i = 0; i < cache->buckets_size; i++) {
+        struct elfuse_attr_cache_entry *entry = cache->buckets[i];
+        while (entry != NULL) {
+            struct elfuse_attr_cache_entry *next = entry->next;
+            entry->next = buckets[entry->hash % buckets_size];
+            buckets[entry->hash % buckets_size] = entry;
+            entry = next;
+        }
+    }
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->buckets_size = buckets_size;
+}
+
+/* Find or create an entry for PATH, NULL if out of memory */
+static struct elfuse_attr_cache_entry *
+get_entry(struct elfuse_attr_cache *cache, const char *path)
+{
+    uint64_t hash = elfuse_hash_path(path);
+    struct elfuse_attr_cache_entry **found = find_entry(cache, path, hash);
+    if (*found != NULL)
+        return *found;
+
+    struct elfuse_attr_cache_entry *entry = calloc(1, sizeof(*entry));
+    if (entry == NULL)
+        return NULL;
+    entry->path = strdup(path);
+    if (entry->path == NULL) {
+        free(entry);
+        return NULL;
+    }
+    entry->hash = hash;
+    entry->ttl = -1;
+
+    maybe_grow(cache);
+    size_t bucket = hash % cache->buckets_size;
+    entry->next = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    cache->entries_size++;
+
+    return entry;
+}
+
+bool
+elfuse_attr_cache_get(struct elfuse_attr_cache *cache, const char *path, struct elfuse_attr *attr)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&cache->lock);
+    struct elfuse_attr_cache_entry *entry = *find_entry(cache, path, elfuse_hash_path(path));
+    if (entry != NULL && entry->valid && entry->expires_ns > elfuse_now_ns()) {
+        *attr = entry->attr;
+        found = true;
+        cache->hits++;
+        if (attr->code == GETATTR_UNKNOWN)
+            cache->negative_hits++;
+    } else {
+        cache->misses++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return found;
+}
+
+uint64_t
+elfuse_attr_cache_version(struct elfuse_attr_cache *cache)
+{
+    pthread_mutex_lock(&cache->lock);
+    uint64_t version = cache->version;
+    pthread_mutex_unlock(&cache->lock);
+
+    return version;
+}
+
+void
+elfuse_attr_cache_put(struct elfuse_attr_cache *cache, const char *path, const struct elfuse_attr *attr,
+                      uint64_t version)
+{
+    pthread_mutex_lock(&cache->lock);
+    if (cache->version != version) {
+        pthread_mutex_unlock(&cache->lock);
+        return;
+    }
+    struct elfuse_attr_cache_entry **found = find_entry(cache, path, elfuse_hash_path(path));
+    double ttl = *found != NULL && (*found)->ttl >= 0 ? (*found)->ttl : cache->ttl;
+    if (ttl > 0) {
+        struct elfuse_attr_cache_entry *entry = *found != NULL ? *found : get_entry(cache, path);
+        if (entry != NULL) {
+            entry->valid = true;
+            entry->attr = *attr;
+            entry->expires_ns = elfuse_now_ns() + (uint64_t) (ttl * 1e9);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void
+elfuse_attr_cache_put_negative(struct elfuse_attr_cache *cache, const char *path, uint64_t version)
+{
+    pthread_mutex_lock(&cache->lock);
+    if (cache->version != version) {
+        pthread_mutex_unlock(&cache->lock);
+        return;
+    }
+    struct elfuse_attr_cache_entry **found = find_entry(cache, path, elfuse_hash_path(path));
+    /* A TTL of 0 set for the path disables negative caching as well */
+    bool disabled = *found != NULL && (*found)->ttl == 0;
+    if (cache->negative_ttl > 0 && !disabled) {
+        struct elfuse_attr_cache_entry *entry = *found != NULL ? *found : get_entry(cache, path);
+        if (entry != NULL) {
+            entry->valid = true;
+            entry->attr = (struct elfuse_attr) {.code = GETATTR_UNKNOWN};
+            entry->expires_ns = elfuse_now_ns() + (uint64_t) (cache->negative_ttl * 1e9);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void
+elfuse_attr_cache_move(struct elfuse_attr_cache *cache, const char *from, const char *to)
+{
+    pthread_mutex_lock(&cache->lock);
+    struct elfuse_attr_cache_entry **found = find_entry(cache, from, elfuse_hash_path(from));
+    if (*found != NULL && (*found)->valid && (*found)->expires_ns > elfuse_now_ns()) {
+        struct elfuse_attr attr = (*found)->attr;
+        uint64_t expires_ns = (*found)->expires_ns;
+        if ((*found)->ttl >= 0) {
+            (*found)->valid = false;
+        } else {
+            free_entry(cache, found);
+        }
+
+        struct elfuse_attr_cache_entry *entry = get_entry(cache, to);
+        if (entry != NULL) {
+            entry->valid = true;
+            entry->attr = attr;
+            entry->expires_ns = expires_ns;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+bool
+elfuse_attr_cache_has_negative_globs(struct elfuse_attr_cache *cache)
+{
+    pthread_mutex_lock(&cache->lock);
+    bool found = cache->negative_globs_size > 0;
+    pthread_mutex_unlock(&cache->lock);
+
+    return found;
+}
+
+bool
+elfuse_attr_cache_negative_glob(struct elfuse_attr_cache *cache, const char *path)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&cache->lock);
+    const char *name = strrchr(path, '/');
+    name = name != NULL ? name + 1 : path;
+    for (size_t i = 0; i < cache->negative_globs_size && !found; i++) {
+        const char *glob = cache->negative_globs[i];
+        if (strchr(glob, '/') != NULL) {
+            found = fnmatch(glob, path, FNM_PATHNAME) == 0;
+        } else {
+            found = fnmatch(glob, name, 0) == 0;
+        }
+    }
+    if (found)
+        cache->negative_hits++;
+    pthread_mutex_unlock(&cache->lock);
+
+    return found;
+}
+
+void
+elfuse_attr_cache_add_negative_glob(struct elfuse_attr_cache *cache, const char *glob)
+{
+    char *copy = strdup(glob);
+    if (copy == NULL)
+        return;
+
+    pthread_mutex_lock(&cache->lock);
+    char **globs = realloc(cache->negative_globs, (cache->negative_globs_size + 1) * sizeof(globs[0]));
+    if (globs != NULL) {
+        globs[cache->negative_globs_size++] = copy;
+        cache->negative_globs = globs;
+        copy = NULL;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    free(copy);
+}
+
+void
+elfuse_attr_cache_clear_negative_globs(struct elfuse_attr_cache *cache)
+{
+    pthread_mutex_lock(&cache->lock);
+    for (size_t i = 0; i < cache->negative_globs_size; i++)
+        free(cache->negative_globs[i]);
+    free(cache->negative_globs);
+    cache->negative_globs = NULL;
+    cache->negative_globs_size = 0;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void
+elfuse_attr_cache_set_ttl(struct elfuse_attr_cache *cache, const char *path, double ttl)
+{
+    pthread_mutex_lock(&cache->lock);
+    struct elfuse_attr_cache_entry *entry = get_entry(cache, path);
+    if (entry != NULL) {
+        entry->ttl = ttl;
+        if (ttl == 0) {
+            entry->valid = false;
+        } else if (entry->valid) {
+            double effective = ttl > 0 ? ttl : cache->ttl;
+            entry->expires_ns = elfuse_now_ns() + (uint64_t) (effective * 1e9);
+        }
+    }
+    cache->version++;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void
+elfuse_attr_cache_invalidate(struct elfuse_attr_cache *cache, const char *path)
+{
+    pthread_mutex_lock(&cache->lock);
+    struct elfuse_attr_cache_entry **entry = find_entry(cache, path, elfuse_hash_path(path));
+    if (*entry != NULL) {
+        /* Keep TTL overrides, only forget the attributes */
+        if ((*entry)->ttl >= 0) {
+            (*entry)->valid = false;
+        } else {
+            free_entry(cache, entry);
+        }
+    }
+    cache->version++;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void
+elfuse_attr_cache_invalidate_prefix(struct elfuse_attr_cache *cache, const char *prefix)
+{
+    pthread_mutex_lock(&cache->lock);
+    for (size_t i = 0; i < cache->buckets_size; i++) {
+        struct elfuse_attr_cache_entry **entry = &cache->buckets[i];
+        while (*entry != NULL) {
+            if (!elfuse_path_below((*entry)->path, prefix)) {
+                entry = &(*entry)->next;
+            } else if ((*entry)->ttl >= 0) {
+                (*entry)->valid = false;
+                entry = &(*entry)->next;
+            } else {
+                free_entry(cache, entry);
+            }
+        }
+    }
+    cache->version++;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void
+elfuse_attr_cache_clear(struct elfuse_attr_cache *cache)
+{
+    pthread_mutex_lock(&cache->lock);
+    for (size_t i = 0; i < cache->buckets_size; i++) {
+        while (cache->buckets[i] != NULL) {
+            free_entry(cache, &cache->buckets[i]);
+        }
+    }
+    cache->version++;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->negative_hits = 0;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void
+elfuse_attr_cache_destroy(struct elfuse_attr_cache *cache)
+{
+    elfuse_attr_cache_clear(cache);
+    elfuse_attr_cache_clear_negative_globs(cache);
+    free(cache->buckets);
+    pthread_mutex_destroy(&cache->lock);
+}
+
+#define BLOCK_CACHE_INITIAL_BUCKETS 1024
+
+static uint64_t
+block_hash(uint64_t path_hash, uint64_t index, uint64_t generation)
+{
+    return path_hash ^ (index * 0x9E3779B97F4A7C15ULL) ^ (generation * 0xC2B2AE3D27D4EB4FULL);
+}
+
+void
+elfuse_block_cache_init(struct elfuse_block_cache *cache)
+{
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->buckets_size = BLOCK_CACHE_INITIAL_BUCKETS;
+    cache->buckets = calloc(cache->buckets_size, sizeof(cache->buckets[0]));
+    cache->blocks_size = 0;
+    cache->lru_head = NULL;
+    cache->lru_tail = NULL;
+    cache->bytes = 0;
+    cache->budget = 64 * 1024 * 1024;
+    cache->epoch = 0;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->evictions = 0;
+}
+
+static struct elfuse_block **
+find_block(struct elfuse_block_cache *cache, const char *path, uint64_t hash, uint64_t index, uint64_t generation)
+{
+    struct elfuse_block **block = &cache->buckets[hash % cache->buckets_size];
+    while (*block != NULL) {
+        if ((*block)->hash == hash && (*block)->index == index && (*block)->generation == generation
+            && strcmp((*block)->path, path) == 0)
+            break;
+        block = &(*block)->next;
+    }
+    return block;
+}
+
+static void
+lru_unlink(struct elfuse_block_cache *cache, struct elfuse_block *block)
+{
+    if (block->lru_prev != NULL)
+        block->lru_prev->lru_next = block->lru_next;
+    else
+        cache->lru_head = block->lru_next;
+    if (block->lru_next != NULL)
+        block->lru_next->lru_prev = block->lru_prev;
+    else
+        cache->lru_tail = block->lru_prev;
+}
+
+static void
+lru_push(struct elfuse_block_cache *cache, struct elfuse_block *block)
+{
+    block->lru_prev = NULL;
+    block->lru_next = cache->lru_head;
+    if (cache->lru_head != NULL)
+        cache->lru_head->lru_prev = block;
+    cache->lru_head = block;
+    if (cache->lru_tail == NULL)
+        cache->lru_tail = block;
+}
+
+static void
+drop_block(struct elfuse_block_cache *cache, struct elfuse_block *block)
+{
+    struct elfuse_block **link = &cache->buckets[block->hash % cache->buckets_size];
+    while (*link != block)
+        link = &(*link)->next;
+    *link = block->next;
+
+    lru_unlink(cache, block);
+    cache->bytes -= block->size;
+    cache->blocks_size--;
+
+    free(block->path);
+    free(block->data);
+    free(block);
+}
+
+static void
+evict_blocks(struct elfuse_block_cache *cache)
+{
+    while (cache->bytes > cache->budget && cache->lru_tail != NULL) {
+        drop_block(cache, cache->lru_tail);
+        cache->evictions++;
+    }
+}
+
+void
+elfuse_block_cache_set_budget(struct elfuse_block_cache *cache, size_t budget)
+{
+    pthread_mutex_lock(&cache->lock);
+    cache->budget = budget;
+    evict_blocks(cache);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+bool
+elfuse_block_cache_enabled(struct elfuse_block_cache *cache)
+{
+    pthread_mutex_lock(&cache->lock);
+    bool enabled = cache->budget > 0;
+    pthread_mutex_unlock(&cache->lock);
+
+    return enabled;
+}
+
+bool
+elfuse_block_cache_contains(struct elfuse_block_cache *cache, const char *path)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&cache->lock);
+    for (struct elfuse_block *block = cache->lru_head; block != NULL; block = block->lru_next) {
+        if (strcmp(block->path, path) == 0) {
+            found = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return found;
+}
+
+long
+elfuse_block_cache_read(struct elfuse_block_cache *cache, const char *path, uint64_t generation,
+                        char *buf, size_t size, size_t offset)
+{
+    uint64_t path_hash = elfuse_hash_path(path);
+    size_t copied = 0;
+
+    pthread_mutex_lock(&cache->lock);
+    while (copied < size) {
+        size_t position = offset + copied;
+        uint64_t index = position / ELFUSE_BLOCK_SIZE;
+        uint64_t hash = block_hash(path_hash, index, generation);
+
+        struct elfuse_block *block = *find_block(cache, path, hash, index, generation);
+        if (block == NULL) {
+            cache->misses++;
+            pthread_mutex_unlock(&cache->lock);
+            return -1;
+        }
+        lru_unlink(cache, block);
+        lru_push(cache, block);
+
+        size_t block_offset = position % ELFUSE_BLOCK_SIZE;
+        if (block_offset >= block->size)
+            break;
+        size_t chunk = block->size - block_offset;
+        if (chunk > size - copied)
+            chunk = size - copied;
+        memcpy(buf + copied, block->data + block_offset, chunk);
+        copied += chunk;
+
+        /* A short block is the end of the file */
+        if (block->size < ELFUSE_BLOCK_SIZE)
+            break;
+    }
+    cache->hits++;
+    pthread_mutex_unlock(&cache->lock);
+
+    return copied;
+}
+
+static void
+put_block(struct elfuse_block_cache *cache, const char *path, uint64_t path_hash, uint64_t generation,
+          uint64_t index, const char *data, size_t size)
+{
+    uint64_t hash = block_hash(path_hash, index, generation);
+    struct elfuse_block *old = *find_block(cache, path, hash, index, generation);
+    if (old != NULL)
+        drop_block(cache, old);
+
+    struct elfuse_block *block = malloc(sizeof(*block));
+    if (block == NULL)
+        return;
+    block->path = strdup(path);
+    block->data = malloc(size > 0 ? size : 1);
+    if (block->path == NULL || block->data == NULL) {
+        free(block->path);
+        free(block->data);
+        free(block);
+        return;
+    }
+    memcpy(block->data, data, size);
+    block->hash = hash;
+    block->index = index;
+    block->generation = generation;
+    block->size = size;
+
+    size_t bucket = hash % cache->buckets_size;
+    block->next = cache->buckets[bucket];
+    cache->buckets[bucket] = block;
+    lru_push(cache, block);
+    cache->bytes += size;
+    cache->blocks_size++;
+}
+
+void
+elfuse_block_cache_fill(struct elfuse_block_cache *cache, const char *path, uint64_t generation,
+                        const char *data, size_t data_size, size_t offset, size_t requested_size)
+{
+    uint64_t path_hash = elfuse_hash_path(path);
+
+    pthread_mutex_lock(&cache->lock);
+    if (cache->budget == 0) {
+        pthread_mutex_unlock(&cache->lock);
+        return;
+    }
+
+    for (size_t done = 0; done < requested_size; done += ELFUSE_BLOCK_SIZE) {
+        size_t size = data_size > done ? data_size - done : 0;
+        if (size > ELFUSE_BLOCK_SIZE)
+            size = ELFUSE_BLOCK_SIZE;
+        put_block(cache, path, path_hash, generation, (offset + done) / ELFUSE_BLOCK_SIZE, data + done, size);
+
+        /* Nothing to cache past the end of the file */
+        if (size < ELFUSE_BLOCK_SIZE)
+            break;
+    }
+    evict_blocks(cache);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void
+elfuse_block_cache_invalidate(struct elfuse_block_cache *cache, const char *path)
+{
+    pthread_mutex_lock(&cache->lock);
+    struct elfuse_block *block = cache->lru_head;
+    while (block != NULL) {
+        struct elfuse_block *next = block->lru_next;
+        if (elfuse_path_below(block->path, path))
+            drop_block(cache, block);
+        block = next;
+    }
+    cache->epoch++;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+uint64_t
+elfuse_block_cache_epoch(struct elfuse_block_cache *cache)
+{
+    pthread_mutex_lock(&cache->lock);
+    uint64_t epoch = cache->epoch;
+    pthread_mutex_unlock(&cache->lock);
+
+    return epoch;
+}
+
+void
+elfuse_block_cache_clear(struct elfuse_block_cache *cache)
+{
+    pthread_mutex_lock(&cache->lock);
+    while (cache->lru_head != NULL)
+        drop_block(cache, cache->lru_head);
+    cache->epoch++;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->evictions = 0;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void
+elfuse_block_cache_destroy(struct elfuse_block_cache *cache)
+{
+    elfuse_block_cache_clear(cache);
+    free(cache->buckets);
+    pthread_mutex_destroy(&cache->lock);
+}
@@ -0,0 +1,234 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef ELFUSE_CACHE_H
+#define ELFUSE_CACHE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "elfuse-fuse.h"
+
+/* Cached GETATTR results */
+struct elfuse_attr {
+    enum elfuse_results_getattr_code code;
+    size_t file_size;
+    /* Content version reported by the handler, if any */
+    bool has_generation;
+    uint64_t generation;
+};
+
+struct elfuse_attr_cache_entry {
+    char *path;
+    uint64_t hash;
+
+    /* Entries created by elfuse_attr_cache_set_ttl only carry a TTL */
+    bool valid;
+    struct elfuse_attr attr;
+    uint64_t expires_ns;
+
+    /* Per-entry TTL in seconds, negative means the cache default */
+    double ttl;
+
+    struct elfuse_attr_cache_entry *next;
+};
+
+/* A path to attributes hash table shared by FUSE threads and Emacs */
+struct elfuse_attr_cache {
+    pthread_mutex_t lock;
+    struct elfuse_attr_cache_entry **buckets;
+    size_t buckets_size;
+    size_t entries_size;
+
+    /* Default TTL in seconds, 0 disables caching */
+    double ttl;
+
+    /* TTL of paths the handler reported missing, 0 disables caching
+     * them. Missing paths are entries with GETATTR_UNKNOWN attributes. */
+    double negative_ttl;
+
+    /* Paths matching these globs are missing without asking Emacs. Globs
+     * with a slash match whole paths, others match the last component. */
+    char **negative_globs;
+    size_t negative_globs_size;
+
+    /* Bumped by every invalidation, puts of attributes fetched before a
+     * bump are dropped */
+    uint64_t version;
+
+    size_t hits;
+    size_t misses;
+    /* Hits answered ENOENT, by cached entries or by globs */
+    size_t negative_hits;
+};
+
+uint64_t
+elfuse_hash_path(const char *path);
+
+uint64_t
+elfuse_now_ns(void);
+
+/* Is PATH the same as PREFIX or somewhere below it? */
+bool
+elfuse_path_below(const char *path, const char *prefix);
+
+void
+elfuse_attr_cache_init(struct elfuse_attr_cache *cache);
+
+void
+elfuse_attr_cache_set_default_ttl(struct elfuse_attr_cache *cache, double ttl);
+
+/* Copy fresh attributes of PATH to ATTR, returns false on a miss */
+bool
+elfuse_attr_cache_get(struct elfuse_attr_cache *cache, const char *path, struct elfuse_attr *attr);
+
+/* Take the version before asking Emacs for attributes to put */
+uint64_t
+elfuse_attr_cache_version(struct elfuse_attr_cache *cache);
+
+/* Cache ATTR of PATH unless the cache was invalidated since VERSION */
+void
+elfuse_attr_cache_put(struct elfuse_attr_cache *cache, const char *path, const struct elfuse_attr *attr,
+                      uint64_t version);
+
+void
+elfuse_attr_cache_set_negative_ttl(struct elfuse_attr_cache *cache, double ttl);
+
+/* Remember that PATH does not exist */
+void
+elfuse_attr_cache_put_negative(struct elfuse_attr_cache *cache, const char *path, uint64_t version);
+
+/* Move fresh attributes of FROM to TO, e.g. once a name got an inode.
+ * Nothing changed, so this is no invalidation. */
+void
+elfuse_attr_cache_move(struct elfuse_attr_cache *cache, const char *from, const char *to);
+
+bool
+elfuse_attr_cache_has_negative_globs(struct elfuse_attr_cache *cache);
+
+/* Does PATH match one of the negative globs? */
+bool
+elfuse_attr_cache_negative_glob(struct elfuse_attr_cache *cache, const char *path);
+
+void
+elfuse_attr_cache_add_negative_glob(struct elfuse_attr_cache *cache, const char *glob);
+
+void
+elfuse_attr_cache_clear_negative_globs(struct elfuse_attr_cache *cache);
+
+/* Set the TTL of PATH, including entries cached later. A negative TTL
+ * restores the default, 0 expires the entry and stops caching it. */
+void
+elfuse_attr_cache_set_ttl(struct elfuse_attr_cache *cache, const char *path, double ttl);
+
+void
+elfuse_attr_cache_invalidate(struct elfuse_attr_cache *cache, const char *path);
+
+/* Drop PREFIX and everything below it */
+void
+elfuse_attr_cache_invalidate_prefix(struct elfuse_attr_cache *cache, const char *prefix);
+
+void
+elfuse_attr_cache_clear(struct elfuse_attr_cache *cache);
+
+void
+elfuse_attr_cache_destroy(struct elfuse_attr_cache *cache);
+
+/* File content is cached in blocks of this size */
+#define ELFUSE_BLOCK_SIZE (64 * 1024)
+
+struct elfuse_block {
+    char *path;
+    uint64_t hash;
+    uint64_t index;
+    uint64_t generation;
+
+    /* Less than ELFUSE_BLOCK_SIZE for the last block of a file */
+    size_t size;
+    char *data;
+
+    /* Hash bucket chain */
+    struct elfuse_block *next;
+
+    /* LRU list, most recently used first */
+    struct elfuse_block *lru_prev;
+    struct elfuse_block *lru_next;
+};
+
+/* An LRU cache of file blocks keyed by path, block index and the file
+ * generation, so blocks of an older generation are never served */
+struct elfuse_block_cache {
+    pthread_mutex_t lock;
+    struct elfuse_block **buckets;
+    size_t buckets_size;
+    size_t blocks_size;
+
+    struct elfuse_block *lru_head;
+    struct elfuse_block *lru_tail;
+
+    /* Bytes of block data cached and the limit, 0 disables caching */
+    size_t bytes;
+    size_t budget;
+
+    /* Bumped whenever content is invalidated */
+    uint64_t epoch;
+
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+};
+
+void
+elfuse_block_cache_init(struct elfuse_block_cache *cache);
+
+void
+elfuse_block_cache_set_budget(struct elfuse_block_cache *cache, size_t budget);
+
+bool
+elfuse_block_cache_enabled(struct elfuse_block_cache *cache);
+
+/* Does the cache hold any block of PATH? */
+bool
+elfuse_block_cache_contains(struct elfuse_block_cache *cache, const char *path);
+
+/* Copy up to SIZE bytes at OFFSET of the PATH GENERATION to BUF. Returns
+ * the number of bytes copied or -1 if any of the blocks is missing. */
+long
+elfuse_block_cache_read(struct elfuse_block_cache *cache, const char *path, uint64_t generation,
+                        char *buf, size_t size, size_t offset);
+
+/* Store DATA_SIZE bytes read at a block aligned OFFSET. Data shorter than
+ * REQUESTED_SIZE marks the end of the file. */
+void
+elfuse_block_cache_fill(struct elfuse_block_cache *cache, const char *path, uint64_t generation,
+                        const char *data, size_t data_size, size_t offset, size_t requested_size);
+
+/* Drop all blocks of PATH and everything below it */
+void
+elfuse_block_cache_invalidate(struct elfuse_block_cache *cache, const char *path);
+
+/* Content read before the epoch changed might be stale */
+uint64_t
+elfuse_block_cache_epoch(struct elfuse_block_cache *cache);
+
+void
+elfuse_block_cache_clear(struct elfuse_block_cache *cache);
+
+void
+elfuse_block_cache_destroy(struct elfuse_block_cache *cache);
+
+#endif //ELFUSE_CACHE_H
@@ -18,11 +18,15 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <stdatomic.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <fuse.h>
 #include <fuse/fuse_lowlevel.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -30,537 +34,2708 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 
 #include "elfuse-fuse.h"
+#include "elfuse-cache.h"
+#include "elfuse-inode.h"
+#include "elfuse-node.h"
+#include "elfuse-log.h"
+#include "elfuse-probes.h"
+#include "elfuse-record.h"
+#include "elfuse-snapshot.h"
+#include "elfuse-stats.h"
+#include "elfuse-mount.h"
+
+/* The kernel request processed by the current FUSE thread */
+static _Thread_local struct elfuse_kernel_request elfuse_kernel_request;
+
+/* The mount served by the current FUSE thread */
+static _Thread_local struct elfuse_mount *elfuse_loop_mount;
+
+/* Inode of the current low-level request, handed to handlers */
+static _Thread_local uint64_t elfuse_request_ino;
+
+void
+elfuse_queue_push(struct elfuse_mount *mount, struct elfuse_call_state *call)
+{
+    struct elfuse_call_state *head = atomic_load(&mount->queue);
+    do {
+        call->next = head;
+    } while (!atomic_compare_exchange_weak(&mount->queue, &head, call));
+}
+
+struct elfuse_call_state *
+elfuse_queue_take(struct elfuse_mount *mount)
+{
+    struct elfuse_call_state *call = atomic_exchange(&mount->queue, NULL);
+
+    /* Reverse the stack to serve requests in arrival order */
+    struct elfuse_call_state *fifo = NULL;
+    while (call != NULL) {
+        struct elfuse_call_state *next = call->next;
+        call->next = fifo;
+        fifo = call;
+        call = next;
+    }
+
+    return fifo;
+}
+
+/* Set while Emacs is draining the queues, new requests will be picked up
+ * without a wakeup */
+static atomic_bool elfuse_draining;
+
+/* Drains in progress, handlers draining again while waiting for something
+ * nest them. Only used by Emacs. */
+static int elfuse_drain_depth;
+
+/* Set once a wakeup is sent but Emacs has not started draining yet */
+static atomic_bool elfuse_wakeup_pending;
+
+/* Size of the last batch handled by Emacs */
+static atomic_size_t elfuse_last_batch;
+
+atomic_uint elfuse_batch_window;
+
+atomic_size_t elfuse_readahead_size = 1024 * 1024;
+
+atomic_int elfuse_wakeup_method = WAKEUP_SIGNAL;
+atomic_int elfuse_wakeup_fd = -1;
+
+/* Request round trip times, from queueing to release */
+atomic_ullong elfuse_rtt_count;
+atomic_ullong elfuse_rtt_sum_ns;
+atomic_ullong elfuse_rtt_max_ns;
+atomic_ullong elfuse_coalesced_count;
+
+void
+elfuse_queue_drain_begin(void)
+{
+    elfuse_drain_depth++;
+    atomic_store(&elfuse_draining, true);
+    atomic_store(&elfuse_wakeup_pending, false);
+}
+
+bool
+elfuse_queue_drain_end(struct elfuse_mount *mounts, size_t handled)
+{
+    /* The outer drain is still going and picks up anything queued later */
+    if (elfuse_drain_depth > 1) {
+        for (struct elfuse_mount *mount = mounts; mount != NULL; mount = mount->next) {
+            if (atomic_load(&mount->queue) != NULL)
+                return false;
+        }
+        elfuse_drain_depth--;
+        return true;
+    }
+
+    atomic_store(&elfuse_draining, false);
+
+    /* Something might have been queued after the last take */
+    for (struct elfuse_mount *mount = mounts; mount != NULL; mount = mount->next) {
+        if (atomic_load(&mount->queue) != NULL) {
+            atomic_store(&elfuse_draining, true);
+            return false;
+        }
+    }
+
+    elfuse_drain_depth = 0;
+    atomic_store(&elfuse_last_batch, handled);
+    return true;
+}
+
+/* Wake Emacs up unless it is already draining the queue or about to. When
+ * requests come in bursts wait a bit so that Emacs handles more of them
+ * per wakeup. */
+void
+elfuse_wakeup(void)
+{
+    int method = atomic_load(&elfuse_wakeup_method);
+    if (method == WAKEUP_NONE)
+        return;
+    if (atomic_load(&elfuse_draining))
+        return;
+    if (atomic_exchange(&elfuse_wakeup_pending, true))
+        return;
+
+    unsigned window = atomic_load(&elfuse_batch_window);
+    if (window > 0 && atomic_load(&elfuse_last_batch) > 1) {
+        struct timespec delay = {
+            .tv_sec = window / 1000000,
+            .tv_nsec = (window % 1000000) * 1000,
+        };
+        nanosleep(&delay, NULL);
+    }
 
-struct elfuse_call_state elfuse_call = {
-    .request_state = WAITING_NONE,
-    .response_state = RESPONSE_NOTREADY,
+    if (method == WAKEUP_PIPE) {
+        int fd = atomic_load(&elfuse_wakeup_fd);
+        /* A full pipe means Emacs has plenty of wakeups already */
+        if (fd >= 0 && write(fd, "\n", 1) < 0 && errno != EAGAIN) {
+            ELFUSE_LOG(ELFUSE_LOG_WARN, "Elfuse: failed to write a wakeup (errno=%d)\n", errno);
+        }
+    } else {
+        pthread_kill(emacs_thread, SIGUSR1);
+    }
+    ELFUSE_PROBE1(signal_sent, method);
+}
+
+static void
+elfuse_rtt_record(uint64_t ns)
+{
+    atomic_fetch_add(&elfuse_rtt_count, 1);
+    atomic_fetch_add(&elfuse_rtt_sum_ns, ns);
+
+    unsigned long long max = atomic_load(&elfuse_rtt_max_ns);
+    while (ns > max && !atomic_compare_exchange_weak(&elfuse_rtt_max_ns, &max, ns));
+}
+
+/* The path of CALL, the old one for renames */
+const char *
+elfuse_call_path(const struct elfuse_call_state *call)
+{
+    switch (call->request_state) {
+    case WAITING_CREATE:
+        return call->args.create.path;
+    case WAITING_RENAME:
+        return call->args.rename.oldpath;
+    case WAITING_GETATTR:
+        return call->args.getattr.path;
+    case WAITING_READDIR:
+        return call->args.readdir.path;
+    case WAITING_OPEN:
+        return call->args.open.path;
+    case WAITING_RELEASE:
+        return call->args.release.path;
+    case WAITING_READ:
+        return call->args.read.path;
+    case WAITING_WRITE:
+        return call->args.write.path;
+    case WAITING_TRUNCATE:
+        return call->args.truncate.path;
+    case WAITING_UNLINK:
+        return call->args.unlink.path;
+    case WAITING_NONE:
+        break;
+    }
+    return NULL;
+}
+
+size_t
+elfuse_call_size(const struct elfuse_call_state *call)
+{
+    switch (call->request_state) {
+    case WAITING_READDIR:
+        return call->args.readdir.limit;
+    case WAITING_READ:
+        return call->args.read.size;
+    case WAITING_WRITE:
+        return call->args.write.size;
+    case WAITING_TRUNCATE:
+        return call->args.truncate.size;
+    default:
+        return 0;
+    }
+}
+
+int64_t
+elfuse_call_offset(const struct elfuse_call_state *call)
+{
+    switch (call->request_state) {
+    case WAITING_READDIR:
+        return call->args.readdir.offset;
+    case WAITING_READ:
+        return call->args.read.offset;
+    case WAITING_WRITE:
+        return call->args.write.offset;
+    default:
+        return 0;
+    }
+}
+
+/* Queue the request, wake Emacs up and block until the request is
+ * handled. */
+static void
+elfuse_call_send(struct elfuse_mount *mount, struct elfuse_call_state *call)
+{
+    sem_init(&call->response_sem, 0, 0);
+    call->ino = elfuse_request_ino;
+
+    call->queued_ns = elfuse_now_ns();
+    ELFUSE_PROBE5(request_enqueue, call, call->request_state, elfuse_call_path(call),
+                  elfuse_call_size(call), elfuse_call_offset(call));
+    elfuse_queue_push(mount, call);
+    elfuse_wakeup();
+    while (sem_wait(&call->response_sem));
+    ELFUSE_PROBE3(request_done, call, call->request_state, elfuse_call_errno(call));
+
+    uint64_t done = elfuse_now_ns();
+    elfuse_rtt_record(done - call->queued_ns);
+    elfuse_stats_record(call, done);
+    elfuse_trace_call(TRACE_CALL, call, done);
+
+    sem_destroy(&call->response_sem);
+}
+
+/* A request waiting for Emacs along with identical requests waiting for
+ * its results. It lives on the stack of the thread that sent it, which
+ * waits for everybody to copy the results before going on. */
+struct elfuse_flight {
+    struct elfuse_call_state *call;
+    bool done;
+    int waiters;
+    pthread_cond_t cond;
+    struct elfuse_flight *next;
 };
 
+/* Only requests without side effects can share results */
+static bool
+elfuse_call_same(const struct elfuse_call_state *a, const struct elfuse_call_state *b)
+{
+    if (a->request_state != b->request_state)
+        return false;
+
+    switch (a->request_state) {
+    case WAITING_GETATTR:
+        return strcmp(a->args.getattr.path, b->args.getattr.path) == 0;
+    case WAITING_READ:
+        return a->args.read.offset == b->args.read.offset
+            && a->args.read.size == b->args.read.size
+            && strcmp(a->args.read.path, b->args.read.path) == 0;
+    default:
+        return false;
+    }
+}
+
+static void
+elfuse_call_copy_results(struct elfuse_call_state *call, const struct elfuse_call_state *from)
+{
+    call->response_state = from->response_state;
+    call->response_err_code = from->response_err_code;
+    call->results = from->results;
+
+    if (call->request_state == WAITING_READ && from->response_state == RESPONSE_SUCCESS
+        && from->results.read.bytes_read > 0) {
+        memcpy(call->args.read.buf, from->args.read.buf, from->results.read.bytes_read);
+    }
+}
+
+/* Unlink the flight of CALL, requests already waiting for it still get
+ * its results */
+static void
+elfuse_flight_close(struct elfuse_mount *mount, struct elfuse_call_state *call)
+{
+    for (struct elfuse_flight **link = &mount->flights; *link != NULL; link = &(*link)->next) {
+        if ((*link)->call == call) {
+            *link = (*link)->next;
+            break;
+        }
+    }
+}
+
+void
+elfuse_call_taken(struct elfuse_mount *mount, struct elfuse_call_state *call)
+{
+    if (call->request_state != WAITING_GETATTR && call->request_state != WAITING_READ)
+        return;
+
+    /* Anything Emacs handles from now on, e.g. a write, could change the
+     * results */
+    pthread_mutex_lock(&mount->flights_lock);
+    elfuse_flight_close(mount, call);
+    pthread_mutex_unlock(&mount->flights_lock);
+}
+
+/* Send the request unless an identical one is waiting for Emacs already,
+ * in which case its results are shared */
+static void
+elfuse_call_wait(struct elfuse_mount *mount, struct elfuse_call_state *call)
+{
+    if (call->request_state != WAITING_GETATTR && call->request_state != WAITING_READ) {
+        elfuse_call_send(mount, call);
+        return;
+    }
+
+    call->ino = elfuse_request_ino;
+    call->queued_ns = elfuse_now_ns();
+    pthread_mutex_lock(&mount->flights_lock);
+    for (struct elfuse_flight *flight = mount->flights; flight != NULL; flight = flight->next) {
+        if (!elfuse_call_same(flight->call, call))
+            continue;
+
+        flight->waiters++;
+        while (!flight->done)
+            pthread_cond_wait(&flight->cond, &mount->flights_lock);
+        elfuse_call_copy_results(call, flight->call);
+        if (--flight->waiters == 0)
+            pthread_cond_broadcast(&flight->cond);
+        pthread_mutex_unlock(&mount->flights_lock);
+
+        atomic_fetch_add(&elfuse_coalesced_count, 1);
+        elfuse_trace_call(TRACE_COALESCED, call, elfuse_now_ns());
+        return;
+    }
+
+    struct elfuse_flight flight = {.call = call, .next = mount->flights};
+    pthread_cond_init(&flight.cond, NULL);
+    mount->flights = &flight;
+    pthread_mutex_unlock(&mount->flights_lock);
+
+    elfuse_call_send(mount, call);
+
+    /* Already closed if Emacs took the call. Waiters copy the results. */
+    pthread_mutex_lock(&mount->flights_lock);
+    elfuse_flight_close(mount, call);
+    flight.done = true;
+    pthread_cond_broadcast(&flight.cond);
+    while (flight.waiters > 0)
+        pthread_cond_wait(&flight.cond, &mount->flights_lock);
+    pthread_mutex_unlock(&mount->flights_lock);
+
+    pthread_cond_destroy(&flight.cond);
+}
+
+/* The mount the current FUSE request belongs to */
+static struct elfuse_mount *
+elfuse_current_mount(void)
+{
+    return elfuse_loop_mount;
+}
+
+/* The low-level backend keys caches and requests on inodes instead of
+ * paths: "#INO" stands for a node and "#PARENT/NAME" for a name without
+ * a node yet. Keys never clash with paths, which start with a slash, and
+ * dropping everything below a node key drops its name keys too. Paths
+ * are only built from keys for handlers and for tables keyed by path. */
+#define ELFUSE_KEY_SIZE 24
+
+static void
+elfuse_node_key(char *key, uint64_t ino)
+{
+    snprintf(key, ELFUSE_KEY_SIZE, "#%" PRIu64, ino);
+}
+
+/* KEY has room for SIZE bytes, ELFUSE_KEY_SIZE + strlen(NAME) will do */
+static void
+elfuse_name_key(char *key, size_t size, uint64_t parent, const char *name)
+{
+    snprintf(key, size, "#%" PRIu64 "/%s", parent, name);
+}
+
+bool
+elfuse_key_parse(const char *key, uint64_t *ino, const char **name)
+{
+    if (key[0] != '#')
+        return false;
+
+    char *end;
+    *ino = strtoull(key + 1, &end, 10);
+    *name = *end == '/' ? end + 1 : NULL;
+    return true;
+}
+
+char *
+elfuse_key_path(struct elfuse_mount *mount, const char *key)
+{
+    uint64_t ino;
+    const char *name;
+    if (!elfuse_key_parse(key, &ino, &name))
+        return strdup(key);
+    if (name != NULL)
+        return elfuse_node_child_path(&mount->node_table, ino, name);
+    return elfuse_node_path(&mount->node_table, ino);
+}
+
+/* Key of NAME listed in the directory DIR: a path below a path, the node
+ * key if NAME was looked up and a name key otherwise. KEY has room for
+ * SIZE bytes, ELFUSE_KEY_SIZE + strlen(DIR) + strlen(NAME) will do. */
+static void
+elfuse_entry_key(struct elfuse_mount *mount, const char *dir, const char *name, char *key, size_t size)
+{
+    uint64_t parent;
+    const char *dir_name;
+    if (!elfuse_key_parse(dir, &parent, &dir_name)) {
+        size_t dir_size = strlen(dir);
+        bool slash = dir_size > 0 && dir[dir_size - 1] == '/';
+        snprintf(key, size, "%s%s%s", dir, slash ? "" : "/", name);
+        return;
+    }
+
+    uint64_t ino = elfuse_node_find(&mount->node_table, parent, name);
+    if (ino != 0) {
+        elfuse_node_key(key, ino);
+    } else {
+        elfuse_name_key(key, size, parent, name);
+    }
+}
+
+/* Remember which kernel node the current request refers to. Nodes of the
+ * low-level backend are in the node table already. */
+static void
+elfuse_track_inode(struct elfuse_mount *mount, const char *path)
+{
+    if (path[0] == '#')
+        return;
+    elfuse_inode_table_track(&mount->inode_table, &elfuse_kernel_request, path);
+}
+
+/* Snapshots are registered by path, keys are only turned into one while
+ * there are any */
+
+static struct elfuse_snapshot *
+elfuse_snapshot_get(struct elfuse_mount *mount, const char *path)
+{
+    if (path[0] != '#')
+        return elfuse_snapshot_table_get(&mount->snapshot_table, path);
+    if (elfuse_snapshot_table_empty(&mount->snapshot_table))
+        return NULL;
+
+    char *key_path = elfuse_key_path(mount, path);
+    struct elfuse_snapshot *snapshot = NULL;
+    if (key_path != NULL)
+        snapshot = elfuse_snapshot_table_get(&mount->snapshot_table, key_path);
+    free(key_path);
+    return snapshot;
+}
+
+static bool
+elfuse_snapshot_contains(struct elfuse_mount *mount, const char *path)
+{
+    if (path[0] != '#')
+        return elfuse_snapshot_table_contains(&mount->snapshot_table, path);
+    if (elfuse_snapshot_table_empty(&mount->snapshot_table))
+        return false;
+
+    char *key_path = elfuse_key_path(mount, path);
+    bool found = key_path != NULL && elfuse_snapshot_table_contains(&mount->snapshot_table, key_path);
+    free(key_path);
+    return found;
+}
+
+static void
+elfuse_snapshot_mark_stale(struct elfuse_mount *mount, const char *path)
+{
+    if (path[0] != '#') {
+        elfuse_snapshot_table_mark_stale(&mount->snapshot_table, path);
+        return;
+    }
+    if (elfuse_snapshot_table_empty(&mount->snapshot_table))
+        return;
+
+    char *key_path = elfuse_key_path(mount, path);
+    if (key_path != NULL)
+        elfuse_snapshot_table_mark_stale(&mount->snapshot_table, key_path);
+    free(key_path);
+}
+
+/* Negative globs match paths. Name keys are only turned into one if there
+ * are globs, nodes were matched when their name was looked up. */
+static bool
+elfuse_negative_glob(struct elfuse_mount *mount, const char *path)
+{
+    if (path[0] != '#')
+        return elfuse_attr_cache_negative_glob(&mount->attr_cache, path);
+    if (strchr(path, '/') == NULL || !elfuse_attr_cache_has_negative_globs(&mount->attr_cache))
+        return false;
+
+    char *key_path = elfuse_key_path(mount, path);
+    bool found = key_path != NULL && elfuse_attr_cache_negative_glob(&mount->attr_cache, key_path);
+    free(key_path);
+    return found;
+}
+
 static int
-elfuse_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+elfuse_serve_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
+    struct elfuse_mount *mount = elfuse_current_mount();
     (void) mode;
     (void) fi;
     int res = 0;
 
+    elfuse_track_inode(mount, path);
+
     /* Function to call */
-    elfuse_call.request_state = WAITING_CREATE;
-    elfuse_call.response_state = RESPONSE_NOTREADY;
+    struct elfuse_call_state call = {
+        .request_state = WAITING_CREATE,
+        .response_state = RESPONSE_NOTREADY,
+    };
 
     /* Set function args */
-    elfuse_call.args.create.path = path;
+    call.args.create.path = path;
 
     /* Wait for the funcall results */
-    fprintf(stderr, "CREATE request (path=%s).\n", path);
-    pthread_kill(emacs_thread, SIGUSR1);
-    while (sem_wait(&request_sem));
+    ELFUSE_LOG(ELFUSE_LOG_DEBUG, "CREATE request (path=%s).\n", path);
+    elfuse_call_wait(mount, &call);
+
+    /* Whatever the result, cached attributes and content might be stale now */
+    elfuse_attr_cache_invalidate(&mount->attr_cache, path);
+    elfuse_block_cache_invalidate(&mount->block_cache, path);
+    elfuse_snapshot_mark_stale(mount, path);
 
     /* Got the results, see if everything's fine */
-    if (elfuse_call.response_state == RESPONSE_SUCCESS) {
-        fprintf(stderr, "CREATE success (code=%d)\n", elfuse_call.results.create.code);
-        if (elfuse_call.results.create.code == CREATE_DONE) {
+    if (call.response_state == RESPONSE_SUCCESS) {
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "CREATE success (code=%d)\n", call.results.create.code);
+        if (call.results.create.code == CREATE_DONE) {
             res = 0;
         } else {
             res = -ENOENT;
         }
-    } else if (elfuse_call.response_state == RESPONSE_UNDEFINED) {
-        fprintf(stderr, "CREATE fail (operation undefined)\n");
+    } else if (call.response_state == RESPONSE_UNDEFINED) {
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "CREATE fail (operation undefined)\n");
         res = -ENOSYS;
-    } else if (elfuse_call.response_state == RESPONSE_SIGNAL_ERROR) {
-        fprintf(stderr, "CREATE fail (elfuse signal with errno %d)\n", elfuse_call.response_err_code);
-        res = -elfuse_call.response_err_code;
+    } else if (call.response_state == RESPONSE_SIGNAL_ERROR) {
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "CREATE fail (elfuse signal with errno %d)\n", call.response_err_code);
+        res = -call.response_err_code;
     } else {
-        fprintf(stderr, "CREATE fail (unknown error\n)");
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "CREATE fail (unknown error)\n");
         res = -ENOSYS;
     }
 
-    elfuse_call.request_state = WAITING_NONE;
-
     return res;
 }
 
 static int
-elfuse_rename(const char *oldpath, const char *newpath)
+elfuse_serve_rename(const char *oldpath, const char *newpath)
 {
+    struct elfuse_mount *mount = elfuse_current_mount();
     int res = 0;
 
+    elfuse_track_inode(mount, oldpath);
+
     /* Function to call */
-    elfuse_call.request_state = WAITING_RENAME;
-    elfuse_call.response_state = RESPONSE_NOTREADY;
+    struct elfuse_call_state call = {
+        .request_state = WAITING_RENAME,
+        .response_state = RESPONSE_NOTREADY,
+    };
 
     /* Set function args */
-    elfuse_call.args.rename.oldpath = oldpath;
-    elfuse_call.args.rename.newpath = newpath;
+    call.args.rename.oldpath = oldpath;
+    call.args.rename.newpath = newpath;
 
     /* Wait for the funcall results */
-    fprintf(stderr, "RENAME request (oldpath=%s, newpath=%s).\n", oldpath, newpath);
-    pthread_kill(emacs_thread, SIGUSR1);
-    while (sem_wait(&request_sem));
-
-    if (elfuse_call.response_state == RESPONSE_SUCCESS) {
-        if (elfuse_call.results.rename.code == RENAME_DONE) {
-            fprintf(stderr, "RENAME success (code=DONE)\n");
+    ELFUSE_LOG(ELFUSE_LOG_DEBUG, "RENAME request (oldpath=%s, newpath=%s).\n", oldpath, newpath);
+    elfuse_call_wait(mount, &call);
+
+    /* Whatever the result, cached attributes and content might be stale now */
+    elfuse_attr_cache_invalidate_prefix(&mount->attr_cache, oldpath);
+    elfuse_block_cache_invalidate(&mount->block_cache, oldpath);
+    elfuse_snapshot_mark_stale(mount, oldpath);
+    elfuse_attr_cache_invalidate_prefix(&mount->attr_cache, newpath);
+    elfuse_block_cache_invalidate(&mount->block_cache, newpath);
+    elfuse_snapshot_mark_stale(mount, newpath);
+    elfuse_inode_table_forget_prefix(&mount->inode_table, oldpath);
+    elfuse_inode_table_forget_prefix(&mount->inode_table, newpath);
+
+    if (call.response_state == RESPONSE_SUCCESS) {
+        if (call.results.rename.code == RENAME_DONE) {
+            ELFUSE_LOG(ELFUSE_LOG_DEBUG, "RENAME success (code=DONE)\n");
             res = 0;
-        }  {
-            fprintf(stderr, "RENAME success (code=UNKNOWN)\n");
+        } else {
+            ELFUSE_LOG(ELFUSE_LOG_DEBUG, "RENAME success (code=UNKNOWN)\n");
             res = -ENOENT;
         }
-    } else if (elfuse_call.response_state == RESPONSE_UNDEFINED) {
-        fprintf(stderr, "RENAME fail (operation undefined)\n");
+    } else if (call.response_state == RESPONSE_UNDEFINED) {
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "RENAME fail (operation undefined)\n");
         res = -ENOSYS;
-    } else if (elfuse_call.response_state == RESPONSE_SIGNAL_ERROR) {
-        fprintf(stderr, "RENAME fail (elfuse signal with errno %d)\n", elfuse_call.response_err_code);
-        res = -elfuse_call.response_err_code;
+    } else if (call.response_state == RESPONSE_SIGNAL_ERROR) {
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "RENAME fail (elfuse signal with errno %d)\n", call.response_err_code);
+        res = -call.response_err_code;
     } else {
-        fprintf(stderr, "RENAME fail unknown error\n");
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "RENAME fail (unknown error)\n");
         res = -ENOSYS;
     }
 
-    elfuse_call.request_state = WAITING_NONE;
-
     return res;
 }
 
+static void
+elfuse_fill_stat(struct stat *stbuf, const struct elfuse_attr *attr)
+{
+    memset(stbuf, 0, sizeof(struct stat));
+    if (attr->code == GETATTR_FILE) {
+        stbuf->st_mode = S_IFREG | 0666;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = attr->file_size;
+    } else {
+        stbuf->st_mode = S_IFDIR | 0755;
+        stbuf->st_nlink = 2;
+    }
+}
+
+/* Ask Emacs for attributes of PATH and cache them */
 static int
-elfuse_getattr(const char *path, struct stat *stbuf)
+elfuse_getattr_call(struct elfuse_mount *mount, const char *path, struct elfuse_attr *attr)
 {
     int res = 0;
 
     /* Function to call */
-    elfuse_call.request_state = WAITING_GETATTR;
-    elfuse_call.response_state = RESPONSE_NOTREADY;
+    struct elfuse_call_state call = {
+        .request_state = WAITING_GETATTR,
+        .response_state = RESPONSE_NOTREADY,
+    };
 
     /* Set function args */
-    elfuse_call.args.getattr.path = path;
+    call.args.getattr.path = path;
+
+    /* An invalidation while Emacs answers makes the answer stale */
+    uint64_t version = elfuse_attr_cache_version(&mount->attr_cache);
 
     /* Wait for the funcall results */
-    fprintf(stderr, "GETATTR request (path=%s)\n", path);
-    pthread_kill(emacs_thread, SIGUSR1);
-    while (sem_wait(&request_sem));
+    ELFUSE_LOG(ELFUSE_LOG_DEBUG, "GETATTR request (path=%s)\n", path);
+    elfuse_call_wait(mount, &call);
 
     /* Got the results, see if everything's fine */
-    if (elfuse_call.response_state == RESPONSE_SUCCESS) {
-        memset(stbuf, 0, sizeof(struct stat));
-        if (elfuse_call.results.getattr.code == GETATTR_FILE) {
-            fprintf(stderr, "GETATTR success (file %s)\n", path);
-            stbuf->st_mode = S_IFREG | 0666;
-            stbuf->st_nlink = 1;
-            stbuf->st_size = elfuse_call.results.getattr.file_size;
-            res = 0;
-        } else if (elfuse_call.results.getattr.code == GETATTR_DIR) {
-            fprintf(stderr, "GETATTR success (dir %s)\n", path);
-            stbuf->st_mode = S_IFDIR | 0755;
-            stbuf->st_nlink = 2;
+    if (call.response_state == RESPONSE_SUCCESS) {
+        attr->code = call.results.getattr.code;
+        attr->file_size = call.results.getattr.file_size;
+        attr->has_generation = call.results.getattr.has_generation;
+        attr->generation = call.results.getattr.generation;
+        if (attr->code == GETATTR_FILE || attr->code == GETATTR_DIR) {
+            ELFUSE_LOG(ELFUSE_LOG_DEBUG, "GETATTR success (%s %s)\n", attr->code == GETATTR_FILE ? "file" : "dir", path);
+            elfuse_attr_cache_put(&mount->attr_cache, path, attr, version);
             res = 0;
         } else {
-            fprintf(stderr, "GETATTR success (unknown %s)\n", path);
+            ELFUSE_LOG(ELFUSE_LOG_DEBUG, "GETATTR success (unknown %s)\n", path);
+            elfuse_attr_cache_put_negative(&mount->attr_cache, path, version);
             res = -ENOENT;
         }
-    } else if (elfuse_call.response_state == RESPONSE_UNDEFINED) {
-        fprintf(stderr, "GETATTR fail (operation undefined)\n");
+    } else if (call.response_state == RESPONSE_UNDEFINED) {
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "GETATTR fail (operation undefined)\n");
         res = -ENOSYS;
-    } else if (elfuse_call.response_state == RESPONSE_SIGNAL_ERROR) {
-        fprintf(stderr, "GETATTR fail (elfuse signal with errno %d)\n", elfuse_call.response_err_code);
-        res = -elfuse_call.response_err_code;
+    } else if (call.response_state == RESPONSE_SIGNAL_ERROR) {
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "GETATTR fail (elfuse signal with errno %d)\n", call.response_err_code);
+        if (call.response_err_code == ENOENT) {
+            elfuse_attr_cache_put_negative(&mount->attr_cache, path, version);
+        }
+        res = -call.response_err_code;
     } else {
-        fprintf(stderr, "GETATTR fail (unknown error)\n");
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "GETATTR fail (unknown error)\n");
         res = -ENOSYS;
     }
 
-    elfuse_call.request_state = WAITING_NONE;
-
     return res;
 }
 
 static int
-elfuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-			 off_t offset, struct fuse_file_info *fi)
+elfuse_serve_getattr(const char *path, struct stat *stbuf)
 {
-    (void) offset;
-    (void) fi;
+    struct elfuse_mount *mount = elfuse_current_mount();
+    elfuse_track_inode(mount, path);
+
+    /* Registered files don't need Emacs either */
+    struct elfuse_snapshot *snapshot = elfuse_snapshot_get(mount, path);
+    if (snapshot != NULL) {
+        struct elfuse_attr attr = {.code = GETATTR_FILE, .file_size = snapshot->size};
+        elfuse_snapshot_release(snapshot);
+        elfuse_fill_stat(stbuf, &attr);
+        return 0;
+    }
+
+    /* Cached attributes don't need Emacs at all, neither do paths known
+     * to be missing */
+    uint64_t start = elfuse_now_ns();
+    struct elfuse_attr attr;
+    if (elfuse_attr_cache_get(&mount->attr_cache, path, &attr)) {
+        int err = attr.code == GETATTR_UNKNOWN ? ENOENT : 0;
+        elfuse_trace_cached(WAITING_GETATTR, path, elfuse_request_ino, start, err);
+        if (err != 0) {
+            return -err;
+        }
+    } else if (elfuse_negative_glob(mount, path)) {
+        elfuse_trace_cached(WAITING_GETATTR, path, elfuse_request_ino, start, ENOENT);
+        return -ENOENT;
+    } else {
+        int res = elfuse_getattr_call(mount, path, &attr);
+        if (res != 0) {
+            return res;
+        }
+    }
 
+    elfuse_fill_stat(stbuf, &attr);
+    return 0;
+}
+
+/* Per open directory listing state, kept in fuse_file_info.fh. Handlers
+ * list a page of entries at a time and FUSE offsets are entry numbers,
+ * so the kernel can resume a listing anywhere. */
+struct elfuse_dir_stream {
+    pthread_mutex_t lock;
+
+    /* The current page, names live in the same allocation as FILES */
+    bool fetched;
+    char **files;
+    struct elfuse_results_getattr *attrs;
+    size_t files_size;
+    /* Entry number of the first entry of the page */
+    off_t page_offset;
+
+    /* Handler offset of the next page, if there is one */
+    bool has_next;
+    int64_t next_offset;
+};
+
+/* Ask Emacs for a page of entries of PATH starting at the handler OFFSET */
+static int
+elfuse_readdir_call(struct elfuse_mount *mount, const char *path, int64_t offset,
+                    struct elfuse_results_readdir *results)
+{
     int res = 0;
 
     /* Function to call */
-    elfuse_call.request_state = WAITING_READDIR;
-    elfuse_call.response_state = RESPONSE_NOTREADY;
+    struct elfuse_call_state call = {
+        .request_state = WAITING_READDIR,
+        .response_state = RESPONSE_NOTREADY,
+    };
 
     /* Set function args */
-    elfuse_call.args.readdir.path = path;
+    call.args.readdir.path = path;
+    call.args.readdir.offset = offset;
+    call.args.readdir.limit = ELFUSE_READDIR_PAGE_SIZE;
 
     /* Wait for results */
-    fprintf(stderr, "READDIR request (path=%s)\n", path);
-    pthread_kill(emacs_thread, SIGUSR1);
-    while (sem_wait(&request_sem));
+    ELFUSE_LOG(ELFUSE_LOG_DEBUG, "READDIR request (path=%s, offset=%ld)\n", path, offset);
+    elfuse_call_wait(mount, &call);
 
     /* Got the results, see if everything's fine */
-    if (elfuse_call.response_state == RESPONSE_SUCCESS) {
-        size_t files_size = elfuse_call.results.readdir.files_size;
-        fprintf(stderr, "READDIR success (files found = %ld)\n", files_size);
-        for (size_t i = 0; i < files_size; i++) {
-            filler(buf, elfuse_call.results.readdir.files[i], NULL, 0);
-        }
-
-        free(elfuse_call.results.readdir.files);
+    if (call.response_state == RESPONSE_SUCCESS) {
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "READDIR success (files found = %ld)\n", call.results.readdir.files_size);
+        *results = call.results.readdir;
         res = 0;
-    } else if (elfuse_call.response_state == RESPONSE_UNDEFINED) {
-        fprintf(stderr, "READDIR fail (operation undefined)\n");
+    } else if (call.response_state == RESPONSE_UNDEFINED) {
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "READDIR fail (operation undefined)\n");
         res = -ENOSYS;
-    } else if (elfuse_call.response_state == RESPONSE_SIGNAL_ERROR) {
-        fprintf(stderr, "READDIR fail (elfuse signal with errno %d)\n", elfuse_call.response_err_code);
-        res = -elfuse_call.response_err_code;
+    } else if (call.response_state == RESPONSE_SIGNAL_ERROR) {
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "READDIR fail (elfuse signal with errno %d)\n", call.response_err_code);
+        res = -call.response_err_code;
     } else {
-        fprintf(stderr, "READDIR fail (unknown error)\n");
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "READDIR fail (unknown error)\n");
         res = -ENOSYS;
     }
 
-    elfuse_call.request_state = WAITING_NONE;
+    return res;
+}
+
+/* Replace the current page with the first one or the next one */
+static int
+elfuse_dir_stream_fetch(struct elfuse_mount *mount, struct elfuse_dir_stream *stream, const char *path,
+                        bool restart)
+{
+    struct elfuse_results_readdir results;
+    uint64_t version = elfuse_attr_cache_version(&mount->attr_cache);
+    int res = elfuse_readdir_call(mount, path, restart ? 0 : stream->next_offset, &results);
+    if (res != 0)
+        return res;
+
+    stream->page_offset = restart ? 0 : stream->page_offset + (off_t) stream->files_size;
+    free(stream->files);
+    free(stream->attrs);
+    stream->fetched = true;
+    stream->files = results.files;
+    stream->attrs = results.attrs;
+    stream->files_size = results.files_size;
+    stream->has_next = results.has_next;
+    stream->next_offset = results.next_offset;
+
+    /* The getattr calls following a listing are served from the cache */
+    size_t dir_size = strlen(path);
+    for (size_t i = 0; stream->attrs != NULL && i < stream->files_size; i++) {
+        const char *name = stream->files[i];
+        const struct elfuse_results_getattr *result = &stream->attrs[i];
+        if (result->code == GETATTR_UNKNOWN || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            continue;
+
+        struct elfuse_attr attr = {
+            .code = result->code,
+            .file_size = result->file_size,
+            .has_generation = result->has_generation,
+            .generation = result->generation,
+        };
+        char entry_key[ELFUSE_KEY_SIZE + dir_size + strlen(name)];
+        elfuse_entry_key(mount, path, name, entry_key, sizeof(entry_key));
+        elfuse_attr_cache_put(&mount->attr_cache, entry_key, &attr, version);
+    }
+
+    return 0;
+}
+
+static int
+elfuse_opendir(const char *path, struct fuse_file_info *fi)
+{
+    (void) path;
+
+    struct elfuse_dir_stream *stream = calloc(1, sizeof(*stream));
+    if (stream == NULL)
+        return -ENOMEM;
+    pthread_mutex_init(&stream->lock, NULL);
+
+    fi->fh = (uintptr_t) stream;
+    return 0;
+}
+
+static int
+elfuse_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    (void) path;
+
+    struct elfuse_dir_stream *stream = (struct elfuse_dir_stream *) (uintptr_t) fi->fh;
+    if (stream != NULL) {
+        pthread_mutex_destroy(&stream->lock);
+        free(stream->files);
+        free(stream->attrs);
+        free(stream);
+    }
+    fi->fh = 0;
+
+    return 0;
+}
+
+/* Fill entries starting at the entry number OFFSET until FILLER is full
+ * or the listing ends, fetching pages as needed */
+static int
+elfuse_serve_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+			 off_t offset, struct fuse_file_info *fi)
+{
+    struct elfuse_mount *mount = elfuse_current_mount();
+    struct elfuse_dir_stream *stream = (struct elfuse_dir_stream *) (uintptr_t) fi->fh;
+    int res = 0;
+
+    elfuse_track_inode(mount, path);
+
+    pthread_mutex_lock(&stream->lock);
+
+    /* Seeking back starts the listing over */
+    if (!stream->fetched || offset < stream->page_offset) {
+        res = elfuse_dir_stream_fetch(mount, stream, path, true);
+    }
+
+    while (res == 0) {
+        if (offset >= stream->page_offset + (off_t) stream->files_size) {
+            if (!stream->has_next)
+                break;
+            res = elfuse_dir_stream_fetch(mount, stream, path, false);
+            continue;
+        }
+
+        size_t i = offset - stream->page_offset;
+        const struct elfuse_results_getattr *result = stream->attrs != NULL ? &stream->attrs[i] : NULL;
+        struct stat stbuf;
+        if (result != NULL && result->code != GETATTR_UNKNOWN) {
+            struct elfuse_attr attr = {.code = result->code, .file_size = result->file_size};
+            elfuse_fill_stat(&stbuf, &attr);
+        }
+
+        /* Entries point at the next one, a full buffer ends the reply */
+        if (filler(buf, stream->files[i], result != NULL && result->code != GETATTR_UNKNOWN ? &stbuf : NULL,
+                   offset + 1) != 0)
+            break;
+        offset++;
+    }
+
+    pthread_mutex_unlock(&stream->lock);
 
     return res;
 }
 
+/* Per open file read state, kept in fuse_file_info.fh */
+struct elfuse_open_file {
+    pthread_mutex_t lock;
+
+    /* Where the next read starts if the reader is sequential. Reads from
+     * the start of the file count as sequential too. */
+    off_t next_offset;
+    bool sequential;
+
+    /* Content read ahead, valid while the block cache epoch is the same.
+     * Windows of files without a generation are only valid while their
+     * attributes are cached with the same size. */
+    char *window;
+    off_t window_offset;
+    size_t window_size;
+    uint64_t window_epoch;
+    bool window_has_generation;
+    uint64_t window_generation;
+    size_t window_file_size;
+    /* The window ends at the end of the file */
+    bool window_eof;
+
+    /* The file on disk reads and writes go to, -1 if Emacs serves them */
+    int backing_fd;
+};
+
+static struct elfuse_open_file *
+elfuse_open_file_new(void)
+{
+    struct elfuse_open_file *file = calloc(1, sizeof(*file));
+    if (file == NULL)
+        return NULL;
+    pthread_mutex_init(&file->lock, NULL);
+    file->backing_fd = -1;
+    return file;
+}
+
+static void
+elfuse_open_file_free(struct elfuse_open_file *file)
+{
+    if (file == NULL)
+        return;
+    if (file->backing_fd >= 0)
+        close(file->backing_fd);
+    pthread_mutex_destroy(&file->lock);
+    free(file->window);
+    free(file);
+}
+
+/* Serve reads, writes and truncation of the handle FI from the file
+ * BACKING on the FUSE thread, Emacs only sees the open and the release */
 static int
-elfuse_open(const char *path, struct fuse_file_info *fi)
+elfuse_open_backing(struct fuse_file_info *fi, const char *backing)
+{
+    /* O_TRUNC comes with the open thanks to atomic_o_trunc. The kernel
+     * keeps track of appends itself. */
+    int fd = open(backing, fi->flags & (O_ACCMODE | O_TRUNC));
+    if (fd < 0) {
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "OPEN fail (backing file %s, errno %d)\n", backing, errno);
+        return -errno;
+    }
+
+    struct elfuse_open_file *file = elfuse_open_file_new();
+    if (file == NULL) {
+        close(fd);
+        return -ENOMEM;
+    }
+    file->backing_fd = fd;
+    fi->fh = (uintptr_t) file;
+
+    return 0;
+}
+
+static int
+elfuse_serve_open(const char *path, struct fuse_file_info *fi)
 {
+    struct elfuse_mount *mount = elfuse_current_mount();
     int res = 0;
 
-    /* TODO: should be handled on the Emacs side of things */
-    if ((fi->flags & 3) != O_RDONLY)
-        return -EACCES;
+    elfuse_track_inode(mount, path);
+
+    /* TODO: should be handled on the Emacs side of things. Only files
+     * with a backing file can be written to. */
+    bool read_only = (fi->flags & O_ACCMODE) == O_RDONLY;
+
+    /* Registered files are always there */
+    if (elfuse_snapshot_contains(mount, path)) {
+        if (!read_only)
+            return -EACCES;
+        fi->fh = (uintptr_t) elfuse_open_file_new();
+        return 0;
+    }
 
     /* Function to call */
-    elfuse_call.request_state = WAITING_OPEN;
-    elfuse_call.response_state = RESPONSE_NOTREADY;
+    struct elfuse_call_state call = {
+        .request_state = WAITING_OPEN,
+        .response_state = RESPONSE_NOTREADY,
+    };
 
     /* Set callback args */
-    elfuse_call.args.open.path = path;
+    call.args.open.path = path;
 
     /* Wait for results */
-    fprintf(stderr, "OPEN request (path=%s)\n", path);
-    pthread_kill(emacs_thread, SIGUSR1);
-    while (sem_wait(&request_sem));
+    ELFUSE_LOG(ELFUSE_LOG_DEBUG, "OPEN request (path=%s)\n", path);
+    elfuse_call_wait(mount, &call);
 
-    if (elfuse_call.response_state == RESPONSE_SUCCESS) {
-        fprintf(stderr, "OPEN success (code=%d)\n", elfuse_call.results.open.code);
+    if (call.response_state == RESPONSE_SUCCESS) {
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "OPEN success (code=%d)\n", call.results.open.code);
 
-        if (elfuse_call.results.open.code == OPEN_FOUND) {
-            res = 0;
-        } else {
+        char *backing = call.results.open.backing;
+        if (call.results.open.code != OPEN_FOUND || (backing == NULL && !read_only)) {
             res = -EACCES;
+        } else if (backing != NULL) {
+            res = elfuse_open_backing(fi, backing);
+            if (res == 0 && (fi->flags & O_TRUNC)) {
+                elfuse_attr_cache_invalidate(&mount->attr_cache, path);
+                elfuse_block_cache_invalidate(&mount->block_cache, path);
+            }
+        } else {
+            fi->fh = (uintptr_t) elfuse_open_file_new();
+            res = 0;
         }
-    } else if (elfuse_call.response_state == RESPONSE_UNDEFINED) {
-        fprintf(stderr, "OPEN fail (operation undefined)\n");
+        free(backing);
+    } else if (call.response_state == RESPONSE_UNDEFINED) {
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "OPEN fail (operation undefined)\n");
         res = -ENOSYS;
-    } else if (elfuse_call.response_state == RESPONSE_SIGNAL_ERROR) {
-        fprintf(stderr, "OPEN fail (elfuse signal with errno %d)\n", elfuse_call.response_err_code);
-        res = -elfuse_call.response_err_code;
+    } else if (call.response_state == RESPONSE_SIGNAL_ERROR) {
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "OPEN fail (elfuse signal with errno %d)\n", call.response_err_code);
+        res = -call.response_err_code;
     } else {
-        fprintf(stderr, "OPEN fail (unknown error\n)");
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "OPEN fail (unknown error)\n");
         res = -ENOSYS;
     }
 
-    elfuse_call.request_state = WAITING_NONE;
-
     return res;
 }
 
 static int
-elfuse_release(const char *path, struct fuse_file_info *fi)
+elfuse_serve_release(const char *path, struct fuse_file_info *fi)
 {
+    struct elfuse_mount *mount = elfuse_current_mount();
     int res = 0;
 
-    /* TODO: should be handled on the Emacs side of things */
-    if ((fi->flags & 3) != O_RDONLY)
+    elfuse_track_inode(mount, path);
+
+    struct elfuse_open_file *file = (struct elfuse_open_file *) (uintptr_t) fi->fh;
+    bool backed = file != NULL && file->backing_fd >= 0;
+    elfuse_open_file_free(file);
+    fi->fh = 0;
+
+    /* TODO: should be handled on the Emacs side of things. Only files
+     * with a backing file can be written to. */
+    if (!backed && (fi->flags & O_ACCMODE) != O_RDONLY)
         return -EACCES;
 
+    if (elfuse_snapshot_contains(mount, path))
+        return 0;
+
     /* Function to call */
-    elfuse_call.request_state = WAITING_RELEASE;
-    elfuse_call.response_state = RESPONSE_NOTREADY;
+    struct elfuse_call_state call = {
+        .request_state = WAITING_RELEASE,
+        .response_state = RESPONSE_NOTREADY,
+    };
 
     /* Set callback args */
-    elfuse_call.args.release.path = path;
+    call.args.release.path = path;
 
     /* Wait for results */
-    fprintf(stderr, "RELEASE request (path=%s)\n", path);
-    pthread_kill(emacs_thread, SIGUSR1);
-    while (sem_wait(&request_sem));
+    ELFUSE_LOG(ELFUSE_LOG_DEBUG, "RELEASE request (path=%s)\n", path);
+    elfuse_call_wait(mount, &call);
 
-    if (elfuse_call.response_state == RESPONSE_SUCCESS) {
-        fprintf(stderr, "RELEASE success (code=%d)\n", elfuse_call.results.release.code);
+    if (call.response_state == RESPONSE_SUCCESS) {
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "RELEASE success (code=%d)\n", call.results.release.code);
 
-        if (elfuse_call.results.release.code == RELEASE_FOUND) {
+        if (call.results.release.code == RELEASE_FOUND) {
             res = 0;
         } else {
             res = -EACCES;
         }
-    } else if (elfuse_call.response_state == RESPONSE_UNDEFINED) {
-        fprintf(stderr, "RELEASE fail (operation undefined)\n");
+    } else if (call.response_state == RESPONSE_UNDEFINED) {
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "RELEASE fail (operation undefined)\n");
         res = -ENOSYS;
-    } else if (elfuse_call.response_state == RESPONSE_SIGNAL_ERROR) {
-        fprintf(stderr, "RELEASE fail (elfuse signal with errno %d)\n", elfuse_call.response_err_code);
-        res = -elfuse_call.response_err_code;
+    } else if (call.response_state == RESPONSE_SIGNAL_ERROR) {
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "RELEASE fail (elfuse signal with errno %d)\n", call.response_err_code);
+        res = -call.response_err_code;
     } else {
-        fprintf(stderr, "RELEASE fail (unknown error\n)");
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "RELEASE fail (unknown error)\n");
         res = -ENOSYS;
     }
 
-    elfuse_call.request_state = WAITING_NONE;
-
     return res;
 }
 
+/* Ask Emacs for SIZE bytes of PATH at OFFSET. BUF must have room for one
+ * more byte, Emacs copies strings with a terminating NUL. */
 static int
-elfuse_read(const char *path, char *buf, size_t size, off_t offset,
-		      struct fuse_file_info *fi)
+elfuse_read_call(struct elfuse_mount *mount, const char *path, char *buf, size_t size, off_t offset)
 {
-    (void) fi;
-
     int res = 0;
 
     /* Function to call */
-    elfuse_call.request_state = WAITING_READ;
-    elfuse_call.response_state = RESPONSE_NOTREADY;
+    struct elfuse_call_state call = {
+        .request_state = WAITING_READ,
+        .response_state = RESPONSE_NOTREADY,
+    };
 
     /* Set function args */
-    elfuse_call.args.read.path = path;
-    elfuse_call.args.read.offset = offset;
-    elfuse_call.args.read.size = size;
+    call.args.read.path = path;
+    call.args.read.offset = offset;
+    call.args.read.size = size;
+    call.args.read.buf = buf;
 
     /* Wait for the funcall results */
-    fprintf(stderr, "READ request (path=%s, size=%ld, offset=%ld).\n", path, size, offset);
-    pthread_kill(emacs_thread, SIGUSR1);
-    while (sem_wait(&request_sem));
-
-    if (elfuse_call.response_state == RESPONSE_SUCCESS) {
-        if (elfuse_call.results.read.bytes_read >= 0) {
-            fprintf(stderr, "READ success (data=%s, size=%d)\n", elfuse_call.results.read.data, elfuse_call.results.read.bytes_read);
-            memcpy(buf, elfuse_call.results.read.data, elfuse_call.results.read.bytes_read);
-            free(elfuse_call.results.read.data);
-            res = elfuse_call.results.read.bytes_read;
+    ELFUSE_LOG(ELFUSE_LOG_DEBUG, "READ request (path=%s, size=%ld, offset=%ld).\n", path, size, offset);
+    elfuse_call_wait(mount, &call);
+
+    if (call.response_state == RESPONSE_SUCCESS) {
+        if (call.results.read.bytes_read >= 0) {
+            ELFUSE_LOG(ELFUSE_LOG_DEBUG, "READ success (size=%d)\n", call.results.read.bytes_read);
+            res = call.results.read.bytes_read;
         } else {
-            fprintf(stderr, "READ success (no data, size=%d)\n", elfuse_call.results.read.bytes_read);
+            ELFUSE_LOG(ELFUSE_LOG_DEBUG, "READ success (no data, size=%d)\n", call.results.read.bytes_read);
             res = -ENOENT;
         }
-    } else if (elfuse_call.response_state == RESPONSE_UNDEFINED) {
-        fprintf(stderr, "READ fail (operation undefined)\n");
+    } else if (call.response_state == RESPONSE_UNDEFINED) {
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "READ fail (operation undefined)\n");
         res = -ENOSYS;
-    } else if (elfuse_call.response_state == RESPONSE_SIGNAL_ERROR) {
-        fprintf(stderr, "READ fail (elfuse signal with errno %d)\n", elfuse_call.response_err_code);
-        res = -elfuse_call.response_err_code;
+    } else if (call.response_state == RESPONSE_SIGNAL_ERROR) {
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "READ fail (elfuse signal with errno %d)\n", call.response_err_code);
+        res = -call.response_err_code;
     } else {
-        fprintf(stderr, "READ fail (unknown error\n)");
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "READ fail (unknown error)\n");
         res = -ENOSYS;
     }
 
-    elfuse_call.request_state = WAITING_NONE;
-
     return res;
 }
 
-static int
-elfuse_write(const char *path, const char *buf, size_t size, off_t offset,
-                        struct fuse_file_info *fi)
+/* Find out the content generation of PATH. Cached attributes are trusted
+ * while fresh, cached blocks make it worth asking Emacs once they expire. */
+static bool
+elfuse_read_generation(struct elfuse_mount *mount, const char *path, uint64_t *generation)
 {
-    (void) fi;
+    if (!elfuse_block_cache_enabled(&mount->block_cache)) {
+        return false;
+    }
 
-    int res = 0;
+    struct elfuse_attr attr;
+    if (!elfuse_attr_cache_get(&mount->attr_cache, path, &attr)) {
+        if (!elfuse_block_cache_contains(&mount->block_cache, path)) {
+            return false;
+        }
+        if (elfuse_getattr_call(mount, path, &attr) != 0) {
+            return false;
+        }
+    }
+    if (attr.code != GETATTR_FILE || !attr.has_generation) {
+        return false;
+    }
+
+    *generation = attr.generation;
+    return true;
+}
+
+/* Copy the part of the read ahead window at OFFSET, -1 if it's not there */
+static long
+elfuse_window_read(struct elfuse_mount *mount, struct elfuse_open_file *file, char *buf, size_t size, off_t offset)
+{
+    if (file->window == NULL || file->window_epoch != elfuse_block_cache_epoch(&mount->block_cache))
+        return -1;
+    if (offset < file->window_offset)
+        return -1;
+
+    size_t skip = offset - file->window_offset;
+    if (skip >= file->window_size)
+        return file->window_eof ? 0 : -1;
+
+    size_t bytes_read = file->window_size - skip;
+    if (bytes_read < size && !file->window_eof)
+        return -1;
+    if (bytes_read > size)
+        bytes_read = size;
+    memcpy(buf, file->window + skip, bytes_read);
+    return bytes_read;
+}
+
+/* Serve sequential readers from one large window read from Emacs. Returns
+ * false if the read should go the usual way. */
+static bool
+elfuse_readahead(struct elfuse_mount *mount, struct elfuse_open_file *file, const char *path, char *buf, size_t size, off_t offset,
+                 int *res)
+{
+    size_t readahead_size = atomic_load(&elfuse_readahead_size);
+    if (readahead_size <= size)
+        return false;
+
+    pthread_mutex_lock(&file->lock);
+
+    file->sequential = offset == file->next_offset;
+    file->next_offset = offset + size;
+
+    /* A newer generation of the content makes the window useless. Nothing
+     * tells content of files without one changed, expired attributes or a
+     * new size are the best hint. */
+    struct elfuse_attr attr;
+    bool has_attr = elfuse_attr_cache_get(&mount->attr_cache, path, &attr);
+    bool stale;
+    if (file->window_has_generation) {
+        stale = has_attr && attr.has_generation && attr.generation != file->window_generation;
+    } else {
+        stale = !has_attr || attr.file_size != file->window_file_size;
+    }
+    if (stale) {
+        free(file->window);
+        file->window = NULL;
+    }
+
+    long cached = elfuse_window_read(mount, file, buf, size, offset);
+    if (cached < 0 && file->sequential && !has_attr) {
+        /* A window nothing could vouch for would only be read once */
+        pthread_mutex_unlock(&file->lock);
+        return false;
+    }
+    if (cached >= 0 || !file->sequential) {
+        pthread_mutex_unlock(&file->lock);
+        *res = cached;
+        return cached >= 0;
+    }
+
+    /* No need to ask for more than the whole file */
+    if (has_attr && attr.code == GETATTR_FILE
+        && attr.file_size > (size_t) offset && attr.file_size - offset < readahead_size) {
+        readahead_size = attr.file_size - offset;
+        if (readahead_size < size)
+            readahead_size = size;
+    }
+
+    char *window = malloc(readahead_size + 1);
+    if (window == NULL) {
+        pthread_mutex_unlock(&file->lock);
+        return false;
+    }
+
+    uint64_t epoch = elfuse_block_cache_epoch(&mount->block_cache);
+    ELFUSE_LOG(ELFUSE_LOG_DEBUG, "READ ahead (path=%s, size=%ld, offset=%ld).\n", path, readahead_size, offset);
+    *res = elfuse_read_call(mount, path, window, readahead_size, offset);
+    if (*res < 0) {
+        free(window);
+        pthread_mutex_unlock(&file->lock);
+        return true;
+    }
+
+    free(file->window);
+    file->window = window;
+    file->window_offset = offset;
+    file->window_size = *res;
+    file->window_epoch = epoch;
+    file->window_has_generation = has_attr && attr.has_generation;
+    file->window_generation = file->window_has_generation ? attr.generation : 0;
+    file->window_file_size = has_attr ? attr.file_size : 0;
+    file->window_eof = (size_t) *res < readahead_size;
+
+    *res = elfuse_window_read(mount, file, buf, size, offset);
+    pthread_mutex_unlock(&file->lock);
+
+    return true;
+}
+
+/* BUF has room for SIZE + 1 bytes, see elfuse_read_buf */
+static int
+elfuse_serve_read(const char *path, char *buf, size_t size, off_t offset,
+		      struct fuse_file_info *fi)
+{
+    struct elfuse_mount *mount = elfuse_current_mount();
+    elfuse_track_inode(mount, path);
+
+    /* Registered files are copied straight from the snapshot */
+    struct elfuse_snapshot *snapshot = elfuse_snapshot_get(mount, path);
+    if (snapshot != NULL) {
+        size_t bytes_read = 0;
+        if ((size_t) offset < snapshot->size) {
+            bytes_read = snapshot->size - offset;
+            if (bytes_read > size)
+                bytes_read = size;
+            memcpy(buf, snapshot->data + offset, bytes_read);
+        }
+        elfuse_snapshot_release(snapshot);
+        return bytes_read;
+    }
+
+    int res;
+    struct elfuse_open_file *file = (struct elfuse_open_file *) (uintptr_t) fi->fh;
+    if (file != NULL && elfuse_readahead(mount, file, path, buf, size, offset, &res)) {
+        return res;
+    }
+
+    /* Files without a generation always go to Emacs */
+    uint64_t generation;
+    if (!elfuse_read_generation(mount, path, &generation)) {
+        return elfuse_read_call(mount, path, buf, size, offset);
+    }
+
+    uint64_t start = elfuse_now_ns();
+    long cached = elfuse_block_cache_read(&mount->block_cache, path, generation, buf, size, offset);
+    if (cached >= 0) {
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "READ cached (path=%s, size=%ld, offset=%ld).\n", path, size, offset);
+        elfuse_trace_cached(WAITING_READ, path, elfuse_request_ino, start, 0);
+        return cached;
+    }
+
+    /* Fetch whole blocks around the requested range */
+    size_t blocks_offset = offset - offset % ELFUSE_BLOCK_SIZE;
+    size_t blocks_end = offset + size + ELFUSE_BLOCK_SIZE - 1;
+    blocks_end -= blocks_end % ELFUSE_BLOCK_SIZE;
+    size_t blocks_size = blocks_end - blocks_offset;
+
+    char *blocks = malloc(blocks_size + 1);
+    if (blocks == NULL) {
+        return elfuse_read_call(mount, path, buf, size, offset);
+    }
+
+    res = elfuse_read_call(mount, path, blocks, blocks_size, blocks_offset);
+    if (res >= 0) {
+        elfuse_block_cache_fill(&mount->block_cache, path, generation, blocks, res, blocks_offset, blocks_size);
+
+        size_t skip = offset - blocks_offset;
+        size_t bytes_read = (size_t) res > skip ? res - skip : 0;
+        if (bytes_read > size) {
+            bytes_read = size;
+        }
+        memcpy(buf, blocks + skip, bytes_read);
+        res = bytes_read;
+    }
+    free(blocks);
+
+    return res;
+}
+
+static int
+elfuse_serve_write(const char *path, const char *buf, size_t size, off_t offset,
+                        struct fuse_file_info *fi)
+{
+    struct elfuse_mount *mount = elfuse_current_mount();
+    int res = 0;
+
+    elfuse_track_inode(mount, path);
+
+    struct elfuse_open_file *file = (struct elfuse_open_file *) (uintptr_t) fi->fh;
+    if (file != NULL && file->backing_fd >= 0) {
+        uint64_t start = elfuse_now_ns();
+        ssize_t written = pwrite(file->backing_fd, buf, size, offset);
+        res = written >= 0 ? written : -errno;
+        elfuse_trace_cached(WAITING_WRITE, path, elfuse_request_ino, start, written >= 0 ? 0 : -res);
+
+        /* The size changed behind the getattr handler's back */
+        elfuse_attr_cache_invalidate(&mount->attr_cache, path);
+        elfuse_block_cache_invalidate(&mount->block_cache, path);
+        return res;
+    }
 
     /* Function to call */
-    elfuse_call.request_state = WAITING_WRITE;
-    elfuse_call.response_state = RESPONSE_NOTREADY;
+    struct elfuse_call_state call = {
+        .request_state = WAITING_WRITE,
+        .response_state = RESPONSE_NOTREADY,
+    };
 
     /* Set function args */
-    elfuse_call.args.write.path = path;
-    elfuse_call.args.write.buf = buf;
-    elfuse_call.args.write.size = size;
-    elfuse_call.args.write.offset = offset;
+    call.args.write.path = path;
+    call.args.write.buf = buf;
+    call.args.write.size = size;
+    call.args.write.offset = offset;
 
     /* Wait for the funcall results */
-    fprintf(stderr, "WRITE request (path=%s, size=%ld, offset=%ld).\n", path, size, offset);
-    pthread_kill(emacs_thread, SIGUSR1);
-    while (sem_wait(&request_sem));
-
-    if (elfuse_call.response_state == RESPONSE_SUCCESS) {
-        fprintf(stderr, "WRITE success (size=%d)\n", elfuse_call.results.write.size);
-        if (elfuse_call.results.write.size >= 0) {
-            res = elfuse_call.results.write.size;
+    ELFUSE_LOG(ELFUSE_LOG_DEBUG, "WRITE request (path=%s, size=%ld, offset=%ld).\n", path, size, offset);
+    elfuse_call_wait(mount, &call);
+
+    /* Whatever the result, cached attributes and content might be stale now */
+    elfuse_attr_cache_invalidate(&mount->attr_cache, path);
+    elfuse_block_cache_invalidate(&mount->block_cache, path);
+    elfuse_snapshot_mark_stale(mount, path);
+
+    if (call.response_state == RESPONSE_SUCCESS) {
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "WRITE success (size=%d)\n", call.results.write.size);
+        if (call.results.write.size >= 0) {
+            res = call.results.write.size;
         } else {
             res = -ENOENT;
         }
-    } else if (elfuse_call.response_state == RESPONSE_UNDEFINED) {
-        fprintf(stderr, "WRITE fail (operation undefined)\n");
+    } else if (call.response_state == RESPONSE_UNDEFINED) {
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "WRITE fail (operation undefined)\n");
         res = -ENOSYS;
-    } else if (elfuse_call.response_state == RESPONSE_SIGNAL_ERROR) {
-        fprintf(stderr, "WRITE fail (elfuse signal with errno %d)\n", elfuse_call.response_err_code);
-        res = -elfuse_call.response_err_code;
+    } else if (call.response_state == RESPONSE_SIGNAL_ERROR) {
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "WRITE fail (elfuse signal with errno %d)\n", call.response_err_code);
+        res = -call.response_err_code;
     } else {
-        fprintf(stderr, "WRITE fail (unknown error\n)");
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "WRITE fail (unknown error)\n");
         res = -ENOSYS;
     }
 
-    elfuse_call.request_state = WAITING_NONE;
-
     return res;
 }
 
 static int
-elfuse_truncate(const char *path, off_t size)
+elfuse_serve_truncate(const char *path, off_t size)
 {
+    struct elfuse_mount *mount = elfuse_current_mount();
     size_t res = 0;
 
+    elfuse_track_inode(mount, path);
+
     /* Function to call */
-    elfuse_call.request_state = WAITING_TRUNCATE;
-    elfuse_call.response_state = RESPONSE_NOTREADY;
+    struct elfuse_call_state call = {
+        .request_state = WAITING_TRUNCATE,
+        .response_state = RESPONSE_NOTREADY,
+    };
 
     /* Set function args */
-    elfuse_call.args.write.path = path;
-    elfuse_call.args.write.size = size;
+    call.args.truncate.path = path;
+    call.args.truncate.size = size;
 
     /* Wait for the funcall results */
-    fprintf(stderr, "TRUNCATE request (path=%s, size=%ld).\n", path, size);
-    pthread_kill(emacs_thread, SIGUSR1);
-    while (sem_wait(&request_sem));
+    ELFUSE_LOG(ELFUSE_LOG_DEBUG, "TRUNCATE request (path=%s, size=%ld).\n", path, size);
+    elfuse_call_wait(mount, &call);
 
-    if (elfuse_call.response_state == RESPONSE_SUCCESS) {
-        fprintf(stderr, "TRUNCATE success (code=%d)\n", elfuse_call.results.truncate.code);
-        if (elfuse_call.results.truncate.code == TRUNCATE_DONE) {
+    /* Whatever the result, cached attributes and content might be stale now */
+    elfuse_attr_cache_invalidate(&mount->attr_cache, path);
+    elfuse_block_cache_invalidate(&mount->block_cache, path);
+    elfuse_snapshot_mark_stale(mount, path);
+
+    if (call.response_state == RESPONSE_SUCCESS) {
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "TRUNCATE success (code=%d)\n", call.results.truncate.code);
+        if (call.results.truncate.code == TRUNCATE_DONE) {
             res = 0;
         } else {
             res = -ENOENT;
         }
-    } else if (elfuse_call.response_state == RESPONSE_UNDEFINED) {
-        fprintf(stderr, "TRUNCATE fail (operation undefined)\n");
+    } else if (call.response_state == RESPONSE_UNDEFINED) {
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "TRUNCATE fail (operation undefined)\n");
         res = -ENOSYS;
-    } else if (elfuse_call.response_state == RESPONSE_SIGNAL_ERROR) {
-        fprintf(stderr, "TRUNCATE fail (elfuse signal with errno %d)\n", elfuse_call.response_err_code);
-        res = -elfuse_call.response_err_code;
+    } else if (call.response_state == RESPONSE_SIGNAL_ERROR) {
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "TRUNCATE fail (elfuse signal with errno %d)\n", call.response_err_code);
+        res = -call.response_err_code;
     } else {
-        fprintf(stderr, "TRUNCATE fail (unknown error\n)");
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "TRUNCATE fail (unknown error)\n");
         res = -ENOSYS;
     }
 
-    elfuse_call.request_state = WAITING_NONE;
+    return res;
+}
 
+/* Truncation of an open handle, e.g. by ftruncate(2) */
+static int
+elfuse_serve_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    struct elfuse_open_file *file = (struct elfuse_open_file *) (uintptr_t) fi->fh;
+    if (file == NULL || file->backing_fd < 0)
+        return elfuse_serve_truncate(path, size);
+
+    struct elfuse_mount *mount = elfuse_current_mount();
+    elfuse_track_inode(mount, path);
+
+    uint64_t start = elfuse_now_ns();
+    int res = ftruncate(file->backing_fd, size) == 0 ? 0 : -errno;
+    elfuse_trace_cached(WAITING_TRUNCATE, path, elfuse_request_ino, start, -res);
+
+    elfuse_attr_cache_invalidate(&mount->attr_cache, path);
+    elfuse_block_cache_invalidate(&mount->block_cache, path);
     return res;
 }
 
 static int
-elfuse_unlink(const char *path)
+elfuse_serve_unlink(const char *path)
 {
+    struct elfuse_mount *mount = elfuse_current_mount();
     size_t res = 0;
 
+    elfuse_track_inode(mount, path);
+
     /* Function to call */
-    elfuse_call.request_state = WAITING_UNLINK;
-    elfuse_call.response_state = RESPONSE_NOTREADY;
+    struct elfuse_call_state call = {
+        .request_state = WAITING_UNLINK,
+        .response_state = RESPONSE_NOTREADY,
+    };
 
     /* Set function args */
-    elfuse_call.args.unlink.path = path;
+    call.args.unlink.path = path;
 
     /* Wait for the funcall results */
-    fprintf(stderr, "UNLINK request (path=%s).\n", path);
-    pthread_kill(emacs_thread, SIGUSR1);
-    while (sem_wait(&request_sem));
-
-    if (elfuse_call.response_state == RESPONSE_SUCCESS) {
-        fprintf(stderr, "UNLINK success (code=%d)\n", elfuse_call.results.unlink.code);
-        if (elfuse_call.results.unlink.code == UNLINK_DONE) {
+    ELFUSE_LOG(ELFUSE_LOG_DEBUG, "UNLINK request (path=%s).\n", path);
+    elfuse_call_wait(mount, &call);
+
+    /* Whatever the result, cached attributes and content might be stale now */
+    elfuse_attr_cache_invalidate(&mount->attr_cache, path);
+    elfuse_block_cache_invalidate(&mount->block_cache, path);
+    elfuse_snapshot_mark_stale(mount, path);
+    elfuse_inode_table_forget_prefix(&mount->inode_table, path);
+
+    if (call.response_state == RESPONSE_SUCCESS) {
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "UNLINK success (code=%d)\n", call.results.unlink.code);
+        if (call.results.unlink.code == UNLINK_DONE) {
             res = 0;
         } else {
             res = -ENOENT;
         }
-    } else if (elfuse_call.response_state == RESPONSE_UNDEFINED) {
-        fprintf(stderr, "TRUNCATE fail (operation undefined)\n");
+    } else if (call.response_state == RESPONSE_UNDEFINED) {
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "UNLINK fail (operation undefined)\n");
         res = -ENOSYS;
-    } else if (elfuse_call.response_state == RESPONSE_SIGNAL_ERROR) {
-        fprintf(stderr, "TRUNCATE fail (elfuse signal with errno %d)\n", elfuse_call.response_err_code);
-        res = -elfuse_call.response_err_code;
+    } else if (call.response_state == RESPONSE_SIGNAL_ERROR) {
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "UNLINK fail (elfuse signal with errno %d)\n", call.response_err_code);
+        res = -call.response_err_code;
     } else {
-        fprintf(stderr, "TRUNCATE fail (unknown error\n)");
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "UNLINK fail (unknown error)\n");
         res = -ENOSYS;
     }
 
-    elfuse_call.request_state = WAITING_NONE;
     return res;
 }
 
+/* Operations as FUSE sees them, the ones above plus recording */
+
+static void
+elfuse_record_request(struct elfuse_mount *mount, enum elfuse_request_state op, const char *path,
+                      const char *newpath, int64_t offset, uint64_t size, uint32_t flags,
+                      uint64_t start, int res)
+{
+    struct elfuse_record record = {
+        .time_ns = start,
+        .duration_ns = elfuse_now_ns() - start,
+        .offset = offset,
+        .size = size,
+        .pid = elfuse_kernel_request.pid,
+        .flags = flags,
+        .result = res,
+        .op = op,
+    };
+
+    /* Recordings are replayed by path */
+    char *key_path = path[0] == '#' ? elfuse_key_path(mount, path) : NULL;
+    char *key_newpath = newpath != NULL && newpath[0] == '#' ? elfuse_key_path(mount, newpath) : NULL;
+    elfuse_recorder_append(&mount->recorder, &record, key_path != NULL ? key_path : path,
+                           key_newpath != NULL ? key_newpath : newpath);
+    free(key_path);
+    free(key_newpath);
+}
+
+static int
+elfuse_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    struct elfuse_mount *mount = elfuse_current_mount();
+    if (!elfuse_recorder_active(&mount->recorder))
+        return elfuse_serve_create(path, mode, fi);
+
+    uint64_t start = elfuse_now_ns();
+    int res = elfuse_serve_create(path, mode, fi);
+    elfuse_record_request(mount, WAITING_CREATE, path, NULL, 0, 0, fi->flags, start, res);
+    return res;
+}
+
+static int
+elfuse_rename(const char *oldpath, const char *newpath)
+{
+    struct elfuse_mount *mount = elfuse_current_mount();
+    if (!elfuse_recorder_active(&mount->recorder))
+        return elfuse_serve_rename(oldpath, newpath);
+
+    uint64_t start = elfuse_now_ns();
+    int res = elfuse_serve_rename(oldpath, newpath);
+    elfuse_record_request(mount, WAITING_RENAME, oldpath, newpath, 0, 0, 0, start, res);
+    return res;
+}
+
+static int
+elfuse_getattr(const char *path, struct stat *stbuf)
+{
+    struct elfuse_mount *mount = elfuse_current_mount();
+    if (!elfuse_recorder_active(&mount->recorder))
+        return elfuse_serve_getattr(path, stbuf);
+
+    uint64_t start = elfuse_now_ns();
+    int res = elfuse_serve_getattr(path, stbuf);
+    elfuse_record_request(mount, WAITING_GETATTR, path, NULL, 0, 0, 0, start, res);
+    return res;
+}
+
+static int
+elfuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+               off_t offset, struct fuse_file_info *fi)
+{
+    struct elfuse_mount *mount = elfuse_current_mount();
+    if (!elfuse_recorder_active(&mount->recorder))
+        return elfuse_serve_readdir(path, buf, filler, offset, fi);
+
+    uint64_t start = elfuse_now_ns();
+    int res = elfuse_serve_readdir(path, buf, filler, offset, fi);
+    elfuse_record_request(mount, WAITING_READDIR, path, NULL, offset, 0, 0, start, res);
+    return res;
+}
+
+static int
+elfuse_open(const char *path, struct fuse_file_info *fi)
+{
+    struct elfuse_mount *mount = elfuse_current_mount();
+    if (!elfuse_recorder_active(&mount->recorder))
+        return elfuse_serve_open(path, fi);
+
+    uint64_t start = elfuse_now_ns();
+    int res = elfuse_serve_open(path, fi);
+    elfuse_record_request(mount, WAITING_OPEN, path, NULL, 0, 0, fi->flags, start, res);
+    return res;
+}
+
+static int
+elfuse_release(const char *path, struct fuse_file_info *fi)
+{
+    struct elfuse_mount *mount = elfuse_current_mount();
+    if (!elfuse_recorder_active(&mount->recorder))
+        return elfuse_serve_release(path, fi);
+
+    uint64_t start = elfuse_now_ns();
+    int flags = fi->flags;
+    int res = elfuse_serve_release(path, fi);
+    elfuse_record_request(mount, WAITING_RELEASE, path, NULL, 0, 0, flags, start, res);
+    return res;
+}
+
+static int
+elfuse_read(const char *path, char *buf, size_t size, off_t offset,
+            struct fuse_file_info *fi)
+{
+    struct elfuse_mount *mount = elfuse_current_mount();
+    if (!elfuse_recorder_active(&mount->recorder))
+        return elfuse_serve_read(path, buf, size, offset, fi);
+
+    uint64_t start = elfuse_now_ns();
+    int res = elfuse_serve_read(path, buf, size, offset, fi);
+    elfuse_record_request(mount, WAITING_READ, path, NULL, offset, size, 0, start, res);
+    return res;
+}
+
+static int
+elfuse_write(const char *path, const char *buf, size_t size, off_t offset,
+             struct fuse_file_info *fi)
+{
+    struct elfuse_mount *mount = elfuse_current_mount();
+    if (!elfuse_recorder_active(&mount->recorder))
+        return elfuse_serve_write(path, buf, size, offset, fi);
+
+    uint64_t start = elfuse_now_ns();
+    int res = elfuse_serve_write(path, buf, size, offset, fi);
+    elfuse_record_request(mount, WAITING_WRITE, path, NULL, offset, size, 0, start, res);
+    return res;
+}
+
+static int
+elfuse_truncate(const char *path, off_t size)
+{
+    struct elfuse_mount *mount = elfuse_current_mount();
+    if (!elfuse_recorder_active(&mount->recorder))
+        return elfuse_serve_truncate(path, size);
+
+    uint64_t start = elfuse_now_ns();
+    int res = elfuse_serve_truncate(path, size);
+    elfuse_record_request(mount, WAITING_TRUNCATE, path, NULL, 0, size, 0, start, res);
+    return res;
+}
+
+static int
+elfuse_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    struct elfuse_mount *mount = elfuse_current_mount();
+    if (!elfuse_recorder_active(&mount->recorder))
+        return elfuse_serve_ftruncate(path, size, fi);
+
+    uint64_t start = elfuse_now_ns();
+    int res = elfuse_serve_ftruncate(path, size, fi);
+    elfuse_record_request(mount, WAITING_TRUNCATE, path, NULL, 0, size, 0, start, res);
+    return res;
+}
+
+static int
+elfuse_unlink(const char *path)
+{
+    struct elfuse_mount *mount = elfuse_current_mount();
+    if (!elfuse_recorder_active(&mount->recorder))
+        return elfuse_serve_unlink(path);
+
+    uint64_t start = elfuse_now_ns();
+    int res = elfuse_serve_unlink(path);
+    elfuse_record_request(mount, WAITING_UNLINK, path, NULL, 0, 0, 0, start, res);
+    return res;
+}
+
+/* Reads of a backing file are answered with the file itself, libfuse
+ * splices it into the reply with the splice_write mount option and reads
+ * it into a buffer otherwise. False if FI has no backing file. */
+static bool
+elfuse_backing_buf(const char *path, struct fuse_file_info *fi, size_t size, off_t offset,
+                   struct fuse_bufvec *bufvec)
+{
+    struct elfuse_open_file *file = (struct elfuse_open_file *) (uintptr_t) fi->fh;
+    if (file == NULL || file->backing_fd < 0)
+        return false;
+
+    struct elfuse_mount *mount = elfuse_current_mount();
+    elfuse_track_inode(mount, path);
+
+    *bufvec = FUSE_BUFVEC_INIT(size);
+    bufvec->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    bufvec->buf[0].fd = file->backing_fd;
+    bufvec->buf[0].pos = offset;
+
+    /* The data is copied once this returns, only the arrival is known */
+    uint64_t start = elfuse_now_ns();
+    elfuse_trace_cached(WAITING_READ, path, elfuse_request_ino, start, 0);
+    if (elfuse_recorder_active(&mount->recorder))
+        elfuse_record_request(mount, WAITING_READ, path, NULL, offset, size, 0, start, size);
+    return true;
+}
+
+/* The reply buffer is allocated here instead of by libfuse, one byte
+ * larger than the request, so that Emacs copies the data straight into
+ * it. libfuse frees the buffer once the reply is sent. */
+static int
+elfuse_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+                struct fuse_file_info *fi)
+{
+    struct fuse_bufvec *bufvec = malloc(sizeof(*bufvec));
+    if (bufvec != NULL && elfuse_backing_buf(path, fi, size, offset, bufvec)) {
+        *bufp = bufvec;
+        return 0;
+    }
+
+    char *mem = malloc(size + 1);
+    if (bufvec == NULL || mem == NULL) {
+        free(bufvec);
+        free(mem);
+        return -ENOMEM;
+    }
+
+    int res = elfuse_read(path, mem, size, offset, fi);
+    if (res < 0) {
+        free(bufvec);
+        free(mem);
+        return res;
+    }
+
+    *bufvec = FUSE_BUFVEC_INIT(res);
+    bufvec->buf[0].mem = mem;
+    *bufp = bufvec;
+
+    return 0;
+}
+
 static struct fuse_operations elfuse_oper = {
     .create	= elfuse_create,
     .rename	= elfuse_rename,
     .getattr	= elfuse_getattr,
+    .opendir	= elfuse_opendir,
     .readdir	= elfuse_readdir,
+    .releasedir	= elfuse_releasedir,
     .open	= elfuse_open,
     .release	= elfuse_release,
-    .read	= elfuse_read,
+    .read_buf	= elfuse_read_buf,
     .write	= elfuse_write,
     .truncate	= elfuse_truncate,
+    .ftruncate	= elfuse_ftruncate,
     .unlink	= elfuse_unlink,
 };
 
-static struct fuse *fuse;
+/* The low-level backend hands out its own inodes and keeps their names in
+ * the node table. Requests are served by the operations above with keys
+ * of the inodes instead of paths, so both backends behave the same but
+ * only requests reaching handlers pay for a path. */
+
+/* A readdir reply being filled */
+struct elfuse_dir_reply {
+    fuse_req_t req;
+    struct elfuse_mount *mount;
+    fuse_ino_t ino;
+
+    char *data;
+    size_t size;
+    size_t capacity;
+};
+
+/* Inode of entries the kernel has not looked up yet */
+#define ELFUSE_UNKNOWN_INO 0xffffffff
+
+static int
+elfuse_dir_fill(void *buf, const char *name, const struct stat *stbuf, off_t off)
+{
+    struct elfuse_dir_reply *reply = buf;
+
+    /* Only the inode and the file type go to the kernel */
+    struct stat entry_stat;
+    memset(&entry_stat, 0, sizeof(entry_stat));
+    entry_stat.st_ino = elfuse_node_find(&reply->mount->node_table, reply->ino, name);
+    if (entry_stat.st_ino == 0)
+        entry_stat.st_ino = ELFUSE_UNKNOWN_INO;
+    if (stbuf != NULL)
+        entry_stat.st_mode = stbuf->st_mode;
+
+    size_t entry_size = fuse_add_direntry(reply->req, NULL, 0, name, NULL, 0);
+    if (reply->size + entry_size > reply->capacity)
+        return 1;
+
+    fuse_add_direntry(reply->req, reply->data + reply->size, entry_size, name, &entry_stat, off);
+    reply->size += entry_size;
+
+    return 0;
+}
+
+/* Key of INO, the handlers also get the inode itself */
+static void
+elfuse_ll_key(char *key, fuse_ino_t ino)
+{
+    elfuse_request_ino = ino;
+    elfuse_node_key(key, ino);
+}
+
+/* Key of NAME in PARENT, the node key and inode if NAME was looked up.
+ * KEY has room for ELFUSE_KEY_SIZE + strlen(NAME) bytes. */
+static void
+elfuse_ll_child_key(struct elfuse_mount *mount, char *key, fuse_ino_t parent, const char *name)
+{
+    elfuse_request_ino = elfuse_node_find(&mount->node_table, parent, name);
+    if (elfuse_request_ino != 0) {
+        elfuse_node_key(key, elfuse_request_ino);
+    } else {
+        elfuse_name_key(key, ELFUSE_KEY_SIZE + strlen(name), parent, name);
+    }
+}
+
+/* Look NAME in PARENT up for the kernel once KEY is known to exist.
+ * Attributes cached for the name move to the node. */
+static int
+elfuse_ll_entry(struct elfuse_mount *mount, fuse_ino_t parent, const char *name, const char *key,
+                struct fuse_entry_param *entry)
+{
+    entry->ino = elfuse_node_lookup(&mount->node_table, parent, name);
+    if (entry->ino == 0)
+        return -ENOMEM;
+    entry->attr.st_ino = entry->ino;
+    entry->attr_timeout = mount->attr_timeout;
+    entry->entry_timeout = mount->entry_timeout;
+
+    char node_key[ELFUSE_KEY_SIZE];
+    elfuse_node_key(node_key, entry->ino);
+    if (strcmp(key, node_key) != 0)
+        elfuse_attr_cache_move(&mount->attr_cache, key, node_key);
+
+    return 0;
+}
+
+/* Attributes cached for NAME in PARENT don't follow its node around */
+static void
+elfuse_ll_drop_name(struct elfuse_mount *mount, fuse_ino_t parent, const char *name)
+{
+    char key[ELFUSE_KEY_SIZE + strlen(name)];
+    elfuse_name_key(key, sizeof(key), parent, name);
+    elfuse_attr_cache_invalidate(&mount->attr_cache, key);
+}
+
+static void
+elfuse_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct elfuse_mount *mount = elfuse_current_mount();
+    char key[ELFUSE_KEY_SIZE + strlen(name)];
+    elfuse_ll_child_key(mount, key, parent, name);
+
+    struct fuse_entry_param entry;
+    memset(&entry, 0, sizeof(entry));
+    int res = elfuse_getattr(key, &entry.attr);
+    if (res == -ENOENT && mount->negative_timeout > 0) {
+        /* An entry without an inode lets the kernel cache the miss */
+        entry.entry_timeout = mount->negative_timeout;
+        fuse_reply_entry(req, &entry);
+    } else if (res == 0 && (res = elfuse_ll_entry(mount, parent, name, key, &entry)) == 0) {
+        /* The kernel never saw the inode if the reply failed */
+        if (fuse_reply_entry(req, &entry) != 0)
+            elfuse_node_forget(&mount->node_table, entry.ino, 1);
+    } else {
+        fuse_reply_err(req, -res);
+    }
+}
+
+static void
+elfuse_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    struct elfuse_mount *mount = elfuse_current_mount();
+    elfuse_node_forget(&mount->node_table, ino, nlookup);
+    fuse_reply_none(req);
+}
+
+static void
+elfuse_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+    struct elfuse_mount *mount = elfuse_current_mount();
+    for (size_t i = 0; i < count; i++)
+        elfuse_node_forget(&mount->node_table, forgets[i].ino, forgets[i].nlookup);
+    fuse_reply_none(req);
+}
+
+static void
+elfuse_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct elfuse_mount *mount = elfuse_current_mount();
+    (void) fi;
+
+    char key[ELFUSE_KEY_SIZE];
+    elfuse_ll_key(key, ino);
+
+    struct stat stbuf;
+    int res = elfuse_getattr(key, &stbuf);
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    stbuf.st_ino = ino;
+    fuse_reply_attr(req, &stbuf, mount->attr_timeout);
+}
+
+static void
+elfuse_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+                  struct fuse_file_info *fi)
+{
+    struct elfuse_mount *mount = elfuse_current_mount();
+
+    /* Handlers know nothing about modes and owners. Times are not kept
+     * either, changing them is silently ignored. */
+    if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+        fuse_reply_err(req, ENOSYS);
+        return;
+    }
+
+    char key[ELFUSE_KEY_SIZE];
+    elfuse_ll_key(key, ino);
+
+    int res = 0;
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        if (fi != NULL)
+            res = elfuse_ftruncate(key, attr->st_size, fi);
+        else
+            res = elfuse_truncate(key, attr->st_size);
+    }
+
+    struct stat stbuf;
+    if (res == 0)
+        res = elfuse_getattr(key, &stbuf);
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    stbuf.st_ino = ino;
+    fuse_reply_attr(req, &stbuf, mount->attr_timeout);
+}
+
+static void
+elfuse_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct elfuse_mount *mount = elfuse_current_mount();
+    char key[ELFUSE_KEY_SIZE];
+    elfuse_ll_key(key, ino);
+
+    int res = elfuse_open(key, fi);
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    fi->keep_cache = mount->kernel_cache;
+    if (fuse_reply_open(req, fi) != 0)
+        elfuse_open_file_free((struct elfuse_open_file *) (uintptr_t) fi->fh);
+}
+
+static void
+elfuse_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    char key[ELFUSE_KEY_SIZE];
+    elfuse_ll_key(key, ino);
 
-static void elfuse_cleanup_mount(void *mountpoint) {
-    fprintf(stderr, "Elfuse: unmounting\n");
-    fuse_unmount(mountpoint, NULL);
-    free(mountpoint);
+    int res = elfuse_release(key, fi);
+    fuse_reply_err(req, -res);
 }
 
-static void elfuse_cleanup_fuse(void *buf) {
-    fprintf(stderr, "Elfuse: cleanup fuse\n");
-    fuse_destroy(fuse);
+static void
+elfuse_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    char key[ELFUSE_KEY_SIZE];
+    elfuse_ll_key(key, ino);
+
+    struct fuse_bufvec bufvec;
+    if (elfuse_backing_buf(key, fi, size, off, &bufvec)) {
+        fuse_reply_data(req, &bufvec, FUSE_BUF_SPLICE_MOVE);
+        return;
+    }
+
+    char *buf = malloc(size + 1);
+    if (buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    int res = elfuse_read(key, buf, size, off, fi);
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+    } else {
+        fuse_reply_buf(req, buf, res);
+    }
     free(buf);
 }
 
+static void
+elfuse_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off,
+                struct fuse_file_info *fi)
+{
+    char key[ELFUSE_KEY_SIZE];
+    elfuse_ll_key(key, ino);
+
+    int res = elfuse_write(key, buf, size, off, fi);
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+    } else {
+        fuse_reply_write(req, res);
+    }
+}
+
+static void
+elfuse_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    (void) ino;
+
+    int res = elfuse_opendir(NULL, fi);
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    if (fuse_reply_open(req, fi) != 0)
+        elfuse_releasedir(NULL, fi);
+}
+
+static void
+elfuse_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    struct elfuse_mount *mount = elfuse_current_mount();
+    char key[ELFUSE_KEY_SIZE];
+    elfuse_ll_key(key, ino);
+
+    struct elfuse_dir_reply reply = {
+        .req = req,
+        .mount = mount,
+        .ino = ino,
+        .data = malloc(size),
+        .capacity = size,
+    };
+    if (reply.data == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    int res = elfuse_readdir(key, &reply, elfuse_dir_fill, off, fi);
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+    } else {
+        fuse_reply_buf(req, reply.data, reply.size);
+    }
+    free(reply.data);
+}
+
+static void
+elfuse_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    (void) ino;
+    elfuse_releasedir(NULL, fi);
+    fuse_reply_err(req, 0);
+}
+
+static void
+elfuse_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+                 struct fuse_file_info *fi)
+{
+    struct elfuse_mount *mount = elfuse_current_mount();
+    char key[ELFUSE_KEY_SIZE + strlen(name)];
+    elfuse_ll_child_key(mount, key, parent, name);
+
+    struct fuse_entry_param entry;
+    memset(&entry, 0, sizeof(entry));
+    int res = elfuse_create(key, mode, fi);
+    if (res == 0)
+        res = elfuse_getattr(key, &entry.attr);
+    if (res == 0)
+        res = elfuse_ll_entry(mount, parent, name, key, &entry);
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    fi->fh = (uintptr_t) elfuse_open_file_new();
+    if (fuse_reply_create(req, &entry, fi) != 0) {
+        elfuse_node_forget(&mount->node_table, entry.ino, 1);
+        elfuse_open_file_free((struct elfuse_open_file *) (uintptr_t) fi->fh);
+    }
+}
+
+static void
+elfuse_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct elfuse_mount *mount = elfuse_current_mount();
+    char key[ELFUSE_KEY_SIZE + strlen(name)];
+    elfuse_ll_child_key(mount, key, parent, name);
+
+    int res = elfuse_unlink(key);
+    elfuse_ll_drop_name(mount, parent, name);
+    if (res == 0)
+        elfuse_node_unlink(&mount->node_table, parent, name);
+    fuse_reply_err(req, -res);
+}
+
+static void
+elfuse_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent,
+                 const char *newname)
+{
+    struct elfuse_mount *mount = elfuse_current_mount();
+    char newkey[ELFUSE_KEY_SIZE + strlen(newname)];
+    elfuse_ll_child_key(mount, newkey, newparent, newname);
+    char oldkey[ELFUSE_KEY_SIZE + strlen(name)];
+    elfuse_ll_child_key(mount, oldkey, parent, name);
+
+    int res = elfuse_rename(oldkey, newkey);
+    elfuse_ll_drop_name(mount, parent, name);
+    elfuse_ll_drop_name(mount, newparent, newname);
+    if (res == 0)
+        elfuse_node_rename(&mount->node_table, parent, name, newparent, newname);
+    fuse_reply_err(req, -res);
+}
+
+static struct fuse_lowlevel_ops elfuse_ll_oper = {
+    .lookup		= elfuse_ll_lookup,
+    .forget		= elfuse_ll_forget,
+    .forget_multi	= elfuse_ll_forget_multi,
+    .getattr		= elfuse_ll_getattr,
+    .setattr		= elfuse_ll_setattr,
+    .open		= elfuse_ll_open,
+    .release		= elfuse_ll_release,
+    .read		= elfuse_ll_read,
+    .write		= elfuse_ll_write,
+    .opendir		= elfuse_ll_opendir,
+    .readdir		= elfuse_ll_readdir,
+    .releasedir		= elfuse_ll_releasedir,
+    .create		= elfuse_ll_create,
+    .unlink		= elfuse_ll_unlink,
+    .rename		= elfuse_ll_rename,
+};
+
+/* Mount options libfuse only parses for the high-level API */
+static const struct fuse_opt elfuse_ll_opts[] = {
+    {"entry_timeout=%lf", offsetof(struct elfuse_mount, entry_timeout), 0},
+    {"attr_timeout=%lf", offsetof(struct elfuse_mount, attr_timeout), 0},
+    {"negative_timeout=%lf", offsetof(struct elfuse_mount, negative_timeout), 0},
+    {"kernel_cache", offsetof(struct elfuse_mount, kernel_cache), 1},
+    FUSE_OPT_KEY("auto_cache", FUSE_OPT_KEY_DISCARD),
+    FUSE_OPT_KEY("use_ino", FUSE_OPT_KEY_DISCARD),
+    FUSE_OPT_KEY("readdir_ino", FUSE_OPT_KEY_DISCARD),
+    FUSE_OPT_END
+};
+
+/* Kernel cache invalidations are sent from a dedicated thread: the kernel
+ * might be holding locks while waiting for a request that Emacs is
+ * handling right now, so Emacs must never block on a notification. */
+struct elfuse_notification {
+    enum elfuse_notification_type {
+        NOTIFY_INODE,
+        NOTIFY_ENTRY,
+    } type;
+    /* The inode itself or the parent directory of an entry */
+    uint64_t nodeid;
+    char *name;
+    struct elfuse_notification *next;
+};
+
+static void
+elfuse_notify_push(struct elfuse_mount *mount, enum elfuse_notification_type type, uint64_t nodeid,
+                   const char *name)
+{
+    struct elfuse_notification *notification = malloc(sizeof(*notification));
+    if (notification == NULL)
+        return;
+    notification->type = type;
+    notification->nodeid = nodeid;
+    notification->name = name != NULL ? strdup(name) : NULL;
+    notification->next = NULL;
+
+    pthread_mutex_lock(&mount->notify_lock);
+    if (mount->notify_chan == NULL) {
+        /* Not mounted yet or already unmounting */
+        pthread_mutex_unlock(&mount->notify_lock);
+        free(notification->name);
+        free(notification);
+        return;
+    }
+    *mount->notify_tail = notification;
+    mount->notify_tail = &notification->next;
+    pthread_cond_signal(&mount->notify_cond);
+    pthread_mutex_unlock(&mount->notify_lock);
+}
+
+void
+elfuse_path_keys(struct elfuse_mount *mount, const char *path, bool below,
+                 void (*fn)(struct elfuse_mount *mount, const char *key, void *arg), void *arg)
+{
+    if (!mount->lowlevel) {
+        fn(mount, path, arg);
+        return;
+    }
+
+    /* The name in its directory */
+    const char *name = strrchr(path, '/');
+    if (name != NULL && name[1] != '\0') {
+        char dir[name - path + 1];
+        memcpy(dir, path, name - path);
+        dir[name - path] = '\0';
+        uint64_t parent = elfuse_node_resolve(&mount->node_table, dir);
+        if (parent != 0) {
+            char key[ELFUSE_KEY_SIZE + strlen(name)];
+            elfuse_name_key(key, sizeof(key), parent, name + 1);
+            fn(mount, key, arg);
+        }
+    }
+
+    /* The node and the ones below it */
+    uint64_t ino = elfuse_node_resolve(&mount->node_table, path);
+    if (ino == 0)
+        return;
+    size_t inos_size = 1;
+    uint64_t *inos = below ? elfuse_node_below(&mount->node_table, ino, &inos_size) : &ino;
+    for (size_t i = 0; i < inos_size; i++) {
+        char key[ELFUSE_KEY_SIZE];
+        elfuse_node_key(key, inos[i]);
+        fn(mount, key, arg);
+    }
+    if (below)
+        free(inos);
+}
+
+void
+elfuse_invalidate_key(struct elfuse_mount *mount, const char *key, void *arg)
+{
+    (void) arg;
+    elfuse_attr_cache_invalidate(&mount->attr_cache, key);
+    elfuse_block_cache_invalidate(&mount->block_cache, key);
+}
+
+void
+elfuse_invalidate_key_prefix(struct elfuse_mount *mount, const char *key, void *arg)
+{
+    (void) arg;
+    elfuse_attr_cache_invalidate_prefix(&mount->attr_cache, key);
+    elfuse_block_cache_invalidate(&mount->block_cache, key);
+}
+
+static void
+elfuse_invalidate_key_attrs(struct elfuse_mount *mount, const char *key, void *arg)
+{
+    (void) arg;
+    elfuse_attr_cache_invalidate(&mount->attr_cache, key);
+}
+
+/* Kernel node of PATH, 0 if the kernel doesn't know it */
+static uint64_t
+elfuse_path_nodeid(struct elfuse_mount *mount, const char *path)
+{
+    if (mount->lowlevel)
+        return elfuse_node_resolve(&mount->node_table, path);
+    return elfuse_inode_table_get(&mount->inode_table, path);
+}
+
+void
+elfuse_notify_changed(struct elfuse_mount *mount, const char *path)
+{
+    elfuse_path_keys(mount, path, false, elfuse_invalidate_key, NULL);
+
+    /* Unknown nodes are not cached by the kernel */
+    uint64_t nodeid = elfuse_path_nodeid(mount, path);
+    if (nodeid != 0) {
+        elfuse_notify_push(mount, NOTIFY_INODE, nodeid, NULL);
+    }
+}
+
+void
+elfuse_notify_entry(struct elfuse_mount *mount, const char *dir, const char *name, bool removed)
+{
+    size_t dir_size = strlen(dir);
+    bool slash = dir_size > 0 && dir[dir_size - 1] == '/';
+    char path[dir_size + strlen(name) + 2];
+    snprintf(path, sizeof(path), "%s%s%s", dir, slash ? "" : "/", name);
+
+    elfuse_path_keys(mount, dir, false, elfuse_invalidate_key_attrs, NULL);
+    elfuse_path_keys(mount, path, true, elfuse_invalidate_key_prefix, NULL);
+    if (removed && !mount->lowlevel) {
+        elfuse_inode_table_forget_prefix(&mount->inode_table, path);
+    }
+
+    uint64_t parent = elfuse_path_nodeid(mount, dir);
+    if (parent != 0) {
+        elfuse_notify_push(mount, NOTIFY_ENTRY, parent, name);
+    }
+}
+
+static void *
+elfuse_notify_loop(void *arg)
+{
+    struct elfuse_mount *mount = arg;
+
+    pthread_mutex_lock(&mount->notify_lock);
+    while (!mount->notify_stop) {
+        struct elfuse_notification *notification = mount->notify_head;
+        if (notification == NULL) {
+            pthread_cond_wait(&mount->notify_cond, &mount->notify_lock);
+            continue;
+        }
+        mount->notify_head = notification->next;
+        if (mount->notify_head == NULL)
+            mount->notify_tail = &mount->notify_head;
+        struct fuse_chan *ch = mount->notify_chan;
+        pthread_mutex_unlock(&mount->notify_lock);
+
+        int err;
+        if (notification->type == NOTIFY_INODE) {
+            err = fuse_lowlevel_notify_inval_inode(ch, notification->nodeid, 0, 0);
+        } else {
+            err = fuse_lowlevel_notify_inval_entry(ch, notification->nodeid, notification->name,
+                                                   strlen(notification->name));
+        }
+        /* ENOENT means the kernel has already forgotten the node */
+        if (err != 0 && err != -ENOENT) {
+            ELFUSE_LOG(ELFUSE_LOG_WARN, "Elfuse: kernel cache invalidation failed (errno=%d)\n", -err);
+        }
+
+        free(notification->name);
+        free(notification);
+        pthread_mutex_lock(&mount->notify_lock);
+    }
+    pthread_mutex_unlock(&mount->notify_lock);
+
+    return NULL;
+}
+
+static int
+elfuse_notify_start(struct elfuse_mount *mount, struct fuse_chan *ch)
+{
+    pthread_mutex_lock(&mount->notify_lock);
+    mount->notify_chan = ch;
+    mount->notify_stop = false;
+    pthread_mutex_unlock(&mount->notify_lock);
+
+    return pthread_create(&mount->notify_thread, NULL, elfuse_notify_loop, mount);
+}
+
+static void
+elfuse_cleanup_notify(void *arg)
+{
+    struct elfuse_mount *mount = arg;
+
+    pthread_mutex_lock(&mount->notify_lock);
+    mount->notify_stop = true;
+    mount->notify_chan = NULL;
+    pthread_cond_signal(&mount->notify_cond);
+    pthread_mutex_unlock(&mount->notify_lock);
+
+    pthread_join(mount->notify_thread, NULL);
+
+    /* Drop notifications nobody is going to send */
+    while (mount->notify_head != NULL) {
+        struct elfuse_notification *notification = mount->notify_head;
+        mount->notify_head = notification->next;
+        free(notification->name);
+        free(notification);
+    }
+    mount->notify_tail = &mount->notify_head;
+}
+
+/* Extra FUSE threads serving the session next to the main loop thread */
+struct elfuse_worker {
+    pthread_t thread;
+    struct elfuse_mount *mount;
+    struct fuse_session *se;
+    struct fuse_chan *ch;
+    char *buf;
+    size_t bufsize;
+
+    /* Next spare thread, see elfuse_workers_park */
+    struct elfuse_worker *next;
+};
+
+/* Cleanup handlers get a single argument */
+struct elfuse_cleanup_args {
+    struct elfuse_mount *mount;
+    void *data;
+};
+
+static void elfuse_cleanup_cmdline(void *args) {
+    fuse_opt_free_args(args);
+}
+
+static void elfuse_cleanup_mount(void *arg) {
+    struct elfuse_cleanup_args *cleanup = arg;
+    ELFUSE_LOG(ELFUSE_LOG_INFO, "Elfuse: unmounting %s\n", cleanup->mount->mountpath);
+    fuse_unmount(cleanup->data, NULL);
+    free(cleanup->data);
+
+    /* This is the last cleanup step, no thread is waiting for Emacs */
+    atomic_store(&cleanup->mount->loop_exited, true);
+}
+
+static void elfuse_cleanup_fuse(void *arg) {
+    struct elfuse_cleanup_args *cleanup = arg;
+    ELFUSE_LOG(ELFUSE_LOG_INFO, "Elfuse: cleanup fuse\n");
+    if (cleanup->mount->fuse != NULL) {
+        fuse_destroy(cleanup->mount->fuse);
+    } else {
+        fuse_session_destroy(cleanup->mount->session);
+    }
+    cleanup->mount->fuse = NULL;
+    cleanup->mount->session = NULL;
+    free(cleanup->data);
+}
+
+static void elfuse_cleanup_workers(void *arg) {
+    struct elfuse_mount *mount = arg;
+
+    ELFUSE_LOG(ELFUSE_LOG_INFO, "Elfuse: stopping %d worker threads\n", mount->workers_size);
+    for (int i = 0; i < mount->workers_size; i++) {
+        pthread_cancel(mount->workers[i].thread);
+    }
+    for (int i = 0; i < mount->workers_size; i++) {
+        pthread_join(mount->workers[i].thread, NULL);
+        free(mount->workers[i].buf);
+    }
+    free(mount->workers);
+    mount->workers = NULL;
+    mount->workers_size = 0;
+
+    /* Spares free themselves, wait for all of them including those reaped
+     * earlier that are still busy */
+    pthread_mutex_lock(&mount->spares_lock);
+    mount->spares_open = false;
+    for (struct elfuse_worker *worker = mount->spares; worker != NULL; worker = worker->next) {
+        pthread_cancel(worker->thread);
+    }
+    mount->spares = NULL;
+    mount->spares_size = 0;
+    while (mount->spares_live > 0) {
+        pthread_cond_wait(&mount->spares_cond, &mount->spares_lock);
+    }
+    pthread_mutex_unlock(&mount->spares_lock);
+}
+
+/* Receive and process kernel requests until the session exits. Threads
+ * can only be cancelled while waiting for a new request, never while a
+ * request is waiting for Emacs. */
+static void
+elfuse_session_loop(struct elfuse_mount *mount, struct fuse_session *se, struct fuse_chan *ch,
+                    char *buf, size_t bufsize)
+{
+    elfuse_loop_mount = mount;
+
+    while (!fuse_session_exited(se)) {
+        struct fuse_chan *tmpch = ch;
+        struct fuse_buf fbuf = {
+            .mem = buf,
+            .size = bufsize,
+        };
+
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        int err = fuse_session_receive_buf(se, &fbuf, &tmpch);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        if (err == -EINTR)
+            continue;
+        if (err <= 0)
+            break;
+
+        /* The header of a request left in a pipe can't be peeked at.
+         * libfuse only leaves large writes there and only with the
+         * splice_read option, which Elfuse never sets. Their node was
+         * tracked by the open of the handle anyway. */
+        if (fbuf.flags & FUSE_BUF_IS_FD) {
+            elfuse_kernel_request_peek(NULL, 0, &elfuse_kernel_request);
+        } else {
+            elfuse_kernel_request_peek(fbuf.mem, err, &elfuse_kernel_request);
+        }
+        fuse_session_process_buf(se, &fbuf, tmpch);
+    }
+}
+
+static void *
+elfuse_worker_loop(void *arg)
+{
+    struct elfuse_worker *worker = arg;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    elfuse_session_loop(worker->mount, worker->se, worker->ch, worker->buf, worker->bufsize);
+
+    return NULL;
+}
+
+/* A spare is gone, it is still in the list unless it was reaped */
+static void
+elfuse_spare_exit(void *arg)
+{
+    struct elfuse_worker *worker = arg;
+    struct elfuse_mount *mount = worker->mount;
+
+    pthread_mutex_lock(&mount->spares_lock);
+    for (struct elfuse_worker **spare = &mount->spares; *spare != NULL; spare = &(*spare)->next) {
+        if (*spare == worker) {
+            *spare = worker->next;
+            mount->spares_size--;
+            break;
+        }
+    }
+    mount->spares_live--;
+    pthread_cond_signal(&mount->spares_cond);
+    pthread_mutex_unlock(&mount->spares_lock);
+
+    free(worker->buf);
+    free(worker);
+}
+
+static void *
+elfuse_spare_loop(void *arg)
+{
+    struct elfuse_worker *worker = arg;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    pthread_cleanup_push(elfuse_spare_exit, worker);
+    elfuse_session_loop(worker->mount, worker->se, worker->ch, worker->buf, worker->bufsize);
+    pthread_cleanup_pop(true);
+
+    return NULL;
+}
+
+static int
+elfuse_worker_start_loop(struct elfuse_worker *worker, struct elfuse_mount *mount,
+                         struct fuse_session *se, struct fuse_chan *ch, size_t bufsize,
+                         void *(*loop)(void *))
+{
+    worker->mount = mount;
+    worker->se = se;
+    worker->ch = ch;
+    worker->bufsize = bufsize;
+    worker->buf = malloc(bufsize);
+    if (!worker->buf) {
+        ELFUSE_LOG(ELFUSE_LOG_ERROR, "Elfuse: failed to allocate a worker buffer\n");
+        return -1;
+    }
+    if (pthread_create(&worker->thread, NULL, loop, worker) != 0) {
+        ELFUSE_LOG(ELFUSE_LOG_ERROR, "Elfuse: failed to start a worker thread\n");
+        free(worker->buf);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+elfuse_worker_start(struct elfuse_worker *worker, struct elfuse_mount *mount,
+                    struct fuse_session *se, struct fuse_chan *ch, size_t bufsize)
+{
+    return elfuse_worker_start_loop(worker, mount, se, ch, bufsize, elfuse_worker_loop);
+}
+
+void
+elfuse_workers_park(struct elfuse_mount *mount)
+{
+    pthread_mutex_lock(&mount->spares_lock);
+    while (mount->spares_open && mount->spares_size < mount->deferred_size) {
+        struct elfuse_worker *worker = calloc(1, sizeof(*worker));
+        if (worker == NULL)
+            break;
+
+        struct fuse_session *se = mount->fuse != NULL ? fuse_get_session(mount->fuse) : mount->session;
+        struct fuse_chan *ch = mount->notify_chan;
+        if (elfuse_worker_start_loop(worker, mount, se, ch, fuse_chan_bufsize(ch), elfuse_spare_loop) != 0) {
+            free(worker);
+            break;
+        }
+        pthread_detach(worker->thread);
+        worker->next = mount->spares;
+        mount->spares = worker;
+        mount->spares_size++;
+        mount->spares_live++;
+    }
+    pthread_mutex_unlock(&mount->spares_lock);
+}
+
+void
+elfuse_workers_reap(struct elfuse_mount *mount)
+{
+    /* Nobody joins a reaped spare, it can't hold up Emacs while its own
+     * request waits for Emacs. Spares in the list haven't exited yet. */
+    pthread_mutex_lock(&mount->spares_lock);
+    while (mount->spares_size > mount->deferred_size) {
+        struct elfuse_worker *worker = mount->spares;
+        mount->spares = worker->next;
+        mount->spares_size--;
+        pthread_cancel(worker->thread);
+    }
+    pthread_mutex_unlock(&mount->spares_lock);
+}
+
 void *
-elfuse_fuse_loop(void* mountpath)
+elfuse_fuse_loop(void* arg)
 {
-    int argc = 2;
+    struct elfuse_mount *mount = arg;
+    int threads = mount->threads;
+
+    /* Mount options go to both fuse_mount and fuse_new */
+    int argc = mount->options != NULL ? 4 : 2;
     char* argv[] = {
         "",
-        mountpath
+        mount->mountpath,
+        "-o",
+        mount->options,
+        NULL
     };
 
 
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
     char *mountpoint;
-    int err = -1;
 
     pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    atomic_store(&mount->loop_exited, false);
 
     /* Parse arguments */
     if (fuse_parse_cmdline(&args, &mountpoint, NULL, NULL) == -1) {
-        fprintf(stderr, "Elfuse: failed parsing the command line\n");
-        free(mountpath);
+        ELFUSE_LOG(ELFUSE_LOG_ERROR, "Elfuse: failed parsing the command line\n");
         free(mountpoint);
 
-        elfuse_init_code = INIT_ERR_ARGS;
-        sem_post(&init_sem);
+        mount->init_code = INIT_ERR_ARGS;
+        atomic_store(&mount->loop_exited, true);
+        sem_post(&mount->init_sem);
 
         pthread_exit(NULL);
     }
-    free(mountpath);
+    pthread_cleanup_push(elfuse_cleanup_cmdline, &args);
 
 
     /* Mount the FUSE FS */
     struct fuse_chan *ch = fuse_mount(mountpoint, &args);
     if (ch == NULL) {
-        fprintf(stderr, "Elfuse: failed mounting\n");
+        ELFUSE_LOG(ELFUSE_LOG_ERROR, "Elfuse: failed mounting\n");
+
+        mount->init_code = INIT_ERR_MOUNT;
+        atomic_store(&mount->loop_exited, true);
+        sem_post(&mount->init_sem);
+
+        pthread_exit(NULL);
+    }
+    struct elfuse_cleanup_args mount_cleanup = {mount, mountpoint};
+    pthread_cleanup_push(elfuse_cleanup_mount, &mount_cleanup);
 
-        elfuse_init_code = INIT_ERR_MOUNT;
-        sem_post(&init_sem);
+    /* Opens of backing files truncate them, not a separate setattr */
+    if (fuse_opt_add_arg(&args, "-oatomic_o_trunc") == -1) {
+        ELFUSE_LOG(ELFUSE_LOG_ERROR, "Elfuse: failed adding mount options\n");
+
+        mount->init_code = INIT_ERR_ARGS;
+        sem_post(&mount->init_sem);
 
         pthread_exit(NULL);
     }
-    pthread_cleanup_push(elfuse_cleanup_mount, mountpoint);
 
-    /* Create the FUSE instance */
-    fuse = fuse_new(ch, &args, &elfuse_oper, sizeof(elfuse_oper), NULL);
-    if (fuse == NULL) {
-        fprintf(stderr, "Elfuse: failed creating FUSE\n");
+    /* Create the FUSE instance or the low-level session */
+    struct fuse_session *se = NULL;
+    if (mount->lowlevel) {
+        if (fuse_opt_parse(&args, mount, elfuse_ll_opts, NULL) == -1) {
+            ELFUSE_LOG(ELFUSE_LOG_ERROR, "Elfuse: failed parsing mount options\n");
+
+            mount->init_code = INIT_ERR_ARGS;
+            sem_post(&mount->init_sem);
+
+            pthread_exit(NULL);
+        }
+        mount->session = fuse_lowlevel_new(&args, &elfuse_ll_oper, sizeof(elfuse_ll_oper), mount);
+        if (mount->session != NULL) {
+            fuse_session_add_chan(mount->session, ch);
+            se = mount->session;
+        }
+    } else {
+        mount->fuse = fuse_new(ch, &args, &elfuse_oper, sizeof(elfuse_oper), mount);
+        if (mount->fuse != NULL)
+            se = fuse_get_session(mount->fuse);
+    }
+    if (se == NULL) {
+        ELFUSE_LOG(ELFUSE_LOG_ERROR, "Elfuse: failed creating FUSE\n");
 
-        elfuse_init_code = INIT_ERR_CREATE;
-        sem_post(&init_sem);
+        mount->init_code = INIT_ERR_CREATE;
+        sem_post(&mount->init_sem);
 
         pthread_exit(NULL);
     }
@@ -568,46 +2743,66 @@ elfuse_fuse_loop(void* mountpath)
     size_t bufsize = fuse_chan_bufsize(ch);
     char *buf = malloc(bufsize);
     if (!buf) {
-        fprintf(stderr, "Elfuse: failed to allocate the read buffer\n");
+        ELFUSE_LOG(ELFUSE_LOG_ERROR, "Elfuse: failed to allocate the read buffer\n");
 
-        elfuse_init_code = INIT_ERR_ALLOC;
-        sem_post(&init_sem);
+        mount->init_code = INIT_ERR_ALLOC;
+        sem_post(&mount->init_sem);
 
         pthread_exit(NULL);
     }
-    pthread_cleanup_push(elfuse_cleanup_fuse, buf);
+    struct elfuse_cleanup_args fuse_cleanup = {mount, buf};
+    pthread_cleanup_push(elfuse_cleanup_fuse, &fuse_cleanup);
 
-    /* Let Emacs know that init was a success */
-    elfuse_init_code = INIT_DONE;
-    sem_post(&init_sem);
+    /* Start the kernel cache invalidation thread */
+    if (elfuse_notify_start(mount, ch) != 0) {
+        ELFUSE_LOG(ELFUSE_LOG_ERROR, "Elfuse: failed to start the notification thread\n");
 
-    /* Go-go-go! */
-    fprintf(stderr, "Elfuse: starting main loop\n");
-    struct fuse_session *se = fuse_get_session(fuse);
-    while (!fuse_session_exited(se)) {
-        struct fuse_chan *tmpch = ch;
-        struct fuse_buf fbuf = {
-            .mem = buf,
-            .size = bufsize,
-        };
+        mount->init_code = INIT_ERR_ALLOC;
+        sem_post(&mount->init_sem);
 
-        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-        err = fuse_session_receive_buf(se, &fbuf, &tmpch);
-        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        pthread_exit(NULL);
+    }
+    pthread_cleanup_push(elfuse_cleanup_notify, mount);
 
-        if (err == -EINTR)
-            continue;
-        if (err <= 0)
-            break;
+    /* Start extra worker threads, the current thread is a worker as well */
+    mount->workers_size = 0;
+    mount->workers = calloc(threads > 1 ? threads - 1 : 1, sizeof(mount->workers[0]));
+    if (!mount->workers) {
+        ELFUSE_LOG(ELFUSE_LOG_ERROR, "Elfuse: failed to allocate worker threads\n");
 
-        fuse_session_process_buf(se, &fbuf, tmpch);
+        mount->init_code = INIT_ERR_ALLOC;
+        sem_post(&mount->init_sem);
+
+        pthread_exit(NULL);
+    }
+    pthread_cleanup_push(elfuse_cleanup_workers, mount);
+    for (int i = 0; i < threads - 1; i++) {
+        if (elfuse_worker_start(&mount->workers[mount->workers_size], mount, se, ch, bufsize) != 0)
+            break;
+        mount->workers_size++;
     }
+    pthread_mutex_lock(&mount->spares_lock);
+    mount->spares_open = true;
+    pthread_mutex_unlock(&mount->spares_lock);
+
+    /* Let Emacs know that init was a success */
+    mount->init_code = INIT_DONE;
+    sem_post(&mount->init_sem);
 
+    /* Go-go-go! */
+    ELFUSE_LOG(ELFUSE_LOG_INFO, "Elfuse: starting main loop (%d threads)\n", mount->workers_size + 1);
+    elfuse_session_loop(mount, se, ch, buf, bufsize);
 
+    /* Stop workers */
+    pthread_cleanup_pop(true);
+    /* Stop notifications */
+    pthread_cleanup_pop(true);
     /* Cleanup FUSE */
     pthread_cleanup_pop(true);
     /* Cleanup the mount point */
     pthread_cleanup_pop(true);
+    /* Cleanup arguments */
+    pthread_cleanup_pop(true);
 
     return NULL;
 }
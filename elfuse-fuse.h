@@ -18,11 +18,15 @@
 
 #include <pthread.h>
 #include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
-extern sem_t request_sem;
-extern sem_t init_sem;
 extern pthread_t emacs_thread;
 
+struct elfuse_mount;
+
 /* Init codes */
 enum elfuse_init_code_enum {
     INIT_DONE,
@@ -30,7 +34,34 @@ enum elfuse_init_code_enum {
     INIT_ERR_MOUNT,
     INIT_ERR_CREATE,
     INIT_ERR_ALLOC
-} elfuse_init_code;
+};
+
+/* Microseconds to wait for more requests before waking Emacs up */
+extern atomic_uint elfuse_batch_window;
+
+/* Largest window in bytes read ahead for sequential readers, 0 disables */
+extern atomic_size_t elfuse_readahead_size;
+
+/* Ways to wake Emacs up when a request is queued */
+enum elfuse_wakeup_method_enum {
+    /* Send SIGUSR1 to the Emacs thread */
+    WAKEUP_SIGNAL,
+    /* Write to a pipe process Emacs watches, see elfuse_wakeup_fd */
+    WAKEUP_PIPE,
+    /* Nothing, Emacs polls the queue on a timer */
+    WAKEUP_NONE,
+};
+
+extern atomic_int elfuse_wakeup_method;
+extern atomic_int elfuse_wakeup_fd;
+
+/* Request round trip times */
+extern atomic_ullong elfuse_rtt_count;
+extern atomic_ullong elfuse_rtt_sum_ns;
+extern atomic_ullong elfuse_rtt_max_ns;
+
+/* Requests answered by an identical request already waiting for Emacs */
+extern atomic_ullong elfuse_coalesced_count;
 
 /* CREATE args and results */
 struct elfuse_args_create {
@@ -69,16 +100,32 @@ struct elfuse_results_getattr {
         GETATTR_UNKNOWN,
     } code;
     size_t file_size;
+    /* Optional content version, e.g. a buffer modification tick */
+    bool has_generation;
+    uint64_t generation;
 };
 
+/* Entries asked from paged readdir handlers at once */
+#define ELFUSE_READDIR_PAGE_SIZE 1024
+
 /* READDIR arsg and results */
 struct elfuse_args_readdir {
     const char *path;
+    /* 0 for the first page, the handler's NEXT_OFFSET afterwards */
+    int64_t offset;
+    size_t limit;
 };
 
 struct elfuse_results_readdir {
+    /* A single allocation, the names follow the array */
     char **files;
     size_t files_size;
+    /* Attributes of entries returned with them, GETATTR_UNKNOWN for bare
+     * names. NULL if there were none. */
+    struct elfuse_results_getattr *attrs;
+    /* Paged handlers return where the next page starts */
+    bool has_next;
+    int64_t next_offset;
 };
 
 /* OPEN args and results */
@@ -91,6 +138,9 @@ struct elfuse_results_open {
         OPEN_FOUND,
         OPEN_UNKNOWN,
     } code;
+    /* A file on disk serving reads and writes of the handle or NULL,
+     * allocated by Emacs and freed by the FUSE thread */
+    char *backing;
 };
 
 /* OPEN args and results */
@@ -110,11 +160,13 @@ struct elfuse_args_read {
     const char *path;
     size_t offset;
     size_t size;
+    /* Emacs copies the data right here, there's room for SIZE bytes and
+     * the NUL terminator Emacs always adds */
+    char *buf;
 };
 
 struct elfuse_results_read {
     int bytes_read;
-    char *data;
 };
 
 /* WRITE args and results */
@@ -154,7 +206,7 @@ struct elfuse_results_unlink {
     } code;
 };
 
-/* A unified data exchange struct. */
+/* A unified data exchange struct, one per request. */
 struct elfuse_call_state {
     enum elfuse_request_state {
         /* Nothing is waiting */
@@ -179,9 +231,21 @@ struct elfuse_call_state {
         RESPONSE_NOTREADY,
         RESPONSE_SIGNAL_ERROR,
         RESPONSE_UNKNOWN_ERROR,
+        /* Emacs replies later, never seen by FUSE threads */
+        RESPONSE_DEFERRED,
     } response_state;
     int response_err_code;
 
+    /* The inode the request works on with the low-level backend, 0 with
+     * the high-level one */
+    uint64_t ino;
+
+    /* When the request was queued, taken by Emacs and handled, in ns, 0 if
+     * it never got that far, see elfuse-stats.h */
+    uint64_t queued_ns;
+    uint64_t taken_ns;
+    uint64_t handled_ns;
+
     union args {
         struct elfuse_args_create create;
         struct elfuse_args_rename rename;
@@ -208,9 +272,97 @@ struct elfuse_call_state {
         struct elfuse_results_unlink unlink;
     } results;
 
-} elfuse_call;
+    /* Posted by Emacs once the request is handled */
+    sem_t response_sem;
+
+    /* Next request in the queue */
+    struct elfuse_call_state *next;
+};
 
+/* The path CALL works on, the old one for renames */
+const char *
+elfuse_call_path(const struct elfuse_call_state *call);
+
+/* Bytes CALL asks for, entries for readdir */
+size_t
+elfuse_call_size(const struct elfuse_call_state *call);
+
+int64_t
+elfuse_call_offset(const struct elfuse_call_state *call);
+
+void
+elfuse_queue_push(struct elfuse_mount *mount, struct elfuse_call_state *call);
+
+/* Emacs took CALL, identical requests arriving from now on must not
+ * share its results */
+void
+elfuse_call_taken(struct elfuse_mount *mount, struct elfuse_call_state *call);
+
+/* The deferred_size FUSE threads of MOUNT waiting for elfuse-reply are
+ * replaced with new ones if needed, so the session is still served by as
+ * many threads as the mount asked for */
+void
+elfuse_workers_park(struct elfuse_mount *mount);
+
+/* Stop spare threads of MOUNT beyond deferred_size. A spare still busy
+ * with a request exits once it is done with it. */
+void
+elfuse_workers_reap(struct elfuse_mount *mount);
+
+/* Take all requests queued for MOUNT, in arrival order */
+struct elfuse_call_state *
+elfuse_queue_take(struct elfuse_mount *mount);
+
+/* Emacs brackets draining the queues of all MOUNTS with these so that FUSE
+ * threads don't send redundant wakeups. elfuse_queue_drain_end returns
+ * false if more requests arrived and draining should go on. Drains nest,
+ * only the outermost one ends draining. */
+void
+elfuse_queue_drain_begin(void);
+
+bool
+elfuse_queue_drain_end(struct elfuse_mount *mounts, size_t handled);
+
+/* Wake Emacs up to look at the queues */
+void
+elfuse_wakeup(void);
+
+/* Inode of a low-level backend KEY and the name of "#PARENT/NAME" keys,
+ * false if KEY is a path */
+bool
+elfuse_key_parse(const char *key, uint64_t *ino, const char **name);
+
+/* A copy of the path KEY stands for, NULL if its node is gone */
+char *
+elfuse_key_path(struct elfuse_mount *mount, const char *key);
+
+/* Call FN with every key cached data of PATH can be found under: PATH
+ * itself with the high-level backend, the keys of its name and node with
+ * the low-level one. With BELOW also the nodes below PATH. */
+void
+elfuse_path_keys(struct elfuse_mount *mount, const char *path, bool below,
+                 void (*fn)(struct elfuse_mount *mount, const char *key, void *arg), void *arg);
+
+/* elfuse_path_keys callbacks dropping cached attributes and data of a key
+ * or of a key and everything below it */
+void
+elfuse_invalidate_key(struct elfuse_mount *mount, const char *key, void *arg);
+
+void
+elfuse_invalidate_key_prefix(struct elfuse_mount *mount, const char *key, void *arg);
+
+/* Drop cached attributes and data of PATH, in Elfuse and in the kernel */
+void
+elfuse_notify_changed(struct elfuse_mount *mount, const char *path);
+
+/* Drop the kernel entry NAME in DIR, e.g. after the entry was added or
+ * removed behind the kernel's back */
+void
+elfuse_notify_entry(struct elfuse_mount *mount, const char *dir, const char *name, bool removed);
+
+/* Mount and serve MOUNT until cancelled with the high-level or the
+ * low-level FUSE API, see elfuse-mount.h */
 void *
-elfuse_fuse_loop(void *mountpath);
+elfuse_fuse_loop(void *mount);
 
 #endif //ELFUSE_FUSE_H
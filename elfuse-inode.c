@@ -0,0 +1,275 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/fuse.h>
+
+#include "elfuse-inode.h"
+#include "elfuse-cache.h"
+
+#define INODE_TABLE_INITIAL_BUCKETS 256
+
+void
+elfuse_kernel_request_peek(const void *mem, size_t size, struct elfuse_kernel_request *request)
+{
+    if (mem == NULL || size < sizeof(struct fuse_in_header)) {
+        request->opcode = 0;
+        request->nodeid = 0;
+        request->pid = 0;
+        return;
+    }
+
+    const struct fuse_in_header *in = mem;
+    request->opcode = in->opcode;
+    request->nodeid = in->nodeid;
+    request->pid = in->pid;
+}
+
+/* Does the request node id belong to the parent directory of the path? */
+static bool
+targets_parent(uint32_t opcode)
+{
+    switch (opcode) {
+    case FUSE_LOOKUP:
+    case FUSE_MKNOD:
+    case FUSE_MKDIR:
+    case FUSE_UNLINK:
+    case FUSE_RMDIR:
+    case FUSE_RENAME:
+    case FUSE_SYMLINK:
+    case FUSE_CREATE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static struct elfuse_inode_entry **
+find_entry(struct elfuse_inode_table *table, const char *path, size_t path_size, uint64_t hash)
+{
+    struct elfuse_inode_entry **entry = &table->buckets[hash % table->buckets_size];
+    while (*entry != NULL) {
+        if ((*entry)->hash == hash
+            && strncmp((*entry)->path, path, path_size) == 0
+            && (*entry)->path[path_size] == '\0')
+            break;
+        entry = &(*entry)->next;
+    }
+    return entry;
+}
+
+static void
+grow(struct elfuse_inode_table *table)
+{
+    size_t buckets_size = table->buckets_size * 2;
+    struct elfuse_inode_entry **buckets = calloc(buckets_size, sizeof(buckets[0]));
+    if (buckets == NULL)
+        return;
+
+    for (size_t i = 0; i < table->buckets_size; i++) {
+        struct elfuse_inode_entry *entry = table->buckets[i];
+        while (entry != NULL) {
+            struct elfuse_inode_entry *next = entry->next;
+            entry->next = buckets[entry->hash % buckets_size];
+            buckets[entry->hash % buckets_size] = entry;
+            entry = next;
+        }
+    }
+    free(table->buckets);
+    table->buckets = buckets;
+    table->buckets_size = buckets_size;
+}
+
+static void
+lru_unlink(struct elfuse_inode_table *table, struct elfuse_inode_entry *entry)
+{
+    if (entry->lru_prev != NULL)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        table->lru_head = entry->lru_next;
+    if (entry->lru_next != NULL)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        table->lru_tail = entry->lru_prev;
+}
+
+static void
+lru_push(struct elfuse_inode_table *table, struct elfuse_inode_entry *entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = table->lru_head;
+    if (table->lru_head != NULL)
+        table->lru_head->lru_prev = entry;
+    table->lru_head = entry;
+    if (table->lru_tail == NULL)
+        table->lru_tail = entry;
+}
+
+/* Remove the entry *ENTRY points to from its bucket and the LRU list */
+static void
+free_entry(struct elfuse_inode_table *table, struct elfuse_inode_entry **entry)
+{
+    struct elfuse_inode_entry *dead = *entry;
+    *entry = dead->next;
+    lru_unlink(table, dead);
+    free(dead->path);
+    free(dead);
+    table->entries_size--;
+}
+
+/* Drop least recently used entries over the limit, except the root */
+static void
+evict(struct elfuse_inode_table *table)
+{
+    struct elfuse_inode_entry *victim = table->lru_tail;
+    while (table->entries_size > ELFUSE_INODE_TABLE_SIZE && victim != NULL) {
+        struct elfuse_inode_entry *prev = victim->lru_prev;
+        if (victim->nodeid != FUSE_ROOT_ID)
+            free_entry(table, find_entry(table, victim->path, strlen(victim->path), victim->hash));
+        victim = prev;
+    }
+}
+
+/* Set the node id of the first PATH_SIZE bytes of PATH */
+static void
+set_nodeid(struct elfuse_inode_table *table, const char *path, size_t path_size, uint64_t nodeid)
+{
+    char key[path_size + 1];
+    memcpy(key, path, path_size);
+    key[path_size] = '\0';
+
+    uint64_t hash = elfuse_hash_path(key);
+    struct elfuse_inode_entry **found = find_entry(table, key, path_size, hash);
+    if (*found != NULL) {
+        (*found)->nodeid = nodeid;
+        lru_unlink(table, *found);
+        lru_push(table, *found);
+        return;
+    }
+
+    struct elfuse_inode_entry *entry = malloc(sizeof(*entry));
+    if (entry == NULL)
+        return;
+    entry->path = strdup(key);
+    if (entry->path == NULL) {
+        free(entry);
+        return;
+    }
+    entry->hash = hash;
+    entry->nodeid = nodeid;
+
+    if (table->entries_size >= table->buckets_size * 2)
+        grow(table);
+    size_t bucket = hash % table->buckets_size;
+    entry->next = table->buckets[bucket];
+    table->buckets[bucket] = entry;
+    table->entries_size++;
+    lru_push(table, entry);
+
+    evict(table);
+}
+
+void
+elfuse_inode_table_init(struct elfuse_inode_table *table)
+{
+    pthread_mutex_init(&table->lock, NULL);
+    table->buckets_size = INODE_TABLE_INITIAL_BUCKETS;
+    table->buckets = calloc(table->buckets_size, sizeof(table->buckets[0]));
+    table->entries_size = 0;
+    table->lru_head = NULL;
+    table->lru_tail = NULL;
+
+    set_nodeid(table, "/", 1, FUSE_ROOT_ID);
+}
+
+void
+elfuse_inode_table_track(struct elfuse_inode_table *table, const struct elfuse_kernel_request *request,
+                         const char *path)
+{
+    if (request->nodeid == 0)
+        return;
+
+    size_t path_size = strlen(path);
+    if (targets_parent(request->opcode)) {
+        const char *slash = strrchr(path, '/');
+        if (slash == NULL || path_size == 1)
+            return;
+        /* The parent of "/name" is "/" */
+        path_size = slash == path ? 1 : (size_t) (slash - path);
+    }
+
+    pthread_mutex_lock(&table->lock);
+    set_nodeid(table, path, path_size, request->nodeid);
+    pthread_mutex_unlock(&table->lock);
+}
+
+uint64_t
+elfuse_inode_table_get(struct elfuse_inode_table *table, const char *path)
+{
+    uint64_t nodeid = 0;
+
+    pthread_mutex_lock(&table->lock);
+    struct elfuse_inode_entry *entry = *find_entry(table, path, strlen(path), elfuse_hash_path(path));
+    if (entry != NULL)
+        nodeid = entry->nodeid;
+    pthread_mutex_unlock(&table->lock);
+
+    return nodeid;
+}
+
+void
+elfuse_inode_table_forget_prefix(struct elfuse_inode_table *table, const char *prefix)
+{
+    pthread_mutex_lock(&table->lock);
+    for (size_t i = 0; i < table->buckets_size; i++) {
+        struct elfuse_inode_entry **entry = &table->buckets[i];
+        while (*entry != NULL) {
+            /* The root never goes away */
+            if (elfuse_path_below((*entry)->path, prefix) && (*entry)->nodeid != FUSE_ROOT_ID) {
+                free_entry(table, entry);
+            } else {
+                entry = &(*entry)->next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&table->lock);
+}
+
+void
+elfuse_inode_table_clear(struct elfuse_inode_table *table)
+{
+    elfuse_inode_table_forget_prefix(table, "/");
+}
+
+void
+elfuse_inode_table_destroy(struct elfuse_inode_table *table)
+{
+    pthread_mutex_lock(&table->lock);
+    for (size_t i = 0; i < table->buckets_size; i++) {
+        while (table->buckets[i] != NULL) {
+            struct elfuse_inode_entry *dead = table->buckets[i];
+            table->buckets[i] = dead->next;
+            free(dead->path);
+            free(dead);
+        }
+    }
+    free(table->buckets);
+    pthread_mutex_unlock(&table->lock);
+    pthread_mutex_destroy(&table->lock);
+}
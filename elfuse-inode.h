@@ -0,0 +1,90 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef ELFUSE_INODE_H
+#define ELFUSE_INODE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* The high-level FUSE API hides kernel node ids, but kernel cache
+ * invalidation needs them. Elfuse peeks at the header of every raw kernel
+ * request and remembers which path the node id belongs to while the
+ * request is processed. The high-level API never passes FORGET on, so
+ * the table keeps the most recently used paths only: nodes evicted from
+ * it are not notified and the kernel drops them after its timeouts. */
+
+/* Opcode and node id of the kernel request being processed and the
+ * process that sent it */
+struct elfuse_kernel_request {
+    uint32_t opcode;
+    uint64_t nodeid;
+    uint32_t pid;
+};
+
+struct elfuse_inode_entry {
+    char *path;
+    uint64_t hash;
+    uint64_t nodeid;
+    struct elfuse_inode_entry *next;
+
+    /* LRU list, most recently used first */
+    struct elfuse_inode_entry *lru_prev;
+    struct elfuse_inode_entry *lru_next;
+};
+
+/* A path to kernel node id table of at most ELFUSE_INODE_TABLE_SIZE
+ * entries, the root is always kept */
+struct elfuse_inode_table {
+    pthread_mutex_t lock;
+    struct elfuse_inode_entry **buckets;
+    size_t buckets_size;
+    size_t entries_size;
+
+    struct elfuse_inode_entry *lru_head;
+    struct elfuse_inode_entry *lru_tail;
+};
+
+#define ELFUSE_INODE_TABLE_SIZE 65536
+
+/* Fill REQUEST from a raw kernel request buffer, zero if it's too short */
+void
+elfuse_kernel_request_peek(const void *mem, size_t size, struct elfuse_kernel_request *request);
+
+void
+elfuse_inode_table_init(struct elfuse_inode_table *table);
+
+/* Remember the node id of a request that works on PATH. Depending on the
+ * opcode the node id belongs to PATH itself or to its parent directory. */
+void
+elfuse_inode_table_track(struct elfuse_inode_table *table, const struct elfuse_kernel_request *request,
+                         const char *path);
+
+/* Node id of PATH, 0 if unknown */
+uint64_t
+elfuse_inode_table_get(struct elfuse_inode_table *table, const char *path);
+
+/* Forget PREFIX and everything below it */
+void
+elfuse_inode_table_forget_prefix(struct elfuse_inode_table *table, const char *prefix);
+
+void
+elfuse_inode_table_clear(struct elfuse_inode_table *table);
+
+void
+elfuse_inode_table_destroy(struct elfuse_inode_table *table);
+
+#endif //ELFUSE_INODE_H
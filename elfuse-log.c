@@ -0,0 +1,209 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+#define _XOPEN_SOURCE 700
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "elfuse-log.h"
+#include "elfuse-cache.h"
+#include "elfuse-stats.h"
+
+atomic_int elfuse_log_level = ELFUSE_LOG_INFO;
+
+void
+elfuse_log(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+/* A record slot. SEQ is the number of the record plus one once it is
+ * complete and 0 while it's being written, readers check it before and
+ * after copying the record. */
+struct elfuse_trace_slot {
+    atomic_ullong seq;
+    atomic_ullong path_hash;
+    atomic_ullong ino;
+    atomic_ullong queued_ns;
+    atomic_ullong taken_ns;
+    atomic_ullong handled_ns;
+    atomic_ullong done_ns;
+    /* The op, the kind and the result */
+    atomic_ullong info;
+};
+
+/* A single writer ring. Rings are never freed, a ring of an exited
+ * thread goes to the next thread needing one. */
+struct elfuse_trace_ring {
+    unsigned id;
+    atomic_bool owned;
+    atomic_ullong head;
+    struct elfuse_trace_ring *next;
+    struct elfuse_trace_slot slots[ELFUSE_TRACE_RING_SIZE];
+};
+
+static _Atomic(struct elfuse_trace_ring *) trace_rings;
+static atomic_uint trace_rings_size;
+
+static _Thread_local struct elfuse_trace_ring *thread_ring;
+static pthread_key_t thread_ring_key;
+static pthread_once_t thread_ring_once = PTHREAD_ONCE_INIT;
+
+static void
+release_ring(void *ring)
+{
+    atomic_store(&((struct elfuse_trace_ring *)ring)->owned, false);
+}
+
+static void
+create_ring_key(void)
+{
+    pthread_key_create(&thread_ring_key, release_ring);
+}
+
+static struct elfuse_trace_ring *
+acquire_ring(void)
+{
+    if (thread_ring != NULL)
+        return thread_ring;
+
+    struct elfuse_trace_ring *ring;
+    for (ring = atomic_load(&trace_rings); ring != NULL; ring = ring->next) {
+        bool owned = false;
+        if (atomic_compare_exchange_strong(&ring->owned, &owned, true))
+            break;
+    }
+
+    if (ring == NULL) {
+        ring = calloc(1, sizeof(*ring));
+        if (ring == NULL)
+            return NULL;
+        ring->id = atomic_fetch_add(&trace_rings_size, 1);
+        atomic_store(&ring->owned, true);
+        ring->next = atomic_load(&trace_rings);
+        while (!atomic_compare_exchange_weak(&trace_rings, &ring->next, ring));
+    }
+
+    /* Give the ring back once the thread exits */
+    pthread_once(&thread_ring_once, create_ring_key);
+    pthread_setspecific(thread_ring_key, ring);
+
+    thread_ring = ring;
+    return ring;
+}
+
+static void
+trace_write(const struct elfuse_trace_record *record)
+{
+    struct elfuse_trace_ring *ring = acquire_ring();
+    if (ring == NULL)
+        return;
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    struct elfuse_trace_slot *slot = &ring->slots[head % ELFUSE_TRACE_RING_SIZE];
+
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    atomic_store_explicit(&slot->path_hash, record->path_hash, memory_order_relaxed);
+    atomic_store_explicit(&slot->ino, record->ino, memory_order_relaxed);
+    atomic_store_explicit(&slot->queued_ns, record->queued_ns, memory_order_relaxed);
+    atomic_store_explicit(&slot->taken_ns, record->taken_ns, memory_order_relaxed);
+    atomic_store_explicit(&slot->handled_ns, record->handled_ns, memory_order_relaxed);
+    atomic_store_explicit(&slot->done_ns, record->done_ns, memory_order_relaxed);
+    uint64_t info = (uint64_t)(record->op & 0xff) | (uint64_t)(record->kind & 0xff) << 8
+        | (uint64_t)(uint32_t)record->result << 32;
+    atomic_store_explicit(&slot->info, info, memory_order_relaxed);
+
+    atomic_store_explicit(&slot->seq, head + 1, memory_order_release);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void
+elfuse_trace_call(enum elfuse_trace_kind kind, const struct elfuse_call_state *call, uint64_t done_ns)
+{
+    const char *path = elfuse_call_path(call);
+    struct elfuse_trace_record record = {
+        .op = call->request_state,
+        .kind = kind,
+        .result = elfuse_call_errno(call),
+        .path_hash = path != NULL ? elfuse_hash_path(path) : 0,
+        .ino = call->ino,
+        .queued_ns = call->queued_ns,
+        .taken_ns = call->taken_ns,
+        .handled_ns = call->handled_ns,
+        .done_ns = done_ns,
+    };
+    trace_write(&record);
+}
+
+void
+elfuse_trace_cached(enum elfuse_request_state op, const char *path, uint64_t ino, uint64_t start_ns, int result)
+{
+    struct elfuse_trace_record record = {
+        .op = op,
+        .kind = TRACE_CACHED,
+        .result = result,
+        .path_hash = path != NULL ? elfuse_hash_path(path) : 0,
+        .ino = ino,
+        .queued_ns = start_ns,
+        .done_ns = elfuse_now_ns(),
+    };
+    trace_write(&record);
+}
+
+void
+elfuse_trace_foreach(void (*fn)(const struct elfuse_trace_record *record, void *data), void *data)
+{
+    for (struct elfuse_trace_ring *ring = atomic_load(&trace_rings); ring != NULL; ring = ring->next) {
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint64_t first = head > ELFUSE_TRACE_RING_SIZE ? head - ELFUSE_TRACE_RING_SIZE : 0;
+
+        for (uint64_t i = first; i < head; i++) {
+            struct elfuse_trace_slot *slot = &ring->slots[i % ELFUSE_TRACE_RING_SIZE];
+            uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+            if (seq != i + 1)
+                continue;
+
+            struct elfuse_trace_record record = {
+                .thread = ring->id,
+                .path_hash = atomic_load_explicit(&slot->path_hash, memory_order_relaxed),
+                .ino = atomic_load_explicit(&slot->ino, memory_order_relaxed),
+                .queued_ns = atomic_load_explicit(&slot->queued_ns, memory_order_relaxed),
+                .taken_ns = atomic_load_explicit(&slot->taken_ns, memory_order_relaxed),
+                .handled_ns = atomic_load_explicit(&slot->handled_ns, memory_order_relaxed),
+                .done_ns = atomic_load_explicit(&slot->done_ns, memory_order_relaxed),
+            };
+            uint64_t info = atomic_load_explicit(&slot->info, memory_order_relaxed);
+
+            /* The writer got around to the slot meanwhile */
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq)
+                continue;
+
+            record.op = info & 0xff;
+            record.kind = (info >> 8) & 0xff;
+            record.result = (int)(uint32_t)(info >> 32);
+            fn(&record, data);
+        }
+    }
+}
@@ -0,0 +1,90 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef ELFUSE_LOG_H
+#define ELFUSE_LOG_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "elfuse-fuse.h"
+
+/* Log levels, messages above ELFUSE_LOG_MAX_LEVEL are compiled out and
+ * messages above elfuse_log_level are skipped at runtime */
+#define ELFUSE_LOG_ERROR 0
+#define ELFUSE_LOG_WARN 1
+#define ELFUSE_LOG_INFO 2
+#define ELFUSE_LOG_DEBUG 3
+
+#ifndef ELFUSE_LOG_MAX_LEVEL
+#define ELFUSE_LOG_MAX_LEVEL ELFUSE_LOG_DEBUG
+#endif
+
+extern atomic_int elfuse_log_level;
+
+void
+elfuse_log(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+#define ELFUSE_LOG(level, ...)                                                  \
+    do {                                                                        \
+        if ((level) <= ELFUSE_LOG_MAX_LEVEL                                     \
+            && (level) <= atomic_load_explicit(&elfuse_log_level, memory_order_relaxed)) \
+            elfuse_log(__VA_ARGS__);                                            \
+    } while (0)
+
+/* How a traced request was answered */
+enum elfuse_trace_kind {
+    /* By the Lisp handler */
+    TRACE_CALL,
+    /* With the results of an identical request in flight */
+    TRACE_COALESCED,
+    /* From Elfuse caches, without Emacs */
+    TRACE_CACHED,
+};
+
+/* A trace record, timestamps in ns are 0 for phases the request skipped */
+struct elfuse_trace_record {
+    /* The thread ring the record comes from */
+    unsigned thread;
+    enum elfuse_request_state op;
+    enum elfuse_trace_kind kind;
+    /* 0 or the errno the request failed with */
+    int result;
+    uint64_t path_hash;
+    uint64_t ino;
+    uint64_t queued_ns;
+    uint64_t taken_ns;
+    uint64_t handled_ns;
+    uint64_t done_ns;
+};
+
+/* Records kept per thread, older ones are overwritten */
+#define ELFUSE_TRACE_RING_SIZE 1024
+
+/* Add a record of CALL, finished at DONE_NS, to the ring of the calling
+ * thread. Never blocks. */
+void
+elfuse_trace_call(enum elfuse_trace_kind kind, const struct elfuse_call_state *call, uint64_t done_ns);
+
+/* Add a record of an OP on PATH (or INO) answered without a call */
+void
+elfuse_trace_cached(enum elfuse_request_state op, const char *path, uint64_t ino, uint64_t start_ns, int result);
+
+/* Call FN with every record of every thread, oldest first within a
+ * thread. Records being written meanwhile are skipped. */
+void
+elfuse_trace_foreach(void (*fn)(const struct elfuse_trace_record *record, void *data), void *data);
+
+#endif //ELFUSE_LOG_H
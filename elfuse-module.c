@@ -13,30 +13,179 @@
 /* You should have received a copy of the GNU General Public License */
 /* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
 
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
 #include <stdbool.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <signal.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "emacs-module.h"
 #include "elfuse-fuse.h"
+#include "elfuse-cache.h"
+#include "elfuse-inode.h"
+#include "elfuse-log.h"
+#include "elfuse-probes.h"
+#include "elfuse-record.h"
+#include "elfuse-snapshot.h"
+#include "elfuse-stats.h"
+#include "elfuse-mount.h"
 
 int plugin_is_GPL_compatible;
 
-sem_t request_sem;
-sem_t init_sem;
 pthread_t emacs_thread;
 
-static bool elfuse_is_started = false;
-static pthread_t fuse_thread;
+/* Mounts served by Emacs, most recent first */
+static struct elfuse_mount *mounts;
+
+/* Set while Lisp handlers run, mounts can't be stopped then */
+static int dispatch_depth;
+
+/* Cache settings applied to every mount */
+static double attr_cache_ttl = 1.0;
+static double negative_cache_ttl = 1.0;
+static size_t block_cache_budget = 64 * 1024 * 1024;
 
 static emacs_value nil;
 static emacs_value t;
 static emacs_value elfuse_op_error;
+static emacs_value Qfile;
+static emacs_value Qdir;
+static emacs_value Qset;
+static emacs_value Qvector;
+static emacs_value Qcons;
+static emacs_value Qcar;
+static emacs_value Qcdr;
+static emacs_value Qelfuse_inode;
+static emacs_value Qbacking;
+
+/* Lisp request handlers */
+enum elfuse_op {
+    OP_CREATE,
+    OP_RENAME,
+    OP_GETATTR,
+    OP_READDIR,
+    OP_OPEN,
+    OP_RELEASE,
+    OP_READ,
+    OP_WRITE,
+    OP_TRUNCATE,
+    OP_UNLINK,
+    OP_COUNT,
+};
+
+/* Handlers used by elfuse-start, see elfuse--bench-handlers */
+static const char *const op_handler_names[OP_COUNT] = {
+    [OP_CREATE] = "elfuse--create-op",
+    [OP_RENAME] = "elfuse--rename-op",
+    [OP_GETATTR] = "elfuse--getattr-op",
+    [OP_READDIR] = "elfuse--readdir-op",
+    [OP_OPEN] = "elfuse--open-op",
+    [OP_RELEASE] = "elfuse--release-op",
+    [OP_READ] = "elfuse--read-op",
+    [OP_WRITE] = "elfuse--write-op",
+    [OP_TRUNCATE] = "elfuse--truncate-op",
+    [OP_UNLINK] = "elfuse--unlink-op",
+};
+
+/* Handlers of a mount as global references, resolved once instead of
+ * checking fboundp on every request. A handler is a symbol, a function
+ * or nil. */
+struct elfuse_handlers {
+    /* handlers_generation the table is valid for, 0 if never resolved */
+    unsigned generation;
+
+    emacs_value ops[OP_COUNT];
+    bool symbol[OP_COUNT];
+    bool defined[OP_COUNT];
+
+    /* The readdir handler takes an offset and a limit */
+    bool paged_readdir;
+};
+
+/* Bumped whenever elfuse-define-op (re)defines a handler */
+static unsigned handlers_generation = 1;
+
+/* A request whose handler called elfuse-defer. The Lisp token owns the
+ * struct, CALL is NULL once the request got its reply. */
+struct elfuse_deferred {
+    struct elfuse_call_state *call;
+    struct elfuse_mount *mount;
+
+    /* Other requests of the mount waiting for a reply */
+    struct elfuse_deferred *prev;
+    struct elfuse_deferred *next;
+};
+
+/* The request being handled and its token, if the handler deferred it */
+static struct elfuse_mount *current_mount;
+static struct elfuse_call_state *current_call;
+static struct elfuse_deferred *current_deferred;
+static emacs_value current_token;
+
+/* The errno of the current request if its handler signalled one. Kept
+ * apart from the request, which is gone once a deferring handler replied
+ * itself. */
+static int current_err_code;
+
+/* The value of `elfuse-inode' while handling the current request */
+static uint64_t current_ino;
+
+/* Let the FUSE thread waiting for a deferred reply go */
+static void
+deferred_finish(struct elfuse_deferred *deferred, int response_state, int err_code)
+{
+    struct elfuse_call_state *call = deferred->call;
+    if (call == NULL) {
+        return;
+    }
+
+    if (deferred->prev != NULL) {
+        deferred->prev->next = deferred->next;
+    } else {
+        deferred->mount->deferred = deferred->next;
+    }
+    if (deferred->next != NULL) {
+        deferred->next->prev = deferred->prev;
+    }
+    deferred->mount->deferred_size--;
+    deferred->call = NULL;
+    deferred->prev = deferred->next = NULL;
+
+    /* The thread started in place of this one isn't needed anymore */
+    elfuse_workers_reap(deferred->mount);
+
+    call->response_state = response_state;
+    call->response_err_code = err_code;
+    ELFUSE_PROBE4(reply, call, call->request_state, response_state, elfuse_call_errno(call));
+    sem_post(&call->response_sem);
+}
+
+/* Fail all requests of MOUNT still waiting for a reply */
+static void
+deferred_fail_all(struct elfuse_mount *mount)
+{
+    while (mount->deferred != NULL) {
+        deferred_finish(mount->deferred, RESPONSE_SIGNAL_ERROR, EIO);
+    }
+}
+
+/* A token nobody can reply to anymore, fail the request */
+static void
+finalize_deferred(void *ptr)
+{
+    struct elfuse_deferred *deferred = ptr;
+    deferred_finish(deferred, RESPONSE_SIGNAL_ERROR, EIO);
+    free(deferred);
+}
 
 static void
 message (emacs_env *env, const char *format, ...)
@@ -82,6 +231,79 @@ fboundp (emacs_env *env, emacs_value Sfun) {
     return env->is_not_nil(env, env->funcall (env, Qfboundp, 1, args));
 }
 
+/* A handler table of a vector of handlers in the elfuse_op order */
+static struct elfuse_handlers *
+handlers_new(emacs_env *env, emacs_value Vhandlers)
+{
+    if (env->vec_size(env, Vhandlers) != OP_COUNT) {
+        env->non_local_exit_clear(env);
+        return NULL;
+    }
+
+    struct elfuse_handlers *handlers = calloc(1, sizeof(*handlers));
+    if (handlers == NULL) {
+        return NULL;
+    }
+
+    emacs_value Qsymbolp = env->intern(env, "symbolp");
+    for (int op = 0; op < OP_COUNT; op++) {
+        emacs_value handler = env->vec_get(env, Vhandlers, op);
+        handlers->ops[op] = env->make_global_ref(env, handler);
+        handlers->symbol[op] = env->is_not_nil(env, handler)
+            && env->is_not_nil(env, env->funcall(env, Qsymbolp, 1, &handler));
+        handlers->defined[op] = env->is_not_nil(env, handler);
+    }
+
+    return handlers;
+}
+
+static void
+handlers_free(emacs_env *env, struct elfuse_handlers *handlers)
+{
+    if (handlers == NULL) {
+        return;
+    }
+    for (int op = 0; op < OP_COUNT; op++) {
+        env->free_global_ref(env, handlers->ops[op]);
+    }
+    free(handlers);
+}
+
+/* Largest number of arguments FUNCTION takes, PTRDIFF_MAX for &rest */
+static ptrdiff_t
+max_arity(emacs_env *env, emacs_value function)
+{
+    emacs_value arity = env->funcall(env, env->intern(env, "func-arity"), 1, &function);
+    if (env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        env->non_local_exit_clear(env);
+        return 0;
+    }
+    emacs_value max = env->funcall(env, Qcdr, 1, &arity);
+    if (!env->eq(env, env->type_of(env, max), env->intern(env, "integer"))) {
+        return PTRDIFF_MAX;
+    }
+    return env->extract_integer(env, max);
+}
+
+/* Make sure the handler table is up to date */
+static void
+resolve_handlers(emacs_env *env, struct elfuse_handlers *handlers)
+{
+    if (handlers->generation == handlers_generation) {
+        return;
+    }
+
+    /* Only named handlers can come and go */
+    for (int op = 0; op < OP_COUNT; op++) {
+        if (handlers->symbol[op]) {
+            handlers->defined[op] = fboundp(env, handlers->ops[op]);
+        }
+    }
+    handlers->paged_readdir = handlers->defined[OP_READDIR]
+        && max_arity(env, handlers->ops[OP_READDIR]) >= 3;
+    handlers->generation = handlers_generation;
+}
+
 static void
 extract_symbol_name(emacs_env *env, emacs_value Qsymbol, char* buffer, ptrdiff_t *size)
 {
@@ -96,340 +318,942 @@ extract_symbol_name(emacs_env *env, emacs_value Qsymbol, char* buffer, ptrdiff_t
     }
 }
 
-static emacs_value
-Felfuse_mount (emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+/* Copy a Lisp string into a fresh malloc'ed buffer */
+static char *
+copy_string(emacs_env *env, emacs_value Sstring)
 {
-    (void)nargs; (void)data;
+    ptrdiff_t buffer_length;
+    if (!env->copy_string_contents(env, Sstring, NULL, &buffer_length)) {
+        return NULL;
+    }
+    char *string = malloc(buffer_length);
+    if (string != NULL && !env->copy_string_contents(env, Sstring, string, &buffer_length)) {
+        free(string);
+        return NULL;
+    }
+    return string;
+}
 
-    if (!elfuse_is_started) {
-        emacs_value Qpath = args[0];
+/* Extract an integer or a float as a double */
+static double
+extract_number(emacs_env *env, emacs_value Nnumber)
+{
+    if (env->eq(env, env->type_of(env, Nnumber), env->intern(env, "integer"))) {
+        return env->extract_integer(env, Nnumber);
+    }
+    return env->extract_float(env, Nnumber);
+}
 
-        ptrdiff_t buffer_length;
-        env->copy_string_contents(env, Qpath, NULL, &buffer_length);
-        char *path = malloc(buffer_length);
-        env->copy_string_contents(env, Qpath, path, &buffer_length);
+static size_t dispatch_queue(emacs_env *env);
+static size_t dispatch_mount(emacs_env *env, struct elfuse_mount *mount);
 
-        sem_init(&request_sem, 0, 0);
-        sem_init(&init_sem, 0, 0);
-        if (pthread_create(&fuse_thread, NULL, elfuse_fuse_loop, path) != 0) {
-            char *msg = "Elfuse: failed to launch a FUSE thread";
-            message(env, msg);
-            fprintf(stderr, "%s\n", msg);
+/* Finalizers get no environment, so the handle going away only marks the
+ * mount and the next dispatch does the rest */
+static void
+finalize_mount(void *ptr)
+{
+    struct elfuse_mount *mount = ptr;
+    if (mount->stopped) {
+        elfuse_mount_free(mount);
+        return;
+    }
 
-            return nil;
-        }
+    mount->orphaned = true;
+    mount->stop_pending = true;
+    elfuse_wakeup();
+}
 
-        /* Wait for initialization */
-        sem_wait(&init_sem);
-        sem_destroy(&init_sem);
+/* The mount behind a handle, NULL if HANDLE is not a mount handle */
+static struct elfuse_mount *
+extract_mount(emacs_env *env, emacs_value handle)
+{
+    if (env->get_user_finalizer(env, handle) != finalize_mount) {
+        env->non_local_exit_clear(env);
+        return NULL;
+    }
+    return env->get_user_ptr(env, handle);
+}
 
-        emacs_value res = nil;
-        char *msg;
-        switch (elfuse_init_code) {
-        case INIT_DONE:
-            elfuse_is_started = true;
-            res = t;
-            break;
-        case INIT_ERR_ARGS:
-            msg = "Elfuse: failed to launch a FUSE thread\n";
-            message(env, msg);
-            fprintf(stderr, "%s", msg);
-            res = nil;
-            break;
-        case INIT_ERR_MOUNT:
-            msg = "Elfuse: failed to mount on %s\n";
-            message(env, msg, path);
-            fprintf(stderr, "Elfuse: failed to mount on %s\n", path);
-            res = nil;
-            break;
-        case INIT_ERR_ALLOC:
-            msg = "Elfuse: failed to launch a FUSE thread";
-            message(env, msg);
-            fprintf(stderr, "%s", msg);
-            res = nil;
-            break;
-        case INIT_ERR_CREATE:
-            msg = "Elfuse: failed to create FUSE instance %d\n";
-            message(env, msg, elfuse_init_code);
-            fprintf(stderr, msg, elfuse_init_code);
-            res = nil;
-            break;
-        default:
-            msg = "Elfuse: failed to launch a FUSE thread";
-            message(env, msg);
-            fprintf(stderr, "%s", msg);
-            res = nil;
+static void
+unlink_mount(struct elfuse_mount *mount)
+{
+    for (struct elfuse_mount **link = &mounts; *link != NULL; link = &(*link)->next) {
+        if (*link == mount) {
+            *link = mount->next;
             break;
         }
-
-        return res;
     }
-    return nil;
+    mount->next = NULL;
 }
 
-static emacs_value
-Felfuse_stop (emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+/* Unmount and wait for the loop to exit. The mount itself stays around
+ * until its handle is gone. */
+static void
+stop_mount(emacs_env *env, struct elfuse_mount *mount)
 {
-    (void)env; (void)nargs; (void)args; (void)data;
-
-    if (!elfuse_is_started) {
-        return nil;
-    }
-
-    elfuse_is_started = false;
+    unlink_mount(mount);
 
-    if (pthread_cancel(fuse_thread) != 0) {
+    if (pthread_cancel(mount->thread) != 0) {
         char* msg = "Elfuse: failed to cancel the FUSE thread\n";
-        fprintf(stderr, "%s", msg);
+        ELFUSE_LOG(ELFUSE_LOG_ERROR, "%s", msg);
         message(env, msg);
-        return nil;
     }
 
-    if (pthread_join(fuse_thread, NULL) != 0) {
+    /* Worker threads waiting for Emacs can't be cancelled, keep serving
+     * them until the loop is gone */
+    while (!atomic_load(&mount->loop_exited)) {
+        dispatch_mount(env, mount);
+        deferred_fail_all(mount);
+        nanosleep(&(struct timespec){ .tv_nsec = 1000000 }, NULL);
+    }
+
+    if (pthread_join(mount->thread, NULL) != 0) {
         char* msg = "Elfuse: failed to join the FUSE thread\n";
-        fprintf(stderr, "%s", msg);
+        ELFUSE_LOG(ELFUSE_LOG_ERROR, "%s", msg);
         message(env, msg);
-        return nil;
     }
-    sem_destroy(&request_sem);
 
-    return t;
+    handlers_free(env, mount->handlers);
+    mount->handlers = NULL;
+    mount->stop_pending = false;
+    mount->stopped = true;
+
+    if (mount->orphaned) {
+        elfuse_mount_free(mount);
+    } else {
+        elfuse_attr_cache_clear(&mount->attr_cache);
+        elfuse_block_cache_clear(&mount->block_cache);
+        elfuse_inode_table_clear(&mount->inode_table);
+    }
+
+    /* No FUSE thread is left to write a wakeup */
+    if (mounts == NULL) {
+        int fd = atomic_exchange(&elfuse_wakeup_fd, -1);
+        if (fd >= 0) {
+            close(fd);
+        }
+        atomic_store(&elfuse_wakeup_method, WAKEUP_SIGNAL);
+    }
 }
 
-static int handle_create(emacs_env *env, const char *path);
-static int handle_rename(emacs_env *env, const char *oldpath, const char *newpath);
-static int handle_readdir(emacs_env *env, const char *path);
-static int handle_getattr(emacs_env *env, const char *path);
-static int handle_open(emacs_env *env, const char *path);
-static int handle_release(emacs_env *env, const char *path);
-static int handle_read(emacs_env *env, const char *path, size_t offset, size_t size);
-static int handle_write(emacs_env *env, const char *path, const char *buf, size_t size, size_t offset);
-static int handle_truncate(emacs_env *env, const char *path, size_t size);
-static int handle_unlink(emacs_env *env, const char *path);
+/* Stop mounts whose handles are gone or that were unmounted by a
+ * handler */
+static void
+reap_mounts(emacs_env *env)
+{
+    /* Handlers draining the queue while waiting for something must not
+     * free mounts the outer dispatch is still going through */
+    if (dispatch_depth > 0) {
+        return;
+    }
 
-static int non_local_op_exit(emacs_env *env, enum emacs_funcall_exit exit_status, emacs_value exit_symbol, emacs_value exit_data);
+    struct elfuse_mount *mount = mounts;
+    while (mount != NULL) {
+        struct elfuse_mount *next = mount->next;
+        if (mount->stop_pending) {
+            stop_mount(env, mount);
+        }
+        mount = next;
+    }
+}
 
 static emacs_value
-Felfuse_check_ops(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+Felfuse_mount (emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
 {
-    (void)env; (void)nargs; (void)args; (void)data;
+    (void)data;
 
-    if (!elfuse_is_started) {
-        message(env, "Elfuse loop is not running, abort.");
+    char *path = copy_string(env, args[0]);
+    if (path == NULL) {
         return nil;
     }
 
-    switch (elfuse_call.request_state) {
-    case WAITING_CREATE:
-        elfuse_call.response_state = handle_create(env, elfuse_call.args.create.path);
-        break;
-    case WAITING_RENAME:
-        elfuse_call.response_state = handle_rename(env, elfuse_call.args.rename.oldpath, elfuse_call.args.rename.newpath);
-        break;
-    case WAITING_READDIR:
-        elfuse_call.response_state = handle_readdir(env, elfuse_call.args.readdir.path);
-        break;
-    case WAITING_GETATTR:
-        elfuse_call.response_state = handle_getattr(env, elfuse_call.args.getattr.path);
-        break;
-    case WAITING_OPEN:
-        elfuse_call.response_state = handle_open(env, elfuse_call.args.open.path);
-        break;
-    case WAITING_RELEASE:
-        elfuse_call.response_state = handle_release(env, elfuse_call.args.open.path);
-        break;
-    case WAITING_READ:
-        elfuse_call.response_state = handle_read(
-            env, elfuse_call.args.read.path, elfuse_call.args.read.offset, elfuse_call.args.read.size
-        );
+    int threads = 1;
+    if (nargs > 2 && env->is_not_nil(env, args[2])) {
+        threads = env->extract_integer(env, args[2]);
+        if (threads < 1) {
+            threads = 1;
+        }
+    }
+
+    char *options = NULL;
+    if (nargs > 3 && env->is_not_nil(env, args[3])) {
+        options = copy_string(env, args[3]);
+    }
+
+    bool lowlevel = nargs > 4 && env->is_not_nil(env, args[4]);
+    bool inode_args = lowlevel && nargs > 5 && env->is_not_nil(env, args[5]);
+
+    struct elfuse_mount *mount = elfuse_mount_new(path, options, threads, lowlevel);
+    if (mount == NULL) {
+        free(path);
+        free(options);
+        return nil;
+    }
+    mount->inode_args = inode_args;
+    elfuse_attr_cache_set_default_ttl(&mount->attr_cache, attr_cache_ttl);
+    elfuse_attr_cache_set_negative_ttl(&mount->attr_cache, negative_cache_ttl);
+    elfuse_block_cache_set_budget(&mount->block_cache, block_cache_budget);
+
+    mount->handlers = handlers_new(env, args[1]);
+    if (mount->handlers == NULL) {
+        message(env, "Elfuse: invalid handlers");
+        elfuse_mount_free(mount);
+        return nil;
+    }
+    resolve_handlers(env, mount->handlers);
+
+    if (pthread_create(&mount->thread, NULL, elfuse_fuse_loop, mount) != 0) {
+        char *msg = "Elfuse: failed to launch a FUSE thread";
+        message(env, msg);
+        ELFUSE_LOG(ELFUSE_LOG_ERROR, "%s\n", msg);
+        handlers_free(env, mount->handlers);
+        elfuse_mount_free(mount);
+
+        return nil;
+    }
+
+    /* Wait for initialization */
+    sem_wait(&mount->init_sem);
+
+    char *msg;
+    switch (mount->init_code) {
+    case INIT_DONE:
+        mount->next = mounts;
+        mounts = mount;
+        return env->make_user_ptr(env, finalize_mount, mount);
+    case INIT_ERR_ARGS:
+        msg = "Elfuse: failed to launch a FUSE thread\n";
+        message(env, msg);
+        ELFUSE_LOG(ELFUSE_LOG_ERROR, "%s", msg);
         break;
-    case WAITING_WRITE:
-        elfuse_call.response_state = handle_write(
-            env, elfuse_call.args.write.path, elfuse_call.args.write.buf, elfuse_call.args.write.size, elfuse_call.args.write.offset
-        );
+    case INIT_ERR_MOUNT:
+        msg = "Elfuse: failed to mount on %s\n";
+        message(env, msg, mount->mountpath);
+        ELFUSE_LOG(ELFUSE_LOG_ERROR, msg, mount->mountpath);
         break;
-    case WAITING_TRUNCATE:
-        elfuse_call.response_state = handle_truncate(env, elfuse_call.args.truncate.path, elfuse_call.args.truncate.size);
+    case INIT_ERR_ALLOC:
+        msg = "Elfuse: failed to launch a FUSE thread";
+        message(env, msg);
+        ELFUSE_LOG(ELFUSE_LOG_ERROR, "%s", msg);
         break;
-    case WAITING_UNLINK:
-        elfuse_call.response_state = handle_unlink(env, elfuse_call.args.unlink.path);
+    case INIT_ERR_CREATE:
+        msg = "Elfuse: failed to create FUSE instance %d\n";
+        message(env, msg, mount->init_code);
+        ELFUSE_LOG(ELFUSE_LOG_ERROR, msg, mount->init_code);
         break;
-    case WAITING_NONE:
+    default:
+        msg = "Elfuse: failed to launch a FUSE thread";
+        message(env, msg);
+        ELFUSE_LOG(ELFUSE_LOG_ERROR, "%s", msg);
         break;
     }
 
-    sem_post(&request_sem);
+    /* The loop thread has exited already */
+    pthread_join(mount->thread, NULL);
+    handlers_free(env, mount->handlers);
+    elfuse_mount_free(mount);
 
-    return t;
+    return nil;
 }
 
-static int
-handle_create(emacs_env *env, const char *path)
+static emacs_value
+Felfuse_unmount (emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
 {
-    fprintf(stderr, "CREATE handle (path=%s).\n", path);
+    (void)nargs; (void)data;
 
-    emacs_value Qcreate = env->intern(env, "elfuse--create-op");
-    if (!fboundp(env, Qcreate)) {
-        return RESPONSE_UNDEFINED;
+    struct elfuse_mount *mount = extract_mount(env, args[0]);
+    if (mount == NULL || mount->stopped || mount->stop_pending) {
+        return nil;
     }
 
-    /* Build args and execute the function call itself */
-    emacs_value args[] = {
-        env->make_string(env, path, strlen(path)),
-    };
-    emacs_value Ires_code = env->funcall(env, Qcreate, sizeof(args)/sizeof(args[0]), args);
-
-    /* Handle possible non-local exits (signals or throws) */
-    emacs_value exit_symbol, exit_data;
-    enum emacs_funcall_exit exit_status = env->non_local_exit_get(
-        env, &exit_symbol, &exit_data
-    );
-    if (exit_status != emacs_funcall_exit_return) {
-        env->non_local_exit_clear(env);
-        return non_local_op_exit(env, exit_status, exit_symbol, exit_data);
+    /* Requests of this very mount might be waiting for the handler that
+     * is unmounting, stop once they are done */
+    if (dispatch_depth > 0) {
+        mount->stop_pending = true;
+        elfuse_wakeup();
+        return t;
     }
 
-    /* Handle proper response */
-    int res_code = env->extract_integer(env, Ires_code);
-    elfuse_call.results.create.code = res_code >= 0 ? CREATE_DONE : CREATE_FAIL;
+    stop_mount(env, mount);
 
-    return RESPONSE_SUCCESS;
+    return t;
 }
 
-static int
-handle_rename(emacs_env *env, const char *oldpath, const char *newpath)
+static emacs_value
+Felfuse_unmount_all (emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
 {
-    fprintf(stderr, "RENAME handle (oldpath=%s, newpath=%s).\n", oldpath, newpath);
+    (void)nargs; (void)args; (void)data;
 
-    emacs_value Qrename = env->intern(env, "elfuse--rename-op");
-    if (!fboundp(env, Qrename)) {
-        return RESPONSE_UNDEFINED;
+    if (dispatch_depth > 0) {
+        for (struct elfuse_mount *mount = mounts; mount != NULL; mount = mount->next) {
+            mount->stop_pending = true;
+        }
+        elfuse_wakeup();
+        return t;
     }
 
-    /* Build args and execute the function call itself */
-    emacs_value args[] = {
-        env->make_string(env, oldpath, strlen(oldpath)),
-        env->make_string(env, newpath, strlen(newpath)),
-    };
-    emacs_value Ires_code = env->funcall(env, Qrename, sizeof(args)/sizeof(args[0]), args);
+    while (mounts != NULL) {
+        stop_mount(env, mounts);
+    }
 
-    /* Handle possible non-local exits (signals or throws) */
-    emacs_value exit_symbol, exit_data;
-    enum emacs_funcall_exit exit_status = env->non_local_exit_get(
-        env, &exit_symbol, &exit_data
-    );
-    if (exit_status != emacs_funcall_exit_return) {
-        env->non_local_exit_clear(env);
-        return non_local_op_exit(env, exit_status, exit_symbol, exit_data);
+    return t;
+}
+
+static emacs_value
+Felfuse_mount_count (emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)nargs; (void)args; (void)data;
+
+    /* Mounts about to stop still need wakeups */
+    intmax_t count = 0;
+    for (struct elfuse_mount *mount = mounts; mount != NULL; mount = mount->next) {
+        count++;
     }
 
-    /* Handle proper response */
+    return env->make_integer(env, count);
+}
+
+static int handle_create(emacs_env *env, const struct elfuse_handlers *handlers, struct elfuse_call_state *call, const char *path);
+static int handle_rename(emacs_env *env, const struct elfuse_handlers *handlers, struct elfuse_call_state *call, const char *oldpath, const char *newpath);
+static int handle_readdir(emacs_env *env, const struct elfuse_handlers *handlers, struct elfuse_call_state *call, const char *path);
+static int handle_getattr(emacs_env *env, const struct elfuse_handlers *handlers, struct elfuse_call_state *call, const char *path);
+static int handle_open(emacs_env *env, const struct elfuse_handlers *handlers, struct elfuse_call_state *call, const char *path);
+static int handle_release(emacs_env *env, const struct elfuse_handlers *handlers, struct elfuse_call_state *call, const char *path);
+static int handle_read(emacs_env *env, const struct elfuse_handlers *handlers, struct elfuse_call_state *call, const char *path, size_t offset, size_t size);
+static int handle_write(emacs_env *env, const struct elfuse_handlers *handlers, struct elfuse_call_state *call, const char *path, const char *buf, size_t size, size_t offset);
+static int handle_truncate(emacs_env *env, const struct elfuse_handlers *handlers, struct elfuse_call_state *call, const char *path, size_t size);
+static int handle_unlink(emacs_env *env, const struct elfuse_handlers *handlers, struct elfuse_call_state *call, const char *path);
+
+static int non_local_op_exit(emacs_env *env, enum emacs_funcall_exit exit_status, emacs_value exit_symbol, emacs_value exit_data);
+
+/* Handler results are turned into replies the same way whether the
+ * handler returns them or passes them to elfuse-reply later */
+static int
+reply_create(emacs_env *env, struct elfuse_call_state *call, emacs_value Ires_code)
+{
     int res_code = env->extract_integer(env, Ires_code);
-    elfuse_call.results.rename.code = res_code >= 0 ? RENAME_DONE : RENAME_UNKNOWN;
+    call->results.create.code = res_code >= 0 ? CREATE_DONE : CREATE_FAIL;
 
     return RESPONSE_SUCCESS;
 }
 
 static int
-handle_readdir(emacs_env *env, const char *path)
+reply_rename(emacs_env *env, struct elfuse_call_state *call, emacs_value Ires_code)
 {
-    fprintf(stderr, "READDIR handle (path=%s).\n", path);
+    int res_code = env->extract_integer(env, Ires_code);
+    call->results.rename.code = res_code >= 0 ? RENAME_DONE : RENAME_UNKNOWN;
 
-    emacs_value Qreaddir = env->intern(env, "elfuse--readdir-op");
-    if (!fboundp(env, Qreaddir)) {
-        return RESPONSE_UNDEFINED;
+    return RESPONSE_SUCCESS;
+}
+
+/* Attributes of a [TYPE SIZE GENERATION] vector starting at INDEX */
+static void
+extract_attr(emacs_env *env, emacs_value vector, ptrdiff_t index, struct elfuse_results_getattr *attr)
+{
+    ptrdiff_t size = env->vec_size(env, vector);
+    emacs_value Qfiletype = env->vec_get(env, vector, index);
+
+    if (env->eq(env, Qfiletype, Qfile)) {
+        attr->code = GETATTR_FILE;
+        attr->file_size = env->extract_integer(env, env->vec_get(env, vector, index + 1));
+    } else if (env->eq(env, Qfiletype, Qdir)) {
+        attr->code = GETATTR_DIR;
+    } else {
+        attr->code = GETATTR_UNKNOWN;
     }
 
-    /* Build args and execute the function call itself */
-    emacs_value args[] = {
-        env->make_string(env, path, strlen(path))
-    };
-    emacs_value file_vector = env->funcall(env, Qreaddir, sizeof(args)/sizeof(args[0]), args);
+    /* An optional third element is the content generation */
+    attr->has_generation = false;
+    if (size > index + 2) {
+        emacs_value Igeneration = env->vec_get(env, vector, index + 2);
+        if (env->is_not_nil(env, Igeneration)) {
+            attr->has_generation = true;
+            attr->generation = env->extract_integer(env, Igeneration);
+        }
+    }
+}
 
-    /* Handle possible non-local exits (signals or throws) */
-    emacs_value exit_symbol, exit_data;
-    enum emacs_funcall_exit exit_status = env->non_local_exit_get(
-        env, &exit_symbol, &exit_data
-    );
-    if (exit_status != emacs_funcall_exit_return) {
-        env->non_local_exit_clear(env);
-        return non_local_op_exit(env, exit_status, exit_symbol, exit_data);
+/* Name of a readdir entry, either a name or a [NAME TYPE SIZE GENERATION]
+ * vector */
+static emacs_value
+readdir_entry_name(emacs_env *env, emacs_value entry)
+{
+    if (env->eq(env, env->type_of(env, entry), Qvector)) {
+        return env->vec_get(env, entry, 0);
     }
+    return entry;
+}
 
-    /* Handle proper response */
-    elfuse_call.results.readdir.files_size = env->vec_size(env, file_vector);
-    size_t arr_bytes_length = elfuse_call.results.readdir.files_size*sizeof(elfuse_call.results.readdir.files[0]);
-    elfuse_call.results.readdir.files = malloc(arr_bytes_length);
+/* Paged handlers return (ENTRIES . NEXT-OFFSET), others just ENTRIES. The
+ * attributes save the kernel a getattr per entry. */
+static int
+reply_readdir(emacs_env *env, struct elfuse_call_state *call, emacs_value result)
+{
+    struct elfuse_results_readdir *results = &call->results.readdir;
+    results->has_next = false;
+    results->attrs = NULL;
+
+    emacs_value file_vector = result;
+    if (env->eq(env, env->type_of(env, result), Qcons)) {
+        file_vector = env->funcall(env, Qcar, 1, &result);
+        emacs_value Inext = env->funcall(env, Qcdr, 1, &result);
+        if (env->is_not_nil(env, Inext)) {
+            results->has_next = true;
+            results->next_offset = env->extract_integer(env, Inext);
+        }
+    }
 
-    for (size_t i = 0; i < elfuse_call.results.readdir.files_size; i++) {
-        emacs_value Spath = env->vec_get(env, file_vector, i);
+    /* Names are copied right after the array of pointers to them, so
+     * the whole listing is a single allocation */
+    results->files_size = env->vec_size(env, file_vector);
+    size_t names_size = 0;
+    for (size_t i = 0; i < results->files_size; i++) {
         ptrdiff_t buffer_length;
-        env->copy_string_contents(env, Spath, NULL, &buffer_length);
-        char *dirpath = malloc(buffer_length);
-        env->copy_string_contents(env, Spath, dirpath, &buffer_length);
-        elfuse_call.results.readdir.files[i] = dirpath;
+        emacs_value Sname = readdir_entry_name(env, env->vec_get(env, file_vector, i));
+        if (!env->copy_string_contents(env, Sname, NULL, &buffer_length)) {
+            env->non_local_exit_clear(env);
+            return RESPONSE_UNKNOWN_ERROR;
+        }
+        names_size += buffer_length;
+    }
+    results->files = malloc(results->files_size * sizeof(results->files[0]) + names_size);
+    if (results->files == NULL) {
+        return RESPONSE_UNKNOWN_ERROR;
+    }
+    char *names = (char *) (results->files + results->files_size);
+
+    for (size_t i = 0; i < results->files_size; i++) {
+        emacs_value entry = env->vec_get(env, file_vector, i);
+        ptrdiff_t buffer_length = names_size;
+        env->copy_string_contents(env, readdir_entry_name(env, entry), names, &buffer_length);
+        results->files[i] = names;
+        names += buffer_length;
+        names_size -= buffer_length;
+
+        if (!env->eq(env, env->type_of(env, entry), Qvector) || env->vec_size(env, entry) < 2) {
+            continue;
+        }
+        if (results->attrs == NULL) {
+            results->attrs = malloc(results->files_size * sizeof(results->attrs[0]));
+            for (size_t j = 0; results->attrs != NULL && j < results->files_size; j++) {
+                results->attrs[j].code = GETATTR_UNKNOWN;
+            }
+        }
+        if (results->attrs != NULL) {
+            extract_attr(env, entry, 1, &results->attrs[i]);
+        }
     }
 
     return RESPONSE_SUCCESS;
 }
 
 static int
-handle_getattr(emacs_env *env, const char *path)
+reply_getattr(emacs_env *env, struct elfuse_call_state *call, emacs_value getattr_result_vector)
 {
-    fprintf(stderr, "GETATTR handle (path=%s).\n", path);
-
-    emacs_value Qgetattr = env->intern(env, "elfuse--getattr-op");
-    if (!fboundp(env, Qgetattr)) {
-        return RESPONSE_UNDEFINED;
-    }
+    extract_attr(env, getattr_result_vector, 0, &call->results.getattr);
 
-    /* Build args and execute the function call itself */
-    emacs_value args[] = {
-        env->make_string(env, path, strlen(path))
-    };
-    emacs_value getattr_result_vector = env->funcall(env, Qgetattr, sizeof(args)/sizeof(args[0]), args);
+    return RESPONSE_SUCCESS;
+}
 
-    /* Handle possible non-local exits (signals or throws) */
-    emacs_value exit_symbol, exit_data;
-    enum emacs_funcall_exit exit_status = env->non_local_exit_get(
-        env, &exit_symbol, &exit_data
-    );
-    if (exit_status != emacs_funcall_exit_return) {
+/* The file of a (:backing PATH) open result as a fresh malloc'ed string,
+ * NULL for anything else */
+static char *
+backing_path(emacs_env *env, emacs_value Lresult)
+{
+    if (!env->eq(env, env->type_of(env, Lresult), Qcons)) {
+        return NULL;
+    }
+    emacs_value Qkey = env->funcall(env, Qcar, 1, &Lresult);
+    if (!env->eq(env, Qkey, Qbacking)) {
+        return NULL;
+    }
+    emacs_value Lrest = env->funcall(env, Qcdr, 1, &Lresult);
+    emacs_value Spath = env->funcall(env, Qcar, 1, &Lrest);
+    char *path = copy_string(env, Spath);
+    if (path == NULL) {
         env->non_local_exit_clear(env);
-        return non_local_op_exit(env, exit_status, exit_symbol, exit_data);
     }
+    return path;
+}
 
-    /* Handle proper response */
-    emacs_value Qfiletype = env->vec_get(env, getattr_result_vector, 0);
-    emacs_value file_size = env->vec_get(env, getattr_result_vector, 1);
-
-    if (env->eq(env, Qfiletype, env->intern(env, "file"))) {
-        elfuse_call.results.getattr.code = GETATTR_FILE;
-        elfuse_call.results.getattr.file_size = env->extract_integer(env, file_size);
-    } else if (env->eq(env, Qfiletype, env->intern(env, "dir"))) {
-        elfuse_call.results.getattr.code = GETATTR_DIR;
+static int
+reply_open(emacs_env *env, struct elfuse_call_state *call, emacs_value Qfound)
+{
+    call->results.open.backing = NULL;
+    if (env->eq(env, Qfound, t)) {
+        call->results.open.code = OPEN_FOUND;
+    } else if ((call->results.open.backing = backing_path(env, Qfound)) != NULL) {
+        call->results.open.code = OPEN_FOUND;
     } else {
-        elfuse_call.results.getattr.code = GETATTR_UNKNOWN;
+        call->results.open.code = OPEN_UNKNOWN;
     }
 
     return RESPONSE_SUCCESS;
 }
 
 static int
-handle_open(emacs_env *env, const char *path)
+reply_release(emacs_env *env, struct elfuse_call_state *call, emacs_value Qfound)
 {
-    fprintf(stderr, "OPEN handle (path=%s).\n", path);
+    if (env->eq(env, Qfound, t)) {
+        call->results.release.code = RELEASE_FOUND;
+    } else {
+        call->results.release.code = RELEASE_UNKNOWN;
+    }
+
+    return RESPONSE_SUCCESS;
+}
+
+static int
+reply_read(emacs_env *env, struct elfuse_call_state *call, emacs_value Sdata)
+{
+    size_t size = call->args.read.size;
+
+    /* Unibyte strings come out byte for byte, the terminating NUL is not
+     * part of the data. */
+    if (env->eq(env, Sdata, nil)) {
+        call->results.read.bytes_read = -1;
+        return RESPONSE_SUCCESS;
+    }
+
+    ptrdiff_t buffer_length = size + 1;
+    if (env->copy_string_contents(env, Sdata, call->args.read.buf, &buffer_length)) {
+        call->results.read.bytes_read = buffer_length - 1;
+        return RESPONSE_SUCCESS;
+    }
+    if (env->non_local_exit_check(env) != emacs_funcall_exit_signal || (size_t) buffer_length <= size + 1) {
+        env->non_local_exit_clear(env);
+        call->results.read.bytes_read = -1;
+        return RESPONSE_SUCCESS;
+    }
+
+    /* More than asked for, keep the first SIZE bytes */
+    env->non_local_exit_clear(env);
+    char *data = malloc(buffer_length);
+    if (data == NULL || !env->copy_string_contents(env, Sdata, data, &buffer_length)) {
+        env->non_local_exit_clear(env);
+        free(data);
+        call->results.read.bytes_read = -1;
+        return RESPONSE_SUCCESS;
+    }
+    memcpy(call->args.read.buf, data, size);
+    free(data);
+    call->results.read.bytes_read = size;
+
+    return RESPONSE_SUCCESS;
+}
+
+static int
+reply_write(emacs_env *env, struct elfuse_call_state *call, emacs_value Ires_code)
+{
+    size_t size = call->args.write.size;
+
+    int res_code = env->extract_integer(env, Ires_code);
+    if (res_code >= 0) {
+        call->results.write.size  = size;
+    } else {
+        call->results.write.size  = res_code;
+    }
+
+    return RESPONSE_SUCCESS;
+}
+
+static int
+reply_truncate(emacs_env *env, struct elfuse_call_state *call, emacs_value Ires_code)
+{
+    if (env->extract_integer(env, Ires_code) >= 0) {
+        call->results.truncate.code  = TRUNCATE_DONE;
+    } else {
+        call->results.truncate.code  = TRUNCATE_UNKNOWN;
+    }
+
+    return RESPONSE_SUCCESS;
+}
+
+static int
+reply_unlink(emacs_env *env, struct elfuse_call_state *call, emacs_value Ires_code)
+{
+    if (env->extract_integer(env, Ires_code) >= 0) {
+        call->results.unlink.code  = UNLINK_DONE;
+    } else {
+        call->results.unlink.code  = UNLINK_UNKNOWN;
+    }
+
+    return RESPONSE_SUCCESS;
+}
+
+/* Handlers of low-level mounts find the inode of the request in
+ * `elfuse-inode', nil otherwise */
+static void
+set_current_ino(emacs_env *env, uint64_t ino)
+{
+    emacs_value value = ino != 0 ? env->make_integer(env, ino) : nil;
+    env->funcall(env, Qset, 2, (emacs_value[]){Qelfuse_inode, value});
+    current_ino = ino;
+}
+
+/* Handle a single queued request and let the waiting FUSE thread go,
+ * unless the handler is going to reply later. */
+static void
+dispatch_call(emacs_env *env, struct elfuse_mount *mount, struct elfuse_call_state *call)
+{
+    const struct elfuse_handlers *handlers = mount->handlers;
+
+    /* Handlers might end up handling other requests, e.g. while waiting
+     * for process output */
+    struct elfuse_mount *outer_mount = current_mount;
+    struct elfuse_call_state *outer_call = current_call;
+    struct elfuse_deferred *outer_deferred = current_deferred;
+    emacs_value outer_token = current_token;
+    int outer_err_code = current_err_code;
+    uint64_t outer_ino = current_ino;
+    current_mount = mount;
+    current_call = call;
+    current_deferred = NULL;
+    current_err_code = 0;
+    call->taken_ns = elfuse_now_ns();
+    elfuse_call_taken(mount, call);
+    if (call->ino != current_ino) {
+        set_current_ino(env, call->ino);
+    }
+
+    int response_state = RESPONSE_UNKNOWN_ERROR;
+    switch (call->request_state) {
+    case WAITING_CREATE:
+        response_state = handle_create(env, handlers, call, call->args.create.path);
+        break;
+    case WAITING_RENAME:
+        response_state = handle_rename(env, handlers, call, call->args.rename.oldpath, call->args.rename.newpath);
+        break;
+    case WAITING_READDIR:
+        response_state = handle_readdir(env, handlers, call, call->args.readdir.path);
+        break;
+    case WAITING_GETATTR:
+        response_state = handle_getattr(env, handlers, call, call->args.getattr.path);
+        break;
+    case WAITING_OPEN:
+        response_state = handle_open(env, handlers, call, call->args.open.path);
+        break;
+    case WAITING_RELEASE:
+        response_state = handle_release(env, handlers, call, call->args.release.path);
+        break;
+    case WAITING_READ:
+        response_state = handle_read(
+            env, handlers, call, call->args.read.path, call->args.read.offset, call->args.read.size
+        );
+        break;
+    case WAITING_WRITE:
+        response_state = handle_write(
+            env, handlers, call, call->args.write.path, call->args.write.buf, call->args.write.size, call->args.write.offset
+        );
+        break;
+    case WAITING_TRUNCATE:
+        response_state = handle_truncate(env, handlers, call, call->args.truncate.path, call->args.truncate.size);
+        break;
+    case WAITING_UNLINK:
+        response_state = handle_unlink(env, handlers, call, call->args.unlink.path);
+        break;
+    case WAITING_NONE:
+        break;
+    }
+
+    struct elfuse_deferred *deferred = current_deferred;
+    int err_code = current_err_code;
+    if (deferred != NULL) {
+        env->free_global_ref(env, current_token);
+    }
+    current_mount = outer_mount;
+    current_call = outer_call;
+    current_deferred = outer_deferred;
+    current_token = outer_token;
+    current_err_code = outer_err_code;
+    if (current_ino != outer_ino) {
+        set_current_ino(env, outer_ino);
+    }
+
+    /* The request might be gone already if the handler replied itself */
+    if (response_state == RESPONSE_DEFERRED) {
+        return;
+    }
+
+    /* The handler deferred the reply but failed afterwards */
+    if (deferred != NULL) {
+        if (deferred->call != NULL) {
+            deferred_finish(deferred, response_state, err_code);
+        }
+        return;
+    }
+
+    call->response_state = response_state;
+    call->response_err_code = err_code;
+    ELFUSE_PROBE4(reply, call, call->request_state, response_state, elfuse_call_errno(call));
+    sem_post(&call->response_sem);
+}
+
+/* Wakeup and batch counters */
+static struct {
+    size_t wakeups;
+    size_t empty_wakeups;
+    size_t requests;
+    size_t max_batch;
+} batch_stats;
+
+/* Handle everything queued for MOUNT, returns the number of requests
+ * handled. */
+static size_t
+dispatch_mount(emacs_env *env, struct elfuse_mount *mount)
+{
+    size_t handled = 0;
+
+    resolve_handlers(env, mount->handlers);
+
+    dispatch_depth++;
+    struct elfuse_call_state *call;
+    while ((call = elfuse_queue_take(mount)) != NULL) {
+        while (call != NULL) {
+            /* The request is gone as soon as the FUSE thread is released */
+            struct elfuse_call_state *next = call->next;
+            dispatch_call(env, mount, call);
+            call = next;
+            handled++;
+        }
+    }
+    dispatch_depth--;
+
+    return handled;
+}
+
+/* Handle everything queued for all mounts, including requests arriving
+ * while draining, returns the number of requests handled. */
+static size_t
+dispatch_queue(emacs_env *env)
+{
+    size_t handled = 0;
+
+    reap_mounts(env);
+
+    elfuse_queue_drain_begin();
+    do {
+        for (struct elfuse_mount *mount = mounts; mount != NULL; mount = mount->next) {
+            handled += dispatch_mount(env, mount);
+        }
+    } while (!elfuse_queue_drain_end(mounts, handled));
+
+    /* Handlers might have unmounted something */
+    reap_mounts(env);
+
+    batch_stats.wakeups++;
+    if (handled == 0) {
+        batch_stats.empty_wakeups++;
+    }
+    batch_stats.requests += handled;
+    if (handled > batch_stats.max_batch) {
+        batch_stats.max_batch = handled;
+    }
+
+    return handled;
+}
+
+static emacs_value
+Felfuse_check_ops(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)nargs; (void)args; (void)data;
+
+    if (mounts == NULL) {
+        return nil;
+    }
+
+    ELFUSE_PROBE0(dispatch_begin);
+    size_t handled = dispatch_queue(env);
+    ELFUSE_PROBE1(dispatch_end, handled);
+
+    return t;
+}
+
+static emacs_value
+Felfuse_defer(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)nargs; (void)args; (void)data;
+
+    if (current_call == NULL) {
+        message(env, "Elfuse: no request to defer");
+        return nil;
+    }
+    if (current_deferred != NULL) {
+        return current_token;
+    }
+
+    struct elfuse_deferred *deferred = calloc(1, sizeof(*deferred));
+    if (deferred == NULL) {
+        return nil;
+    }
+    emacs_value token = env->make_user_ptr(env, finalize_deferred, deferred);
+    if (env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        free(deferred);
+        return nil;
+    }
+
+    deferred->call = current_call;
+    deferred->mount = current_mount;
+    deferred->next = current_mount->deferred;
+    if (deferred->next != NULL) {
+        deferred->next->prev = deferred;
+    }
+    current_mount->deferred = deferred;
+    current_mount->deferred_size++;
+    current_deferred = deferred;
+    current_token = env->make_global_ref(env, token);
+
+    /* The FUSE thread waits for the reply, don't let the mount run out of
+     * threads */
+    elfuse_workers_park(current_mount);
+
+    return token;
+}
+
+/* The request behind a token, NULL if it was replied to already */
+static struct elfuse_deferred *
+extract_deferred(emacs_env *env, emacs_value token)
+{
+    if (env->get_user_finalizer(env, token) != finalize_deferred) {
+        env->non_local_exit_clear(env);
+        return NULL;
+    }
+    struct elfuse_deferred *deferred = env->get_user_ptr(env, token);
+    return deferred->call != NULL ? deferred : NULL;
+}
+
+static int
+reply_value(emacs_env *env, struct elfuse_call_state *call, emacs_value value)
+{
+    switch (call->request_state) {
+    case WAITING_CREATE:
+        return reply_create(env, call, value);
+    case WAITING_RENAME:
+        return reply_rename(env, call, value);
+    case WAITING_READDIR:
+        return reply_readdir(env, call, value);
+    case WAITING_GETATTR:
+        return reply_getattr(env, call, value);
+    case WAITING_OPEN:
+        return reply_open(env, call, value);
+    case WAITING_RELEASE:
+        return reply_release(env, call, value);
+    case WAITING_READ:
+        return reply_read(env, call, value);
+    case WAITING_WRITE:
+        return reply_write(env, call, value);
+    case WAITING_TRUNCATE:
+        return reply_truncate(env, call, value);
+    case WAITING_UNLINK:
+        return reply_unlink(env, call, value);
+    case WAITING_NONE:
+        break;
+    }
+    return RESPONSE_UNKNOWN_ERROR;
+}
+
+static emacs_value
+Felfuse_reply(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)nargs; (void)data;
+
+    struct elfuse_deferred *deferred = extract_deferred(env, args[0]);
+    if (deferred == NULL) {
+        return nil;
+    }
+    deferred->call->handled_ns = elfuse_now_ns();
+
+    /* A bad value still ends the request, the signal goes to the caller */
+    int response_state = reply_value(env, deferred->call, args[1]);
+    if (env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        response_state = RESPONSE_UNKNOWN_ERROR;
+    }
+    deferred_finish(deferred, response_state, 0);
+
+    return t;
+}
+
+static emacs_value
+Felfuse_reply_error(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)nargs; (void)data;
+
+    struct elfuse_deferred *deferred = extract_deferred(env, args[0]);
+    if (deferred == NULL) {
+        return nil;
+    }
+    deferred->call->handled_ns = elfuse_now_ns();
+
+    intmax_t err_code = env->extract_integer(env, args[1]);
+    if (env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        err_code = EIO;
+    }
+    deferred_finish(deferred, RESPONSE_SIGNAL_ERROR, err_code);
+
+    return t;
+}
+
+/* The Lisp value of PATH for handlers. Keys of the low-level backend are
+ * turned into the inode, or (PARENT . NAME) for names without one, for
+ * mounts with inode arguments and into paths otherwise. */
+static emacs_value
+path_arg(emacs_env *env, const char *path)
+{
+    uint64_t ino;
+    const char *name;
+    if (!elfuse_key_parse(path, &ino, &name)) {
+        return env->make_string(env, path, strlen(path));
+    }
+
+    if (current_mount->inode_args) {
+        emacs_value Iino = env->make_integer(env, ino);
+        if (name == NULL) {
+            return Iino;
+        }
+        emacs_value pair[] = { Iino, env->make_string(env, name, strlen(name)) };
+        return env->funcall(env, Qcons, 2, pair);
+    }
+
+    /* The kernel holds on to the nodes of its requests, only a bug leaves
+     * a handler without a path */
+    char *key_path = elfuse_key_path(current_mount, path);
+    emacs_value Spath = key_path != NULL ? env->make_string(env, key_path, strlen(key_path)) : nil;
+    free(key_path);
+    return Spath;
+}
+
+/* Run the OP handler of CALL, noting when it returned unless the handler
+ * deferred the reply, which might have been sent already */
+static emacs_value
+call_handler(emacs_env *env, const struct elfuse_handlers *handlers, struct elfuse_call_state *call,
+             enum elfuse_op op, ptrdiff_t nargs, emacs_value args[])
+{
+    enum elfuse_request_state state = call->request_state;
+    ELFUSE_PROBE3(handler_enter, call, state, elfuse_call_path(call));
+    emacs_value result = env->funcall(env, handlers->ops[op], nargs, args);
+    if (current_deferred == NULL) {
+        call->handled_ns = elfuse_now_ns();
+        ELFUSE_PROBE3(handler_return, call, state, elfuse_call_path(call));
+    } else {
+        ELFUSE_PROBE3(handler_return, call, state, NULL);
+    }
+    return result;
+}
+
+static int
+handle_create(emacs_env *env, const struct elfuse_handlers *handlers, struct elfuse_call_state *call, const char *path)
+{
+    ELFUSE_LOG(ELFUSE_LOG_DEBUG, "CREATE handle (path=%s).\n", path);
 
-    emacs_value Qopen = env->intern(env, "elfuse--open-op");
-    if (!fboundp(env, Qopen)) {
+    if (!handlers->defined[OP_CREATE]) {
         return RESPONSE_UNDEFINED;
     }
 
     /* Build args and execute the function call itself */
     emacs_value args[] = {
-        env->make_string(env, path, strlen(path))
+        path_arg(env, path),
     };
-    emacs_value Qfound = env->funcall(env, Qopen, sizeof(args)/sizeof(args[0]), args);
+    emacs_value Ires_code = call_handler(env, handlers, call, OP_CREATE, sizeof(args)/sizeof(args[0]), args);
 
     /* Handle possible non-local exits (signals or throws) */
     emacs_value exit_symbol, exit_data;
@@ -441,31 +1265,29 @@ handle_open(emacs_env *env, const char *path)
         return non_local_op_exit(env, exit_status, exit_symbol, exit_data);
     }
 
-    /* Handle proper response */
-    if (env->eq(env, Qfound, t)) {
-        elfuse_call.results.open.code = OPEN_FOUND;
-    } else {
-        elfuse_call.results.open.code = OPEN_UNKNOWN;
+    /* The handler will reply with elfuse-reply */
+    if (current_deferred != NULL) {
+        return RESPONSE_DEFERRED;
     }
 
-    return RESPONSE_SUCCESS;
+    return reply_create(env, call, Ires_code);
 }
 
 static int
-handle_release(emacs_env *env, const char *path)
+handle_rename(emacs_env *env, const struct elfuse_handlers *handlers, struct elfuse_call_state *call, const char *oldpath, const char *newpath)
 {
-    fprintf(stderr, "RELEASE handle (path=%s).\n", path);
+    ELFUSE_LOG(ELFUSE_LOG_DEBUG, "RENAME handle (oldpath=%s, newpath=%s).\n", oldpath, newpath);
 
-    emacs_value Qrelease = env->intern(env, "elfuse--release-op");
-    if (!fboundp(env, Qrelease)) {
+    if (!handlers->defined[OP_RENAME]) {
         return RESPONSE_UNDEFINED;
     }
 
     /* Build args and execute the function call itself */
     emacs_value args[] = {
-        env->make_string(env, path, strlen(path))
+        path_arg(env, oldpath),
+        path_arg(env, newpath),
     };
-    emacs_value Qfound = env->funcall(env, Qrelease, sizeof(args)/sizeof(args[0]), args);
+    emacs_value Ires_code = call_handler(env, handlers, call, OP_RENAME, sizeof(args)/sizeof(args[0]), args);
 
     /* Handle possible non-local exits (signals or throws) */
     emacs_value exit_symbol, exit_data;
@@ -477,33 +1299,32 @@ handle_release(emacs_env *env, const char *path)
         return non_local_op_exit(env, exit_status, exit_symbol, exit_data);
     }
 
-    /* Handle proper response */
-    if (env->eq(env, Qfound, t)) {
-        elfuse_call.results.release.code = RELEASE_FOUND;
-    } else {
-        elfuse_call.results.release.code = RELEASE_UNKNOWN;
+    /* The handler will reply with elfuse-reply */
+    if (current_deferred != NULL) {
+        return RESPONSE_DEFERRED;
     }
 
-    return RESPONSE_SUCCESS;
+    return reply_rename(env, call, Ires_code);
 }
 
 static int
-handle_read(emacs_env *env, const char *path, size_t offset, size_t size)
+handle_readdir(emacs_env *env, const struct elfuse_handlers *handlers, struct elfuse_call_state *call, const char *path)
 {
-    fprintf(stderr, "READ handle (path=%s).\n", path);
+    ELFUSE_LOG(ELFUSE_LOG_DEBUG, "READDIR handle (path=%s).\n", path);
 
-    emacs_value Qread = env->intern(env, "elfuse--read-op");
-    if (!fboundp(env, Qread)) {
+    if (!handlers->defined[OP_READDIR]) {
         return RESPONSE_UNDEFINED;
     }
 
-    /* Build args and execute the function call itself */
+    /* Build args and execute the function call itself, paged handlers
+     * also get the offset and the number of entries wanted */
     emacs_value args[] = {
-        env->make_string(env, path, strlen(path)),
-        env->make_integer(env, offset),
-        env->make_integer(env, size),
+        path_arg(env, path),
+        env->make_integer(env, call->args.readdir.offset),
+        env->make_integer(env, call->args.readdir.limit),
     };
-    emacs_value Sdata = env->funcall(env, Qread, sizeof(args)/sizeof(args[0]), args);
+    ptrdiff_t nargs = handlers->paged_readdir ? 3 : 1;
+    emacs_value file_vector = call_handler(env, handlers, call, OP_READDIR, nargs, args);
 
     /* Handle possible non-local exits (signals or throws) */
     emacs_value exit_symbol, exit_data;
@@ -515,40 +1336,28 @@ handle_read(emacs_env *env, const char *path, size_t offset, size_t size)
         return non_local_op_exit(env, exit_status, exit_symbol, exit_data);
     }
 
-    /* Handle proper response */
-    if (env->eq(env, Sdata, nil)) {
-        elfuse_call.results.read.bytes_read = -1;
-    } else {
-        ptrdiff_t buffer_length;
-        env->copy_string_contents(env, Sdata, NULL, &buffer_length);
-        elfuse_call.results.read.data = malloc(buffer_length);
-        if (!env->copy_string_contents(env, Sdata, elfuse_call.results.read.data, &buffer_length)) {
-            elfuse_call.results.read.bytes_read = -1;
-        } else {
-            elfuse_call.results.read.bytes_read = buffer_length;
-        }
+    /* The handler will reply with elfuse-reply */
+    if (current_deferred != NULL) {
+        return RESPONSE_DEFERRED;
     }
 
-    return RESPONSE_SUCCESS;
+    return reply_readdir(env, call, file_vector);
 }
 
 static int
-handle_write(emacs_env *env, const char *path, const char *buf, size_t size, size_t offset)
+handle_getattr(emacs_env *env, const struct elfuse_handlers *handlers, struct elfuse_call_state *call, const char *path)
 {
-    fprintf(stderr, "WRITE handle (path=%s).\n", path);
+    ELFUSE_LOG(ELFUSE_LOG_DEBUG, "GETATTR handle (path=%s).\n", path);
 
-    emacs_value Qwrite = env->intern(env, "elfuse--write-op");
-    if (!fboundp(env, Qwrite)) {
+    if (!handlers->defined[OP_GETATTR]) {
         return RESPONSE_UNDEFINED;
     }
 
     /* Build args and execute the function call itself */
     emacs_value args[] = {
-        env->make_string(env, path, strlen(path)),
-        env->make_string(env, buf, size),
-        env->make_integer(env, offset),
+        path_arg(env, path)
     };
-    emacs_value Ires_code = env->funcall(env, Qwrite, sizeof(args)/sizeof(args[0]), args);
+    emacs_value getattr_result_vector = call_handler(env, handlers, call, OP_GETATTR, sizeof(args)/sizeof(args[0]), args);
 
     /* Handle possible non-local exits (signals or throws) */
     emacs_value exit_symbol, exit_data;
@@ -560,33 +1369,28 @@ handle_write(emacs_env *env, const char *path, const char *buf, size_t size, siz
         return non_local_op_exit(env, exit_status, exit_symbol, exit_data);
     }
 
-    /* Handle proper response */
-    int res_code = env->extract_integer(env, Ires_code);
-    if (res_code >= 0) {
-        elfuse_call.results.write.size  = size;
-    } else {
-        elfuse_call.results.write.size  = res_code;
+    /* The handler will reply with elfuse-reply */
+    if (current_deferred != NULL) {
+        return RESPONSE_DEFERRED;
     }
 
-    return RESPONSE_SUCCESS;
+    return reply_getattr(env, call, getattr_result_vector);
 }
 
 static int
-handle_truncate(emacs_env *env, const char *path, size_t size)
+handle_open(emacs_env *env, const struct elfuse_handlers *handlers, struct elfuse_call_state *call, const char *path)
 {
-    fprintf(stderr, "TRUNCATE handle (path=%s).\n", path);
+    ELFUSE_LOG(ELFUSE_LOG_DEBUG, "OPEN handle (path=%s).\n", path);
 
-    emacs_value Qtruncate = env->intern(env, "elfuse--truncate-op");
-    if (!fboundp(env, Qtruncate)) {
+    if (!handlers->defined[OP_OPEN]) {
         return RESPONSE_UNDEFINED;
     }
 
     /* Build args and execute the function call itself */
     emacs_value args[] = {
-        env->make_string(env, path, strlen(path)),
-        env->make_integer(env, size),
+        path_arg(env, path)
     };
-    emacs_value Ires_code = env->funcall(env, Qtruncate, sizeof(args)/sizeof(args[0]), args);
+    emacs_value Qfound = call_handler(env, handlers, call, OP_OPEN, sizeof(args)/sizeof(args[0]), args);
 
     /* Handle possible non-local exits (signals or throws) */
     emacs_value exit_symbol, exit_data;
@@ -598,32 +1402,28 @@ handle_truncate(emacs_env *env, const char *path, size_t size)
         return non_local_op_exit(env, exit_status, exit_symbol, exit_data);
     }
 
-    /* Handle proper response */
-    if (env->extract_integer(env, Ires_code) >= 0) {
-        elfuse_call.results.truncate.code  = TRUNCATE_DONE;
-    } else {
-        elfuse_call.results.truncate.code  = TRUNCATE_UNKNOWN;
+    /* The handler will reply with elfuse-reply */
+    if (current_deferred != NULL) {
+        return RESPONSE_DEFERRED;
     }
 
-    return RESPONSE_SUCCESS;
+    return reply_open(env, call, Qfound);
 }
 
-
 static int
-handle_unlink(emacs_env *env, const char *path)
+handle_release(emacs_env *env, const struct elfuse_handlers *handlers, struct elfuse_call_state *call, const char *path)
 {
-    fprintf(stderr, "UNLINK handle (path=%s).\n", path);
+    ELFUSE_LOG(ELFUSE_LOG_DEBUG, "RELEASE handle (path=%s).\n", path);
 
-    emacs_value Qunlink = env->intern(env, "elfuse--unlink-op");
-    if (!fboundp(env, Qunlink)) {
+    if (!handlers->defined[OP_RELEASE]) {
         return RESPONSE_UNDEFINED;
     }
 
     /* Build args and execute the function call itself */
     emacs_value args[] = {
-        env->make_string(env, path, strlen(path)),
+        path_arg(env, path)
     };
-    emacs_value Ires_code = env->funcall(env, Qunlink, sizeof(args)/sizeof(args[0]), args);
+    emacs_value Qfound = call_handler(env, handlers, call, OP_RELEASE, sizeof(args)/sizeof(args[0]), args);
 
     /* Handle possible non-local exits (signals or throws) */
     emacs_value exit_symbol, exit_data;
@@ -635,74 +1435,1156 @@ handle_unlink(emacs_env *env, const char *path)
         return non_local_op_exit(env, exit_status, exit_symbol, exit_data);
     }
 
-    /* Handle proper response */
-    if (env->extract_integer(env, Ires_code) >= 0) {
-        elfuse_call.results.unlink.code  = UNLINK_DONE;
-    } else {
-        elfuse_call.results.unlink.code  = UNLINK_UNKNOWN;
+    /* The handler will reply with elfuse-reply */
+    if (current_deferred != NULL) {
+        return RESPONSE_DEFERRED;
     }
 
-    return RESPONSE_SUCCESS;
+    return reply_release(env, call, Qfound);
 }
 
-
 static int
-non_local_op_exit(emacs_env *env, enum emacs_funcall_exit exit_code, emacs_value exit_symbol, emacs_value exit_data)
+handle_read(emacs_env *env, const struct elfuse_handlers *handlers, struct elfuse_call_state *call, const char *path, size_t offset, size_t size)
 {
-    int res = RESPONSE_UNKNOWN_ERROR;
-    if (exit_code == emacs_funcall_exit_signal) {
-        if (env->eq(env, exit_symbol, elfuse_op_error)) {
-            elfuse_call.response_err_code = env->extract_integer(env, exit_data);
-            res = RESPONSE_SIGNAL_ERROR;
-            fprintf(stderr, "An Elfuse signal caught (code=%d)\n", elfuse_call.response_err_code);
-        } else {
-            ptrdiff_t size;
-            extract_symbol_name(env, exit_symbol, NULL, &size);
-            char name[size];
-            extract_symbol_name(env, exit_symbol, name, &size);
-            fprintf(stderr, "Unknown error caught (name=%s)\n", name);
-        }
+    ELFUSE_LOG(ELFUSE_LOG_DEBUG, "READ handle (path=%s).\n", path);
 
-    } else {
-        fprintf(stderr, "An unknown non-local op exit\n");
+    if (!handlers->defined[OP_READ]) {
+        return RESPONSE_UNDEFINED;
     }
-    return res;
-}
-
-int
-emacs_module_init (struct emacs_runtime *ert)
-{
-    emacs_env *env = ert->get_environment (ert);
 
-    nil = env->intern(env, "nil");
-    t = env->intern(env, "t");
+    /* Build args and execute the function call itself */
+    emacs_value args[] = {
+        path_arg(env, path),
+        env->make_integer(env, offset),
+        env->make_integer(env, size),
+    };
+    emacs_value Sdata = call_handler(env, handlers, call, OP_READ, sizeof(args)/sizeof(args[0]), args);
+
+    /* Handle possible non-local exits (signals or throws) */
+    emacs_value exit_symbol, exit_data;
+    enum emacs_funcall_exit exit_status = env->non_local_exit_get(
+        env, &exit_symbol, &exit_data
+    );
+    if (exit_status != emacs_funcall_exit_return) {
+        env->non_local_exit_clear(env);
+        return non_local_op_exit(env, exit_status, exit_symbol, exit_data);
+    }
+
+    /* The handler will reply with elfuse-reply */
+    if (current_deferred != NULL) {
+        return RESPONSE_DEFERRED;
+    }
+
+    return reply_read(env, call, Sdata);
+}
+
+static int
+handle_write(emacs_env *env, const struct elfuse_handlers *handlers, struct elfuse_call_state *call, const char *path, const char *buf, size_t size, size_t offset)
+{
+    ELFUSE_LOG(ELFUSE_LOG_DEBUG, "WRITE handle (path=%s).\n", path);
+
+    if (!handlers->defined[OP_WRITE]) {
+        return RESPONSE_UNDEFINED;
+    }
+
+    /* Build args and execute the function call itself */
+    emacs_value args[] = {
+        path_arg(env, path),
+        env->make_string(env, buf, size),
+        env->make_integer(env, offset),
+    };
+    emacs_value Ires_code = call_handler(env, handlers, call, OP_WRITE, sizeof(args)/sizeof(args[0]), args);
+
+    /* Handle possible non-local exits (signals or throws) */
+    emacs_value exit_symbol, exit_data;
+    enum emacs_funcall_exit exit_status = env->non_local_exit_get(
+        env, &exit_symbol, &exit_data
+    );
+    if (exit_status != emacs_funcall_exit_return) {
+        env->non_local_exit_clear(env);
+        return non_local_op_exit(env, exit_status, exit_symbol, exit_data);
+    }
+
+    /* The handler will reply with elfuse-reply */
+    if (current_deferred != NULL) {
+        return RESPONSE_DEFERRED;
+    }
+
+    return reply_write(env, call, Ires_code);
+}
+
+static int
+handle_truncate(emacs_env *env, const struct elfuse_handlers *handlers, struct elfuse_call_state *call, const char *path, size_t size)
+{
+    ELFUSE_LOG(ELFUSE_LOG_DEBUG, "TRUNCATE handle (path=%s).\n", path);
+
+    if (!handlers->defined[OP_TRUNCATE]) {
+        return RESPONSE_UNDEFINED;
+    }
+
+    /* Build args and execute the function call itself */
+    emacs_value args[] = {
+        path_arg(env, path),
+        env->make_integer(env, size),
+    };
+    emacs_value Ires_code = call_handler(env, handlers, call, OP_TRUNCATE, sizeof(args)/sizeof(args[0]), args);
+
+    /* Handle possible non-local exits (signals or throws) */
+    emacs_value exit_symbol, exit_data;
+    enum emacs_funcall_exit exit_status = env->non_local_exit_get(
+        env, &exit_symbol, &exit_data
+    );
+    if (exit_status != emacs_funcall_exit_return) {
+        env->non_local_exit_clear(env);
+        return non_local_op_exit(env, exit_status, exit_symbol, exit_data);
+    }
+
+    /* The handler will reply with elfuse-reply */
+    if (current_deferred != NULL) {
+        return RESPONSE_DEFERRED;
+    }
+
+    return reply_truncate(env, call, Ires_code);
+}
+
+
+static int
+handle_unlink(emacs_env *env, const struct elfuse_handlers *handlers, struct elfuse_call_state *call, const char *path)
+{
+    ELFUSE_LOG(ELFUSE_LOG_DEBUG, "UNLINK handle (path=%s).\n", path);
+
+    if (!handlers->defined[OP_UNLINK]) {
+        return RESPONSE_UNDEFINED;
+    }
+
+    /* Build args and execute the function call itself */
+    emacs_value args[] = {
+        path_arg(env, path),
+    };
+    emacs_value Ires_code = call_handler(env, handlers, call, OP_UNLINK, sizeof(args)/sizeof(args[0]), args);
+
+    /* Handle possible non-local exits (signals or throws) */
+    emacs_value exit_symbol, exit_data;
+    enum emacs_funcall_exit exit_status = env->non_local_exit_get(
+        env, &exit_symbol, &exit_data
+    );
+    if (exit_status != emacs_funcall_exit_return) {
+        env->non_local_exit_clear(env);
+        return non_local_op_exit(env, exit_status, exit_symbol, exit_data);
+    }
+
+    /* The handler will reply with elfuse-reply */
+    if (current_deferred != NULL) {
+        return RESPONSE_DEFERRED;
+    }
+
+    return reply_unlink(env, call, Ires_code);
+}
+
+
+static int
+non_local_op_exit(emacs_env *env, enum emacs_funcall_exit exit_code, emacs_value exit_symbol, emacs_value exit_data)
+{
+    int res = RESPONSE_UNKNOWN_ERROR;
+    if (exit_code == emacs_funcall_exit_signal) {
+        if (env->eq(env, exit_symbol, elfuse_op_error)) {
+            current_err_code = env->extract_integer(env, exit_data);
+            res = RESPONSE_SIGNAL_ERROR;
+            ELFUSE_LOG(ELFUSE_LOG_DEBUG, "An Elfuse signal caught (code=%d)\n", current_err_code);
+        } else {
+            ptrdiff_t size;
+            extract_symbol_name(env, exit_symbol, NULL, &size);
+            char name[size];
+            extract_symbol_name(env, exit_symbol, name, &size);
+            ELFUSE_LOG(ELFUSE_LOG_DEBUG, "Unknown error caught (name=%s)\n", name);
+        }
+
+    } else {
+        ELFUSE_LOG(ELFUSE_LOG_DEBUG, "An unknown non-local op exit\n");
+    }
+    return res;
+}
+
+static emacs_value
+Felfuse_handlers_changed(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)env; (void)nargs; (void)args; (void)data;
+
+    handlers_generation++;
+
+    return t;
+}
+
+static uint64_t
+bench_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Call the getattr handler N times the way requests used to do it and
+ * through the handler table, see bench/handler-dispatch.el */
+static emacs_value
+Felfuse_bench_handlers(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)nargs; (void)data;
+
+    intmax_t n = env->extract_integer(env, args[0]);
+    emacs_value path = env->make_string(env, "/", 1);
+
+    uint64_t start = bench_now_ns();
+    for (intmax_t i = 0; i < n; i++) {
+        emacs_value Qgetattr = env->intern(env, "elfuse--getattr-op");
+        if (!fboundp(env, Qgetattr)) {
+            return nil;
+        }
+        emacs_value result = env->funcall(env, Qgetattr, 1, &path);
+        emacs_value Qfiletype = env->vec_get(env, result, 0);
+        if (env->non_local_exit_check(env) != emacs_funcall_exit_return
+            || (!env->eq(env, Qfiletype, env->intern(env, "file"))
+                && !env->eq(env, Qfiletype, env->intern(env, "dir")))) {
+            return nil;
+        }
+    }
+    uint64_t interned_ns = bench_now_ns() - start;
+
+    /* The table elfuse-start mounts with */
+    emacs_value ops[OP_COUNT];
+    for (int op = 0; op < OP_COUNT; op++) {
+        ops[op] = env->intern(env, op_handler_names[op]);
+    }
+    struct elfuse_handlers *handlers = handlers_new(
+        env, env->funcall(env, env->intern(env, "vector"), OP_COUNT, ops)
+    );
+    if (handlers == NULL) {
+        return nil;
+    }
+
+    bool ok = true;
+    start = bench_now_ns();
+    for (intmax_t i = 0; ok && i < n; i++) {
+        resolve_handlers(env, handlers);
+        if (!handlers->defined[OP_GETATTR]) {
+            ok = false;
+            break;
+        }
+        emacs_value result = env->funcall(env, handlers->ops[OP_GETATTR], 1, &path);
+        emacs_value Qfiletype = env->vec_get(env, result, 0);
+        ok = env->non_local_exit_check(env) == emacs_funcall_exit_return
+            && (env->eq(env, Qfiletype, Qfile) || env->eq(env, Qfiletype, Qdir));
+    }
+    uint64_t resolved_ns = bench_now_ns() - start;
+    handlers_free(env, handlers);
+    if (!ok) {
+        return nil;
+    }
+
+    emacs_value times[] = {
+        env->make_integer(env, interned_ns),
+        env->make_integer(env, resolved_ns),
+    };
+    return env->funcall(env, Qvector, sizeof(times)/sizeof(times[0]), times);
+}
+
+static emacs_value
+Felfuse_set_batch_window(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)nargs; (void)data;
+
+    intmax_t window = env->extract_integer(env, args[0]);
+    atomic_store(&elfuse_batch_window, window > 0 ? window : 0);
+
+    return t;
+}
+
+static emacs_value
+Felfuse_set_readahead_size(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)nargs; (void)data;
+
+    intmax_t size = env->extract_integer(env, args[0]);
+    atomic_store(&elfuse_readahead_size, size > 0 ? size : 0);
+
+    return t;
+}
+
+static emacs_value
+Felfuse_set_wakeup(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)data;
+
+    if (mounts != NULL) {
+        message(env, "Elfuse: can't change the wakeup method while mounted");
+        return nil;
+    }
+
+    emacs_value Qmethod = args[0];
+    if (env->eq(env, Qmethod, env->intern(env, "pipe"))) {
+        /* Pipe channels only exist in Emacs 28+ */
+        if (nargs < 2 || env->size < (ptrdiff_t) sizeof(struct emacs_env_28)) {
+            return nil;
+        }
+
+        int fd = env->open_channel(env, args[1]);
+        if (fd < 0) {
+            return nil;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+        int old_fd = atomic_exchange(&elfuse_wakeup_fd, fd);
+        if (old_fd >= 0) {
+            close(old_fd);
+        }
+        atomic_store(&elfuse_wakeup_method, WAKEUP_PIPE);
+    } else if (env->eq(env, Qmethod, env->intern(env, "signal"))) {
+        atomic_store(&elfuse_wakeup_method, WAKEUP_SIGNAL);
+    } else if (env->eq(env, Qmethod, env->intern(env, "timer"))) {
+        atomic_store(&elfuse_wakeup_method, WAKEUP_NONE);
+    } else {
+        return nil;
+    }
+
+    return t;
+}
+
+static emacs_value
+Felfuse_batch_stats(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)nargs; (void)args; (void)data;
+
+    emacs_value stats[] = {
+        env->make_integer(env, batch_stats.wakeups),
+        env->make_integer(env, batch_stats.empty_wakeups),
+        env->make_integer(env, batch_stats.requests),
+        env->make_integer(env, batch_stats.max_batch),
+        env->make_integer(env, atomic_load(&elfuse_rtt_count)),
+        env->make_integer(env, atomic_load(&elfuse_rtt_sum_ns)),
+        env->make_integer(env, atomic_load(&elfuse_rtt_max_ns)),
+        env->make_integer(env, atomic_load(&elfuse_coalesced_count)),
+    };
+    return env->funcall(env, Qvector, sizeof(stats)/sizeof(stats[0]), stats);
+}
+
+/* [SUM MAX P50 P90 P99 P99.9] of HISTOGRAM, in ns */
+static emacs_value
+make_histogram_stats(emacs_env *env, struct elfuse_histogram *histogram)
+{
+    emacs_value stats[] = {
+        env->make_integer(env, atomic_load(&histogram->sum)),
+        env->make_integer(env, atomic_load(&histogram->max)),
+        env->make_integer(env, elfuse_histogram_percentile(histogram, 0.5)),
+        env->make_integer(env, elfuse_histogram_percentile(histogram, 0.9)),
+        env->make_integer(env, elfuse_histogram_percentile(histogram, 0.99)),
+        env->make_integer(env, elfuse_histogram_percentile(histogram, 0.999)),
+    };
+    return env->funcall(env, Qvector, sizeof(stats)/sizeof(stats[0]), stats);
+}
+
+static emacs_value
+Felfuse_stats(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)nargs; (void)args; (void)data;
+
+    emacs_value ops[OP_COUNT];
+    for (int op = 0; op < OP_COUNT; op++) {
+        /* Ops are in the order of the request states */
+        struct elfuse_op_stats *stats = &elfuse_op_stats[WAITING_CREATE + op];
+
+        emacs_value Lerrnos = nil;
+        for (int err = ELFUSE_STATS_ERRNOS - 1; err > 0; err--) {
+            unsigned long long count = atomic_load(&stats->errnos[err]);
+            if (count == 0) {
+                continue;
+            }
+            emacs_value pair[] = { env->make_integer(env, err), env->make_integer(env, count) };
+            emacs_value cell[] = { env->funcall(env, Qcons, 2, pair), Lerrnos };
+            Lerrnos = env->funcall(env, Qcons, 2, cell);
+        }
+
+        emacs_value op_stats[] = {
+            env->make_integer(env, atomic_load(&stats->count)),
+            env->make_integer(env, atomic_load(&stats->errors)),
+            Lerrnos,
+            make_histogram_stats(env, &stats->phases[PHASE_QUEUED]),
+            make_histogram_stats(env, &stats->phases[PHASE_HANDLER]),
+            make_histogram_stats(env, &stats->phases[PHASE_REPLY]),
+        };
+        ops[op] = env->funcall(env, Qvector, sizeof(op_stats)/sizeof(op_stats[0]), op_stats);
+    }
+    return env->funcall(env, Qvector, OP_COUNT, ops);
+}
+
+static emacs_value
+Felfuse_stats_reset(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)env; (void)nargs; (void)args; (void)data;
+
+    elfuse_stats_reset();
+
+    return t;
+}
+
+static emacs_value
+Felfuse_set_log_level(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)nargs; (void)data;
+
+    static const char *const levels[] = {
+        [ELFUSE_LOG_ERROR] = "error",
+        [ELFUSE_LOG_WARN] = "warn",
+        [ELFUSE_LOG_INFO] = "info",
+        [ELFUSE_LOG_DEBUG] = "debug",
+    };
+    for (int level = 0; level < (int)(sizeof(levels)/sizeof(levels[0])); level++) {
+        if (env->eq(env, args[0], env->intern(env, levels[level]))) {
+            atomic_store(&elfuse_log_level, level);
+            return t;
+        }
+    }
+    return nil;
+}
+
+struct trace_list {
+    emacs_env *env;
+    emacs_value list;
+};
+
+static void
+trace_list_add(const struct elfuse_trace_record *record, void *data)
+{
+    struct trace_list *trace = data;
+    emacs_env *env = trace->env;
+
+    char hash[17];
+    snprintf(hash, sizeof(hash), "%016" PRIx64, record->path_hash);
+
+    emacs_value fields[] = {
+        env->make_integer(env, record->thread),
+        env->make_integer(env, record->op),
+        env->make_integer(env, record->kind),
+        env->make_integer(env, record->result),
+        env->make_string(env, hash, strlen(hash)),
+        env->make_integer(env, record->ino),
+        env->make_integer(env, record->queued_ns),
+        env->make_integer(env, record->taken_ns),
+        env->make_integer(env, record->handled_ns),
+        env->make_integer(env, record->done_ns),
+    };
+    emacs_value cell[] = {
+        env->funcall(env, Qvector, sizeof(fields)/sizeof(fields[0]), fields),
+        trace->list,
+    };
+    trace->list = env->funcall(env, Qcons, 2, cell);
+}
+
+static emacs_value
+Felfuse_trace_records(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)nargs; (void)args; (void)data;
+
+    struct trace_list trace = { .env = env, .list = nil };
+    elfuse_trace_foreach(trace_list_add, &trace);
+    return trace.list;
+}
+
+static emacs_value
+Felfuse_batch_stats_reset(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)env; (void)nargs; (void)args; (void)data;
+
+    memset(&batch_stats, 0, sizeof(batch_stats));
+    atomic_store(&elfuse_rtt_count, 0);
+    atomic_store(&elfuse_rtt_sum_ns, 0);
+    atomic_store(&elfuse_rtt_max_ns, 0);
+    atomic_store(&elfuse_coalesced_count, 0);
+
+    return t;
+}
+
+/* The mount given as the optional argument INDEX or the first of all
+ * mounts, SINGLE tells if the rest should be skipped. NULL if the
+ * argument is not a live mount handle. */
+static struct elfuse_mount *
+selected_mounts(emacs_env *env, ptrdiff_t nargs, emacs_value args[], ptrdiff_t index, bool *single)
+{
+    *single = nargs > index && env->is_not_nil(env, args[index]);
+    if (!*single) {
+        return mounts;
+    }
+
+    struct elfuse_mount *mount = extract_mount(env, args[index]);
+    return mount != NULL && !mount->stopped ? mount : NULL;
+}
+
+#define FOR_SELECTED_MOUNTS(mount, index, single)                       \
+    for (struct elfuse_mount *mount = selected_mounts(env, nargs, args, index, &single); \
+         mount != NULL;                                                 \
+         mount = single ? NULL : mount->next)
+
+static emacs_value
+Felfuse_set_attr_cache_ttl(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)nargs; (void)data;
+
+    double ttl = extract_number(env, args[0]);
+    if (env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        return nil;
+    }
+    attr_cache_ttl = ttl;
+    for (struct elfuse_mount *mount = mounts; mount != NULL; mount = mount->next) {
+        elfuse_attr_cache_set_default_ttl(&mount->attr_cache, ttl);
+    }
+
+    return t;
+}
+
+static emacs_value
+Felfuse_set_negative_cache_ttl(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)nargs; (void)data;
+
+    double ttl = extract_number(env, args[0]);
+    if (env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        return nil;
+    }
+    negative_cache_ttl = ttl;
+    for (struct elfuse_mount *mount = mounts; mount != NULL; mount = mount->next) {
+        elfuse_attr_cache_set_negative_ttl(&mount->attr_cache, ttl);
+    }
+
+    return t;
+}
+
+static emacs_value
+Felfuse_set_block_cache_size(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)nargs; (void)data;
+
+    intmax_t budget = env->extract_integer(env, args[0]);
+    if (env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        return nil;
+    }
+    if (budget < 0) {
+        budget = 0;
+    }
+    block_cache_budget = budget;
+    for (struct elfuse_mount *mount = mounts; mount != NULL; mount = mount->next) {
+        elfuse_block_cache_set_budget(&mount->block_cache, budget);
+    }
+
+    return t;
+}
+
+static void
+set_key_ttl(struct elfuse_mount *mount, const char *key, void *arg)
+{
+    elfuse_attr_cache_set_ttl(&mount->attr_cache, key, *(double *)arg);
+}
+
+static emacs_value
+Felfuse_set_attr_ttl(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)data;
+
+    double ttl = -1;
+    if (env->is_not_nil(env, args[1])) {
+        ttl = extract_number(env, args[1]);
+        if (env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+            return nil;
+        }
+        if (ttl < 0) {
+            ttl = 0;
+        }
+    }
+
+    char *path = copy_string(env, args[0]);
+    if (path == NULL) {
+        return nil;
+    }
+    bool single;
+    FOR_SELECTED_MOUNTS(mount, 2, single) {
+        elfuse_path_keys(mount, path, false, set_key_ttl, &ttl);
+    }
+    free(path);
+
+    return t;
+}
+
+static emacs_value
+Felfuse_add_negative_glob(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)data;
+
+    char *glob = copy_string(env, args[0]);
+    if (glob == NULL) {
+        return nil;
+    }
+    bool single;
+    FOR_SELECTED_MOUNTS(mount, 1, single) {
+        elfuse_attr_cache_add_negative_glob(&mount->attr_cache, glob);
+    }
+    free(glob);
+
+    return t;
+}
+
+static emacs_value
+Felfuse_clear_negative_globs(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)data;
+
+    bool single;
+    FOR_SELECTED_MOUNTS(mount, 0, single) {
+        elfuse_attr_cache_clear_negative_globs(&mount->attr_cache);
+    }
+
+    return t;
+}
+
+static emacs_value
+Felfuse_invalidate(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)data;
+
+    char *path = copy_string(env, args[0]);
+    if (path == NULL) {
+        return nil;
+    }
+    bool single;
+    FOR_SELECTED_MOUNTS(mount, 1, single) {
+        elfuse_path_keys(mount, path, false, elfuse_invalidate_key, NULL);
+    }
+    free(path);
+
+    return t;
+}
+
+static emacs_value
+Felfuse_invalidate_prefix(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)data;
+
+    char *prefix = copy_string(env, args[0]);
+    if (prefix == NULL) {
+        return nil;
+    }
+    bool single;
+    FOR_SELECTED_MOUNTS(mount, 1, single) {
+        elfuse_path_keys(mount, prefix, true, elfuse_invalidate_key_prefix, NULL);
+    }
+    free(prefix);
+
+    return t;
+}
+
+static emacs_value
+Felfuse_snapshot_set(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)data;
+
+    char *path = copy_string(env, args[0]);
+    if (path == NULL) {
+        return nil;
+    }
+
+    /* The text is encoded as UTF-8 once, straight into the snapshot */
+    ptrdiff_t buffer_length;
+    struct elfuse_snapshot *snapshot = NULL;
+    if (env->copy_string_contents(env, args[1], NULL, &buffer_length)) {
+        snapshot = elfuse_snapshot_new(buffer_length - 1);
+    }
+    if (snapshot == NULL
+        || !env->copy_string_contents(env, args[1], snapshot->data, &buffer_length)) {
+        elfuse_snapshot_release(snapshot);
+        free(path);
+        return nil;
+    }
+
+    /* Mounts share the snapshot, each table holds a reference */
+    bool res = true;
+    bool single;
+    FOR_SELECTED_MOUNTS(mount, 2, single) {
+        atomic_fetch_add(&snapshot->refs, 1);
+        res = elfuse_snapshot_table_set(&mount->snapshot_table, path, snapshot) && res;
+    }
+    elfuse_snapshot_release(snapshot);
+    free(path);
+
+    return res ? t : nil;
+}
+
+static emacs_value
+Felfuse_snapshot_remove(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)data;
+
+    char *path = copy_string(env, args[0]);
+    if (path == NULL) {
+        return nil;
+    }
+    bool single;
+    FOR_SELECTED_MOUNTS(mount, 1, single) {
+        elfuse_snapshot_table_remove(&mount->snapshot_table, path);
+    }
+    free(path);
+
+    return t;
+}
+
+static emacs_value
+Felfuse_notify_changed(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)data;
+
+    char *path = copy_string(env, args[0]);
+    if (path == NULL) {
+        return nil;
+    }
+    bool single;
+    FOR_SELECTED_MOUNTS(mount, 1, single) {
+        elfuse_notify_changed(mount, path);
+    }
+    free(path);
+
+    return t;
+}
+
+/* Both entry notifications only differ in what Elfuse forgets */
+static emacs_value
+notify_entry(emacs_env *env, ptrdiff_t nargs, emacs_value args[], bool removed)
+{
+    char *dir = copy_string(env, args[0]);
+    char *name = copy_string(env, args[1]);
+    bool done = dir != NULL && name != NULL;
+    if (done) {
+        bool single;
+        FOR_SELECTED_MOUNTS(mount, 2, single) {
+            elfuse_notify_entry(mount, dir, name, removed);
+        }
+    }
+    free(dir);
+    free(name);
+
+    return done ? t : nil;
+}
+
+static emacs_value
+Felfuse_notify_entry_added(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)data;
+
+    return notify_entry(env, nargs, args, false);
+}
+
+static emacs_value
+Felfuse_notify_entry_removed(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)data;
+
+    return notify_entry(env, nargs, args, true);
+}
+
+static emacs_value
+Felfuse_attr_cache_stats(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)data;
+
+    size_t entries = 0, hits = 0, misses = 0, negative_hits = 0;
+    bool single;
+    FOR_SELECTED_MOUNTS(mount, 0, single) {
+        pthread_mutex_lock(&mount->attr_cache.lock);
+        entries += mount->attr_cache.entries_size;
+        hits += mount->attr_cache.hits;
+        misses += mount->attr_cache.misses;
+        negative_hits += mount->attr_cache.negative_hits;
+        pthread_mutex_unlock(&mount->attr_cache.lock);
+    }
+
+    emacs_value stats[] = {
+        env->make_integer(env, entries),
+        env->make_integer(env, hits),
+        env->make_integer(env, misses),
+        env->make_integer(env, negative_hits),
+    };
+    return env->funcall(env, Qvector, sizeof(stats)/sizeof(stats[0]), stats);
+}
+
+static emacs_value
+Felfuse_block_cache_stats(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)data;
+
+    size_t bytes = 0, blocks = 0, hits = 0, misses = 0, evictions = 0;
+    bool single;
+    FOR_SELECTED_MOUNTS(mount, 0, single) {
+        pthread_mutex_lock(&mount->block_cache.lock);
+        bytes += mount->block_cache.bytes;
+        blocks += mount->block_cache.blocks_size;
+        hits += mount->block_cache.hits;
+        misses += mount->block_cache.misses;
+        evictions += mount->block_cache.evictions;
+        pthread_mutex_unlock(&mount->block_cache.lock);
+    }
+
+    emacs_value stats[] = {
+        env->make_integer(env, bytes),
+        env->make_integer(env, blocks),
+        env->make_integer(env, hits),
+        env->make_integer(env, misses),
+        env->make_integer(env, evictions),
+    };
+    return env->funcall(env, Qvector, sizeof(stats)/sizeof(stats[0]), stats);
+}
+
+static emacs_value
+Felfuse_record_start(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)data;
+
+    char *path = copy_string(env, args[0]);
+    if (path == NULL) {
+        return nil;
+    }
+    struct elfuse_record_file *file = elfuse_record_file_open(path);
+    if (file == NULL) {
+        ELFUSE_LOG(ELFUSE_LOG_ERROR, "Elfuse: failed to create %s (%s)\n", path, strerror(errno));
+        free(path);
+        return nil;
+    }
+    free(path);
+
+    /* Mounts share the file, each recorder holds a reference */
+    bool single;
+    FOR_SELECTED_MOUNTS(mount, 1, single) {
+        atomic_fetch_add(&file->refs, 1);
+        elfuse_recorder_set(&mount->recorder, file);
+    }
+    elfuse_record_file_release(file);
+
+    return t;
+}
+
+static emacs_value
+Felfuse_record_stop(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)data;
+
+    bool single;
+    FOR_SELECTED_MOUNTS(mount, 0, single) {
+        elfuse_recorder_set(&mount->recorder, NULL);
+    }
+
+    return t;
+}
+
+int
+emacs_module_init (struct emacs_runtime *ert)
+{
+    emacs_env *env = ert->get_environment (ert);
+
+    nil = env->intern(env, "nil");
+    t = env->intern(env, "t");
     elfuse_op_error = env->intern(env, "elfuse-op-error");
+    Qfile = env->make_global_ref(env, env->intern(env, "file"));
+    Qdir = env->make_global_ref(env, env->intern(env, "dir"));
+    Qset = env->make_global_ref(env, env->intern(env, "set"));
+    Qvector = env->make_global_ref(env, env->intern(env, "vector"));
+    Qcons = env->make_global_ref(env, env->intern(env, "cons"));
+    Qcar = env->make_global_ref(env, env->intern(env, "car"));
+    Qcdr = env->make_global_ref(env, env->intern(env, "cdr"));
+    Qelfuse_inode = env->make_global_ref(env, env->intern(env, "elfuse-inode"));
+    Qbacking = env->make_global_ref(env, env->intern(env, ":backing"));
     emacs_thread = pthread_self();
 
     emacs_value fun = env->make_function (
-        env, 1, 1,
+        env, 2, 6,
         Felfuse_mount,
-        "Start the elfuse thread. ",
+        "Mount PATH served by a vector of HANDLERS using an optional number of FUSE threads, FUSE -o options and the low-level API if LOWLEVEL is non-nil, passing handlers inodes instead of paths if INODE-ARGS is non-nil, return a mount handle or nil. ",
         NULL
     );
     bind_function (env, "elfuse--mount", fun);
 
+    fun = env->make_function (
+        env, 1, 1,
+        Felfuse_unmount,
+        "Unmount the mount HANDLE. ",
+        NULL
+    );
+    bind_function (env, "elfuse--unmount", fun);
+
+    fun = env->make_function (
+        env, 0, 0,
+        Felfuse_unmount_all,
+        "Unmount everything. ",
+        NULL
+    );
+    bind_function (env, "elfuse--unmount-all", fun);
+
     fun = env->make_function (
         env, 0, 0,
-        Felfuse_stop,
-        "Kill the elfuse thread. ",
+        Felfuse_mount_count,
+        "Return the number of mounts. ",
         NULL
     );
-    bind_function (env, "elfuse--stop", fun);
+    bind_function (env, "elfuse--mount-count", fun);
 
     fun = env->make_function (
         env, 0, 0,
         Felfuse_check_ops,
-        "Check if Fuse callbacks are waiting for reply and reply. ",
+        "Reply to all Fuse callbacks waiting in the queue. ",
         NULL
     );
     bind_function (env, "elfuse--check-ops", fun);
 
+    fun = env->make_function (
+        env, 0, 0,
+        Felfuse_defer,
+        "Defer the reply to the request being handled, return a token for elfuse-reply. The handler's return value is ignored. The request holds a FUSE thread until the reply, another one is started in its place so that `elfuse-fuse-threads' of them keep serving the mount, and stopped after the reply. ",
+        NULL
+    );
+    bind_function (env, "elfuse-defer", fun);
+
+    fun = env->make_function (
+        env, 2, 2,
+        Felfuse_reply,
+        "Reply to the deferred request TOKEN with VALUE, as if the handler returned it. Return nil if the request is gone. ",
+        NULL
+    );
+    bind_function (env, "elfuse-reply", fun);
+
+    fun = env->make_function (
+        env, 2, 2,
+        Felfuse_reply_error,
+        "Fail the deferred request TOKEN with ERRNO, as if the handler signalled elfuse-op-error. Return nil if the request is gone. ",
+        NULL
+    );
+    bind_function (env, "elfuse-reply-error", fun);
+
+    fun = env->make_function (
+        env, 0, 0,
+        Felfuse_handlers_changed,
+        "Resolve request handlers again before the next request. ",
+        NULL
+    );
+    bind_function (env, "elfuse--handlers-changed", fun);
+
+    fun = env->make_function (
+        env, 1, 1,
+        Felfuse_bench_handlers,
+        "Call the getattr handler N times with and without the handler table, return a vector of both times in ns. ",
+        NULL
+    );
+    bind_function (env, "elfuse--bench-handlers", fun);
+
+    fun = env->make_function (
+        env, 1, 1,
+        Felfuse_set_batch_window,
+        "Set the time in microseconds FUSE threads wait for more requests before waking Emacs up. ",
+        NULL
+    );
+    bind_function (env, "elfuse--set-batch-window", fun);
+
+    fun = env->make_function (
+        env, 1, 1,
+        Felfuse_set_readahead_size,
+        "Set the largest number of bytes read ahead for sequential readers, 0 disables read ahead. ",
+        NULL
+    );
+    bind_function (env, "elfuse--set-readahead-size", fun);
+
+    fun = env->make_function (
+        env, 0, 0,
+        Felfuse_batch_stats,
+        "Return a vector of wakeups, empty wakeups, requests handled, the largest batch, request round trip count, total and max in ns and requests coalesced. ",
+        NULL
+    );
+    bind_function (env, "elfuse--batch-stats", fun);
+
+    fun = env->make_function (
+        env, 1, 2,
+        Felfuse_set_wakeup,
+        "Set the way FUSE threads wake Emacs up: signal, pipe (with a pipe process) or timer. ",
+        NULL
+    );
+    bind_function (env, "elfuse--set-wakeup", fun);
+
+    fun = env->make_function (
+        env, 0, 0,
+        Felfuse_batch_stats_reset,
+        "Reset wakeup and batch counters. ",
+        NULL
+    );
+    bind_function (env, "elfuse--batch-stats-reset", fun);
+
+    fun = env->make_function (
+        env, 0, 0,
+        Felfuse_stats,
+        "Return a vector of per operation stats, each a vector of the request count, the error count, an alist of errnos to counts and vectors of total, max, p50, p90, p99 and p99.9 times in ns spent queued, in the handler and getting the reply back. ",
+        NULL
+    );
+    bind_function (env, "elfuse--stats", fun);
+
+    fun = env->make_function (
+        env, 0, 0,
+        Felfuse_stats_reset,
+        "Reset per operation stats. ",
+        NULL
+    );
+    bind_function (env, "elfuse--stats-reset", fun);
+
+    fun = env->make_function (
+        env, 1, 1,
+        Felfuse_set_log_level,
+        "Set the level of messages printed to stderr: error, warn, info or debug. ",
+        NULL
+    );
+    bind_function (env, "elfuse--set-log-level", fun);
+
+    fun = env->make_function (
+        env, 0, 0,
+        Felfuse_trace_records,
+        "Return a list of recent request trace records, each a vector of the thread, the request state, the kind, the errno, the path hash, the inode and the times in ns the request was queued, taken, handled and done. ",
+        NULL
+    );
+    bind_function (env, "elfuse--trace-records", fun);
+
+    fun = env->make_function (
+        env, 1, 1,
+        Felfuse_set_attr_cache_ttl,
+        "Set the default time in seconds GETATTR results are cached for, 0 disables caching. ",
+        NULL
+    );
+    bind_function (env, "elfuse--set-attr-cache-ttl", fun);
+
+    fun = env->make_function (
+        env, 1, 1,
+        Felfuse_set_negative_cache_ttl,
+        "Set the time in seconds paths GETATTR reported missing are cached for, 0 disables caching. ",
+        NULL
+    );
+    bind_function (env, "elfuse--set-negative-cache-ttl", fun);
+
+    fun = env->make_function (
+        env, 1, 2,
+        Felfuse_add_negative_glob,
+        "Answer GETATTR of paths matching GLOB with ENOENT without calling handlers. A GLOB without a slash matches file names. Applies to an optional MOUNT or all mounts. ",
+        NULL
+    );
+    bind_function (env, "elfuse-add-negative-glob", fun);
+
+    fun = env->make_function (
+        env, 0, 1,
+        Felfuse_clear_negative_globs,
+        "Drop the negative globs of an optional MOUNT or all mounts. ",
+        NULL
+    );
+    bind_function (env, "elfuse-clear-negative-globs", fun);
+
+    fun = env->make_function (
+        env, 2, 3,
+        Felfuse_set_attr_ttl,
+        "Set the time in seconds GETATTR results of PATH are cached for, nil restores the default. Applies to an optional MOUNT or all mounts. ",
+        NULL
+    );
+    bind_function (env, "elfuse-set-attr-ttl", fun);
+
+    fun = env->make_function (
+        env, 1, 2,
+        Felfuse_invalidate,
+        "Drop cached attributes and content of PATH in an optional MOUNT or all mounts. ",
+        NULL
+    );
+    bind_function (env, "elfuse-invalidate", fun);
+
+    fun = env->make_function (
+        env, 1, 2,
+        Felfuse_invalidate_prefix,
+        "Drop cached attributes and content of PREFIX and every path below it in an optional MOUNT or all mounts. ",
+        NULL
+    );
+    bind_function (env, "elfuse-invalidate-prefix", fun);
+
+    fun = env->make_function (
+        env, 0, 1,
+        Felfuse_attr_cache_stats,
+        "Return a vector of attribute cache entries, hits, misses and hits of missing paths of an optional MOUNT or all mounts. ",
+        NULL
+    );
+    bind_function (env, "elfuse--attr-cache-stats", fun);
+
+    fun = env->make_function (
+        env, 1, 1,
+        Felfuse_set_block_cache_size,
+        "Set the number of bytes of file content cached in blocks, 0 disables caching. ",
+        NULL
+    );
+    bind_function (env, "elfuse--set-block-cache-size", fun);
+
+    fun = env->make_function (
+        env, 0, 1,
+        Felfuse_block_cache_stats,
+        "Return a vector of block cache bytes, blocks, hits, misses and evictions of an optional MOUNT or all mounts. ",
+        NULL
+    );
+    bind_function (env, "elfuse--block-cache-stats", fun);
+
+    fun = env->make_function (
+        env, 2, 3,
+        Felfuse_snapshot_set,
+        "Serve the file PATH from a snapshot of the string TEXT in an optional MOUNT or all mounts. ",
+        NULL
+    );
+    bind_function (env, "elfuse--snapshot-set", fun);
+
+    fun = env->make_function (
+        env, 1, 2,
+        Felfuse_snapshot_remove,
+        "Stop serving the file PATH from a snapshot in an optional MOUNT or all mounts. ",
+        NULL
+    );
+    bind_function (env, "elfuse--snapshot-remove", fun);
+
+    fun = env->make_function (
+        env, 1, 2,
+        Felfuse_notify_changed,
+        "Tell Elfuse and the kernel that the content or attributes of PATH changed in an optional MOUNT or all mounts. ",
+        NULL
+    );
+    bind_function (env, "elfuse-notify-changed", fun);
+
+    fun = env->make_function (
+        env, 2, 3,
+        Felfuse_notify_entry_added,
+        "Tell Elfuse and the kernel that NAME appeared in the directory DIR of an optional MOUNT or all mounts. ",
+        NULL
+    );
+    bind_function (env, "elfuse-notify-entry-added", fun);
+
+    fun = env->make_function (
+        env, 2, 3,
+        Felfuse_notify_entry_removed,
+        "Tell Elfuse and the kernel that NAME was removed from the directory DIR of an optional MOUNT or all mounts. ",
+        NULL
+    );
+    bind_function (env, "elfuse-notify-entry-removed", fun);
+
+    fun = env->make_function (
+        env, 1, 2,
+        Felfuse_record_start,
+        "Append every request of an optional MOUNT or all mounts to a new trace file PATH, return nil if it can't be created. ",
+        NULL
+    );
+    bind_function (env, "elfuse--record-start", fun);
+
+    fun = env->make_function (
+        env, 0, 1,
+        Felfuse_record_stop,
+        "Stop recording requests of an optional MOUNT or all mounts. ",
+        NULL
+    );
+    bind_function (env, "elfuse--record-stop", fun);
+
     provide (env, "elfuse-module");
 
     return 0;
@@ -0,0 +1,84 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdlib.h>
+
+#include "elfuse-mount.h"
+
+struct elfuse_mount *
+elfuse_mount_new(char *mountpath, char *options, int threads, bool lowlevel)
+{
+    struct elfuse_mount *mount = calloc(1, sizeof(*mount));
+    if (mount == NULL)
+        return NULL;
+
+    mount->mountpath = mountpath;
+    mount->options = options;
+    mount->threads = threads > 0 ? threads : 1;
+    mount->lowlevel = lowlevel;
+
+    /* The high-level API defaults */
+    mount->entry_timeout = 1.0;
+    mount->attr_timeout = 1.0;
+    mount->negative_timeout = 0.0;
+
+    atomic_init(&mount->queue, NULL);
+    pthread_mutex_init(&mount->flights_lock, NULL);
+    mount->flights = NULL;
+    sem_init(&mount->init_sem, 0, 0);
+    atomic_init(&mount->loop_exited, false);
+
+    pthread_mutex_init(&mount->spares_lock, NULL);
+    pthread_cond_init(&mount->spares_cond, NULL);
+    mount->spares = NULL;
+
+    pthread_mutex_init(&mount->notify_lock, NULL);
+    pthread_cond_init(&mount->notify_cond, NULL);
+    mount->notify_head = NULL;
+    mount->notify_tail = &mount->notify_head;
+
+    elfuse_attr_cache_init(&mount->attr_cache);
+    elfuse_block_cache_init(&mount->block_cache);
+    elfuse_inode_table_init(&mount->inode_table);
+    elfuse_snapshot_table_init(&mount->snapshot_table);
+    elfuse_node_table_init(&mount->node_table);
+    elfuse_recorder_init(&mount->recorder);
+
+    return mount;
+}
+
+void
+elfuse_mount_free(struct elfuse_mount *mount)
+{
+    elfuse_recorder_destroy(&mount->recorder);
+    elfuse_node_table_destroy(&mount->node_table);
+    elfuse_snapshot_table_destroy(&mount->snapshot_table);
+    elfuse_inode_table_destroy(&mount->inode_table);
+    elfuse_block_cache_destroy(&mount->block_cache);
+    elfuse_attr_cache_destroy(&mount->attr_cache);
+
+    pthread_cond_destroy(&mount->notify_cond);
+    pthread_mutex_destroy(&mount->notify_lock);
+    pthread_cond_destroy(&mount->spares_cond);
+    pthread_mutex_destroy(&mount->spares_lock);
+    sem_destroy(&mount->init_sem);
+    pthread_mutex_destroy(&mount->flights_lock);
+
+    free(mount->options);
+    free(mount->mountpath);
+    free(mount);
+}
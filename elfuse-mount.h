@@ -0,0 +1,143 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef ELFUSE_MOUNT_H
+#define ELFUSE_MOUNT_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "elfuse-fuse.h"
+#include "elfuse-cache.h"
+#include "elfuse-inode.h"
+#include "elfuse-node.h"
+#include "elfuse-record.h"
+#include "elfuse-snapshot.h"
+
+struct fuse;
+struct fuse_chan;
+struct fuse_session;
+struct elfuse_worker;
+struct elfuse_notification;
+struct elfuse_handlers;
+struct elfuse_deferred;
+struct elfuse_flight;
+
+/* Everything a single mounted file system needs. Emacs creates the mount
+ * and starts its loop thread, FUSE threads are handed the mount by the
+ * loop. */
+struct elfuse_mount {
+    char *mountpath;
+    /* Comma separated FUSE options or NULL */
+    char *options;
+    int threads;
+
+    /* Serve the mount with the low-level FUSE API and a table of inodes
+     * instead of letting libfuse translate inodes to paths */
+    bool lowlevel;
+    /* Pass handlers of a low-level mount inodes, or (PARENT . NAME) for
+     * names without one, instead of paths built from the inode table */
+    bool inode_args;
+
+    /* Requests waiting for Emacs, most recent first. FUSE threads push, the
+     * Emacs thread takes the whole list at once, so a plain CAS stack is
+     * enough. */
+    _Atomic(struct elfuse_call_state *) queue;
+
+    /* Requests waiting for Emacs that identical requests can share */
+    pthread_mutex_t flights_lock;
+    struct elfuse_flight *flights;
+
+    /* The FUSE loop thread, posts init_sem once init_code is set */
+    pthread_t thread;
+    sem_t init_sem;
+    enum elfuse_init_code_enum init_code;
+    /* Set once the FUSE loop and all of its worker threads are gone */
+    atomic_bool loop_exited;
+
+    /* The high-level FUSE instance or the low-level session */
+    struct fuse *fuse;
+    struct fuse_session *session;
+
+    /* Low-level cache timeouts in seconds and options, parsed from the
+     * mount options like libfuse does for the high-level API */
+    double entry_timeout;
+    double attr_timeout;
+    double negative_timeout;
+    int kernel_cache;
+
+    /* Extra FUSE threads serving the session next to the loop thread */
+    struct elfuse_worker *workers;
+    int workers_size;
+
+    /* Threads started while FUSE threads wait for elfuse-reply, one per
+     * request waiting at the same time. Only started once the loop is
+     * serving the session. Spares are detached, SPARES_LIVE counts the
+     * ones not gone yet, including those reaped from the list. */
+    pthread_mutex_t spares_lock;
+    pthread_cond_t spares_cond;
+    struct elfuse_worker *spares;
+    int spares_size;
+    int spares_live;
+    bool spares_open;
+
+    /* Kernel cache invalidations waiting for the notification thread */
+    pthread_mutex_t notify_lock;
+    pthread_cond_t notify_cond;
+    struct elfuse_notification *notify_head;
+    struct elfuse_notification **notify_tail;
+    struct fuse_chan *notify_chan;
+    bool notify_stop;
+    pthread_t notify_thread;
+
+    struct elfuse_attr_cache attr_cache;
+    struct elfuse_block_cache block_cache;
+    struct elfuse_inode_table inode_table;
+    struct elfuse_snapshot_table snapshot_table;
+    /* Inodes handed out to the kernel by the low-level backend */
+    struct elfuse_node_table node_table;
+    /* Where requests are recorded, if anywhere */
+    struct elfuse_recorder recorder;
+
+    /* Lisp handlers, only used by Emacs */
+    struct elfuse_handlers *handlers;
+
+    /* Requests waiting for elfuse-reply and their number, only used by
+     * Emacs */
+    struct elfuse_deferred *deferred;
+    int deferred_size;
+
+    /* Emacs stops the mount once it is done with the current requests */
+    bool stop_pending;
+    /* The Lisp handle is gone, the mount is freed once stopped */
+    bool orphaned;
+    /* The loop is gone, the mount is freed with its handle */
+    bool stopped;
+
+    /* Next mount in the list served by Emacs */
+    struct elfuse_mount *next;
+};
+
+/* A mount of MOUNTPATH, takes over MOUNTPATH and OPTIONS */
+struct elfuse_mount *
+elfuse_mount_new(char *mountpath, char *options, int threads, bool lowlevel);
+
+/* Free a mount that was never started or whose loop has exited */
+void
+elfuse_mount_free(struct elfuse_mount *mount);
+
+#endif //ELFUSE_MOUNT_H
@@ -0,0 +1,402 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "elfuse-node.h"
+#include "elfuse-cache.h"
+
+#define NODE_TABLE_INITIAL_BUCKETS 256
+
+static uint64_t
+name_hash(uint64_t parent, const char *name)
+{
+    return elfuse_hash_path(name) ^ (parent * 0x9e3779b97f4a7c15ULL);
+}
+
+static struct elfuse_node **
+find_ino(struct elfuse_node_table *table, uint64_t ino)
+{
+    struct elfuse_node **node = &table->by_ino[ino % table->by_ino_size];
+    while (*node != NULL && (*node)->ino != ino)
+        node = &(*node)->ino_next;
+    return node;
+}
+
+static struct elfuse_node **
+find_name(struct elfuse_node_table *table, uint64_t parent, const char *name, uint64_t hash)
+{
+    struct elfuse_node **node = &table->by_name[hash % table->by_name_size];
+    while (*node != NULL) {
+        if ((*node)->name_hash == hash && (*node)->parent == parent && strcmp((*node)->name, name) == 0)
+            break;
+        node = &(*node)->name_next;
+    }
+    return node;
+}
+
+static void
+grow(struct elfuse_node_table *table)
+{
+    size_t size = table->by_ino_size * 2;
+    struct elfuse_node **by_ino = calloc(size, sizeof(by_ino[0]));
+    struct elfuse_node **by_name = calloc(size, sizeof(by_name[0]));
+    if (by_ino == NULL || by_name == NULL) {
+        free(by_ino);
+        free(by_name);
+        return;
+    }
+
+    for (size_t i = 0; i < table->by_ino_size; i++) {
+        struct elfuse_node *node = table->by_ino[i];
+        while (node != NULL) {
+            struct elfuse_node *next = node->ino_next;
+            node->ino_next = by_ino[node->ino % size];
+            by_ino[node->ino % size] = node;
+            node = next;
+        }
+    }
+    for (size_t i = 0; i < table->by_name_size; i++) {
+        struct elfuse_node *node = table->by_name[i];
+        while (node != NULL) {
+            struct elfuse_node *next = node->name_next;
+            node->name_next = by_name[node->name_hash % size];
+            by_name[node->name_hash % size] = node;
+            node = next;
+        }
+    }
+
+    free(table->by_ino);
+    free(table->by_name);
+    table->by_ino = by_ino;
+    table->by_name = by_name;
+    table->by_ino_size = table->by_name_size = size;
+}
+
+static void
+link_name(struct elfuse_node_table *table, struct elfuse_node *node)
+{
+    size_t bucket = node->name_hash % table->by_name_size;
+    node->name_next = table->by_name[bucket];
+    table->by_name[bucket] = node;
+    node->unlinked = false;
+}
+
+static void
+unlink_name(struct elfuse_node_table *table, struct elfuse_node *node)
+{
+    if (node->unlinked)
+        return;
+    struct elfuse_node **found = find_name(table, node->parent, node->name, node->name_hash);
+    if (*found == node)
+        *found = node->name_next;
+    node->name_next = NULL;
+    node->unlinked = true;
+}
+
+/* Path of NODE built from the names of its directories up to the root,
+ * followed by NAME unless NULL */
+static char *
+build_path(const struct elfuse_node *node, const char *name)
+{
+    size_t name_size = name != NULL ? strlen(name) : 0;
+    size_t size = name != NULL ? name_size + 1 : 0;
+    for (const struct elfuse_node *dir = node; dir->dir != NULL; dir = dir->dir)
+        size += dir->name_size + 1;
+    if (size == 0)
+        return strdup("/");
+
+    char *path = malloc(size + 1);
+    if (path == NULL)
+        return NULL;
+
+    /* Filled from the end */
+    char *end = path + size;
+    *end = '\0';
+    if (name != NULL) {
+        end -= name_size;
+        memcpy(end, name, name_size);
+        *--end = '/';
+    }
+    for (const struct elfuse_node *dir = node; dir->dir != NULL; dir = dir->dir) {
+        end -= dir->name_size;
+        memcpy(end, dir->name, dir->name_size);
+        *--end = '/';
+    }
+    return path;
+}
+
+/* Free NODE once the kernel forgot it and nothing refers to it, the same
+ * for the directories it kept around */
+static void
+release_node(struct elfuse_node_table *table, struct elfuse_node *node)
+{
+    while (node != NULL && node->ino != ELFUSE_ROOT_INO && node->nlookup == 0 && node->children == 0) {
+        struct elfuse_node *dir = node->dir;
+        unlink_name(table, node);
+        struct elfuse_node **found = find_ino(table, node->ino);
+        if (*found == node)
+            *found = node->ino_next;
+        free(node->name);
+        free(node);
+        table->nodes_size--;
+
+        dir->children--;
+        node = dir;
+    }
+}
+
+void
+elfuse_node_table_init(struct elfuse_node_table *table)
+{
+    pthread_rwlock_init(&table->lock, NULL);
+    table->by_ino_size = table->by_name_size = NODE_TABLE_INITIAL_BUCKETS;
+    table->by_ino = calloc(table->by_ino_size, sizeof(table->by_ino[0]));
+    table->by_name = calloc(table->by_name_size, sizeof(table->by_name[0]));
+    table->nodes_size = 0;
+    table->next_ino = ELFUSE_ROOT_INO + 1;
+
+    /* The root is never looked up nor forgotten */
+    struct elfuse_node *root = calloc(1, sizeof(*root));
+    if (root == NULL)
+        return;
+    root->ino = ELFUSE_ROOT_INO;
+    root->name = strdup("");
+    root->nlookup = 1;
+    root->unlinked = true;
+    *find_ino(table, root->ino) = root;
+    table->nodes_size++;
+}
+
+char *
+elfuse_node_path(struct elfuse_node_table *table, uint64_t ino)
+{
+    char *path = NULL;
+
+    pthread_rwlock_rdlock(&table->lock);
+    struct elfuse_node *node = *find_ino(table, ino);
+    if (node != NULL)
+        path = build_path(node, NULL);
+    pthread_rwlock_unlock(&table->lock);
+
+    return path;
+}
+
+char *
+elfuse_node_child_path(struct elfuse_node_table *table, uint64_t parent, const char *name)
+{
+    char *path = NULL;
+
+    pthread_rwlock_rdlock(&table->lock);
+    struct elfuse_node *node = *find_ino(table, parent);
+    if (node != NULL)
+        path = build_path(node, name);
+    pthread_rwlock_unlock(&table->lock);
+
+    return path;
+}
+
+uint64_t
+elfuse_node_find(struct elfuse_node_table *table, uint64_t parent, const char *name)
+{
+    uint64_t ino = 0;
+
+    pthread_rwlock_rdlock(&table->lock);
+    struct elfuse_node *node = *find_name(table, parent, name, name_hash(parent, name));
+    if (node != NULL)
+        ino = node->ino;
+    pthread_rwlock_unlock(&table->lock);
+
+    return ino;
+}
+
+uint64_t
+elfuse_node_resolve(struct elfuse_node_table *table, const char *path)
+{
+    uint64_t ino = ELFUSE_ROOT_INO;
+    char name[strlen(path) + 1];
+
+    pthread_rwlock_rdlock(&table->lock);
+    while (ino != 0 && *path != '\0') {
+        size_t name_size = strcspn(path, "/");
+        if (name_size > 0) {
+            memcpy(name, path, name_size);
+            name[name_size] = '\0';
+            struct elfuse_node *node = *find_name(table, ino, name, name_hash(ino, name));
+            ino = node != NULL ? node->ino : 0;
+        }
+        path += name_size;
+        if (*path == '/')
+            path++;
+    }
+    pthread_rwlock_unlock(&table->lock);
+
+    return ino;
+}
+
+uint64_t *
+elfuse_node_below(struct elfuse_node_table *table, uint64_t ino, size_t *size)
+{
+    *size = 0;
+
+    pthread_rwlock_rdlock(&table->lock);
+    uint64_t *inos = malloc(table->nodes_size * sizeof(inos[0]));
+    for (size_t i = 0; inos != NULL && i < table->by_ino_size; i++) {
+        for (struct elfuse_node *node = table->by_ino[i]; node != NULL; node = node->ino_next) {
+            const struct elfuse_node *dir = node;
+            while (dir != NULL && dir->ino != ino)
+                dir = dir->dir;
+            if (dir != NULL)
+                inos[(*size)++] = node->ino;
+        }
+    }
+    pthread_rwlock_unlock(&table->lock);
+
+    return inos;
+}
+
+uint64_t
+elfuse_node_lookup(struct elfuse_node_table *table, uint64_t parent, const char *name)
+{
+    uint64_t hash = name_hash(parent, name);
+    uint64_t ino = 0;
+
+    pthread_rwlock_wrlock(&table->lock);
+    struct elfuse_node *node = *find_name(table, parent, name, hash);
+    if (node != NULL) {
+        node->nlookup++;
+        ino = node->ino;
+        goto out;
+    }
+
+    struct elfuse_node *dir = *find_ino(table, parent);
+    if (dir == NULL)
+        goto out;
+
+    node = calloc(1, sizeof(*node));
+    if (node == NULL)
+        goto out;
+    node->name = strdup(name);
+    if (node->name == NULL) {
+        free(node);
+        goto out;
+    }
+    node->name_size = strlen(name);
+    node->ino = table->next_ino++;
+    node->parent = parent;
+    node->dir = dir;
+    dir->children++;
+    node->nlookup = 1;
+    node->name_hash = hash;
+
+    if (table->nodes_size >= table->by_ino_size * 2)
+        grow(table);
+    struct elfuse_node **slot = find_ino(table, node->ino);
+    *slot = node;
+    link_name(table, node);
+    table->nodes_size++;
+    ino = node->ino;
+
+out:
+    pthread_rwlock_unlock(&table->lock);
+    return ino;
+}
+
+void
+elfuse_node_forget(struct elfuse_node_table *table, uint64_t ino, uint64_t nlookup)
+{
+    if (ino == ELFUSE_ROOT_INO)
+        return;
+
+    pthread_rwlock_wrlock(&table->lock);
+    struct elfuse_node *node = *find_ino(table, ino);
+    if (node != NULL) {
+        node->nlookup = node->nlookup > nlookup ? node->nlookup - nlookup : 0;
+        release_node(table, node);
+    }
+    pthread_rwlock_unlock(&table->lock);
+}
+
+void
+elfuse_node_unlink(struct elfuse_node_table *table, uint64_t parent, const char *name)
+{
+    pthread_rwlock_wrlock(&table->lock);
+    struct elfuse_node *node = *find_name(table, parent, name, name_hash(parent, name));
+    if (node != NULL)
+        unlink_name(table, node);
+    pthread_rwlock_unlock(&table->lock);
+}
+
+void
+elfuse_node_rename(struct elfuse_node_table *table, uint64_t parent, const char *name,
+                   uint64_t newparent, const char *newname)
+{
+    pthread_rwlock_wrlock(&table->lock);
+    struct elfuse_node *node = *find_name(table, parent, name, name_hash(parent, name));
+    struct elfuse_node *dir = *find_ino(table, newparent);
+    if (node == NULL || dir == NULL)
+        goto out;
+
+    char *new_name = strdup(newname);
+    if (new_name == NULL)
+        goto out;
+
+    /* The target is replaced */
+    uint64_t hash = name_hash(newparent, newname);
+    struct elfuse_node *target = *find_name(table, newparent, newname, hash);
+    if (target != NULL && target != node)
+        unlink_name(table, target);
+
+    unlink_name(table, node);
+    free(node->name);
+    node->name = new_name;
+    node->name_size = strlen(new_name);
+    node->parent = newparent;
+    node->name_hash = hash;
+    link_name(table, node);
+
+    /* Everything below a renamed directory moves along with it */
+    struct elfuse_node *old_dir = node->dir;
+    dir->children++;
+    node->dir = dir;
+    old_dir->children--;
+    release_node(table, old_dir);
+
+out:
+    pthread_rwlock_unlock(&table->lock);
+}
+
+void
+elfuse_node_table_destroy(struct elfuse_node_table *table)
+{
+    for (size_t i = 0; i < table->by_ino_size; i++) {
+        struct elfuse_node *node = table->by_ino[i];
+        while (node != NULL) {
+            struct elfuse_node *next = node->ino_next;
+            free(node->name);
+            free(node);
+            node = next;
+        }
+    }
+    free(table->by_ino);
+    free(table->by_name);
+    table->by_ino = table->by_name = NULL;
+    table->by_ino_size = table->by_name_size = 0;
+    table->nodes_size = 0;
+    pthread_rwlock_destroy(&table->lock);
+}
@@ -0,0 +1,117 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef ELFUSE_NODE_H
+#define ELFUSE_NODE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Inodes handed out by the low-level backend. The kernel looks names up
+ * in a directory, gets an inode number and refers to the file by that
+ * number until it forgets it. */
+
+/* The mount point, always known */
+#define ELFUSE_ROOT_INO 1
+
+struct elfuse_node {
+    uint64_t ino;
+    uint64_t parent;
+    char *name;
+    size_t name_size;
+
+    /* The node of PARENT, NULL for the root. Paths handlers get are built
+     * from the names up to the root, so renames only touch the node. */
+    struct elfuse_node *dir;
+    /* Nodes whose DIR this is, a node stays around until they are gone */
+    uint64_t children;
+
+    /* Kernel lookups not forgotten yet */
+    uint64_t nlookup;
+
+    /* Removed from its directory but still known to the kernel */
+    bool unlinked;
+
+    /* Hash chains by inode and by parent and name */
+    uint64_t name_hash;
+    struct elfuse_node *ino_next;
+    struct elfuse_node *name_next;
+};
+
+struct elfuse_node_table {
+    /* Paths are built under the read lock */
+    pthread_rwlock_t lock;
+
+    struct elfuse_node **by_ino;
+    size_t by_ino_size;
+
+    /* Names of every directory share a single table keyed by the parent
+     * inode and the name */
+    struct elfuse_node **by_name;
+    size_t by_name_size;
+
+    size_t nodes_size;
+    uint64_t next_ino;
+};
+
+void
+elfuse_node_table_init(struct elfuse_node_table *table);
+
+/* A copy of the path of INO, NULL if the inode is unknown */
+char *
+elfuse_node_path(struct elfuse_node_table *table, uint64_t ino);
+
+/* A copy of the path of NAME in the directory PARENT, NULL if the
+ * directory is unknown */
+char *
+elfuse_node_child_path(struct elfuse_node_table *table, uint64_t parent, const char *name);
+
+/* Inode of NAME in PARENT, 0 if it was never looked up */
+uint64_t
+elfuse_node_find(struct elfuse_node_table *table, uint64_t parent, const char *name);
+
+/* Inode of PATH if every name in it was looked up, 0 otherwise */
+uint64_t
+elfuse_node_resolve(struct elfuse_node_table *table, const char *path);
+
+/* INO and the inodes below it, a malloc'ed array of SIZE or NULL */
+uint64_t *
+elfuse_node_below(struct elfuse_node_table *table, uint64_t ino, size_t *size);
+
+/* Inode of NAME in PARENT for the kernel, creating it on the first
+ * lookup. Every call has to be matched by a forget. 0 on failure. */
+uint64_t
+elfuse_node_lookup(struct elfuse_node_table *table, uint64_t parent, const char *name);
+
+/* The kernel dropped NLOOKUP references to INO */
+void
+elfuse_node_forget(struct elfuse_node_table *table, uint64_t ino, uint64_t nlookup);
+
+/* NAME was removed from PARENT, its inode lives on until forgotten */
+void
+elfuse_node_unlink(struct elfuse_node_table *table, uint64_t parent, const char *name);
+
+/* NAME in PARENT is now NEWNAME in NEWPARENT, paths below it follow
+ * without being touched */
+void
+elfuse_node_rename(struct elfuse_node_table *table, uint64_t parent, const char *name,
+                   uint64_t newparent, const char *newname);
+
+void
+elfuse_node_table_destroy(struct elfuse_node_table *table);
+
+#endif //ELFUSE_NODE_H
@@ -0,0 +1,63 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef ELFUSE_PROBES_H
+#define ELFUSE_PROBES_H
+
+/* USDT probes on the request lifecycle for perf, bpftrace and friends,
+ * see tools/. A disabled probe is a single nop. Without <sys/sdt.h> (or
+ * with ELFUSE_NO_PROBES defined) probes compile to nothing. */
+
+#if !defined(ELFUSE_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define ELFUSE_HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef ELFUSE_HAVE_PROBES
+#define ELFUSE_PROBE0(name) DTRACE_PROBE(elfuse, name)
+#define ELFUSE_PROBE1(name, a1) DTRACE_PROBE1(elfuse, name, a1)
+#define ELFUSE_PROBE2(name, a1, a2) DTRACE_PROBE2(elfuse, name, a1, a2)
+#define ELFUSE_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(elfuse, name, a1, a2, a3)
+#define ELFUSE_PROBE4(name, a1, a2, a3, a4) DTRACE_PROBE4(elfuse, name, a1, a2, a3, a4)
+#define ELFUSE_PROBE5(name, a1, a2, a3, a4, a5) DTRACE_PROBE5(elfuse, name, a1, a2, a3, a4, a5)
+#else
+/* Arguments are only looked at by sizeof so they are never evaluated */
+#define ELFUSE_PROBE0(name) do {} while (0)
+#define ELFUSE_PROBE1(name, a1) do { (void)sizeof(a1); } while (0)
+#define ELFUSE_PROBE2(name, a1, a2) do { (void)sizeof(a1); (void)sizeof(a2); } while (0)
+#define ELFUSE_PROBE3(name, a1, a2, a3) \
+    do { (void)sizeof(a1); (void)sizeof(a2); (void)sizeof(a3); } while (0)
+#define ELFUSE_PROBE4(name, a1, a2, a3, a4) \
+    do { (void)sizeof(a1); (void)sizeof(a2); (void)sizeof(a3); (void)sizeof(a4); } while (0)
+#define ELFUSE_PROBE5(name, a1, a2, a3, a4, a5) \
+    do { (void)sizeof(a1); (void)sizeof(a2); (void)sizeof(a3); (void)sizeof(a4); (void)sizeof(a5); } while (0)
+#endif
+
+/* Probes, the call pointer identifies a request across probes and op
+ * codes are enum elfuse_request_state values:
+ *
+ *   request_enqueue(call, op, path, size, offset)  FUSE thread queued a request
+ *   signal_sent(method)                            FUSE thread woke Emacs up
+ *   dispatch_begin()                               Emacs started draining queues
+ *   handler_enter(call, op, path)                  Lisp handler called
+ *   handler_return(call, op, path)                 Lisp handler returned
+ *   reply(call, op, response, errno)               Emacs released the FUSE thread
+ *   dispatch_end(handled)                          Emacs drained the queues
+ *   request_done(call, op, errno, size)            FUSE thread got the results
+ */
+
+#endif //ELFUSE_PROBES_H
@@ -0,0 +1,136 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "elfuse-record.h"
+#include "elfuse-cache.h"
+
+/* Records are written in large chunks, a crash loses the tail */
+#define RECORD_BUFFER_SIZE (1024 * 1024)
+
+/* Paths longer than this are cut */
+#define RECORD_PATH_MAX UINT16_MAX
+
+struct elfuse_record_file *
+elfuse_record_file_open(const char *path)
+{
+    struct elfuse_record_file *file = calloc(1, sizeof(*file));
+    if (file == NULL)
+        return NULL;
+
+    file->file = fopen(path, "wb");
+    if (file->file == NULL) {
+        free(file);
+        return NULL;
+    }
+    setvbuf(file->file, NULL, _IOFBF, RECORD_BUFFER_SIZE);
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    struct elfuse_record_header header = {
+        .magic = ELFUSE_RECORD_MAGIC,
+        .version = ELFUSE_RECORD_VERSION,
+        .record_size = sizeof(struct elfuse_record),
+        .start_ns = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec,
+    };
+    if (fwrite(&header, sizeof(header), 1, file->file) != 1) {
+        int err = errno;
+        fclose(file->file);
+        free(file);
+        errno = err;
+        return NULL;
+    }
+
+    pthread_mutex_init(&file->lock, NULL);
+    file->start_ns = elfuse_now_ns();
+    atomic_init(&file->refs, 1);
+    atomic_init(&file->dropped, 0);
+    return file;
+}
+
+void
+elfuse_record_file_release(struct elfuse_record_file *file)
+{
+    if (file == NULL || atomic_fetch_sub(&file->refs, 1) != 1)
+        return;
+
+    fclose(file->file);
+    pthread_mutex_destroy(&file->lock);
+    free(file);
+}
+
+void
+elfuse_recorder_init(struct elfuse_recorder *recorder)
+{
+    pthread_rwlock_init(&recorder->lock, NULL);
+    atomic_init(&recorder->file, NULL);
+}
+
+void
+elfuse_recorder_set(struct elfuse_recorder *recorder, struct elfuse_record_file *file)
+{
+    pthread_rwlock_wrlock(&recorder->lock);
+    struct elfuse_record_file *old = atomic_exchange(&recorder->file, file);
+    pthread_rwlock_unlock(&recorder->lock);
+
+    elfuse_record_file_release(old);
+}
+
+void
+elfuse_recorder_append(struct elfuse_recorder *recorder, struct elfuse_record *record,
+                       const char *path, const char *newpath)
+{
+    size_t path_size = path != NULL ? strlen(path) : 0;
+    size_t newpath_size = newpath != NULL ? strlen(newpath) : 0;
+    record->path_size = path_size < RECORD_PATH_MAX ? path_size : RECORD_PATH_MAX;
+    record->newpath_size = newpath_size < RECORD_PATH_MAX ? newpath_size : RECORD_PATH_MAX;
+
+    pthread_rwlock_rdlock(&recorder->lock);
+    struct elfuse_record_file *file = atomic_load(&recorder->file);
+    if (file == NULL) {
+        pthread_rwlock_unlock(&recorder->lock);
+        return;
+    }
+
+    /* Requests that arrived before the file was switched to count from
+     * its start */
+    record->time_ns = record->time_ns > file->start_ns ? record->time_ns - file->start_ns : 0;
+
+    /* Records of a request are never interleaved with other records */
+    pthread_mutex_lock(&file->lock);
+    bool written = fwrite(record, sizeof(*record), 1, file->file) == 1
+        && (record->path_size == 0
+            || fwrite(path, 1, record->path_size, file->file) == record->path_size)
+        && (record->newpath_size == 0
+            || fwrite(newpath, 1, record->newpath_size, file->file) == record->newpath_size);
+    pthread_mutex_unlock(&file->lock);
+    if (!written)
+        atomic_fetch_add(&file->dropped, 1);
+
+    pthread_rwlock_unlock(&recorder->lock);
+}
+
+void
+elfuse_recorder_destroy(struct elfuse_recorder *recorder)
+{
+    elfuse_recorder_set(recorder, NULL);
+    pthread_rwlock_destroy(&recorder->lock);
+}
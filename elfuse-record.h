@@ -0,0 +1,116 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef ELFUSE_RECORD_H
+#define ELFUSE_RECORD_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "elfuse-fuse.h"
+
+/* Request traces. While a mount is recorded FUSE threads append every
+ * request they get to a trace file, whether Emacs or a cache answered it,
+ * and bench/replay re-issues the trace against a mount. The file starts
+ * with a header followed by records, each record followed by its paths
+ * without NULs. Numbers are in host byte order. */
+
+#define ELFUSE_RECORD_MAGIC "ELFTRACE"
+#define ELFUSE_RECORD_VERSION 1
+
+struct elfuse_record_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    /* Wall clock time the trace starts at in ns since the epoch */
+    uint64_t start_ns;
+};
+
+struct elfuse_record {
+    /* Arrival time in ns since the start of the trace */
+    uint64_t time_ns;
+    /* How long the request took to answer */
+    uint64_t duration_ns;
+    int64_t offset;
+    /* Bytes read or written, the new size for truncate */
+    uint64_t size;
+    /* The client process, 0 if the kernel didn't say */
+    uint32_t pid;
+    /* Open flags for open and create */
+    uint32_t flags;
+    /* The reply: bytes for reads and writes, a negated errno on failure */
+    int32_t result;
+    uint16_t path_size;
+    /* The new path of renames */
+    uint16_t newpath_size;
+    /* enum elfuse_request_state */
+    uint8_t op;
+    uint8_t reserved[7];
+};
+
+/* A trace file, shared by the mounts recorded into it */
+struct elfuse_record_file {
+    pthread_mutex_t lock;
+    FILE *file;
+    uint64_t start_ns;
+    atomic_uint refs;
+    /* Records that didn't make it to the file */
+    atomic_ullong dropped;
+};
+
+/* Create a trace file at PATH, NULL with errno set on failure */
+struct elfuse_record_file *
+elfuse_record_file_open(const char *path);
+
+/* Drop a reference, the last one flushes and closes the file */
+void
+elfuse_record_file_release(struct elfuse_record_file *file);
+
+/* What a mount is being recorded into. FUSE threads hold the read side
+ * of the lock while appending, Emacs takes the write side to switch
+ * files. */
+struct elfuse_recorder {
+    pthread_rwlock_t lock;
+    _Atomic(struct elfuse_record_file *) file;
+};
+
+void
+elfuse_recorder_init(struct elfuse_recorder *recorder);
+
+/* Record into FILE from now on, NULL stops recording. Takes over the
+ * reference to FILE. */
+void
+elfuse_recorder_set(struct elfuse_recorder *recorder, struct elfuse_record_file *file);
+
+/* Is anything recorded at all? Cheap enough to check on every request. */
+static inline bool
+elfuse_recorder_active(struct elfuse_recorder *recorder)
+{
+    return atomic_load_explicit(&recorder->file, memory_order_relaxed) != NULL;
+}
+
+/* Append RECORD of a request on PATH and NEWPATH (or NULL), its time_ns
+ * is an elfuse_now_ns time. Sizes of the paths are filled in. */
+void
+elfuse_recorder_append(struct elfuse_recorder *recorder, struct elfuse_record *record,
+                       const char *path, const char *newpath);
+
+void
+elfuse_recorder_destroy(struct elfuse_recorder *recorder);
+
+#endif //ELFUSE_RECORD_H
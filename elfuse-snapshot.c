@@ -0,0 +1,181 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "elfuse-snapshot.h"
+#include "elfuse-cache.h"
+
+#define SNAPSHOT_TABLE_BUCKETS 64
+
+static struct elfuse_snapshot_entry **
+find_entry(struct elfuse_snapshot_table *table, const char *path, uint64_t hash)
+{
+    struct elfuse_snapshot_entry **entry = &table->buckets[hash % table->buckets_size];
+    while (*entry != NULL) {
+        if ((*entry)->hash == hash && strcmp((*entry)->path, path) == 0)
+            break;
+        entry = &(*entry)->next;
+    }
+    return entry;
+}
+
+void
+elfuse_snapshot_table_init(struct elfuse_snapshot_table *table)
+{
+    pthread_rwlock_init(&table->lock, NULL);
+    table->buckets_size = SNAPSHOT_TABLE_BUCKETS;
+    table->buckets = calloc(table->buckets_size, sizeof(table->buckets[0]));
+    table->entries_size = 0;
+}
+
+struct elfuse_snapshot *
+elfuse_snapshot_new(size_t size)
+{
+    struct elfuse_snapshot *snapshot = malloc(sizeof(*snapshot) + size + 1);
+    if (snapshot == NULL)
+        return NULL;
+    atomic_init(&snapshot->refs, 1);
+    snapshot->size = size;
+    return snapshot;
+}
+
+bool
+elfuse_snapshot_table_set(struct elfuse_snapshot_table *table, const char *path, struct elfuse_snapshot *snapshot)
+{
+    uint64_t hash = elfuse_hash_path(path);
+    struct elfuse_snapshot *old = NULL;
+
+    pthread_rwlock_wrlock(&table->lock);
+    struct elfuse_snapshot_entry *entry = *find_entry(table, path, hash);
+    if (entry == NULL) {
+        entry = malloc(sizeof(*entry));
+        if (entry != NULL)
+            entry->path = strdup(path);
+        if (entry == NULL || entry->path == NULL) {
+            pthread_rwlock_unlock(&table->lock);
+            free(entry);
+            elfuse_snapshot_release(snapshot);
+            return false;
+        }
+        entry->hash = hash;
+        entry->snapshot = NULL;
+        size_t bucket = hash % table->buckets_size;
+        entry->next = table->buckets[bucket];
+        table->buckets[bucket] = entry;
+        table->entries_size++;
+    }
+    old = entry->snapshot;
+    entry->snapshot = snapshot;
+    atomic_store(&entry->stale, false);
+    pthread_rwlock_unlock(&table->lock);
+
+    /* Readers still copying from the old snapshot hold their own reference */
+    if (old != NULL)
+        elfuse_snapshot_release(old);
+
+    return true;
+}
+
+void
+elfuse_snapshot_table_remove(struct elfuse_snapshot_table *table, const char *path)
+{
+    pthread_rwlock_wrlock(&table->lock);
+    struct elfuse_snapshot_entry **found = find_entry(table, path, elfuse_hash_path(path));
+    struct elfuse_snapshot_entry *entry = *found;
+    if (entry != NULL) {
+        *found = entry->next;
+        table->entries_size--;
+    }
+    pthread_rwlock_unlock(&table->lock);
+
+    if (entry != NULL) {
+        elfuse_snapshot_release(entry->snapshot);
+        free(entry->path);
+        free(entry);
+    }
+}
+
+bool
+elfuse_snapshot_table_empty(struct elfuse_snapshot_table *table)
+{
+    pthread_rwlock_rdlock(&table->lock);
+    bool empty = table->entries_size == 0;
+    pthread_rwlock_unlock(&table->lock);
+
+    return empty;
+}
+
+bool
+elfuse_snapshot_table_contains(struct elfuse_snapshot_table *table, const char *path)
+{
+    pthread_rwlock_rdlock(&table->lock);
+    bool found = *find_entry(table, path, elfuse_hash_path(path)) != NULL;
+    pthread_rwlock_unlock(&table->lock);
+
+    return found;
+}
+
+struct elfuse_snapshot *
+elfuse_snapshot_table_get(struct elfuse_snapshot_table *table, const char *path)
+{
+    struct elfuse_snapshot *snapshot = NULL;
+
+    pthread_rwlock_rdlock(&table->lock);
+    struct elfuse_snapshot_entry *entry = *find_entry(table, path, elfuse_hash_path(path));
+    if (entry != NULL && !atomic_load(&entry->stale)) {
+        snapshot = entry->snapshot;
+        atomic_fetch_add(&snapshot->refs, 1);
+    }
+    pthread_rwlock_unlock(&table->lock);
+
+    return snapshot;
+}
+
+void
+elfuse_snapshot_table_mark_stale(struct elfuse_snapshot_table *table, const char *path)
+{
+    pthread_rwlock_rdlock(&table->lock);
+    struct elfuse_snapshot_entry *entry = *find_entry(table, path, elfuse_hash_path(path));
+    if (entry != NULL)
+        atomic_store(&entry->stale, true);
+    pthread_rwlock_unlock(&table->lock);
+}
+
+void
+elfuse_snapshot_release(struct elfuse_snapshot *snapshot)
+{
+    if (snapshot != NULL && atomic_fetch_sub(&snapshot->refs, 1) == 1)
+        free(snapshot);
+}
+
+void
+elfuse_snapshot_table_destroy(struct elfuse_snapshot_table *table)
+{
+    for (size_t i = 0; i < table->buckets_size; i++) {
+        while (table->buckets[i] != NULL) {
+            struct elfuse_snapshot_entry *entry = table->buckets[i];
+            table->buckets[i] = entry->next;
+            elfuse_snapshot_release(entry->snapshot);
+            free(entry->path);
+            free(entry);
+        }
+    }
+    free(table->buckets);
+    pthread_rwlock_destroy(&table->lock);
+}
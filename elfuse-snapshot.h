@@ -0,0 +1,93 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef ELFUSE_SNAPSHOT_H
+#define ELFUSE_SNAPSHOT_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Files registered from Emacs are served by FUSE threads from immutable
+ * snapshots of their content. Emacs replaces a snapshot as a whole, FUSE
+ * threads keep a reference to the snapshot they are copying from. */
+
+struct elfuse_snapshot {
+    atomic_uint refs;
+    size_t size;
+    char data[];
+};
+
+struct elfuse_snapshot_entry {
+    char *path;
+    uint64_t hash;
+    struct elfuse_snapshot *snapshot;
+
+    /* Set when the content was changed through the file system and the
+     * snapshot is behind until Emacs takes a new one */
+    atomic_bool stale;
+
+    struct elfuse_snapshot_entry *next;
+};
+
+/* A path to snapshot table. Lookups only take the read side of the lock,
+ * replacing a snapshot or changing registrations takes the write side. */
+struct elfuse_snapshot_table {
+    pthread_rwlock_t lock;
+    struct elfuse_snapshot_entry **buckets;
+    size_t buckets_size;
+    size_t entries_size;
+};
+
+void
+elfuse_snapshot_table_init(struct elfuse_snapshot_table *table);
+
+/* A snapshot of SIZE bytes to be filled in, with room for a trailing NUL */
+struct elfuse_snapshot *
+elfuse_snapshot_new(size_t size);
+
+/* Register PATH with SNAPSHOT or replace its snapshot. The table takes
+ * over the reference, even on failure. */
+bool
+elfuse_snapshot_table_set(struct elfuse_snapshot_table *table, const char *path, struct elfuse_snapshot *snapshot);
+
+void
+elfuse_snapshot_table_remove(struct elfuse_snapshot_table *table, const char *path);
+
+/* Is nothing registered? */
+bool
+elfuse_snapshot_table_empty(struct elfuse_snapshot_table *table);
+
+/* Is PATH registered at all, fresh or not? */
+bool
+elfuse_snapshot_table_contains(struct elfuse_snapshot_table *table, const char *path);
+
+/* Get a reference to the fresh snapshot of PATH, NULL if there's none */
+struct elfuse_snapshot *
+elfuse_snapshot_table_get(struct elfuse_snapshot_table *table, const char *path);
+
+/* Stop serving the snapshot of PATH until it's replaced */
+void
+elfuse_snapshot_table_mark_stale(struct elfuse_snapshot_table *table, const char *path);
+
+void
+elfuse_snapshot_release(struct elfuse_snapshot *snapshot);
+
+void
+elfuse_snapshot_table_destroy(struct elfuse_snapshot_table *table);
+
+#endif //ELFUSE_SNAPSHOT_H
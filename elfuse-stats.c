@@ -0,0 +1,149 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <errno.h>
+#include <stddef.h>
+
+#include "elfuse-stats.h"
+
+#define SUB_BITS ELFUSE_HISTOGRAM_SUB_BITS
+#define SUB_SIZE (1ULL << SUB_BITS)
+
+struct elfuse_op_stats elfuse_op_stats[ELFUSE_STATS_OPS];
+
+static size_t
+histogram_index(uint64_t value)
+{
+    if (value >= 1ULL << ELFUSE_HISTOGRAM_MAX_BITS)
+        value = (1ULL << ELFUSE_HISTOGRAM_MAX_BITS) - 1;
+    if (value < SUB_SIZE)
+        return value;
+
+    int bits = 63 - __builtin_clzll(value);
+    int shift = bits - SUB_BITS;
+    return ((size_t)(shift + 1) << SUB_BITS) + ((value >> shift) & (SUB_SIZE - 1));
+}
+
+/* The largest value in bucket INDEX */
+static uint64_t
+histogram_bucket_max(size_t index)
+{
+    if (index < SUB_SIZE)
+        return index;
+
+    int shift = (int)(index >> SUB_BITS) - 1;
+    uint64_t low = (SUB_SIZE + (index & (SUB_SIZE - 1))) << shift;
+    return low + (1ULL << shift) - 1;
+}
+
+static void
+histogram_record(struct elfuse_histogram *histogram, uint64_t value)
+{
+    atomic_fetch_add_explicit(&histogram->buckets[histogram_index(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum, value, memory_order_relaxed);
+
+    unsigned long long max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    while (value > max && !atomic_compare_exchange_weak(&histogram->max, &max, value));
+}
+
+uint64_t
+elfuse_histogram_percentile(struct elfuse_histogram *histogram, double fraction)
+{
+    /* Buckets are updated while we look, count what is actually there */
+    uint64_t total = 0;
+    for (size_t i = 0; i < ELFUSE_HISTOGRAM_BUCKETS; i++)
+        total += atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+    if (total == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t)(fraction * total);
+    if (rank < 1)
+        rank = 1;
+    if (rank > total)
+        rank = total;
+
+    uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < ELFUSE_HISTOGRAM_BUCKETS; i++) {
+        seen += atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+        if (seen >= rank) {
+            uint64_t value = histogram_bucket_max(i);
+            return value < max ? value : max;
+        }
+    }
+    return max;
+}
+
+int
+elfuse_call_errno(const struct elfuse_call_state *call)
+{
+    switch (call->response_state) {
+    case RESPONSE_SUCCESS:
+        return 0;
+    case RESPONSE_SIGNAL_ERROR:
+        return call->response_err_code > 0 ? call->response_err_code : EIO;
+    default:
+        return ENOSYS;
+    }
+}
+
+void
+elfuse_stats_record(const struct elfuse_call_state *call, uint64_t done_ns)
+{
+    if (call->request_state == WAITING_NONE || call->request_state >= ELFUSE_STATS_OPS)
+        return;
+    struct elfuse_op_stats *stats = &elfuse_op_stats[call->request_state];
+
+    atomic_fetch_add_explicit(&stats->count, 1, memory_order_relaxed);
+    int err = elfuse_call_errno(call);
+    if (err != 0) {
+        atomic_fetch_add_explicit(&stats->errors, 1, memory_order_relaxed);
+        if (err >= ELFUSE_STATS_ERRNOS)
+            err = ELFUSE_STATS_ERRNOS - 1;
+        atomic_fetch_add_explicit(&stats->errnos[err], 1, memory_order_relaxed);
+    }
+
+    /* Requests failed before Emacs took them spent all their time queued */
+    uint64_t taken = call->taken_ns != 0 ? call->taken_ns : done_ns;
+    uint64_t handled = call->handled_ns > taken ? call->handled_ns : taken;
+    if (handled > done_ns)
+        handled = done_ns;
+    if (taken > handled)
+        taken = handled;
+    uint64_t queued = call->queued_ns < taken ? call->queued_ns : taken;
+
+    histogram_record(&stats->phases[PHASE_QUEUED], taken - queued);
+    histogram_record(&stats->phases[PHASE_HANDLER], handled - taken);
+    histogram_record(&stats->phases[PHASE_REPLY], done_ns - handled);
+}
+
+void
+elfuse_stats_reset(void)
+{
+    for (size_t op = 0; op < ELFUSE_STATS_OPS; op++) {
+        struct elfuse_op_stats *stats = &elfuse_op_stats[op];
+        atomic_store(&stats->count, 0);
+        atomic_store(&stats->errors, 0);
+        for (size_t i = 0; i < ELFUSE_STATS_ERRNOS; i++)
+            atomic_store(&stats->errnos[i], 0);
+        for (size_t phase = 0; phase < PHASE_COUNT; phase++) {
+            struct elfuse_histogram *histogram = &stats->phases[phase];
+            atomic_store(&histogram->sum, 0);
+            atomic_store(&histogram->max, 0);
+            for (size_t i = 0; i < ELFUSE_HISTOGRAM_BUCKETS; i++)
+                atomic_store(&histogram->buckets[i], 0);
+        }
+    }
+}
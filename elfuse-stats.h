@@ -0,0 +1,81 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef ELFUSE_STATS_H
+#define ELFUSE_STATS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "elfuse-fuse.h"
+
+/* Phases of a request timed separately */
+enum elfuse_stats_phase {
+    /* Queued by a FUSE thread until Emacs took it */
+    PHASE_QUEUED,
+    /* In the Lisp handler, until the reply for deferred requests */
+    PHASE_HANDLER,
+    /* From the handler returning to the FUSE thread getting the results */
+    PHASE_REPLY,
+    PHASE_COUNT,
+};
+
+/* Log-linear buckets, like HDR histograms: values below 2^SUB_BITS get a
+ * bucket each, larger values share buckets 1/2^SUB_BITS of their size
+ * wide. Values in ns up to 2^MAX_BITS (about 4.9 hours) are told apart. */
+#define ELFUSE_HISTOGRAM_SUB_BITS 3
+#define ELFUSE_HISTOGRAM_MAX_BITS 44
+#define ELFUSE_HISTOGRAM_BUCKETS \
+    ((ELFUSE_HISTOGRAM_MAX_BITS - ELFUSE_HISTOGRAM_SUB_BITS + 1) << ELFUSE_HISTOGRAM_SUB_BITS)
+
+struct elfuse_histogram {
+    atomic_ullong sum;
+    atomic_ullong max;
+    atomic_ullong buckets[ELFUSE_HISTOGRAM_BUCKETS];
+};
+
+/* Errnos counted separately, larger ones share the last counter */
+#define ELFUSE_STATS_ERRNOS 256
+
+/* Counters of a single request type, updated by FUSE threads */
+struct elfuse_op_stats {
+    atomic_ullong count;
+    atomic_ullong errors;
+    atomic_ullong errnos[ELFUSE_STATS_ERRNOS];
+    struct elfuse_histogram phases[PHASE_COUNT];
+};
+
+/* Indexed by the request state, WAITING_NONE is unused */
+#define ELFUSE_STATS_OPS (WAITING_UNLINK + 1)
+
+extern struct elfuse_op_stats elfuse_op_stats[ELFUSE_STATS_OPS];
+
+/* The errno FUSE gets for CALL, 0 if it succeeded */
+int
+elfuse_call_errno(const struct elfuse_call_state *call);
+
+/* Count CALL answered by Emacs at DONE_NS */
+void
+elfuse_stats_record(const struct elfuse_call_state *call, uint64_t done_ns);
+
+void
+elfuse_stats_reset(void);
+
+/* The smallest value at least FRACTION of the recorded values are below
+ * or equal to, within the bucket precision */
+uint64_t
+elfuse_histogram_percentile(struct elfuse_histogram *histogram, double fraction);
+
+#endif //ELFUSE_STATS_H
@@ -21,6 +21,7 @@
 
 (defconst elfuse-EPERM 1 "errno: operation not permitted")
 (defconst elfuse-ENOENT 2 "errno: no such file or directory")
+(defconst elfuse-EIO 5 "errno: input/output error")
 (defconst elfuse-EACCESS 13 "errno: permission denied")
 (defconst elfuse-EBUSY 16 "errno: block device required")
 (defconst elfuse-EEXIST 17 "errno: file exists")
@@ -32,11 +33,130 @@
 (defconst elfuse-ENOTEMPTY 39 "errno: directory not empty")
 
 (defvar elfuse-time-between-checks 0.01
-  "Time interval in seconds between Elfuse request checks.")
+  "Time interval in seconds between Elfuse request checks.
+Only used by the `timer' wakeup method.")
+
+(defvar elfuse-wakeup-method 'pipe
+  "The way FUSE threads wake Emacs up when requests are queued.
+`pipe' writes to a pipe process watched by the Emacs event loop
+and requires Emacs 28 or later, `signal' sends SIGUSR1 handled
+through `special-event-map' and `timer' polls the request queue
+every `elfuse-time-between-checks' seconds. `pipe' falls back to
+`signal' when not supported.")
+
+(defvar elfuse-attr-cache-ttl 1.0
+  "Default time in seconds `getattr' results are cached for.
+Cached attributes are served without waking Emacs up. Handlers
+changing files behind Elfuse's back should call
+`elfuse-invalidate' or `elfuse-invalidate-prefix', and can
+override the time for a single path with `elfuse-set-attr-ttl'.
+Set to 0 to disable the cache.")
+
+(defvar elfuse-negative-cache-ttl 1.0
+  "Time in seconds Elfuse remembers paths that don't exist.
+A `getattr' handler signalling ENOENT is not called for the same
+path again until the time passes, unless the path is created,
+renamed or invalidated on the mount meanwhile. Set to 0 to
+disable.")
+
+(defvar elfuse-negative-globs nil
+  "Globs of paths that never exist on new mounts.
+Probes for such paths, e.g. \='(".git" "*.swp"
+"autorun.inf"), are answered without calling handlers. Globs
+without a slash match file names, others match whole paths. See
+`elfuse-add-negative-glob' for existing mounts.")
+
+(defvar elfuse-block-cache-size (* 64 1024 1024)
+  "Number of bytes of file content Elfuse caches.
+Only files whose `getattr' handler returns a content generation
+as the third vector element, e.g. `buffer-modified-tick', are
+cached. Blocks are dropped when the generation changes. Set to 0
+to disable the cache.")
+
+(defvar elfuse-readahead-size (* 1024 1024)
+  "Largest number of bytes Elfuse reads ahead for sequential readers.
+Once an open file is read from the start or from where the
+previous read ended, a single `read' op call fetches this much
+\(or the rest of the file if its size is known and smaller) and
+later reads are served without waking Emacs up. Files without a
+generation are only read ahead while their attributes are cached,
+a new size or expired attributes drop the window. Set to 0 to
+disable.")
+
+(defvar elfuse-log-level 'info
+  "Level of messages Elfuse prints to stderr.
+One of `error', `warn', `info' and `debug'. `debug' prints every
+request and is slow under load, see `elfuse-trace-dump' for a
+cheap record of recent requests.")
+
+(defvar elfuse-mount-options nil
+  "Default FUSE mount options used by `elfuse-mount'.
+A plist of:
+
+  :entry-timeout SECONDS    - kernel cache time of name lookups
+  :attr-timeout SECONDS     - kernel cache time of file attributes
+  :negative-timeout SECONDS - kernel cache time of failed lookups
+  :max-read BYTES           - largest read request
+  :max-background N         - outstanding background requests
+  :big-writes BOOL          - allow writes larger than a page
+  :async-read BOOL          - allow the kernel to issue reads in parallel
+  :kernel-cache BOOL        - never drop the kernel page cache on open
+  :auto-cache BOOL          - drop the page cache on open if size or
+                              modification time changed
+  :splice-write BOOL        - splice backing file reads into replies
+  :splice-move BOOL         - move pages instead of copying when splicing
+  :inodes BOOL              - serve the mount with the low-level FUSE
+                              API, see `elfuse-inode'
+  :inode-args BOOL          - pass handlers of an :inodes mount inode
+                              numbers instead of paths, see `elfuse-inode'
+
+Read-mostly file systems can use long timeouts and the kernel cache
+to keep most requests away from Emacs.")
+
+(defconst elfuse--mount-options-alist '((:entry-timeout . "entry_timeout")
+                                        (:attr-timeout . "attr_timeout")
+                                        (:negative-timeout . "negative_timeout")
+                                        (:max-read . "max_read")
+                                        (:max-background . "max_background")
+                                        (:big-writes . "big_writes")
+                                        (:async-read . "async_read")
+                                        (:kernel-cache . "kernel_cache")
+                                        (:auto-cache . "auto_cache")
+                                        (:splice-write . "splice_write")
+                                        (:splice-move . "splice_move"))
+  "An alist of `elfuse-mount-options' keys and FUSE option names.")
+
+(defvar elfuse-inode nil
+  "Inode number of the file the current request works on, or nil.
+Set while handlers of mounts with the :inodes option run. Inode
+numbers are assigned by Elfuse on the first lookup of a name and
+stay the same while the kernel remembers the file, including
+renames. Requests creating a file have no inode yet.
+
+Handlers of mounts with the :inode-args option get the inode
+instead of a path, or a cons of the parent inode and the name for
+files not looked up yet, and never make Elfuse build paths.")
+
+(defvar elfuse--wakeup-process nil
+  "The pipe process used by the `pipe' wakeup method.")
+
+(defvar elfuse--check-timer nil
+  "The timer used by the `timer' wakeup method.")
+
+(defvar elfuse-fuse-threads 4
+  "Number of FUSE threads serving kernel requests.
+Requests from all threads are queued and handled by Emacs in
+arrival order.")
+
+(defvar elfuse-batch-window 100
+  "Time in microseconds FUSE threads wait for more requests before waking Emacs.
+Emacs handles all the queued requests on every wakeup. The window
+is only used after a wakeup has seen more than one request, so
+isolated requests are not delayed. Set to 0 to disable.")
 
 (defconst elfuse--supported-ops-alist '((create . 1)
                                         (rename . 2)
-                                        (readdir . 1)
+                                        (readdir 1 3)
                                         (getattr . 1)
                                         (open . 1)
                                         (release . 1)
@@ -44,25 +164,385 @@
                                         (write . 3)
                                         (truncate . 2)
                                         (unlink . 1))
-  "An alist of Fuse operation name/arity pairs supported by Elfuse.")
+  "An alist of Fuse operation names and arities supported by Elfuse.
+An op with a list of arities can have a handler taking any of them.")
+
+(defconst elfuse--handler-keys '(:create :rename :getattr :readdir :open
+                                  :release :read :write :truncate :unlink)
+  "Keys of `elfuse-mount' handler alists in the order the module expects.")
+
+(defvar elfuse--default-mount nil
+  "The mount handle of `elfuse-start'.")
+
+(defun elfuse-mount (mountpath handlers &optional options)
+  "Mount an Elfuse file system on MOUNTPATH served by HANDLERS.
+HANDLERS is an alist of op keys and handler functions, e.g.
+
+  \='((:getattr . my-getattr) (:readdir . my-readdir) (:read . my-read))
+
+Keys are listed in `elfuse--handler-keys', handlers take the
+arguments listed in `elfuse--supported-ops-alist'. Requests for
+ops without a handler fail. OPTIONS is a plist of FUSE mount
+options, see `elfuse-mount-options' which is used by default.
+
+Return a mount handle for `elfuse-unmount' and the functions
+taking an optional MOUNT, or nil if mounting failed. The file
+system is unmounted once the handle is garbage collected."
+  (dolist (handler handlers)
+    (unless (memq (car handler) elfuse--handler-keys)
+      (error "Unknown Elfuse op: %s" (car handler))))
+  (if (not (elfuse--dir-mountable-p mountpath))
+      (progn (message "Elfuse: %s does not exist or is not empty." mountpath)
+             nil)
+    (elfuse--set-batch-window elfuse-batch-window)
+    (elfuse--set-attr-cache-ttl elfuse-attr-cache-ttl)
+    (elfuse--set-negative-cache-ttl elfuse-negative-cache-ttl)
+    (elfuse--set-block-cache-size elfuse-block-cache-size)
+    (elfuse--set-readahead-size elfuse-readahead-size)
+    (elfuse--set-log-level elfuse-log-level)
+    ;; All mounts share a single wakeup channel
+    (when (= (elfuse--mount-count) 0)
+      (elfuse--wakeup-start elfuse-wakeup-method))
+    (let* ((options (or options elfuse-mount-options))
+           (handle (elfuse--mount (file-truename mountpath)
+                                  (vconcat (mapcar (lambda (key) (alist-get key handlers))
+                                                   elfuse--handler-keys))
+                                  elfuse-fuse-threads
+                                  (elfuse--mount-options-string options)
+                                  (plist-get options :inodes)
+                                  (plist-get options :inode-args))))
+      (cond (handle (dolist (glob elfuse-negative-globs)
+                      (elfuse-add-negative-glob glob handle))
+                    (add-hook 'kill-emacs-hook #'elfuse--unmount-all))
+            ((= (elfuse--mount-count) 0) (elfuse--wakeup-stop)))
+      handle)))
 
-(defun elfuse-start (mountpath)
-  "Start Elfuse using a given MOUNTPATH."
+(defun elfuse-unmount (mount)
+  "Unmount MOUNT returned by `elfuse-mount'."
+  (prog1 (elfuse--unmount mount)
+    (when (= (elfuse--mount-count) 0)
+      (elfuse--wakeup-stop)
+      (remove-hook 'kill-emacs-hook #'elfuse--unmount-all))))
+
+(defun elfuse-start (mountpath &optional options)
+  "Start Elfuse using a given MOUNTPATH.
+Requests are served by ops defined with `elfuse-define-op'.
+OPTIONS is a plist of FUSE mount options, see
+`elfuse-mount-options' which is used by default."
   (interactive "DElfuse mount path: ")
-  (if (elfuse--dir-mountable-p mountpath)
-      (let ((abspath (file-truename mountpath)))
-	(elfuse--mount abspath)
-        (add-hook 'kill-emacs-hook 'elfuse--stop))
-    (message "Elfuse: %s does not exist or is not empty." mountpath)))
+  (if elfuse--default-mount
+      (message "Elfuse: already started, see `elfuse-mount' for more mounts.")
+    (setq elfuse--default-mount
+          (elfuse-mount mountpath
+                        (mapcar (lambda (key)
+                                  (cons key (intern (format "elfuse--%s-op"
+                                                            (substring (symbol-name key) 1)))))
+                                elfuse--handler-keys)
+                        options))))
 
 (defun elfuse-stop ()
   "Stop Elfuse."
   (interactive)
-  (elfuse--stop)
-  (remove-hook 'kill-emacs-hook 'elfuse--stop))
+  (when elfuse--default-mount
+    (elfuse-unmount elfuse--default-mount)
+    (setq elfuse--default-mount nil)))
+
+(defun elfuse--mount-options-string (options)
+  "Convert a plist of mount OPTIONS into a FUSE -o string.
+Return nil if there are no options. The :inodes and :inode-args
+options are not FUSE options and are skipped."
+  (let (strings)
+    (while options
+      (let ((name (alist-get (car options) elfuse--mount-options-alist))
+            (value (cadr options)))
+        (unless (or name (memq (car options) '(:inodes :inode-args)))
+          (error "Unknown Elfuse mount option: %s" (car options)))
+        (cond ((null name))
+              ((eq value t) (push name strings))
+              ((numberp value) (push (format "%s=%s" name value) strings))
+              ((null value))
+              (t (error "Invalid value of Elfuse mount option %s: %S"
+                        (car options) value))))
+      (setq options (cddr options)))
+    (when strings
+      (mapconcat #'identity (nreverse strings) ","))))
+
+(defun elfuse--wakeup-start (method)
+  "Set up Emacs to be woken up by FUSE threads using METHOD.
+See `elfuse-wakeup-method' for possible values."
+  (elfuse--wakeup-stop)
+  (when (eq method 'pipe)
+    (setq elfuse--wakeup-process
+          (make-pipe-process :name "elfuse-wakeup"
+                             :buffer nil
+                             :coding 'binary
+                             :noquery t
+                             :filter (lambda (_proc _output)
+                                       (elfuse--check-ops))))
+    (unless (elfuse--set-wakeup 'pipe elfuse--wakeup-process)
+      (message "Elfuse: pipe wakeups not supported, using signals")
+      (delete-process elfuse--wakeup-process)
+      (setq elfuse--wakeup-process nil
+            method 'signal)))
+  (pcase method
+    ('signal
+     (elfuse--set-wakeup 'signal)
+     (define-key special-event-map (kbd "<sigusr1>") #'elfuse--check-ops-command))
+    ('timer
+     (elfuse--set-wakeup 'timer)
+     (setq elfuse--check-timer
+           (run-with-timer elfuse-time-between-checks
+                           elfuse-time-between-checks
+                           #'elfuse--check-ops)))))
+
+(defun elfuse--wakeup-stop ()
+  "Drop whatever was set up by `elfuse--wakeup-start'."
+  (when elfuse--wakeup-process
+    (delete-process elfuse--wakeup-process)
+    (setq elfuse--wakeup-process nil))
+  (when elfuse--check-timer
+    (cancel-timer elfuse--check-timer)
+    (setq elfuse--check-timer nil))
+  (when (eq (lookup-key special-event-map (kbd "<sigusr1>"))
+            #'elfuse--check-ops-command)
+    (define-key special-event-map (kbd "<sigusr1>") nil)))
+
+(defun elfuse--check-ops-command ()
+  "Handle queued Elfuse requests on a SIGUSR1 event."
+  (interactive)
+  (elfuse--check-ops))
+
+(defvar elfuse--registered-buffers nil
+  "An alist of (PATH . MOUNT) registered with `elfuse-register-buffer' and buffers.")
+
+(defvar-local elfuse--buffer-paths nil
+  "(PATH . MOUNT) pairs the current buffer is registered as.")
+
+(defvar elfuse--dirty-buffers nil
+  "Registered buffers changed since their last snapshot.")
+
+(defvar elfuse--snapshot-timer nil
+  "The idle timer refreshing snapshots of `elfuse--dirty-buffers'.")
+
+(defun elfuse-register-buffer (path buffer &optional mount)
+  "Serve the text of BUFFER as the file PATH of MOUNT.
+The module keeps a snapshot of the text and answers `getattr',
+`open', `release' and `read' requests for PATH without calling
+the op handlers. The `readdir' handler still has to list the
+file. The snapshot is refreshed once Emacs is idle after BUFFER
+changes; writes through the file system go to the `write' and
+`truncate' handlers and PATH is served by the `read' handler
+until then. MOUNT is a handle returned by `elfuse-mount', nil
+means all mounts."
+  (let ((key (cons path mount)))
+    (with-current-buffer buffer
+      (unless (member key elfuse--buffer-paths)
+        (push key elfuse--buffer-paths))
+      (add-hook 'after-change-functions #'elfuse--buffer-changed nil t)
+      (add-hook 'kill-buffer-hook #'elfuse--buffer-killed nil t))
+    (setf (alist-get key elfuse--registered-buffers nil nil #'equal) buffer))
+  (elfuse--snapshot-buffer buffer))
+
+(defun elfuse-unregister-buffer (path &optional mount)
+  "Stop serving PATH of MOUNT registered with `elfuse-register-buffer'."
+  (let* ((key (cons path mount))
+         (buffer (alist-get key elfuse--registered-buffers nil nil #'equal)))
+    (setq elfuse--registered-buffers
+          (seq-remove (lambda (entry) (equal (car entry) key))
+                      elfuse--registered-buffers))
+    (elfuse--snapshot-remove path mount)
+    (elfuse-notify-changed path mount)
+    (when (buffer-live-p buffer)
+      (with-current-buffer buffer
+        (setq elfuse--buffer-paths (delete key elfuse--buffer-paths))
+        (unless elfuse--buffer-paths
+          (remove-hook 'after-change-functions #'elfuse--buffer-changed t)
+          (remove-hook 'kill-buffer-hook #'elfuse--buffer-killed t))))))
+
+(defun elfuse--snapshot-buffer (buffer)
+  "Replace snapshots of all paths BUFFER is registered as."
+  (with-current-buffer buffer
+    (let ((text (save-restriction
+                  (widen)
+                  (buffer-substring-no-properties (point-min) (point-max)))))
+      (pcase-dolist (`(,path . ,mount) elfuse--buffer-paths)
+        (elfuse--snapshot-set path text mount)
+        (elfuse-notify-changed path mount)))))
+
+(defun elfuse--buffer-changed (&rest _)
+  "Schedule a snapshot of the current buffer."
+  (unless (memq (current-buffer) elfuse--dirty-buffers)
+    (push (current-buffer) elfuse--dirty-buffers))
+  (unless elfuse--snapshot-timer
+    (setq elfuse--snapshot-timer
+          (run-with-idle-timer 0 nil #'elfuse--refresh-snapshots))))
+
+(defun elfuse--refresh-snapshots ()
+  "Take new snapshots of `elfuse--dirty-buffers'."
+  (setq elfuse--snapshot-timer nil)
+  (let ((buffers elfuse--dirty-buffers))
+    (setq elfuse--dirty-buffers nil)
+    (dolist (buffer buffers)
+      (when (buffer-live-p buffer)
+        (elfuse--snapshot-buffer buffer)))))
+
+(defun elfuse--buffer-killed ()
+  "Unregister all paths of the current buffer."
+  (pcase-dolist (`(,path . ,mount) elfuse--buffer-paths)
+    (elfuse-unregister-buffer path mount)))
+
+(defun elfuse-batch-stats ()
+  "Return an alist of Elfuse wakeup counters.
+`average' is the average number of requests handled per wakeup,
+`round-trip-avg-us' and `round-trip-max-us' are times from a
+request being queued to a FUSE thread getting the reply and
+`coalesced' is the number of handler calls saved by sharing the
+results of identical `getattr' and `read' requests in flight."
+  (seq-let (wakeups empty requests max-batch rtt-count rtt-sum rtt-max coalesced)
+      (elfuse--batch-stats)
+    `((wakeups . ,wakeups)
+      (empty-wakeups . ,empty)
+      (requests . ,requests)
+      (max-batch . ,max-batch)
+      (average . ,(if (> wakeups 0) (/ (float requests) wakeups) 0.0))
+      (round-trip-avg-us . ,(if (> rtt-count 0) (/ rtt-sum rtt-count 1000.0) 0.0))
+      (round-trip-max-us . ,(/ rtt-max 1000.0))
+      (coalesced . ,coalesced))))
+
+(defun elfuse-attr-cache-stats (&optional mount)
+  "Return an alist of attribute cache counters of MOUNT or all mounts."
+  (seq-let (entries hits misses negative-hits) (elfuse--attr-cache-stats mount)
+    `((entries . ,entries)
+      (hits . ,hits)
+      (misses . ,misses)
+      (negative-hits . ,negative-hits))))
+
+(defun elfuse-block-cache-stats (&optional mount)
+  "Return an alist of file content cache counters of MOUNT or all mounts."
+  (seq-let (bytes blocks hits misses evictions) (elfuse--block-cache-stats mount)
+    `((bytes . ,bytes)
+      (blocks . ,blocks)
+      (hits . ,hits)
+      (misses . ,misses)
+      (evictions . ,evictions))))
+
+(defun elfuse-batch-stats-reset ()
+  "Reset Elfuse wakeup counters."
+  (elfuse--batch-stats-reset))
+
+(defconst elfuse--stats-ops
+  '(create rename getattr readdir open release read write truncate unlink)
+  "Operations in the order `elfuse--stats' returns them.")
+
+(defun elfuse--latency-stats (count latencies)
+  "Turn a vector of LATENCIES of COUNT requests in ns into an alist in us."
+  (seq-let (sum max p50 p90 p99 p999) latencies
+    `((avg-us . ,(if (> count 0) (/ sum count 1000.0) 0.0))
+      (p50-us . ,(/ p50 1000.0))
+      (p90-us . ,(/ p90 1000.0))
+      (p99-us . ,(/ p99 1000.0))
+      (p999-us . ,(/ p999 1000.0))
+      (max-us . ,(/ max 1000.0)))))
+
+(defun elfuse-stats ()
+  "Return an alist of per operation request counters and latencies.
+Every operation maps to an alist of `count', `errors', `errnos', an
+alist of errnos to the number of requests that failed with them,
+and latencies of request phases: `queued' from a FUSE thread
+queueing the request to Emacs taking it, `handler' in the Lisp
+handler, up to the reply for deferred requests, and `reply' from
+there to the FUSE thread getting the results.  Latencies are
+alists of `avg-us', `p50-us', `p90-us', `p99-us', `p999-us' and
+`max-us'.  Percentiles are precise within 12.5%.
+
+Requests answered by sharing the results of an identical one are
+only counted as `coalesced' by `elfuse-batch-stats'."
+  (seq-mapn
+   (lambda (op stats)
+     (seq-let (count errors errnos queued handler reply) stats
+       `(,op
+         (count . ,count)
+         (errors . ,errors)
+         (errnos . ,errnos)
+         (queued . ,(elfuse--latency-stats count queued))
+         (handler . ,(elfuse--latency-stats count handler))
+         (reply . ,(elfuse--latency-stats count reply)))))
+   elfuse--stats-ops
+   (elfuse--stats)))
+
+(defun elfuse-stats-reset ()
+  "Reset Elfuse per operation counters and latencies."
+  (elfuse--stats-reset))
+
+(defconst elfuse--trace-kinds '(call coalesced cached)
+  "Ways traced requests are answered, in the order the module uses.")
+
+(defun elfuse--trace-us (from to)
+  "Format the time between FROM and TO in ns as microseconds.
+Phases a request skipped have 0 timestamps and show up as -."
+  (if (and (> from 0) (>= to from))
+      (format "%.1f" (/ (- to from) 1000.0))
+    "-"))
+
+(defun elfuse-trace-dump ()
+  "Show recent requests of all FUSE threads, oldest first.
+FUSE threads record every request in a per-thread ring of the
+last few thousand records: the op, how it was answered (by the
+handler, by sharing an identical request in flight or from
+caches), the errno it failed with, the hash of its path and the
+time it spent queued, in the handler and getting the reply back.
+Return the buffer with the records."
+  (interactive)
+  (let ((records (sort (elfuse--trace-records)
+                       (lambda (a b) (< (aref a 6) (aref b 6)))))
+        (buffer (get-buffer-create "*elfuse-trace*")))
+    (with-current-buffer buffer
+      (special-mode)
+      (let ((inhibit-read-only t)
+            (origin (if records (aref (car records) 6) 0)))
+        (erase-buffer)
+        (insert (format "%12s %6s %-8s %-9s %5s %-16s %8s %10s %10s %10s %10s\n"
+                        "start-us" "thread" "op" "kind" "errno" "path-hash" "ino"
+                        "total-us" "queued-us" "handler-us" "reply-us"))
+        (dolist (record records)
+          (seq-let (thread op kind result hash ino queued taken handled done) record
+            (insert (format "%12.1f %6d %-8s %-9s %5d %-16s %8d %10s %10s %10s %10s\n"
+                            (/ (- queued origin) 1000.0) thread
+                            (nth (1- op) elfuse--stats-ops)
+                            (nth kind elfuse--trace-kinds)
+                            result hash ino
+                            (elfuse--trace-us queued done)
+                            (elfuse--trace-us queued taken)
+                            (elfuse--trace-us taken handled)
+                            (elfuse--trace-us handled done)))))
+        (goto-char (point-min))))
+    (when (called-interactively-p 'interactive)
+      (display-buffer buffer))
+    buffer))
+
+(defun elfuse-record-start (file &optional mount)
+  "Record requests of MOUNT or all mounts to the trace FILE.
+FUSE threads append every request they get, whether it is
+answered by a handler or from caches: the op, the paths, the
+offset and size, the client pid, the arrival time, how long it
+took and the result. Recording goes on until `elfuse-record-stop'.
+The trace can be replayed against a mount with bench/replay."
+  (interactive "FRecord requests to: ")
+  (unless (elfuse--record-start (expand-file-name file) mount)
+    (error "Elfuse: cannot record to %s" file)))
+
+(defun elfuse-record-stop (&optional mount)
+  "Stop recording requests of MOUNT or all mounts."
+  (interactive)
+  (elfuse--record-stop mount))
 
 (define-error 'elfuse-op-error "Elfuse operation error")
 
+(defun elfuse--op-arities (opname)
+  "Return a list of numbers of arguments OPNAME handlers can take."
+  (let ((arity (alist-get opname elfuse--supported-ops-alist)))
+    (if (listp arity) arity (list arity))))
+
 (defmacro elfuse-define-op (opname arglist &rest body)
   "Define a Fuse operation OPNAME handler.
 Apart from defining the function required by Elfuse the macro
@@ -74,22 +554,34 @@ variable.
 Argument ARGLIST is a list of operation arguments.
 
 Optional argument BODY is a body of the function that will handle
-the operation."
+the operation.
+
+A `readdir' handler taking (PATH OFFSET LIMIT) lists large
+directories a page at a time: it returns up to LIMIT entries
+starting at OFFSET, which is 0 for the first page, as a cons of
+an entries vector and the OFFSET of the next page, or nil if
+there are no more entries.
+
+An `open' handler returning (:backing FILE) instead of t has reads,
+writes and truncation of the file served from FILE on disk without
+calling the `read', `write' and `truncate' handlers. Files with a backing file are the
+only ones that can be opened for writing.
+
+Elfuse checks which handlers exist on `elfuse-start' and whenever
+an op is defined with this macro. Handlers defined some other way
+while mounted are only noticed after one of those."
   (declare (indent 2))
   (cond ((not (assq opname elfuse--supported-ops-alist))
          `(error "Operation '%s' not supported" ,(symbol-name opname)))
-        ((not (= (alist-get opname elfuse--supported-ops-alist) (length arglist)))
-         `(error "Operation '%s' requires %d arguments"
+        ((not (memq (length arglist) (elfuse--op-arities opname)))
+         `(error "Operation '%s' requires %s arguments"
                  ,(symbol-name opname)
-                 ,(alist-get opname elfuse--supported-ops-alist)))
-        (t `(defun ,(intern (concat "elfuse--" (symbol-name opname) "-op"))
-                ,arglist
-              ,@body))))
-
-(define-key special-event-map (kbd "<sigusr1>")
-  (lambda ()
-    (interactive)
-    (elfuse--check-ops)))
+                 ,(mapconcat #'number-to-string (elfuse--op-arities opname) " or ")))
+        (t `(prog1
+                (defun ,(intern (concat "elfuse--" (symbol-name opname) "-op"))
+                    ,arglist
+                  ,@body)
+              (elfuse--handlers-changed)))))
 
 (defun elfuse--dir-mountable-p (path)
   (and (file-exists-p path)
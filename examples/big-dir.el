@@ -0,0 +1,61 @@
+;;; mounts.el --- Several Elfuse mounts -*- lexical-binding: t -*-
+
+;; This file is part of Elfuse.
+
+;; Elfuse is free software: you can redistribute it and/or modify
+;; it under the terms of the GNU General Public License as published by
+;; the Free Software Foundation, either version 3 of the License, or
+;; (at your option) any later version.
+
+;; Elfuse is distributed in the hope that it will be useful,
+;; but WITHOUT ANY WARRANTY; without even the implied warranty of
+;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;; GNU General Public License for more details.
+
+
+(require 'elfuse)
+
+;; A directory of 200000 generated files listed a page at a time, so
+;; Emacs never builds the whole listing at once. Every file holds its
+;; own name.
+
+(defvar big-dir-size 200000
+  "Number of files in the directory.")
+
+(defun big-dir--name (index)
+  (format "file-%06d" index))
+
+(defun big-dir--index (path)
+  "Index of the file at PATH or nil."
+  (when (string-match "\\`/file-\\([0-9]\\{6\\}\\)\\'" path)
+    (let ((index (string-to-number (match-string 1 path))))
+      (and (< index big-dir-size) index))))
+
+(elfuse-define-op readdir (path offset limit)
+  (unless (equal path "/")
+    (signal 'elfuse-op-error elfuse-ENOENT))
+  (let* ((end (min big-dir-size (+ offset limit)))
+         (entries (make-vector (- end offset) nil)))
+    (dotimes (i (length entries))
+      (let ((name (big-dir--name (+ offset i))))
+        (aset entries i (vector name 'file (1+ (length name))))))
+    (cons (if (= offset 0) (vconcat ["." ".."] entries) entries)
+          (and (< end big-dir-size) end))))
+
+(elfuse-define-op getattr (path)
+  (cond ((equal path "/") [dir 0])
+        ((big-dir--index path) (vector 'file (length path)))
+        (t (signal 'elfuse-op-error elfuse-ENOENT))))
+
+(elfuse-define-op open (path)
+  (if (big-dir--index path)
+      t
+    (signal 'elfuse-op-error elfuse-ENOENT)))
+
+(elfuse-define-op release (path)
+  (and (big-dir--index path) t))
+
+(elfuse-define-op read (path offset size)
+  (let ((content (concat (substring path 1) "\n")))
+    (substring content (min offset (length content))
+               (min (+ offset size) (length content)))))
@@ -0,0 +1,63 @@
+;;; deferred.el --- Elfuse handlers replying later -*- lexical-binding: t -*-
+
+;; This file is part of Elfuse.
+
+;; Elfuse is free software: you can redistribute it and/or modify
+;; it under the terms of the GNU General Public License as published by
+;; the Free Software Foundation, either version 3 of the License, or
+;; (at your option) any later version.
+
+;; Elfuse is distributed in the hope that it will be useful,
+;; but WITHOUT ANY WARRANTY; without even the implied warranty of
+;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;; GNU General Public License for more details.
+
+;; You should have received a copy of the GNU General Public License
+;; along with Elfuse.  If not, see <http://www.gnu.org/licenses/>.
+
+(require 'elfuse)
+
+;; /uptime is the output of a subprocess. The read handler defers the
+;; reply and Emacs keeps running while the process does its thing.
+
+(defun deferred--command-output (command callback)
+  "Run COMMAND and call CALLBACK with its output, or nil if it failed."
+  (let ((buffer (generate-new-buffer " *elfuse-deferred*")))
+    (make-process :name "elfuse-deferred"
+                  :buffer buffer
+                  :command command
+                  :noquery t
+                  :sentinel (lambda (process _event)
+                              (unless (process-live-p process)
+                                (funcall callback
+                                         (when (= (process-exit-status process) 0)
+                                           (with-current-buffer buffer
+                                             (encode-coding-string (buffer-string) 'utf-8))))
+                                (kill-buffer buffer))))))
+
+(elfuse-define-op readdir (path)
+  (unless (equal path "/")
+    (signal 'elfuse-op-error elfuse-ENOENT))
+  ["." ".." "uptime"])
+
+(elfuse-define-op getattr (path)
+  (cond
+   ((equal path "/") (vector 'dir 0))
+   ;; The size is unknown until the command runs
+   ((equal path "/uptime") (vector 'file 4096))
+   (t (signal 'elfuse-op-error elfuse-ENOENT))))
+
+(elfuse-define-op open (path)
+  (or (equal path "/uptime")
+      (signal 'elfuse-op-error elfuse-ENOENT)))
+
+(elfuse-define-op read (_path offset size)
+  (let ((token (elfuse-defer)))
+    (deferred--command-output
+     '("uptime")
+     (lambda (output)
+       (if (null output)
+           (elfuse-reply-error token elfuse-EIO)
+         (let ((start (min offset (length output))))
+           (elfuse-reply token (substring output start
+                                          (min (+ start size) (length output))))))))))
@@ -0,0 +1,70 @@
+;;; flat-mirror.el --- Files on disk under computed names -*- lexical-binding: t -*-
+
+;; This file is part of Elfuse.
+
+;; Elfuse is free software: you can redistribute it and/or modify
+;; it under the terms of the GNU General Public License as published by
+;; the Free Software Foundation, either version 3 of the License, or
+;; (at your option) any later version.
+
+;; Elfuse is distributed in the hope that it will be useful,
+;; but WITHOUT ANY WARRANTY; without even the implied warranty of
+;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;; GNU General Public License for more details.
+
+;; You should have received a copy of the GNU General Public License
+;; along with Elfuse.  If not, see <http://www.gnu.org/licenses/>.
+
+(require 'elfuse)
+
+;; All files under `flat-mirror-directory' listed in a single directory,
+;; slashes in their relative names replaced with !, e.g. src!main.c
+;; (names with a ! of their own are not found).
+;; Emacs only computes names and attributes: open returns the real file
+;; as a backing file and reads and writes never reach Lisp.
+
+(defvar flat-mirror-directory default-directory
+  "The directory tree to mirror.")
+
+;; Reads of large files are spliced straight from the backing files
+(setq elfuse-mount-options '(:splice-write t :splice-move t))
+
+(defun flat-mirror--name (file)
+  "The mirrored name of FILE."
+  (replace-regexp-in-string
+   "/" "!" (file-relative-name file flat-mirror-directory)))
+
+(defun flat-mirror--file (path)
+  "The file behind PATH or nil."
+  (let ((file (expand-file-name (replace-regexp-in-string
+                                 "!" "/" (substring path 1))
+                                flat-mirror-directory)))
+    ;; Names like ..!etc!passwd must not escape the tree
+    (and (not (string-match-p "/" (substring path 1)))
+         (file-in-directory-p file flat-mirror-directory)
+         (file-regular-p file)
+         file)))
+
+(elfuse-define-op readdir (path)
+  (unless (equal path "/")
+    (signal 'elfuse-op-error elfuse-ENOENT))
+  (vconcat ["." ".."]
+           (mapcar (lambda (file)
+                     (vector (flat-mirror--name file) 'file
+                             (file-attribute-size (file-attributes file))))
+                   (directory-files-recursively flat-mirror-directory ""))))
+
+(elfuse-define-op getattr (path)
+  (let ((file (flat-mirror--file path)))
+    (cond ((equal path "/") [dir 0])
+          (file (vector 'file (file-attribute-size (file-attributes file))))
+          (t (signal 'elfuse-op-error elfuse-ENOENT)))))
+
+(elfuse-define-op open (path)
+  (let ((file (flat-mirror--file path)))
+    (if file
+        (list :backing file)
+      (signal 'elfuse-op-error elfuse-ENOENT))))
+
+(elfuse-define-op release (path)
+  (and (flat-mirror--file path) t))
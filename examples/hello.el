@@ -15,6 +15,10 @@
 
 (require 'elfuse)
 
+;; Files never change, let the kernel cache everything
+(setq elfuse-mount-options '(:entry-timeout 60
+                             :attr-timeout 60
+                             :kernel-cache t))
 
 (elfuse-define-op readdir (path)
   (message "READDIR: %s" path)
@@ -22,6 +22,20 @@
 (defvar list-buffers--posix-portable-filename-re
   (rx (one-or-more (in "-0-9A-Za-z._")) line-end))
 
+;; Buffer changes are pushed to the kernel, so it can cache for long
+(setq elfuse-mount-options '(:entry-timeout 60
+                             :attr-timeout 60
+                             :negative-timeout 60
+                             :kernel-cache t))
+
+(defvar list-buffers--names nil
+  "Buffer names the kernel was last told about.")
+
+(defvar list-buffers--changed nil
+  "Names of buffers edited since the last notification.")
+
+(defvar list-buffers--timer nil)
+
 (elfuse-define-op create (path)
   (message "CREATE: %s" path)
   (get-buffer-create (file-name-nondirectory path))
@@ -31,9 +45,13 @@
   (message "READDIR: %s" path)
   (unless (equal path "/")
     (signal 'elfuse-op-error elfuse-ENOENT))
+  ;; Attributes come along, so `ls -l' needs no getattr calls
   (seq-concatenate 'vector
                    '("." "..")
-                   (list-buffers--list-buffer-names)))
+                   (mapcar (lambda (name)
+                             (with-current-buffer name
+                               (vector name 'file (buffer-size) (buffer-modified-tick))))
+                           (list-buffers--list-buffer-names))))
 
 (elfuse-define-op getattr (path)
   (message "GETATTR: %s" path)
@@ -43,7 +61,8 @@
       [dir 0])
      ((member name
               (list-buffers--list-buffer-names))
-      (vector 'file (buffer-size (get-buffer name))))
+      (with-current-buffer name
+        (vector 'file (buffer-size) (buffer-modified-tick))))
      (t (signal 'elfuse-op-error elfuse-ENOENT)))))
 
 (elfuse-define-op read (path offset size)
@@ -73,6 +92,33 @@
     (seq-filter #'list-buffers--posix-filename-p)
     (seq-map #'buffer-name)))
 
+(defun list-buffers--after-change (&rest _)
+  (when (list-buffers--posix-filename-p (current-buffer))
+    (add-to-list 'list-buffers--changed (buffer-name))
+    (list-buffers--schedule-notify)))
+
+(defun list-buffers--schedule-notify ()
+  (unless list-buffers--timer
+    (setq list-buffers--timer
+          (run-with-idle-timer 0.1 nil #'list-buffers--notify))))
+
+(defun list-buffers--notify ()
+  "Push buffers created, killed or edited since the last call to the kernel."
+  (setq list-buffers--timer nil)
+  (let ((names (list-buffers--list-buffer-names)))
+    (dolist (name (seq-difference list-buffers--names names))
+      (elfuse-notify-entry-removed "/" name))
+    (dolist (name (seq-difference names list-buffers--names))
+      (elfuse-notify-entry-added "/" name))
+    (dolist (name list-buffers--changed)
+      (elfuse-notify-changed (concat "/" name)))
+    (setq list-buffers--names names
+          list-buffers--changed nil)))
+
 (defun list-buffers--posix-filename-p (buf)
   (string-match list-buffers--posix-portable-filename-re
                 (buffer-name buf)))
+
+(setq list-buffers--names (list-buffers--list-buffer-names))
+(add-hook 'after-change-functions #'list-buffers--after-change)
+(add-hook 'buffer-list-update-hook #'list-buffers--schedule-notify)
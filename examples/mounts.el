@@ -0,0 +1,55 @@
+;;; mounts.el --- Several Elfuse mounts -*- lexical-binding: t -*-
+
+;; This file is part of Elfuse.
+
+;; Elfuse is free software: you can redistribute it and/or modify
+;; it under the terms of the GNU General Public License as published by
+;; the Free Software Foundation, either version 3 of the License, or
+;; (at your option) any later version.
+
+;; Elfuse is distributed in the hope that it will be useful,
+;; but WITHOUT ANY WARRANTY; without even the implied warranty of
+;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;; GNU General Public License for more details.
+
+;; You should have received a copy of the GNU General Public License
+;; along with Elfuse.  If not, see <http://www.gnu.org/licenses/>.
+
+(require 'elfuse)
+
+;; Two file systems served by the same Emacs, each with its own
+;; handlers. Mount with (mounts-start "a/" "b/"), unmount with
+;; (mounts-stop).
+
+(defvar mounts--handles nil
+  "Mount handles, dropping them unmounts the file systems eventually.")
+
+(defun mounts--handlers (name content)
+  "Handlers of a file system with a single file NAME holding CONTENT."
+  (let ((path (concat "/" name)))
+    `((:readdir . ,(lambda (dir)
+                     (unless (equal dir "/")
+                       (signal 'elfuse-op-error elfuse-ENOENT))
+                     (vector "." ".." name)))
+      (:getattr . ,(lambda (file)
+                     (cond
+                      ((equal file "/") (vector 'dir 0))
+                      ((equal file path) (vector 'file (string-bytes content)))
+                      (t (signal 'elfuse-op-error elfuse-ENOENT)))))
+      (:open . ,(lambda (file)
+                  (or (equal file path)
+                      (signal 'elfuse-op-error elfuse-ENOENT))))
+      (:read . ,(lambda (_file offset size)
+                  (let ((start (min offset (length content))))
+                    (substring content start (min (+ start size) (length content)))))))))
+
+(defun mounts-start (first second)
+  "Mount two file systems on FIRST and SECOND."
+  (setq mounts--handles
+        (list (elfuse-mount first (mounts--handlers "first" "first data\n"))
+              (elfuse-mount second (mounts--handlers "second" "second data\n")))))
+
+(defun mounts-stop ()
+  "Unmount the file systems mounted by `mounts-start'."
+  (mapc #'elfuse-unmount (delq nil mounts--handles))
+  (setq mounts--handles nil))
@@ -18,6 +18,11 @@
 
 (defvar write-buffer--buffer-name "*Elfuse buffer*")
 
+;; Edits are pushed to the kernel, so it can cache for long
+(setq elfuse-mount-options '(:entry-timeout 60
+                             :attr-timeout 60
+                             :kernel-cache t))
+
 (elfuse-define-op readdir (path)
   (unless (equal path "/")
     (signal 'elfuse-op-error elfuse-ENOENT))
@@ -28,7 +33,8 @@
   (cond ((equal path "/")
          [dir 0])
         ((equal path "/buffer")
-         (vector 'file (buffer-size (write-buffer--get-buffer))))
+         (with-current-buffer (write-buffer--get-buffer)
+           (vector 'file (buffer-size) (buffer-modified-tick))))
         (t (signal 'elfuse-op-error elfuse-ENOENT))))
 
 (elfuse-define-op read (path offset size)
@@ -64,4 +70,9 @@
    (t (seq-subseq str offset (+ offset size)))))
 
 (defun write-buffer--get-buffer ()
-  (get-buffer-create write-buffer--buffer-name))
+  (or (get-buffer write-buffer--buffer-name)
+      (let ((buffer (get-buffer-create write-buffer--buffer-name)))
+        ;; Reads are served by the module, the handlers above are only
+        ;; used right after writes
+        (elfuse-register-buffer "/buffer" buffer)
+        buffer)))